@@ -152,10 +152,9 @@ my_fileset_user(struct my_fileset *fs)
 	return (fs->user);
 }
 
-void
-my_fileset_reload(struct my_fileset *fs)
+static void
+fileset_read(struct my_fileset *fs)
 {
-	assert(fs != NULL);
 	struct fileset_entry *ent, **entptr;
 	entry_vec *new_entries;
 	FILE *fp;
@@ -163,9 +162,6 @@ my_fileset_reload(struct my_fileset *fs)
 	size_t len = 0;
 	ubuf *u;
 
-	if (!setfile_updated(fs))
-		return;
-
 	fp = fopen(fs->setfile, "r");
 	if (fp == NULL)
 		return;
@@ -220,6 +216,22 @@ my_fileset_reload(struct my_fileset *fs)
 	ubuf_destroy(&u);
 }
 
+void
+my_fileset_reload(struct my_fileset *fs)
+{
+	assert(fs != NULL);
+	if (setfile_updated(fs))
+		fileset_read(fs);
+}
+
+void
+my_fileset_reload_force(struct my_fileset *fs)
+{
+	assert(fs != NULL);
+	(void) setfile_updated(fs);
+	fileset_read(fs);
+}
+
 bool
 my_fileset_get(
 	struct my_fileset *fs,
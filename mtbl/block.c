@@ -70,7 +70,7 @@ struct block_iter {
 };
 
 static inline uint32_t
-num_restarts(struct block *b)
+num_restarts(const struct block *b)
 {
 	assert(b->size >= 2*sizeof(uint32_t));
 	return (mtbl_fixed_decode32(b->data + b->size - sizeof(uint32_t)));
@@ -89,19 +89,22 @@ decode_entry(uint8_t *p, uint8_t *limit,
 		/* fast path */
 		p += 3;
 	} else {
-		p += mtbl_varint_decode32(p, shared);
-		p += mtbl_varint_decode32(p, non_shared);
-		p += mtbl_varint_decode32(p, value_length);
-		assert (p <= limit);
+		uint32_t v[3];
+		size_t len = varint_decode32_n(p, limit - p, v, 3);
+
+		assert(len > 0);
+		p += len;
+		*shared = v[0];
+		*non_shared = v[1];
+		*value_length = v[2];
 	}
 	assert(!((limit - p) < (*non_shared + *value_length)));
 	return (p);
 }
 
-struct block *
-block_init(uint8_t *data, size_t size, bool needs_free)
+static void
+block_setup(struct block *b, uint8_t *data, size_t size)
 {
-	struct block *b = my_calloc(1, sizeof(*b));
 	b->data = data;
 	b->size = size;
 	if (size < sizeof(uint32_t)) {
@@ -132,6 +135,13 @@ block_init(uint8_t *data, size_t size, bool needs_free)
 	if (b->restart_offset > size - sizeof(uint32_t)) {
 		b->size = 0;
 	}
+}
+
+struct block *
+block_init(uint8_t *data, size_t size, bool needs_free)
+{
+	struct block *b = my_calloc(1, sizeof(*b));
+	block_setup(b, data, size);
 	b->needs_free = needs_free;
 	return (b);
 }
@@ -390,3 +400,94 @@ block_iter_get(struct block_iter *bi,
 	}
 	return (true);
 }
+
+static inline uint64_t
+block_restart_point(const struct block *b, uint32_t idx)
+{
+	if (b->restart_offset > UINT32_MAX)
+		return (mtbl_fixed_decode64(b->data + b->restart_offset + idx * sizeof(uint64_t)));
+	return (mtbl_fixed_decode32(b->data + b->restart_offset + idx * sizeof(uint32_t)));
+}
+
+/*
+ * Find the first entry with a key >= target, like block_iter_seek(), but
+ * without an iterator. The keys are never reconstructed: while scanning
+ * forward from a restart point, only the length of the common prefix of the
+ * previous key and the target is tracked, and each key's unshared suffix is
+ * compared against the target from there.
+ */
+bool
+block_lookup(const struct block *b, const uint8_t *target, size_t target_len,
+	     bool *exact, const uint8_t **val, size_t *val_len)
+{
+	uint32_t shared, non_shared, value_length;
+	uint32_t left = 0, right;
+	uint8_t *p, *limit;
+	size_t match = 0;
+
+	if (b->size < 2 * sizeof(uint32_t) || num_restarts(b) == 0)
+		return (false);
+	limit = b->data + b->restart_offset;
+
+	/* Binary search for the last restart point with a key < target. */
+	right = num_restarts(b) - 1;
+	while (left < right) {
+		uint32_t mid = (left + right + 1) / 2;
+		const uint8_t *key = decode_entry(b->data + block_restart_point(b, mid), limit,
+						  &shared, &non_shared, &value_length);
+		assert(key != NULL && shared == 0);
+		if (bytes_compare(key, non_shared, target, target_len) < 0)
+			left = mid;
+		else
+			right = mid - 1;
+	}
+
+	for (p = b->data + block_restart_point(b, left); p < limit;
+	     p += non_shared + value_length)
+	{
+		size_t n, i = 0;
+
+		p = decode_entry(p, limit, &shared, &non_shared, &value_length);
+		assert(p != NULL);
+
+		/*
+		 * The previous key sorts before the target and differs from
+		 * it at offset 'match', so a key sharing more than 'match'
+		 * bytes with it sorts before the target too.
+		 */
+		if (shared > match)
+			continue;
+
+		n = target_len - shared;
+		if (n > non_shared)
+			n = non_shared;
+		while (i < n && p[i] == target[shared + i])
+			i++;
+		match = shared + i;
+		if (i < n) {
+			if (p[i] < target[shared + i])
+				continue;
+			*exact = false;
+		} else if (non_shared < target_len - shared) {
+			/* The key is a proper prefix of the target. */
+			continue;
+		} else {
+			*exact = (non_shared == target_len - shared);
+		}
+		*val = p + non_shared;
+		*val_len = value_length;
+		return (true);
+	}
+	return (false);
+}
+
+bool
+block_data_lookup(uint8_t *data, size_t size,
+		  const uint8_t *target, size_t target_len,
+		  bool *exact, const uint8_t **val, size_t *val_len)
+{
+	struct block b = { 0 };
+
+	block_setup(&b, data, size);
+	return (block_lookup(&b, target, target_len, exact, val, val_len));
+}
@@ -0,0 +1,583 @@
+/*
+ * Copyright (c) 2024 DomainTools LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/file.h>
+#include <libgen.h>
+#include <time.h>
+
+#include "mtbl-private.h"
+
+#include "libmy/my_time.h"
+#include "libmy/ubuf.h"
+
+/*
+ * Size-tiered compaction of the files listed in a fileset setfile. Files are
+ * grouped into tiers by size, each tier covering sizes 'tier_ratio' times
+ * larger than the one below it. Once a tier holds 'tier_files' files, they
+ * are merged into a single file, which replaces them in the setfile.
+ *
+ * A tombstone only hides the values of the files which sort before its own,
+ * and a file with tombstones may be added at any time, so the merged file
+ * must sort in the place of its inputs. The files sorting between those of
+ * the tier are merged as well, and the merged file is named after the newest
+ * input. Tombstones are kept, unless every file of the setfile is merged.
+ */
+
+struct mtbl_compact_options {
+	mtbl_merge_func			merge;
+	mtbl_merge_values_func		merge_values;
+	void				*merge_clos;
+	const struct mtbl_writer_options *wopt;
+	size_t				tier_files;
+	size_t				tier_ratio;
+	uint64_t			tier_size;
+	uint64_t			rate_limit;
+	bool				keep_inputs;
+};
+
+struct compact_file {
+	char				*fname;
+	char				*line;
+	uint64_t			size;
+	unsigned			tier;
+	bool				tombstones;
+};
+
+VECTOR_GENERATE(cfile_vec, struct compact_file);
+
+#if HAVE_CLOCK_GETTIME
+static const clockid_t compact_clock = CLOCK_MONOTONIC;
+#else
+static const int compact_clock = -1;
+#endif
+
+struct mtbl_compact_options *
+mtbl_compact_options_init(void)
+{
+	struct mtbl_compact_options *opt;
+	opt = my_calloc(1, sizeof(*opt));
+	opt->tier_files = DEFAULT_COMPACT_TIER_FILES;
+	opt->tier_ratio = DEFAULT_COMPACT_TIER_RATIO;
+	opt->tier_size = DEFAULT_COMPACT_TIER_SIZE;
+	return (opt);
+}
+
+void
+mtbl_compact_options_destroy(struct mtbl_compact_options **opt)
+{
+	if (*opt)
+		my_free(*opt);
+}
+
+void
+mtbl_compact_options_set_merge_func(struct mtbl_compact_options *opt,
+				    mtbl_merge_func merge, void *clos)
+{
+	opt->merge = merge;
+	opt->merge_values = NULL;
+	opt->merge_clos = clos;
+}
+
+void
+mtbl_compact_options_set_merge_values_func(struct mtbl_compact_options *opt,
+					   mtbl_merge_values_func merge_values,
+					   void *clos)
+{
+	opt->merge = NULL;
+	opt->merge_values = merge_values;
+	opt->merge_clos = clos;
+}
+
+void
+mtbl_compact_options_set_writer_options(struct mtbl_compact_options *opt,
+					const struct mtbl_writer_options *wopt)
+{
+	opt->wopt = wopt;
+}
+
+void
+mtbl_compact_options_set_tier_files(struct mtbl_compact_options *opt,
+				    size_t tier_files)
+{
+	if (tier_files < 2)
+		tier_files = 2;
+	opt->tier_files = tier_files;
+}
+
+void
+mtbl_compact_options_set_tier_ratio(struct mtbl_compact_options *opt,
+				    size_t tier_ratio)
+{
+	if (tier_ratio < 2)
+		tier_ratio = 2;
+	opt->tier_ratio = tier_ratio;
+}
+
+void
+mtbl_compact_options_set_tier_size(struct mtbl_compact_options *opt,
+				   uint64_t tier_size)
+{
+	if (tier_size < 1)
+		tier_size = 1;
+	opt->tier_size = tier_size;
+}
+
+void
+mtbl_compact_options_set_rate_limit(struct mtbl_compact_options *opt,
+				    uint64_t bytes_per_second)
+{
+	opt->rate_limit = bytes_per_second;
+}
+
+void
+mtbl_compact_options_set_keep_inputs(struct mtbl_compact_options *opt,
+				     bool keep_inputs)
+{
+	opt->keep_inputs = keep_inputs;
+}
+
+static unsigned
+compact_tier(const struct mtbl_compact_options *opt, uint64_t size)
+{
+	uint64_t bound = opt->tier_size;
+	unsigned tier = 0;
+
+	while (size >= bound) {
+		tier++;
+		if (bound > UINT64_MAX / opt->tier_ratio)
+			break;
+		bound *= opt->tier_ratio;
+	}
+	return (tier);
+}
+
+/* Resolve a setfile line the same way as mtbl_fileset(3). */
+static void
+compact_path(ubuf *u, const char *setdir, const char *line)
+{
+	ubuf_clip(u, 0);
+	if (line[0] != '/') {
+		ubuf_add_cstr(u, setdir);
+		ubuf_add(u, '/');
+	}
+	ubuf_add_cstr(u, line);
+	ubuf_rstrip(u, '\n');
+	ubuf_cterm(u);
+}
+
+static void
+compact_files_destroy(cfile_vec **files)
+{
+	if (*files == NULL)
+		return;
+	for (size_t i = 0; i < cfile_vec_size(*files); i++) {
+		free(cfile_vec_value(*files, i).fname);
+		free(cfile_vec_value(*files, i).line);
+	}
+	cfile_vec_destroy(files);
+}
+
+/* Whether the metadata of a file says that it may hold tombstones. */
+static bool
+compact_file_tombstones(const char *fname, uint64_t size)
+{
+	uint8_t buf[MTBL_METADATA_SIZE];
+	struct mtbl_metadata m;
+	bool tombstones = false;
+	int fd;
+
+	if (size < MTBL_METADATA_SIZE)
+		return (false);
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return (false);
+	if (pread(fd, buf, sizeof(buf), size - MTBL_METADATA_SIZE) == sizeof(buf) &&
+	    metadata_read(buf, &m))
+		tombstones = m.has_tombstones;
+	close(fd);
+	return (tombstones);
+}
+
+static int
+compact_file_compare(const void *va, const void *vb)
+{
+	const struct compact_file *a = va;
+	const struct compact_file *b = vb;
+
+	return (strcmp(a->fname, b->fname));
+}
+
+/*
+ * Read the existing files listed in the setfile, along with their sizes, in
+ * the sorted order in which mtbl_fileset(3) merges them.
+ */
+static bool
+compact_read_setfile(const struct mtbl_compact_options *opt,
+		     const char *setfile, const char *setdir, cfile_vec *files)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t len = 0;
+	ubuf *u;
+
+	fp = fopen(setfile, "r");
+	if (fp == NULL)
+		return (false);
+
+	u = ubuf_init(64);
+	while (getline(&line, &len, fp) != -1) {
+		struct compact_file f;
+		struct stat sb;
+
+		compact_path(u, setdir, line);
+		if (stat((const char *) ubuf_data(u), &sb) != 0 || !S_ISREG(sb.st_mode))
+			continue;
+		f.fname = my_strdup((const char *) ubuf_data(u));
+		f.line = my_strdup(line);
+		f.line[strcspn(f.line, "\n")] = '\0';
+		f.size = sb.st_size;
+		f.tier = compact_tier(opt, f.size);
+		f.tombstones = compact_file_tombstones(f.fname, f.size);
+		cfile_vec_add(files, f);
+	}
+	free(line);
+	fclose(fp);
+	ubuf_destroy(&u);
+
+	qsort(cfile_vec_data(files), cfile_vec_size(files),
+	      sizeof(struct compact_file), compact_file_compare);
+	return (true);
+}
+
+/* Sleep as needed to keep the bytes written since 'start' under the limit. */
+static void
+compact_throttle(const struct mtbl_compact_options *opt, int fd, off_t offset,
+		 const struct timespec *start)
+{
+	struct timespec now, target;
+	off_t cur;
+
+	if (opt->rate_limit == 0)
+		return;
+	cur = lseek(fd, 0, SEEK_CUR);
+	if (cur <= offset)
+		return;
+
+	my_timespec_from_double((double) (cur - offset) / opt->rate_limit, &target);
+	my_timespec_add(start, &target);
+	my_gettime(compact_clock, &now);
+	if (my_timespec_cmp(&now, &target) < 0) {
+		my_timespec_sub(&now, &target);
+		my_nanosleep(&target);
+	}
+}
+
+/*
+ * Merge the input files into the new file open on 'fd'. Tombstones are
+ * dropped if 'bottom' is true, and kept otherwise.
+ */
+static mtbl_res
+compact_merge(const struct mtbl_compact_options *opt,
+	      struct compact_file *inputs, size_t n_inputs, bool bottom, int fd)
+{
+	struct mtbl_merger_options *mopt;
+	struct mtbl_writer_options *wopt;
+	struct mtbl_merger *m;
+	struct mtbl_reader **readers;
+	struct mtbl_writer *w;
+	struct mtbl_iter *it;
+	struct timespec start;
+	const uint8_t *key, *val;
+	size_t len_key, len_val;
+	off_t offset = lseek(fd, 0, SEEK_CUR);
+	uint64_t n_since = 0;
+	bool tombstones = false;
+	mtbl_res res = mtbl_res_success;
+
+	mopt = mtbl_merger_options_init();
+	if (opt->merge_values != NULL)
+		mtbl_merger_options_set_merge_values_func(mopt, opt->merge_values,
+							  opt->merge_clos);
+	else
+		mtbl_merger_options_set_merge_func(mopt, opt->merge, opt->merge_clos);
+	m = mtbl_merger_init(mopt);
+	mtbl_merger_options_destroy(&mopt);
+	merger_set_tombstones(m, bottom ? MERGER_TOMBSTONES_DROP : MERGER_TOMBSTONES_KEEP);
+
+	readers = my_calloc(n_inputs, sizeof(*readers));
+	for (size_t i = 0; i < n_inputs; i++) {
+		readers[i] = mtbl_reader_init(inputs[i].fname, NULL);
+		if (readers[i] == NULL) {
+			res = mtbl_res_failure;
+			goto out;
+		}
+		mtbl_merger_add_source(m, mtbl_reader_source(readers[i]));
+		tombstones |= !bottom && inputs[i].tombstones;
+	}
+
+	my_gettime(compact_clock, &start);
+	wopt = writer_options_dup(opt->wopt);
+	mtbl_writer_options_set_tombstones(wopt, tombstones);
+	w = mtbl_writer_init_fd(fd, wopt);
+	mtbl_writer_options_destroy(&wopt);
+	it = mtbl_source_iter(mtbl_merger_source(m));
+	while (mtbl_iter_next(it, &key, &len_key, &val, &len_val) == mtbl_res_success) {
+		uint64_t n = 1;
+
+		if (mtbl_writer_add_iter_block(w, it, &n) != mtbl_res_success) {
+			res = writer_add(w, key, len_key, val, len_val,
+					 iter_entry_type(it));
+			if (res != mtbl_res_success)
+				break;
+		}
+		n_since += n;
+		if (n_since >= COMPACT_THROTTLE_INTERVAL) {
+			compact_throttle(opt, fd, offset, &start);
+			n_since = 0;
+		}
+	}
+	mtbl_iter_destroy(&it);
+	mtbl_writer_destroy(&w);
+	if (res == mtbl_res_success && fsync(fd) != 0)
+		res = mtbl_res_failure;
+
+out:
+	for (size_t i = 0; i < n_inputs; i++)
+		mtbl_reader_destroy(&readers[i]);
+	my_free(readers);
+	mtbl_merger_destroy(&m);
+	return (res);
+}
+
+/*
+ * Replace the merged input files with the line 'out_line' in the setfile. The
+ * setfile is read again, under a lock on "<setfile>.lock", so that files
+ * added to it during the merge are kept.
+ */
+static mtbl_res
+compact_update_setfile(const char *setfile, const char *setdir,
+		       struct compact_file *inputs, size_t n_inputs,
+		       const char *out_line)
+{
+	mtbl_res res = mtbl_res_failure;
+	ubuf *lock_fname = ubuf_init(0);
+	ubuf *tmp_fname = ubuf_init(0);
+	ubuf *u = ubuf_init(64);
+	bool *found = my_calloc(n_inputs, sizeof(bool));
+	FILE *fp = NULL, *out = NULL;
+	char *line = NULL;
+	size_t len = 0;
+	int lock_fd;
+
+	ubuf_add_fmt(lock_fname, "%s.lock", setfile);
+	ubuf_cterm(lock_fname);
+	ubuf_add_fmt(tmp_fname, "%s.tmp", setfile);
+	ubuf_cterm(tmp_fname);
+
+	lock_fd = open((const char *) ubuf_data(lock_fname), O_RDWR | O_CREAT, 0644);
+	if (lock_fd < 0)
+		goto out;
+	if (flock(lock_fd, LOCK_EX) != 0)
+		goto out;
+
+	fp = fopen(setfile, "r");
+	out = fopen((const char *) ubuf_data(tmp_fname), "w");
+	if (fp == NULL || out == NULL)
+		goto out;
+	while (getline(&line, &len, fp) != -1) {
+		bool merged = false;
+
+		compact_path(u, setdir, line);
+		for (size_t i = 0; i < n_inputs; i++) {
+			if (strcmp((const char *) ubuf_data(u), inputs[i].fname) == 0) {
+				found[i] = merged = true;
+				break;
+			}
+		}
+		if (!merged && fputs(line, out) == EOF)
+			goto out;
+		if (!merged && line[strlen(line) - 1] != '\n' && fputc('\n', out) == EOF)
+			goto out;
+	}
+
+	/* An input removed from the setfile during the merge would come back. */
+	for (size_t i = 0; i < n_inputs; i++)
+		if (!found[i])
+			goto out;
+
+	fprintf(out, "%s\n", out_line);
+	if (fflush(out) != 0 || fsync(fileno(out)) != 0)
+		goto out;
+	if (rename((const char *) ubuf_data(tmp_fname), setfile) != 0)
+		goto out;
+	res = mtbl_res_success;
+
+out:
+	if (out != NULL) {
+		fclose(out);
+		if (res != mtbl_res_success)
+			unlink((const char *) ubuf_data(tmp_fname));
+	}
+	if (fp != NULL)
+		fclose(fp);
+	if (lock_fd >= 0)
+		close(lock_fd);
+	free(line);
+	free(found);
+	ubuf_destroy(&u);
+	ubuf_destroy(&tmp_fname);
+	ubuf_destroy(&lock_fname);
+	return (res);
+}
+
+/*
+ * Set 'out_line' to the setfile line of a merged file named after the file
+ * 'f', less any suffix from an earlier merge if 'strip' is true, and 'out'
+ * to its path, both ending in the "XXXXXX" template of mkstemp(3).
+ */
+static void
+compact_out_name(const char *setdir, const struct compact_file *f, bool strip,
+		 ubuf *out_line, ubuf *out)
+{
+	char *t = my_strdup(f->line), *base = strrchr(t, '/'), *suffix;
+
+	base = (base != NULL) ? base + 1 : t;
+	suffix = strstr(base, ".compact.");
+	if (strip && suffix != NULL)
+		*suffix = '\0';
+	ubuf_clip(out_line, 0);
+	ubuf_add_fmt(out_line, "%s.compact.XXXXXX", t);
+	ubuf_cterm(out_line);
+	compact_path(out, setdir, (const char *) ubuf_data(out_line));
+	free(t);
+}
+
+/*
+ * Whether every path made by filling in the template 'out' sorts after the
+ * file 'prev' and before the file 'next', either of which may be NULL.
+ */
+static bool
+compact_out_fits(const char *out, const struct compact_file *prev,
+		 const struct compact_file *next)
+{
+	size_t len = strlen(out) - 6;
+
+	if (prev != NULL && strncmp(out, prev->fname, len) <= 0)
+		return (false);
+	if (next != NULL && strncmp(out, next->fname, len) >= 0)
+		return (false);
+	return (true);
+}
+
+mtbl_res
+mtbl_compact(const char *setfile, const struct mtbl_compact_options *opt,
+	     size_t *n_merged)
+{
+	mtbl_res res = mtbl_res_failure;
+	cfile_vec *files = cfile_vec_init(16);
+	struct compact_file *fv, *inputs = NULL;
+	size_t first = 0, last = 0, n_inputs = 0;
+	ubuf *out_fname = NULL, *out_line = NULL;
+	char *setdir, *t;
+	int fd;
+
+	if (n_merged != NULL)
+		*n_merged = 0;
+	if (opt == NULL || (opt->merge == NULL && opt->merge_values == NULL))
+		return (mtbl_res_failure);
+
+	t = my_strdup(setfile);
+	setdir = my_strdup(dirname(t));
+	free(t);
+
+	if (!compact_read_setfile(opt, setfile, setdir, files))
+		goto out;
+
+	/* Find the smallest tier which is full. */
+	for (unsigned tier = 0; tier <= 64 && n_inputs < opt->tier_files; tier++) {
+		n_inputs = 0;
+		for (size_t i = 0; i < cfile_vec_size(files); i++) {
+			if (cfile_vec_value(files, i).tier == tier) {
+				if (n_inputs++ == 0)
+					first = i;
+				last = i;
+			}
+		}
+	}
+	if (n_inputs < opt->tier_files) {
+		n_inputs = 0;
+		res = mtbl_res_success;
+		goto out;
+	}
+
+	/*
+	 * Name the merged file after the newest input, less any suffix from
+	 * an earlier merge if it still sorts in place. Otherwise the next file
+	 * is merged as well, until the name sorts before the file after it.
+	 */
+	out_fname = ubuf_init(0);
+	out_line = ubuf_init(0);
+	fv = cfile_vec_data(files);
+	for (;;) {
+		const struct compact_file *prev = (first > 0) ? &fv[first - 1] : NULL;
+		const struct compact_file *next =
+			(last + 1 < cfile_vec_size(files)) ? &fv[last + 1] : NULL;
+
+		compact_out_name(setdir, &fv[last], true, out_line, out_fname);
+		if (compact_out_fits((const char *) ubuf_data(out_fname), prev, next))
+			break;
+		compact_out_name(setdir, &fv[last], false, out_line, out_fname);
+		if (compact_out_fits((const char *) ubuf_data(out_fname), prev, next))
+			break;
+		last++;
+	}
+	n_inputs = last - first + 1;
+	inputs = my_calloc(n_inputs, sizeof(*inputs));
+	memcpy(inputs, &fv[first], n_inputs * sizeof(*inputs));
+
+	fd = mkstemp((char *) ubuf_data(out_fname));
+	if (fd < 0)
+		goto out;
+	(void) fchmod(fd, 0644);
+	/* The line ends with the same template, which mkstemp() filled in. */
+	memcpy(ubuf_data(out_line) + strlen((const char *) ubuf_data(out_line)) - 6,
+	       ubuf_data(out_fname) + strlen((const char *) ubuf_data(out_fname)) - 6, 6);
+
+	res = compact_merge(opt, inputs, n_inputs,
+			    n_inputs == cfile_vec_size(files), fd);
+	close(fd);
+	if (res == mtbl_res_success)
+		res = compact_update_setfile(setfile, setdir, inputs, n_inputs,
+					     (const char *) ubuf_data(out_line));
+	if (res != mtbl_res_success) {
+		unlink((const char *) ubuf_data(out_fname));
+		goto out;
+	}
+
+	if (!opt->keep_inputs)
+		for (size_t i = 0; i < n_inputs; i++)
+			unlink(inputs[i].fname);
+	if (n_merged != NULL)
+		*n_merged = n_inputs;
+
+out:
+	free(inputs);
+	free(setdir);
+	ubuf_destroy(&out_fname);
+	ubuf_destroy(&out_line);
+	compact_files_destroy(&files);
+	return (res);
+}
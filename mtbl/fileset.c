@@ -15,16 +15,30 @@
  * limitations under the License.
  */
 
+#if HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+# include <poll.h>
+#endif
+#include <pthread.h>
+#include <sched.h>
 #include <time.h>
 
 #include "mtbl-private.h"
+#include "threadpool.h"
 
 #include "libmy/my_fileset.h"
 #include "libmy/my_time.h"
+#include "libmy/ubuf.h"
+#include "libmy/vector.h"
 
 struct mtbl_fileset_options {
 	uint32_t			reload_interval;
+	bool				watch;
+	bool				prefetch_index;
+	size_t				max_open_readers;
+	struct mtbl_threadpool		*pool;
 	mtbl_merge_func			merge;
+	mtbl_merge_values_func		merge_values;
 	void				*merge_clos;
 	mtbl_dupsort_func		dupsort;
 	void				*dupsort_clos;
@@ -34,37 +48,921 @@ struct mtbl_fileset_options {
 	void				*reader_filter_clos;
 };
 
+/*
+ * The open readers of a fileset with a limit on open readers. Readers which
+ * are open but not in use are kept in least recently used order, and closed
+ * while more than max_open readers are open. Readers in use are never closed,
+ * so the limit may be exceeded while many of them are in use at once.
+ * n_missing counts the files found removed from disk when opened again.
+ */
+struct fs_lru {
+	pthread_mutex_t			lock;
+	size_t				max_open, n_open;
+	struct fileset_reader		*head, *tail;	/* most recently used first */
+	uint32_t			n_missing;
+};
+
+/*
+ * A reader loaded from the setfile. It is referenced by the shared fileset
+ * while listed in the setfile, and by each snapshot which includes it, and is
+ * destroyed when the last of these references is dropped.
+ *
+ * With a limit on open readers, the file is only mapped while in use or among
+ * the most recently used, and its source opens and maps it again by name on
+ * demand. Like any other reader, it keeps no file descriptor open. The key
+ * range and whether the file may have tombstones are kept from when it was
+ * first opened.
+ */
+struct fileset_reader {
+	struct mtbl_reader		*reader;
+	uint32_t			refs;
+	bool				prefetch_index;
+	char				*fname;		/* until opened, unless lazy */
+	struct fs_lru			*lru;		/* NULL unless lazy */
+	bool				missing;	/* removed when opened again */
+	struct mtbl_source		*source;
+	struct key_range		kr;
+	uint32_t			users;
+	struct fileset_reader		*lru_prev, *lru_next;
+};
+
+VECTOR_GENERATE(fs_reader_vec, struct fileset_reader *);
+VECTOR_GENERATE(fs_level_vec, struct level *);
+
+/* A reader's key range, while grouping readers into levels. */
+struct fs_level_entry {
+	struct key_range		kr;
+	const struct mtbl_source	*source;
+};
+
+VECTOR_GENERATE(fs_level_entry_vec, struct fs_level_entry);
+
+/* A level being built. Readers with unknown key ranges are alone in a level. */
+struct fs_level_build {
+	fs_level_entry_vec		*entries;
+	bool				unbounded;
+};
+
+VECTOR_GENERATE(fs_level_build_vec, struct fs_level_build);
+
+/*
+ * An immutable view of a fileset: the readers included when it was taken and
+ * a merger over them. The fileset holds a reference to its current snapshot,
+ * and each iterator or lookup holds a reference to the snapshot it was started
+ * on. Snapshots are only freed by mtbl_fileset_destroy(), so that a thread
+ * which has loaded a stale pointer to one can still safely try to reference it.
+ */
+struct fileset_snapshot {
+	uint32_t			refs;
+	bool				dead;
+	uint32_t			generation;
+	struct mtbl_merger		*merger;
+	fs_reader_vec			*readers;
+	fs_level_vec			*levels;
+	struct fileset_snapshot		*next;
+};
+
 struct shared_fileset {
-	size_t 				n_loaded, n_unloaded, n_fs, n_iters;
+	pthread_mutex_t			lock;
+	size_t 				n_loaded, n_unloaded, n_fs;
 	bool				reload_needed;
+	uint32_t			generation;
 	struct timespec			fs_last;
 	struct my_fileset		*my_fs;
+	struct mtbl_threadpool		*pool;
+	bool				prefetch_index;
+	struct fs_lru			lru;
+	fs_reader_vec			*pending;	/* loaded, to be opened */
+	char				*setfile;
+	bool				watching;
+#if HAVE_SYS_INOTIFY_H
+	pthread_t			watcher;
+	int				watch_fd;
+	int				watch_pipe[2];
+	int				watch_timeout;
+#endif
+};
+
+
+struct mtbl_fileset {
+	uint32_t			reload_interval;
+	struct shared_fileset		*shared_fs;
+	struct fileset_snapshot		*snap;
+	struct fileset_snapshot		*snapshots;
+	struct mtbl_merger_options	*mopt;
+	struct mtbl_source		*source;
+	mtbl_filename_filter_func	fname_filter;
+	void				*fname_filter_clos;
+	mtbl_reader_filter_func		reader_filter;
+	void				*reader_filter_clos;
 };
 
+typedef enum {
+	FILESET_ITER_TYPE_ITER,
+	FILESET_ITER_TYPE_GET,
+	FILESET_ITER_TYPE_GET_PREFIX,
+	FILESET_ITER_TYPE_GET_RANGE,
+} fileset_iter_type;
+
+/*
+ * With a limit on open readers, an iterator can resume on a new snapshot if
+ * one of its files is found removed when opened again, so it keeps its query,
+ * and the key to seek to, which is the key last sought or just after the key
+ * last returned.
+ */
+struct fileset_iter {
+	struct mtbl_fileset *f;
+	struct fileset_snapshot *snap;
+	struct mtbl_iter *iter;
+
+	bool resumable;
+	uint32_t n_missing;
+	fileset_iter_type it_type;
+	ubuf *key0, *key1;
+	ubuf *pos;
+	bool has_pos;
+};
+
+/*
+ * A lookup on a fileset with a limit on open readers. A merger only calls the
+ * lookup function once every source has been looked up, so if one of the files
+ * was found removed by then, no values are passed on and the lookup is retried
+ * on a new snapshot.
+ */
+struct fs_lookup {
+	struct mtbl_fileset		*f;
+	struct fileset_snapshot		*snap;
+	uint32_t			n_missing;
+	bool				checked, retry;
+	mtbl_lookup_func		lookup;
+	void				*lookup_clos;
+};
+
+/* An iterator over a lazily opened reader, which keeps the reader open. */
+struct fs_lazy_iter {
+	struct fileset_reader		*fr;
+	struct mtbl_iter		*iter;
+};
+
+/* Must be called with the LRU lock held. Does nothing if fr is not listed. */
+static void
+fs_lru_unlink(struct fs_lru *lru, struct fileset_reader *fr)
+{
+	if (fr->lru_prev != NULL)
+		fr->lru_prev->lru_next = fr->lru_next;
+	else if (lru->head == fr)
+		lru->head = fr->lru_next;
+	else
+		return;
+	if (fr->lru_next != NULL)
+		fr->lru_next->lru_prev = fr->lru_prev;
+	else
+		lru->tail = fr->lru_prev;
+	fr->lru_prev = fr->lru_next = NULL;
+}
+
+/* Must be called with the LRU lock held. */
+static void
+fs_lru_push(struct fs_lru *lru, struct fileset_reader *fr)
+{
+	fr->lru_prev = NULL;
+	fr->lru_next = lru->head;
+	if (lru->head != NULL)
+		lru->head->lru_prev = fr;
+	else
+		lru->tail = fr;
+	lru->head = fr;
+}
+
+/*
+ * Close the least recently used readers while more than max_open readers are
+ * open. Returns whether any reader was closed.
+ */
+static bool
+fs_lru_trim(struct fs_lru *lru, size_t max_open)
+{
+	bool closed = false;
+
+	for (;;) {
+		struct fileset_reader *fr;
+		struct mtbl_reader *r;
+
+		pthread_mutex_lock(&lru->lock);
+		fr = lru->tail;
+		if (fr == NULL || lru->n_open <= max_open) {
+			pthread_mutex_unlock(&lru->lock);
+			return (closed);
+		}
+		fs_lru_unlink(lru, fr);
+		r = fr->reader;
+		fr->reader = NULL;
+		lru->n_open--;
+		pthread_mutex_unlock(&lru->lock);
+		mtbl_reader_destroy(&r);
+		closed = true;
+	}
+}
+
+static struct mtbl_reader *
+fs_reader_open(const char *fname, bool prefetch_index)
+{
+	struct mtbl_reader *r = mtbl_reader_init(fname, NULL);
+
+	if (r != NULL && prefetch_index)
+		reader_prefetch_index(r);
+	return (r);
+}
+
+/*
+ * Get a lazily opened reader for use, opening and mapping its file again if
+ * needed. If that fails, the readers not in use are closed to make room, and
+ * it is tried again. Returns NULL if the file still cannot be opened, after
+ * marking the reader missing if the file has been removed. The reader stays
+ * open until released with fs_reader_release().
+ */
+static struct mtbl_reader *
+fs_reader_acquire(struct fileset_reader *fr)
+{
+	struct fs_lru *lru = fr->lru;
+	struct mtbl_reader *r, *opened = NULL;
+
+	pthread_mutex_lock(&lru->lock);
+	if (fr->reader == NULL) {
+		pthread_mutex_unlock(&lru->lock);
+		opened = fs_reader_open(fr->fname, fr->prefetch_index);
+		if (opened == NULL && errno != ENOENT && fs_lru_trim(lru, 0))
+			opened = fs_reader_open(fr->fname, fr->prefetch_index);
+		if (opened == NULL) {
+			if (errno == ENOENT) {
+				__atomic_store_n(&fr->missing, true, __ATOMIC_RELAXED);
+				__atomic_add_fetch(&lru->n_missing, 1, __ATOMIC_RELEASE);
+			}
+			return (NULL);
+		}
+		__atomic_store_n(&fr->missing, false, __ATOMIC_RELAXED);
+		pthread_mutex_lock(&lru->lock);
+		if (fr->reader == NULL) {
+			fr->reader = opened;
+			lru->n_open++;
+		}
+	}
+	r = fr->reader;
+	fs_lru_unlink(lru, fr);
+	fr->users++;
+	pthread_mutex_unlock(&lru->lock);
+
+	if (opened == r) {
+		fs_lru_trim(lru, lru->max_open);
+	} else {
+		/* Another thread opened the reader at the same time. */
+		mtbl_reader_destroy(&opened);
+	}
+	return (r);
+}
+
+static void
+fs_reader_release(struct fileset_reader *fr)
+{
+	struct fs_lru *lru = fr->lru;
+
+	pthread_mutex_lock(&lru->lock);
+	if (--fr->users == 0)
+		fs_lru_push(lru, fr);
+	pthread_mutex_unlock(&lru->lock);
+	fs_lru_trim(lru, lru->max_open);
+}
+
+static void
+fs_reader_unref(struct fileset_reader *fr)
+{
+	if (fr != NULL && __atomic_sub_fetch(&fr->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		if (fr->lru != NULL) {
+			pthread_mutex_lock(&fr->lru->lock);
+			fs_lru_unlink(fr->lru, fr);
+			if (fr->reader != NULL)
+				fr->lru->n_open--;
+			pthread_mutex_unlock(&fr->lru->lock);
+			mtbl_source_destroy(&fr->source);
+			free((void *) fr->kr.first);
+		}
+		mtbl_reader_destroy(&fr->reader);
+		free(fr->fname);
+		free(fr);
+	}
+}
+
+static mtbl_res
+fs_lazy_iter_seek(void *v, const uint8_t *key, size_t len_key)
+{
+	struct fs_lazy_iter *it = (struct fs_lazy_iter *) v;
+	return (mtbl_iter_seek(it->iter, key, len_key));
+}
+
+static mtbl_res
+fs_lazy_iter_next(void *v,
+		  const uint8_t **key, size_t *len_key,
+		  const uint8_t **val, size_t *len_val)
+{
+	struct fs_lazy_iter *it = (struct fs_lazy_iter *) v;
+	return (mtbl_iter_next(it->iter, key, len_key, val, len_val));
+}
+
+static bool
+fs_lazy_iter_raw_block(void *v, struct raw_block *rb)
+{
+	struct fs_lazy_iter *it = (struct fs_lazy_iter *) v;
+	return (iter_raw_block(it->iter, rb));
+}
+
+static void
+fs_lazy_iter_skip_block(void *v)
+{
+	struct fs_lazy_iter *it = (struct fs_lazy_iter *) v;
+	iter_skip_block(it->iter);
+}
+
+static bool
+fs_lazy_iter_reset(void *v, iter_reset_type type,
+		   const uint8_t *key0, size_t len_key0,
+		   const uint8_t *key1, size_t len_key1)
+{
+	struct fs_lazy_iter *it = (struct fs_lazy_iter *) v;
+	return (iter_reset(it->iter, type, key0, len_key0, key1, len_key1));
+}
+
+static entry_type
+fs_lazy_iter_entry_type(void *v)
+{
+	struct fs_lazy_iter *it = (struct fs_lazy_iter *) v;
+	return (iter_entry_type(it->iter));
+}
+
+static void
+fs_lazy_iter_free(void *v)
+{
+	struct fs_lazy_iter *it = (struct fs_lazy_iter *) v;
+
+	if (it) {
+		mtbl_iter_destroy(&it->iter);
+		fs_reader_release(it->fr);
+		free(it);
+	}
+}
+
+/* Wrap an iterator over an acquired reader, releasing the reader with it. */
+static struct mtbl_iter *
+fs_lazy_iter_init(struct fileset_reader *fr, struct mtbl_iter *iter)
+{
+	struct fs_lazy_iter *it;
+	struct mtbl_iter *lit;
+
+	if (iter == NULL) {
+		fs_reader_release(fr);
+		return (NULL);
+	}
+	it = my_calloc(1, sizeof(*it));
+	it->fr = fr;
+	it->iter = iter;
+	lit = mtbl_iter_init(fs_lazy_iter_seek, fs_lazy_iter_next, fs_lazy_iter_free, it);
+	iter_set_raw_block_funcs(lit, fs_lazy_iter_raw_block, fs_lazy_iter_skip_block);
+	iter_set_entry_type_func(lit, fs_lazy_iter_entry_type);
+	iter_set_reset_func(lit, fs_lazy_iter_reset);
+	return (lit);
+}
+
+static struct mtbl_iter *
+fs_lazy_iter(void *clos)
+{
+	struct fileset_reader *fr = (struct fileset_reader *) clos;
+	struct mtbl_reader *r = fs_reader_acquire(fr);
+
+	if (r == NULL)
+		return (NULL);
+	return (fs_lazy_iter_init(fr, mtbl_source_iter(mtbl_reader_source(r))));
+}
+
+static struct mtbl_iter *
+fs_lazy_get(void *clos, const uint8_t *key, size_t len_key)
+{
+	struct fileset_reader *fr = (struct fileset_reader *) clos;
+	struct mtbl_reader *r = fs_reader_acquire(fr);
+
+	if (r == NULL)
+		return (NULL);
+	return (fs_lazy_iter_init(fr, mtbl_source_get(mtbl_reader_source(r), key, len_key)));
+}
+
+static struct mtbl_iter *
+fs_lazy_get_prefix(void *clos, const uint8_t *key, size_t len_key)
+{
+	struct fileset_reader *fr = (struct fileset_reader *) clos;
+	struct mtbl_reader *r = fs_reader_acquire(fr);
+
+	if (r == NULL)
+		return (NULL);
+	return (fs_lazy_iter_init(fr,
+			mtbl_source_get_prefix(mtbl_reader_source(r), key, len_key)));
+}
+
+static struct mtbl_iter *
+fs_lazy_get_range(void *clos,
+		  const uint8_t *key0, size_t len_key0,
+		  const uint8_t *key1, size_t len_key1)
+{
+	struct fileset_reader *fr = (struct fileset_reader *) clos;
+	struct mtbl_reader *r = fs_reader_acquire(fr);
+
+	if (r == NULL)
+		return (NULL);
+	return (fs_lazy_iter_init(fr,
+			mtbl_source_get_range(mtbl_reader_source(r),
+					      key0, len_key0, key1, len_key1)));
+}
+
+static void
+fs_lazy_key_range(void *clos, struct key_range *kr)
+{
+	struct fileset_reader *fr = (struct fileset_reader *) clos;
+	*kr = fr->kr;
+}
+
+static mtbl_res
+fs_lazy_lookup(void *clos, const uint8_t *key, size_t len_key,
+	       mtbl_lookup_func lookup, void *lookup_clos)
+{
+	struct fileset_reader *fr = (struct fileset_reader *) clos;
+	struct mtbl_reader *r = fs_reader_acquire(fr);
+	mtbl_res res;
+
+	if (r == NULL)
+		return (mtbl_res_failure);
+	res = mtbl_source_lookup(mtbl_reader_source(r), key, len_key, lookup, lookup_clos);
+	fs_reader_release(fr);
+	return (res);
+}
+
+/*
+ * Set up a newly opened reader to be opened on demand: keep a copy of its key
+ * range, give it a source which opens it when used, and make it the most
+ * recently used reader, which may close others.
+ */
+static void
+fs_reader_lazy_init(struct fileset_reader *fr)
+{
+	const struct mtbl_source *s = mtbl_reader_source(fr->reader);
+	struct key_range kr;
+	uint8_t *keys;
+
+	source_key_range(s, &kr);
+	keys = my_malloc(kr.len_first + kr.len_last + 1);
+	if (kr.has_first)
+		memcpy(keys, kr.first, kr.len_first);
+	if (kr.has_last)
+		memcpy(keys + kr.len_first, kr.last, kr.len_last);
+	fr->kr = kr;
+	fr->kr.first = keys;
+	fr->kr.last = keys + kr.len_first;
+
+	fr->source = mtbl_source_init(fs_lazy_iter,
+				      fs_lazy_get,
+				      fs_lazy_get_prefix,
+				      fs_lazy_get_range,
+				      NULL, fr);
+	source_set_key_range_func(fr->source, fs_lazy_key_range);
+	source_set_lookup_func(fr->source, fs_lazy_lookup, source_lookup_unique(s));
+	source_set_tombstones(fr->source, source_tombstones(s));
+
+	pthread_mutex_lock(&fr->lru->lock);
+	fr->lru->n_open++;
+	fs_lru_push(fr->lru, fr);
+	pthread_mutex_unlock(&fr->lru->lock);
+	fs_lru_trim(fr->lru, fr->lru->max_open);
+}
+
+/* The source of a loaded reader, or NULL if it could not be opened. */
+static const struct mtbl_source *
+fs_reader_source(const struct fileset_reader *fr)
+{
+	if (fr->lru != NULL)
+		return (fr->source);
+	return (fr->reader != NULL ? mtbl_reader_source(fr->reader) : NULL);
+}
+
+/*
+ * A lazily opened reader is opened, if needed, to be passed to the filter, and
+ * left out if it cannot be.
+ */
+static bool
+fs_reader_filter(struct mtbl_fileset *f, struct fileset_reader *fr)
+{
+	struct mtbl_reader *r;
+	bool keep;
+
+	if (f->reader_filter == NULL)
+		return (true);
+	if (fr->lru == NULL)
+		return (f->reader_filter(fr->reader, f->reader_filter_clos));
+	r = fs_reader_acquire(fr);
+	if (r == NULL)
+		return (false);
+	keep = f->reader_filter(r, f->reader_filter_clos);
+	fs_reader_release(fr);
+	return (keep);
+}
+
+/* Take a reference to a snapshot, unless its last reference has been dropped. */
+static bool
+fs_snapshot_ref(struct fileset_snapshot *snap)
+{
+	uint32_t refs = __atomic_load_n(&snap->refs, __ATOMIC_ACQUIRE);
+
+	while (refs != 0) {
+		if (__atomic_compare_exchange_n(&snap->refs, &refs, refs + 1, false,
+						__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return (true);
+	}
+	return (false);
+}
+
+static void
+fs_snapshot_unref(struct fileset_snapshot *snap)
+{
+	if (__atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	mtbl_merger_destroy(&snap->merger);
+	for (size_t i = 0; i < fs_level_vec_size(snap->levels); i++) {
+		struct level *l = fs_level_vec_value(snap->levels, i);
+		level_destroy(&l);
+	}
+	fs_level_vec_destroy(&snap->levels);
+	for (size_t i = 0; i < fs_reader_vec_size(snap->readers); i++)
+		fs_reader_unref(fs_reader_vec_value(snap->readers, i));
+	fs_reader_vec_destroy(&snap->readers);
+	__atomic_store_n(&snap->dead, true, __ATOMIC_RELEASE);
+}
+
+/* Pin the current snapshot of the fileset. This does not block. */
+static struct fileset_snapshot *
+fs_snapshot_pin(struct mtbl_fileset *f)
+{
+	for (;;) {
+		struct fileset_snapshot *snap = __atomic_load_n(&f->snap, __ATOMIC_ACQUIRE);
+
+		if (fs_snapshot_ref(snap)) {
+			/* Retry if a reload retired the snapshot in the meantime. */
+			if (snap == __atomic_load_n(&f->snap, __ATOMIC_ACQUIRE))
+				return (snap);
+			fs_snapshot_unref(snap);
+		}
+		sched_yield();
+	}
+}
+
+static struct fileset_snapshot *
+fs_snapshot_init(struct mtbl_fileset *f, uint32_t generation)
+{
+	struct fileset_snapshot *snap;
+
+	/* Reuse a snapshot whose last reference has been dropped, if any. */
+	for (snap = f->snapshots; snap != NULL; snap = snap->next)
+		if (__atomic_load_n(&snap->dead, __ATOMIC_ACQUIRE))
+			break;
+	if (snap == NULL) {
+		snap = my_calloc(1, sizeof(*snap));
+		snap->next = f->snapshots;
+		f->snapshots = snap;
+	} else {
+		__atomic_store_n(&snap->dead, false, __ATOMIC_RELAXED);
+	}
+
+	__atomic_store_n(&snap->generation, generation, __ATOMIC_RELAXED);
+	snap->merger = mtbl_merger_init(f->mopt);
+	snap->readers = fs_reader_vec_init(1);
+	snap->levels = fs_level_vec_init(1);
+	__atomic_store_n(&snap->refs, 1, __ATOMIC_RELEASE);
+	return (snap);
+}
+
+static void
+fs_snapshot_add_readers(struct mtbl_fileset *f, struct fileset_snapshot *snap)
+{
+	const char *fname;
+	struct fileset_reader *fr;
+	size_t i = 0;
+
+	while (my_fileset_get(f->shared_fs->my_fs, i++, &fname, (void **) &fr)) {
+		if (fr == NULL || fs_reader_source(fr) == NULL) {
+			continue;
+		}
+
+		/*
+		* Add the reader's source to the merger unless filtered out by the
+		* fname_filter or reader_filter.
+		*/
+		if (
+			(f->fname_filter == NULL
+				|| f->fname_filter(fname, f->fname_filter_clos))
+			&&
+			fs_reader_filter(f, fr)
+		   ) {
+			__atomic_add_fetch(&fr->refs, 1, __ATOMIC_RELAXED);
+			fs_reader_vec_add(snap->readers, fr);
+		}
+	}
+}
+
+/* Whether a reader's keys may overlap those of any reader in a level. */
+static bool
+fs_level_overlaps(const struct fs_level_build *lb, const struct key_range *kr)
+{
+	const struct fs_level_entry *ents = fs_level_entry_vec_data(lb->entries);
+	size_t lo = 0, hi = fs_level_entry_vec_size(lb->entries);
+
+	if (lb->unbounded || !kr->has_first || !kr->has_last)
+		return (true);
+
+	/* Find the first reader in the level whose last key is not before ours. */
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (bytes_compare(ents[mid].kr.last, ents[mid].kr.len_last,
+				  kr->first, kr->len_first) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo < fs_level_entry_vec_size(lb->entries) &&
+		bytes_compare(ents[lo].kr.first, ents[lo].kr.len_first,
+			      kr->last, kr->len_last) <= 0);
+}
+
+/* Insert a reader into a level, keeping the level ordered by key. */
+static void
+fs_level_insert(struct fs_level_build *lb, const struct fs_level_entry *ent)
+{
+	struct fs_level_entry *ents;
+	size_t n = fs_level_entry_vec_size(lb->entries), i = n;
+
+	fs_level_entry_vec_add(lb->entries, *ent);
+	ents = fs_level_entry_vec_data(lb->entries);
+	while (i > 0 && bytes_compare(ents[i - 1].kr.first, ents[i - 1].kr.len_first,
+				      ent->kr.first, ent->kr.len_first) > 0)
+		i--;
+	memmove(&ents[i + 1], &ents[i], (n - i) * sizeof(*ents));
+	ents[i] = *ent;
+}
+
+/*
+ * Add the snapshot's readers to its merger, grouping readers whose key ranges
+ * do not overlap into levels. The merger then has a single source per level,
+ * which finds the reader that may have a key by binary search. Each reader is
+ * put in the level after the last one with a reader whose keys overlap its
+ * own, so readers which may share a key keep their order in the merger, and
+ * their values are merged in the same order as without levels.
+ */
+static void
+fs_snapshot_add_levels(struct fileset_snapshot *snap)
+{
+	fs_level_build_vec *builds = fs_level_build_vec_init(1);
+
+	for (size_t i = 0; i < fs_reader_vec_size(snap->readers); i++) {
+		struct fileset_reader *fr = fs_reader_vec_value(snap->readers, i);
+		struct fs_level_entry ent = { .source = fs_reader_source(fr) };
+		size_t n_levels = fs_level_build_vec_size(builds), lvl = 0;
+
+		source_key_range(ent.source, &ent.kr);
+		for (size_t j = n_levels; j > 0; j--) {
+			if (fs_level_overlaps(fs_level_build_vec_data(builds) + j - 1, &ent.kr)) {
+				lvl = j;
+				break;
+			}
+		}
+		if (lvl == n_levels) {
+			struct fs_level_build lb = {
+				.entries = fs_level_entry_vec_init(1),
+				.unbounded = !ent.kr.has_first || !ent.kr.has_last,
+			};
+			fs_level_build_vec_add(builds, lb);
+		}
+		fs_level_insert(fs_level_build_vec_data(builds) + lvl, &ent);
+	}
+
+	for (size_t i = 0; i < fs_level_build_vec_size(builds); i++) {
+		struct fs_level_build *lb = fs_level_build_vec_data(builds) + i;
+		size_t n = fs_level_entry_vec_size(lb->entries);
+
+		if (n == 1) {
+			mtbl_merger_add_source(snap->merger,
+					       fs_level_entry_vec_value(lb->entries, 0).source);
+		} else {
+			struct level *l = level_init();
+
+			for (size_t j = 0; j < n; j++)
+				level_add_source(l, fs_level_entry_vec_value(lb->entries, j).source);
+			fs_level_vec_add(snap->levels, l);
+			mtbl_merger_add_source(snap->merger, level_source(l));
+		}
+		fs_level_entry_vec_destroy(&lb->entries);
+	}
+	fs_level_build_vec_destroy(&builds);
+}
+
+static void
+fs_maybe_reload(struct mtbl_fileset *);
+
+static struct fileset_snapshot *
+fs_snapshot_repin(struct mtbl_fileset *, struct fileset_snapshot *);
+
+static struct fileset_snapshot *
+fs_source_pin(struct mtbl_fileset *f)
+{
+	fs_maybe_reload(f);
+	return (fs_snapshot_pin(f));
+}
+
+static uint32_t
+fs_missing_count(struct mtbl_fileset *f)
+{
+	return (__atomic_load_n(&f->shared_fs->lru.n_missing, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Whether one of the files of a snapshot was found removed since n_missing
+ * was counted, which is updated.
+ */
+static bool
+fs_snapshot_missing(struct mtbl_fileset *f, struct fileset_snapshot *snap,
+		    uint32_t *n_missing)
+{
+	uint32_t n = fs_missing_count(f);
+
+	if (n == *n_missing)
+		return (false);
+	*n_missing = n;
+	for (size_t i = 0; i < fs_reader_vec_size(snap->readers); i++) {
+		struct fileset_reader *fr = fs_reader_vec_value(snap->readers, i);
+
+		if (__atomic_load_n(&fr->missing, __ATOMIC_RELAXED))
+			return (true);
+	}
+	return (false);
+}
+
+static struct fileset_iter *
+fileset_iter_alloc(struct mtbl_fileset *f, fileset_iter_type it_type,
+		   const uint8_t *key0, size_t len_key0,
+		   const uint8_t *key1, size_t len_key1)
+{
+	struct fileset_iter *it = my_calloc(1, sizeof(*it));
+	it->f = f;
+	it->snap = fs_source_pin(f);
+	if (f->shared_fs->lru.max_open > 0) {
+		it->resumable = true;
+		it->n_missing = fs_missing_count(f);
+		it->it_type = it_type;
+		it->key0 = ubuf_init(len_key0);
+		it->key1 = ubuf_init(len_key1);
+		it->pos = ubuf_init(64);
+		if (len_key0 > 0)
+			ubuf_append(it->key0, key0, len_key0);
+		if (len_key1 > 0)
+			ubuf_append(it->key1, key1, len_key1);
+	}
+	return (it);
+}
+
+static struct mtbl_iter *
+fileset_iter_query(struct fileset_iter *it)
+{
+	const struct mtbl_source *s = mtbl_merger_source(it->snap->merger);
+
+	switch (it->it_type) {
+	case FILESET_ITER_TYPE_ITER:
+		return (mtbl_source_iter(s));
+	case FILESET_ITER_TYPE_GET:
+		return (mtbl_source_get(s, ubuf_data(it->key0), ubuf_size(it->key0)));
+	case FILESET_ITER_TYPE_GET_PREFIX:
+		return (mtbl_source_get_prefix(s, ubuf_data(it->key0), ubuf_size(it->key0)));
+	case FILESET_ITER_TYPE_GET_RANGE:
+		return (mtbl_source_get_range(s,
+					      ubuf_data(it->key0), ubuf_size(it->key0),
+					      ubuf_data(it->key1), ubuf_size(it->key1)));
+	}
+	return (NULL);
+}
+
+/* Record the key to resume from, just after the key if it was returned. */
+static void
+fileset_iter_set_pos(struct fileset_iter *it, const uint8_t *key, size_t len_key,
+		     bool returned)
+{
+	ubuf_clip(it->pos, 0);
+	ubuf_append(it->pos, key, len_key);
+	if (returned)
+		ubuf_add(it->pos, '\0');
+	it->has_pos = true;
+}
+
+/*
+ * If one of the files of the iterator's snapshot was found removed, reload the
+ * fileset and resume the iteration on the new snapshot. Other entries with the
+ * key last returned are not returned again. Returns whether the iterator was
+ * resumed, which it is not if the setfile still lists the file.
+ */
+static bool
+fileset_iter_resume(struct fileset_iter *it)
+{
+	struct fileset_snapshot *snap;
+
+	if (!fs_snapshot_missing(it->f, it->snap, &it->n_missing))
+		return (false);
+	snap = fs_snapshot_repin(it->f, it->snap);
+	if (snap == NULL)
+		return (false);
+	mtbl_iter_destroy(&it->iter);
+	fs_snapshot_unref(it->snap);
+	it->snap = snap;
+	it->iter = fileset_iter_query(it);
+	if (it->has_pos &&
+	    mtbl_iter_seek(it->iter, ubuf_data(it->pos), ubuf_size(it->pos)) != mtbl_res_success)
+		mtbl_iter_destroy(&it->iter);
+	return (true);
+}
+
+/*
+ * Re-aim the iterator on the fileset's current snapshot. If the fileset has
+ * not been reloaded since the iterator was created, its merger iterator is
+ * reset in place.
+ */
+static bool
+fileset_iter_reset(void *v, iter_reset_type type,
+		   const uint8_t *key0, size_t len_key0,
+		   const uint8_t *key1, size_t len_key1)
+{
+	struct fileset_iter *it = (struct fileset_iter *)v;
+	struct fileset_snapshot *snap = fs_source_pin(it->f);
+	const struct mtbl_source *s;
 
-struct mtbl_fileset {
-	uint32_t			reload_interval;
-	struct shared_fileset		*shared_fs;
-	struct timespec			fs_last;
-	struct mtbl_merger		*merger;
-	struct mtbl_merger_options	*mopt;
-	struct mtbl_source		*source;
-	mtbl_filename_filter_func	fname_filter;
-	void				*fname_filter_clos;
-	mtbl_reader_filter_func		reader_filter;
-	void				*reader_filter_clos;
-};
+	if (it->resumable) {
+		switch (type) {
+		case ITER_RESET_GET:
+			it->it_type = FILESET_ITER_TYPE_GET;
+			break;
+		case ITER_RESET_PREFIX:
+			it->it_type = FILESET_ITER_TYPE_GET_PREFIX;
+			break;
+		case ITER_RESET_RANGE:
+			it->it_type = FILESET_ITER_TYPE_GET_RANGE;
+			break;
+		}
+		ubuf_clip(it->key0, 0);
+		ubuf_clip(it->key1, 0);
+		ubuf_append(it->key0, key0, len_key0);
+		ubuf_append(it->key1, key1, len_key1);
+		it->has_pos = false;
+	}
 
-struct fileset_iter {
-	struct mtbl_fileset *fs;
-	struct mtbl_iter *iter;
-};
+	if (snap == it->snap) {
+		fs_snapshot_unref(snap);
+		if (iter_reset(it->iter, type, key0, len_key0, key1, len_key1)) {
+			while (it->resumable && fileset_iter_resume(it));
+			return (true);
+		}
+		mtbl_iter_destroy(&it->iter);
+	} else {
+		mtbl_iter_destroy(&it->iter);
+		fs_snapshot_unref(it->snap);
+		it->snap = snap;
+	}
+
+	s = mtbl_merger_source(it->snap->merger);
+	switch (type) {
+	case ITER_RESET_GET:
+		it->iter = mtbl_source_get(s, key0, len_key0);
+		break;
+	case ITER_RESET_PREFIX:
+		it->iter = mtbl_source_get_prefix(s, key0, len_key0);
+		break;
+	case ITER_RESET_RANGE:
+		it->iter = mtbl_source_get_range(s, key0, len_key0, key1, len_key1);
+		break;
+	}
+	while (it->resumable && fileset_iter_resume(it));
+	return (true);
+}
 
 static mtbl_res
 fileset_iter_seek(void *v, const uint8_t *key, size_t len)
 {
 	struct fileset_iter *it = (struct fileset_iter *)v;
-	return mtbl_iter_seek(it->iter, key, len);
+	mtbl_res res = mtbl_iter_seek(it->iter, key, len);
+
+	if (it->resumable) {
+		fileset_iter_set_pos(it, key, len, false);
+		while (fileset_iter_resume(it));
+	}
+	return (res);
 }
 
 static mtbl_res
@@ -73,7 +971,54 @@ fileset_iter_next(void *v,
 		const uint8_t **val, size_t *len_val)
 {
 	struct fileset_iter *it = (struct fileset_iter *)v;
-	return mtbl_iter_next(it->iter, key, len_key, val, len_val);
+	mtbl_res res;
+
+	if (!it->resumable)
+		return mtbl_iter_next(it->iter, key, len_key, val, len_val);
+
+	/* An entry found after a file was found removed may skip its entries. */
+	do {
+		res = mtbl_iter_next(it->iter, key, len_key, val, len_val);
+	} while (fileset_iter_resume(it));
+	if (res == mtbl_res_success)
+		fileset_iter_set_pos(it, *key, *len_key, true);
+	return (res);
+}
+
+static size_t
+fileset_iter_next_batch(void *v, struct mtbl_entry *entries, size_t n)
+{
+	struct fileset_iter *it = (struct fileset_iter *)v;
+	size_t n_entries;
+
+	if (!it->resumable)
+		return mtbl_iter_next_batch(it->iter, entries, n);
+
+	do {
+		n_entries = mtbl_iter_next_batch(it->iter, entries, n);
+	} while (fileset_iter_resume(it));
+	if (n_entries > 0)
+		fileset_iter_set_pos(it, entries[n_entries - 1].key,
+				     entries[n_entries - 1].len_key, true);
+	return (n_entries);
+}
+
+/* Blocks are not copied from iterators which keep the last key returned. */
+static bool
+fileset_iter_raw_block(void *v, struct raw_block *rb)
+{
+	struct fileset_iter *it = (struct fileset_iter *)v;
+
+	if (it->resumable)
+		return (false);
+	return iter_raw_block(it->iter, rb);
+}
+
+static void
+fileset_iter_skip_block(void *v)
+{
+	struct fileset_iter *it = (struct fileset_iter *)v;
+	iter_skip_block(it->iter);
 }
 
 static void
@@ -81,53 +1026,57 @@ fileset_iter_free(void *v)
 {
 	struct fileset_iter *it = (struct fileset_iter *)v;
 	if (it) {
-		it->fs->shared_fs->n_iters--;
 		mtbl_iter_destroy(&it->iter);
-		mtbl_fileset_reload(it->fs);
+		fs_snapshot_unref(it->snap);
+		ubuf_destroy(&it->key0);
+		ubuf_destroy(&it->key1);
+		ubuf_destroy(&it->pos);
 		free(it);
 	}
 }
 
 static struct mtbl_iter *
-fileset_iter_init(struct mtbl_fileset *f, struct mtbl_iter *mit)
+fileset_iter_init(struct fileset_iter *it, struct mtbl_iter *mit)
 {
-	struct fileset_iter *it = my_calloc(1, sizeof(*it));
-	f->shared_fs->n_iters++;
+	struct mtbl_iter *iter;
 	it->iter = mit;
-	it->fs = f;
-	return mtbl_iter_init(fileset_iter_seek,
+	while (it->resumable && fileset_iter_resume(it));
+	iter = mtbl_iter_init(fileset_iter_seek,
 				fileset_iter_next,
 				fileset_iter_free,
 				it);
+	iter_set_raw_block_funcs(iter, fileset_iter_raw_block, fileset_iter_skip_block);
+	iter_set_next_batch_func(iter, fileset_iter_next_batch);
+	iter_set_reset_func(iter, fileset_iter_reset);
+	return iter;
 }
 
-
 static struct mtbl_iter *
 fileset_source_iter(void *clos)
 {
-	struct mtbl_fileset *f = (struct mtbl_fileset *) clos;
-	mtbl_fileset_reload(f);
-	return fileset_iter_init(f,
-			mtbl_source_iter(mtbl_merger_source(f->merger)));
+	struct fileset_iter *it = fileset_iter_alloc(clos, FILESET_ITER_TYPE_ITER,
+						     NULL, 0, NULL, 0);
+	return fileset_iter_init(it,
+			mtbl_source_iter(mtbl_merger_source(it->snap->merger)));
 }
 
 static struct mtbl_iter *
 fileset_source_get(void *clos, const uint8_t *key, size_t len_key)
 {
-	struct mtbl_fileset *f = (struct mtbl_fileset *) clos;
-	mtbl_fileset_reload(f);
-	return fileset_iter_init(f,
-			mtbl_source_get(mtbl_merger_source(f->merger),
+	struct fileset_iter *it = fileset_iter_alloc(clos, FILESET_ITER_TYPE_GET,
+						     key, len_key, NULL, 0);
+	return fileset_iter_init(it,
+			mtbl_source_get(mtbl_merger_source(it->snap->merger),
 					key, len_key));
 }
 
 static struct mtbl_iter *
 fileset_source_get_prefix(void *clos, const uint8_t *key, size_t len_key)
 {
-	struct mtbl_fileset *f = (struct mtbl_fileset *) clos;
-	mtbl_fileset_reload(f);
-	return fileset_iter_init(f,
-			mtbl_source_get_prefix(mtbl_merger_source(f->merger),
+	struct fileset_iter *it = fileset_iter_alloc(clos, FILESET_ITER_TYPE_GET_PREFIX,
+						     key, len_key, NULL, 0);
+	return fileset_iter_init(it,
+			mtbl_source_get_prefix(mtbl_merger_source(it->snap->merger),
 						key, len_key));
 }
 
@@ -136,13 +1085,71 @@ fileset_source_get_range(void *clos,
 			 const uint8_t *key0, size_t len_key0,
 			 const uint8_t *key1, size_t len_key1)
 {
-	struct mtbl_fileset *f = (struct mtbl_fileset *) clos;
-	mtbl_fileset_reload(f);
-	return fileset_iter_init(f,
-			mtbl_source_get_range(mtbl_merger_source(f->merger),
+	struct fileset_iter *it = fileset_iter_alloc(clos, FILESET_ITER_TYPE_GET_RANGE,
+						     key0, len_key0, key1, len_key1);
+	return fileset_iter_init(it,
+			mtbl_source_get_range(mtbl_merger_source(it->snap->merger),
 				     key0, len_key0, key1, len_key1));
 }
 
+static void
+fs_lookup_func(void *clos, const uint8_t *key, size_t len_key,
+	       const uint8_t *val, size_t len_val)
+{
+	struct fs_lookup *fl = (struct fs_lookup *) clos;
+
+	if (!fl->checked) {
+		fl->checked = true;
+		fl->retry = fs_snapshot_missing(fl->f, fl->snap, &fl->n_missing);
+	}
+	if (!fl->retry)
+		fl->lookup(fl->lookup_clos, key, len_key, val, len_val);
+}
+
+static mtbl_res
+fileset_source_lookup(void *clos, const uint8_t *key, size_t len_key,
+		      mtbl_lookup_func lookup, void *lookup_clos)
+{
+	struct mtbl_fileset *f = (struct mtbl_fileset *) clos;
+	struct fileset_snapshot *snap = fs_source_pin(f);
+	struct fs_lookup fl = {
+		.f = f,
+		.n_missing = fs_missing_count(f),
+		.lookup = lookup,
+		.lookup_clos = lookup_clos,
+	};
+	mtbl_res res;
+
+	if (f->shared_fs->lru.max_open == 0) {
+		res = mtbl_source_lookup(mtbl_merger_source(snap->merger),
+					 key, len_key, lookup, lookup_clos);
+		fs_snapshot_unref(snap);
+		return res;
+	}
+
+	for (;;) {
+		struct fileset_snapshot *next;
+
+		fl.snap = snap;
+		fl.checked = false;
+		fl.retry = false;
+		res = mtbl_source_lookup(mtbl_merger_source(snap->merger),
+					 key, len_key, fs_lookup_func, &fl);
+		if (!fl.checked)
+			fl.retry = fs_snapshot_missing(f, snap, &fl.n_missing);
+		if (!fl.retry)
+			break;
+		res = mtbl_res_failure;
+		next = fs_snapshot_repin(f, snap);
+		if (next == NULL)
+			break;
+		fs_snapshot_unref(snap);
+		snap = next;
+	}
+	fs_snapshot_unref(snap);
+	return res;
+}
+
 struct mtbl_fileset_options *
 mtbl_fileset_options_init(void)
 {
@@ -166,6 +1173,17 @@ mtbl_fileset_options_set_merge_func(struct mtbl_fileset_options *opt,
 				    mtbl_merge_func merge, void *clos)
 {
 	opt->merge = merge;
+	opt->merge_values = NULL;
+	opt->merge_clos = clos;
+}
+
+void
+mtbl_fileset_options_set_merge_values_func(struct mtbl_fileset_options *opt,
+					   mtbl_merge_values_func merge_values,
+					   void *clos)
+{
+	opt->merge = NULL;
+	opt->merge_values = merge_values;
 	opt->merge_clos = clos;
 }
 
@@ -200,21 +1218,254 @@ mtbl_fileset_options_set_reload_interval(struct mtbl_fileset_options *opt,
 	opt->reload_interval = reload_interval;
 }
 
+void
+mtbl_fileset_options_set_threadpool(struct mtbl_fileset_options *opt,
+				    struct mtbl_threadpool *pool)
+{
+	opt->pool = pool;
+}
+
+void
+mtbl_fileset_options_set_prefetch_index(struct mtbl_fileset_options *opt,
+					bool prefetch_index)
+{
+	opt->prefetch_index = prefetch_index;
+}
+
+void
+mtbl_fileset_options_set_watch(struct mtbl_fileset_options *opt, bool watch)
+{
+	opt->watch = watch;
+}
+
+void
+mtbl_fileset_options_set_max_open_readers(struct mtbl_fileset_options *opt,
+					  size_t max_open_readers)
+{
+	opt->max_open_readers = max_open_readers;
+}
+
+static void *
+fs_open_reader(void *arg)
+{
+	struct fileset_reader *fr = (struct fileset_reader *) arg;
+
+	fr->reader = fs_reader_open(fr->fname, fr->prefetch_index);
+	if (fr->lru == NULL)
+		my_free(fr->fname);
+	else if (fr->reader != NULL)
+		fs_reader_lazy_init(fr);
+	return (NULL);
+}
+
+static void
+fs_open_done(void *res __attribute__((unused)), void *clos __attribute__((unused)))
+{
+}
+
+/*
+ * Open the readers loaded by a reload of the shared fileset on the threadpool,
+ * and wait for them to be opened.
+ */
+static void
+fs_open_pending(struct shared_fileset *f)
+{
+	struct result_handler *rh;
+
+	if (fs_reader_vec_size(f->pending) == 0)
+		return;
+
+	rh = result_handler_init(fs_open_done, NULL);
+	for (size_t i = 0; i < fs_reader_vec_size(f->pending); i++)
+		threadpool_dispatch(f->pool->pool, rh, false, fs_open_reader,
+				    fs_reader_vec_value(f->pending, i));
+	result_handler_destroy(&rh);
+	fs_reader_vec_reset(f->pending);
+}
+
 static void *
 fs_load(struct my_fileset *fs, const char *fname)
 {
 	struct shared_fileset *f = (struct shared_fileset *) my_fileset_user(fs);
+	struct fileset_reader *fr = my_calloc(1, sizeof(*fr));
+
 	f->n_loaded++;
-	return (mtbl_reader_init(fname, NULL));
+	fr->refs = 1;
+	fr->prefetch_index = f->prefetch_index;
+	fr->fname = my_strdup(fname);
+	if (f->lru.max_open > 0)
+		fr->lru = &f->lru;
+	if (f->pool != NULL && f->pool->pool != NULL)
+		fs_reader_vec_add(f->pending, fr);
+	else
+		fs_open_reader(fr);
+	return (fr);
 }
 
 static void
 fs_unload(struct my_fileset *fs, const char *fname, void *ptr)
 {
 	struct shared_fileset *f = (struct shared_fileset *) my_fileset_user(fs);
-	struct mtbl_reader *r = (struct mtbl_reader *) ptr;
 	f->n_unloaded++;
-	mtbl_reader_destroy(&r);
+	fs_reader_unref((struct fileset_reader *) ptr);
+}
+
+/*
+ * Reload the shared fileset, loading any new readers. Must be called with the
+ * shared fileset lock held.
+ */
+static void
+fs_shared_reload(struct shared_fileset *sfs, bool force)
+{
+	struct timespec now;
+
+#if HAVE_CLOCK_GETTIME
+	static const clockid_t clock = CLOCK_MONOTONIC;
+#else
+	static const int clock = -1;
+#endif
+	my_gettime(clock, &now);
+
+	sfs->n_loaded = 0;
+	sfs->n_unloaded = 0;
+	assert(sfs->my_fs != NULL);
+	if (force)
+		my_fileset_reload_force(sfs->my_fs);
+	else
+		my_fileset_reload(sfs->my_fs);
+	fs_open_pending(sfs);
+	if (sfs->n_loaded > 0 || sfs->n_unloaded > 0)
+		__atomic_add_fetch(&sfs->generation, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&sfs->fs_last.tv_sec, now.tv_sec, __ATOMIC_RELAXED);
+	sfs->reload_needed = false;
+}
+
+#if HAVE_SYS_INOTIFY_H
+/*
+ * Watch the setfile's directory for the setfile being written or renamed into
+ * place, and reload the shared fileset when it is. Also reload every
+ * reload_interval seconds, in case a change was missed.
+ */
+static void *
+fs_watch_thread(void *arg)
+{
+	struct shared_fileset *sfs = (struct shared_fileset *) arg;
+	const char *name = strrchr(sfs->setfile, '/');
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd fds[2] = {
+		{ .fd = sfs->watch_fd, .events = POLLIN },
+		{ .fd = sfs->watch_pipe[0], .events = POLLIN },
+	};
+
+	name = (name != NULL) ? name + 1 : sfs->setfile;
+
+	pthread_mutex_lock(&sfs->lock);
+	fs_shared_reload(sfs, false);
+	pthread_mutex_unlock(&sfs->lock);
+
+	for (;;) {
+		bool changed = false;
+		int n;
+
+		n = poll(fds, 2, sfs->watch_timeout);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[1].revents != 0)
+			break;
+
+		if ((fds[0].revents & POLLIN) != 0) {
+			ssize_t len = read(sfs->watch_fd, buf, sizeof(buf));
+
+			for (ssize_t i = 0; i < len; ) {
+				const struct inotify_event *ev =
+					(const struct inotify_event *) &buf[i];
+
+				if ((ev->mask & IN_Q_OVERFLOW) != 0 ||
+				    (ev->len > 0 && strcmp(ev->name, name) == 0))
+					changed = true;
+				i += sizeof(*ev) + ev->len;
+			}
+		}
+
+		if (changed || n == 0) {
+			pthread_mutex_lock(&sfs->lock);
+			fs_shared_reload(sfs, changed);
+			pthread_mutex_unlock(&sfs->lock);
+		}
+	}
+	return (NULL);
+}
+#endif
+
+/*
+ * Start watching the setfile for changes, if supported. Must be called with
+ * the shared fileset lock held.
+ */
+static void
+fs_watch_start(struct shared_fileset *sfs, uint32_t reload_interval)
+{
+#if HAVE_SYS_INOTIFY_H
+	char *setdir;
+	const char *slash;
+
+	if (sfs->watching)
+		return;
+
+	sfs->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (sfs->watch_fd < 0)
+		return;
+	slash = strrchr(sfs->setfile, '/');
+	if (slash == NULL) {
+		setdir = my_strdup(".");
+	} else {
+		setdir = my_strdup(sfs->setfile);
+		setdir[slash > sfs->setfile ? slash - sfs->setfile : 1] = '\0';
+	}
+	if (inotify_add_watch(sfs->watch_fd, setdir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0 ||
+	    pipe(sfs->watch_pipe) != 0)
+	{
+		free(setdir);
+		close(sfs->watch_fd);
+		return;
+	}
+	free(setdir);
+
+	if (reload_interval == MTBL_FILESET_RELOAD_INTERVAL_NEVER ||
+	    reload_interval > INT_MAX / 1000)
+		sfs->watch_timeout = -1;
+	else
+		sfs->watch_timeout = (reload_interval > 0 ? reload_interval : 1) * 1000;
+
+	if (pthread_create(&sfs->watcher, NULL, fs_watch_thread, sfs) != 0) {
+		close(sfs->watch_pipe[0]);
+		close(sfs->watch_pipe[1]);
+		close(sfs->watch_fd);
+		return;
+	}
+	__atomic_store_n(&sfs->watching, true, __ATOMIC_RELEASE);
+#else
+	(void) sfs;
+	(void) reload_interval;
+#endif
+}
+
+static void
+fs_watch_stop(struct shared_fileset *sfs)
+{
+#if HAVE_SYS_INOTIFY_H
+	if (!sfs->watching)
+		return;
+	close(sfs->watch_pipe[1]);
+	pthread_join(sfs->watcher, NULL);
+	close(sfs->watch_pipe[0]);
+	close(sfs->watch_fd);
+	sfs->watching = false;
+#else
+	(void) sfs;
+#endif
 }
 
 static void
@@ -224,18 +1475,26 @@ mtbl_fileset_set_options(struct mtbl_fileset *f, const struct mtbl_fileset_optio
 
 	f->reload_interval = opt->reload_interval;
 	f->mopt = mtbl_merger_options_init();
-	mtbl_merger_options_set_merge_func(f->mopt, opt->merge, opt->merge_clos);
+	if (opt->merge_values != NULL)
+		mtbl_merger_options_set_merge_values_func(f->mopt, opt->merge_values,
+							  opt->merge_clos);
+	else
+		mtbl_merger_options_set_merge_func(f->mopt, opt->merge, opt->merge_clos);
 	mtbl_merger_options_set_dupsort_func(f->mopt, opt->dupsort, opt->dupsort_clos);
 	f->fname_filter = opt->fname_filter;
 	f->fname_filter_clos = opt->fname_filter_clos;
 	f->reader_filter = opt->reader_filter;
 	f->reader_filter_clos = opt->reader_filter_clos;
-	f->merger = mtbl_merger_init(f->mopt);
+
+	/* Start with an empty snapshot, which the first reload replaces. */
+	f->snap = fs_snapshot_init(f, 0);
 	f->source = mtbl_source_init(fileset_source_iter,
 				     fileset_source_get,
 				     fileset_source_get_prefix,
 				     fileset_source_get_range,
 				     NULL, f);
+	source_set_lookup_func(f->source, fileset_source_lookup,
+			       source_lookup_unique(mtbl_merger_source(f->snap->merger)));
 }
 
 struct mtbl_fileset *
@@ -244,12 +1503,25 @@ mtbl_fileset_init(const char *fname, const struct mtbl_fileset_options *opt)
 	struct mtbl_fileset *f = my_calloc(1, sizeof(*f));
 
 	f->shared_fs = my_calloc(1, sizeof(*(f->shared_fs)));
+	pthread_mutex_init(&f->shared_fs->lock, NULL);
 	f->shared_fs->n_fs = 1;
 	f->shared_fs->reload_needed = true;
+	f->shared_fs->generation = 1;
+	f->shared_fs->pool = opt->pool;
+	f->shared_fs->prefetch_index = opt->prefetch_index;
+	pthread_mutex_init(&f->shared_fs->lru.lock, NULL);
+	f->shared_fs->lru.max_open = opt->max_open_readers;
+	f->shared_fs->pending = fs_reader_vec_init(1);
 	f->shared_fs->my_fs = my_fileset_init(fname, fs_load, fs_unload, f->shared_fs);
 	assert(f->shared_fs->my_fs != NULL);
+	f->shared_fs->setfile = my_strdup(fname);
 
 	mtbl_fileset_set_options(f, opt);
+	if (opt->watch) {
+		pthread_mutex_lock(&f->shared_fs->lock);
+		fs_watch_start(f->shared_fs, opt->reload_interval);
+		pthread_mutex_unlock(&f->shared_fs->lock);
+	}
 
 	return (f);
 }
@@ -260,10 +1532,18 @@ mtbl_fileset_dup(struct mtbl_fileset *orig, const struct mtbl_fileset_options *o
 	struct mtbl_fileset *f = my_calloc(1, sizeof(*f));
 
 	f->shared_fs = orig->shared_fs;
-	f->shared_fs->n_fs++;
-
 	mtbl_fileset_set_options(f, opt);
 
+	pthread_mutex_lock(&f->shared_fs->lock);
+	f->shared_fs->n_fs++;
+	if (f->shared_fs->pool == NULL)
+		f->shared_fs->pool = opt->pool;
+	if (opt->prefetch_index)
+		f->shared_fs->prefetch_index = true;
+	if (opt->watch)
+		fs_watch_start(f->shared_fs, opt->reload_interval);
+	pthread_mutex_unlock(&f->shared_fs->lock);
+
 	return (f);
 }
 
@@ -271,12 +1551,30 @@ void
 mtbl_fileset_destroy(struct mtbl_fileset **f)
 {
 	if (*f) {
-		if (--((*f)->shared_fs->n_fs) <= 0) {
-			my_fileset_destroy(&(*f)->shared_fs->my_fs);
-			free((*f)->shared_fs);
-		}
+		struct shared_fileset *sfs = (*f)->shared_fs;
+		struct fileset_snapshot *snap, *next;
+		size_t n_fs;
 
-		mtbl_merger_destroy(&(*f)->merger);
+		/* All iterators must have been destroyed by now. */
+		fs_snapshot_unref((*f)->snap);
+
+		pthread_mutex_lock(&sfs->lock);
+		n_fs = --(sfs->n_fs);
+		pthread_mutex_unlock(&sfs->lock);
+		if (n_fs == 0) {
+			fs_watch_stop(sfs);
+			my_fileset_destroy(&sfs->my_fs);
+			fs_reader_vec_destroy(&sfs->pending);
+			free(sfs->setfile);
+			pthread_mutex_destroy(&sfs->lru.lock);
+			pthread_mutex_destroy(&sfs->lock);
+			free(sfs);
+		}
+		for (snap = (*f)->snapshots; snap != NULL; snap = next) {
+			next = snap->next;
+			assert(snap->dead);
+			free(snap);
+		}
 		mtbl_merger_options_destroy(&(*f)->mopt);
 		mtbl_source_destroy(&(*f)->source);
 
@@ -293,60 +1591,30 @@ mtbl_fileset_source(struct mtbl_fileset *f)
 	return (f->source);
 }
 
+/*
+ * Replace the fileset's snapshot with one taken from the shared fileset.
+ * Iterators on the old snapshot keep using it until they are destroyed.
+ */
 static void
-fs_reinit_merger(struct mtbl_fileset *f)
+fs_snapshot_publish(struct mtbl_fileset *f)
 {
-	const char *fname;
-	struct mtbl_reader *reader;
-	size_t i = 0;
-
-	if (f->merger) {
-		mtbl_merger_destroy(&f->merger);
-		f->merger = mtbl_merger_init(f->mopt);
-	}
-	assert(f->merger != NULL);
-	while (my_fileset_get(f->shared_fs->my_fs, i++, &fname, (void **) &reader)) {
-		if (reader == NULL) {
-			continue;
-		}
+	struct fileset_snapshot *old = f->snap;
+	struct fileset_snapshot *snap;
 
-		/*
-		* Add the reader's source to the merger unless filtered out by the
-		* fname_filter or reader_filter.
-		*/
-		if (
-			(f->fname_filter == NULL
-				|| f->fname_filter(fname, f->fname_filter_clos))
-			&&
-			(f->reader_filter == NULL
-				|| f->reader_filter(reader, f->reader_filter_clos))
-		   ) {
-			mtbl_merger_add_source(f->merger, mtbl_reader_source(reader));
-		}
-	}
+	snap = fs_snapshot_init(f, f->shared_fs->generation);
+	fs_snapshot_add_readers(f, snap);
+	fs_snapshot_add_levels(snap);
+	__atomic_store_n(&f->snap, snap, __ATOMIC_RELEASE);
+	fs_snapshot_unref(old);
 }
 
-void
-mtbl_fileset_reload(struct mtbl_fileset *f)
+/* Must be called with the shared fileset lock held. */
+static void
+fs_reload_locked(struct mtbl_fileset *f, bool force)
 {
-	assert(f != NULL);
+	struct shared_fileset *sfs = f->shared_fs;
 	struct timespec now;
 
-	/* if our merger is from an out of date fileset, reinitialize it. */
-	if ((f->fs_last.tv_sec != f->shared_fs->fs_last.tv_sec) ||
-	    (f->fs_last.tv_nsec != f->shared_fs->fs_last.tv_nsec)) {
-		fs_reinit_merger(f);
-		f->fs_last = f->shared_fs->fs_last;
-	}
-
-	/* if we loaded at least once and we are configured to *not* reload then do not reload */
-	if (!f->shared_fs->reload_needed && f->reload_interval == MTBL_FILESET_RELOAD_INTERVAL_NEVER)
-		return;
-
-	/* if there are any open iterators under this fileset, do not reload now */
-	if (f->shared_fs->n_iters > 0)
-		return;
-
 #if HAVE_CLOCK_GETTIME
 	static const clockid_t clock = CLOCK_MONOTONIC;
 #else
@@ -354,35 +1622,69 @@ mtbl_fileset_reload(struct mtbl_fileset *f)
 #endif
 	my_gettime(clock, &now);
 
-	if (f->shared_fs->reload_needed || (now.tv_sec - f->shared_fs->fs_last.tv_sec > f->reload_interval)) {
-		f->shared_fs->n_loaded = 0;
-		f->shared_fs->n_unloaded = 0;
-		assert(f->shared_fs->my_fs != NULL);
-		my_fileset_reload(f->shared_fs->my_fs);
-		if (f->shared_fs->n_loaded > 0 || f->shared_fs->n_unloaded > 0)
-			fs_reinit_merger(f);
-		f->shared_fs->fs_last = now;
-		f->fs_last = now;
-		f->shared_fs->reload_needed = false;
-	}
+	if (force || sfs->reload_needed ||
+	    (f->reload_interval != MTBL_FILESET_RELOAD_INTERVAL_NEVER &&
+	     now.tv_sec - sfs->fs_last.tv_sec > f->reload_interval))
+		fs_shared_reload(sfs, false);
+
+	/* if our snapshot is from an out of date fileset, replace it. */
+	if (f->snap->generation != sfs->generation)
+		fs_snapshot_publish(f);
 }
 
-void
-mtbl_fileset_reload_now(struct mtbl_fileset *f)
+/*
+ * After one of the files of a snapshot was found removed from disk, as by
+ * mtbl_compact(), which first lists the file replacing it in the setfile,
+ * reload the setfile and pin the new snapshot. Returns NULL if the snapshot is
+ * still the current one.
+ */
+static struct fileset_snapshot *
+fs_snapshot_repin(struct mtbl_fileset *f, struct fileset_snapshot *snap)
 {
-	assert(f != NULL);
+	struct shared_fileset *sfs = f->shared_fs;
+	struct fileset_snapshot *cur;
+
+	pthread_mutex_lock(&sfs->lock);
+	fs_shared_reload(sfs, true);
+	if (f->snap->generation != sfs->generation)
+		fs_snapshot_publish(f);
+	pthread_mutex_unlock(&sfs->lock);
 
+	cur = fs_snapshot_pin(f);
+	if (cur == snap) {
+		fs_snapshot_unref(cur);
+		return (NULL);
+	}
+	return (cur);
+}
+
+/*
+ * Reload the fileset before an access through its source if needed. This
+ * blocks only if the snapshot is known to be out of date; a reload which is
+ * merely due is skipped if another thread is already reloading. If the
+ * setfile is being watched, the watcher thread does the reloading, and only
+ * the generation is checked here.
+ */
+static void
+fs_maybe_reload(struct mtbl_fileset *f)
+{
+	struct shared_fileset *sfs = f->shared_fs;
+	struct fileset_snapshot *snap = __atomic_load_n(&f->snap, __ATOMIC_ACQUIRE);
 	struct timespec now;
 
-	/*
-	 * if there are any open iterators under this fileset,
-	 * do not reload now
-	 */
-	if (f->shared_fs->n_iters > 0) {
-		f->shared_fs->reload_needed = true;
+	if (__atomic_load_n(&snap->generation, __ATOMIC_RELAXED) !=
+	    __atomic_load_n(&sfs->generation, __ATOMIC_ACQUIRE))
+	{
+		pthread_mutex_lock(&sfs->lock);
+		fs_reload_locked(f, false);
+		pthread_mutex_unlock(&sfs->lock);
 		return;
 	}
 
+	if (f->reload_interval == MTBL_FILESET_RELOAD_INTERVAL_NEVER ||
+	    __atomic_load_n(&sfs->watching, __ATOMIC_RELAXED))
+		return;
+
 #if HAVE_CLOCK_GETTIME
 	static const clockid_t clock = CLOCK_MONOTONIC;
 #else
@@ -390,17 +1692,49 @@ mtbl_fileset_reload_now(struct mtbl_fileset *f)
 #endif
 	my_gettime(clock, &now);
 
-	f->shared_fs->n_loaded = 0;
-	f->shared_fs->n_unloaded = 0;
-	assert(f->shared_fs->my_fs != NULL);
-	my_fileset_reload(f->shared_fs->my_fs);
-	if (f->shared_fs->n_loaded > 0 || f->shared_fs->n_unloaded > 0)
-		fs_reinit_merger(f);
-	f->shared_fs->fs_last = now;
-	f->fs_last = now;
-	f->shared_fs->reload_needed = false;
+	if (now.tv_sec - __atomic_load_n(&sfs->fs_last.tv_sec, __ATOMIC_RELAXED) > f->reload_interval &&
+	    pthread_mutex_trylock(&sfs->lock) == 0)
+	{
+		fs_reload_locked(f, false);
+		pthread_mutex_unlock(&sfs->lock);
+	}
+}
+
+void
+mtbl_fileset_reload(struct mtbl_fileset *f)
+{
+	assert(f != NULL);
+
+	pthread_mutex_lock(&f->shared_fs->lock);
+	fs_reload_locked(f, false);
+	pthread_mutex_unlock(&f->shared_fs->lock);
+}
+
+void
+mtbl_fileset_reload_now(struct mtbl_fileset *f)
+{
+	assert(f != NULL);
+
+	pthread_mutex_lock(&f->shared_fs->lock);
+	fs_reload_locked(f, true);
+	pthread_mutex_unlock(&f->shared_fs->lock);
+}
+
+/* Drop the references mtbl_fileset_partition() took for a merger. */
+static void
+fs_partition_free(void *clos)
+{
+	fs_reader_vec *readers = (fs_reader_vec *) clos;
+
+	for (size_t i = 0; i < fs_reader_vec_size(readers); i++)
+		fs_reader_unref(fs_reader_vec_value(readers, i));
+	fs_reader_vec_destroy(&readers);
 }
 
+/*
+ * Each merger holds a reference to the readers whose sources it was given, so
+ * that they outlive reloads, including those of the watcher thread.
+ */
 void
 mtbl_fileset_partition(struct mtbl_fileset *f,
 		mtbl_filename_filter_func cb,
@@ -408,19 +1742,29 @@ mtbl_fileset_partition(struct mtbl_fileset *f,
 		struct mtbl_merger **m1,
 		struct mtbl_merger **m2)
 {
+	fs_reader_vec *r1 = fs_reader_vec_init(1), *r2 = fs_reader_vec_init(1);
 	const char *fname;
-	struct mtbl_reader *reader;
+	struct fileset_reader *fr;
 	size_t i = 0;
 
-	mtbl_fileset_reload(f);	/* open the fileset file if not already done */
-
 	*m1 = mtbl_merger_init(f->mopt);
 	*m2 = mtbl_merger_init(f->mopt);
+	merger_set_free_func(*m1, fs_partition_free, r1);
+	merger_set_free_func(*m2, fs_partition_free, r2);
 
-	while (my_fileset_get(f->shared_fs->my_fs, i++, &fname, (void**) &reader)) {
-		if (cb(fname, clos))
-			mtbl_merger_add_source(*m1, mtbl_reader_source(reader));
-		else
-			mtbl_merger_add_source(*m2, mtbl_reader_source(reader));
+	pthread_mutex_lock(&f->shared_fs->lock);
+	fs_reload_locked(f, false);	/* open the fileset file if not already done */
+	while (my_fileset_get(f->shared_fs->my_fs, i++, &fname, (void**) &fr)) {
+		if (fr == NULL || fs_reader_source(fr) == NULL)
+			continue;
+		__atomic_add_fetch(&fr->refs, 1, __ATOMIC_RELAXED);
+		if (cb(fname, clos)) {
+			mtbl_merger_add_source(*m1, fs_reader_source(fr));
+			fs_reader_vec_add(r1, fr);
+		} else {
+			mtbl_merger_add_source(*m2, fs_reader_source(fr));
+			fs_reader_vec_add(r2, fr);
+		}
 	}
+	pthread_mutex_unlock(&f->shared_fs->lock);
 }
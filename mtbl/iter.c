@@ -16,10 +16,22 @@
 
 #include "mtbl-private.h"
 
+#include "libmy/ubuf.h"
+
 struct mtbl_iter {
 	mtbl_iter_seek_func	iter_seek;
 	mtbl_iter_next_func	iter_next;
 	mtbl_iter_free_func	iter_free;
+	iter_raw_block_func	iter_raw_block;
+	iter_skip_block_func	iter_skip_block;
+	iter_entry_type_func	iter_entry_type;
+	iter_next_batch_func	iter_next_batch;
+	iter_reset_func		iter_reset;
+	ubuf			*batch;		/* entries copied by mtbl_iter_next_batch() */
+	const uint8_t		*key;		/* last returned, until the next call */
+	size_t			len_key;
+	ubuf			*seek_key;	/* for mtbl_iter_seek_next_prefix() */
+	bool			exhausted;	/* past the last prefix, until a seek */
 	void			*clos;
 };
 
@@ -45,26 +57,224 @@ mtbl_iter_destroy(struct mtbl_iter **it)
 	if (*it) {
 		if ((*it)->iter_free != NULL)
 			(*it)->iter_free((*it)->clos);
+		ubuf_destroy(&(*it)->batch);
+		ubuf_destroy(&(*it)->seek_key);
 		free(*it);
 		*it = NULL;
 	}
 }
 
+void
+iter_set_raw_block_funcs(struct mtbl_iter *it,
+			 iter_raw_block_func raw_block,
+			 iter_skip_block_func skip_block)
+{
+	it->iter_raw_block = raw_block;
+	it->iter_skip_block = skip_block;
+}
+
+bool
+iter_raw_block(struct mtbl_iter *it, struct raw_block *rb)
+{
+	if (it == NULL || it->iter_raw_block == NULL)
+		return (false);
+	return (it->iter_raw_block(it->clos, rb));
+}
+
+void
+iter_skip_block(struct mtbl_iter *it)
+{
+	assert(it->iter_skip_block != NULL);
+	it->iter_skip_block(it->clos);
+}
+
+void
+iter_set_entry_type_func(struct mtbl_iter *it, iter_entry_type_func fp)
+{
+	it->iter_entry_type = fp;
+}
+
+entry_type
+iter_entry_type(struct mtbl_iter *it)
+{
+	if (it == NULL || it->iter_entry_type == NULL)
+		return (ENTRY_TYPE_VALUE);
+	return (it->iter_entry_type(it->clos));
+}
+
+void
+iter_set_next_batch_func(struct mtbl_iter *it, iter_next_batch_func fp)
+{
+	it->iter_next_batch = fp;
+}
+
+void
+iter_set_reset_func(struct mtbl_iter *it, iter_reset_func fp)
+{
+	it->iter_reset = fp;
+}
+
+bool
+iter_reset(struct mtbl_iter *it, iter_reset_type type,
+	   const uint8_t *key0, size_t len_key0,
+	   const uint8_t *key1, size_t len_key1)
+{
+	if (it == NULL || it->iter_reset == NULL)
+		return (false);
+	it->key = NULL;
+	it->exhausted = false;
+	return (it->iter_reset(it->clos, type, key0, len_key0, key1, len_key1));
+}
+
+mtbl_res
+mtbl_iter_reset_get(struct mtbl_iter *it, const uint8_t *key, size_t len_key)
+{
+	if (!iter_reset(it, ITER_RESET_GET, key, len_key, key, len_key))
+		return (mtbl_res_failure);
+	return (mtbl_res_success);
+}
+
+mtbl_res
+mtbl_iter_reset_prefix(struct mtbl_iter *it, const uint8_t *key, size_t len_key)
+{
+	if (!iter_reset(it, ITER_RESET_PREFIX, key, len_key, NULL, 0))
+		return (mtbl_res_failure);
+	return (mtbl_res_success);
+}
+
+mtbl_res
+mtbl_iter_reset_range(struct mtbl_iter *it,
+		      const uint8_t *key0, size_t len_key0,
+		      const uint8_t *key1, size_t len_key1)
+{
+	if (!iter_reset(it, ITER_RESET_RANGE, key0, len_key0, key1, len_key1))
+		return (mtbl_res_failure);
+	return (mtbl_res_success);
+}
+
+bool
+mtbl_iter_is_tombstone(struct mtbl_iter *it)
+{
+	return (iter_entry_type(it) == ENTRY_TYPE_TOMBSTONE);
+}
+
 mtbl_res
 mtbl_iter_seek(struct mtbl_iter *it,
 	       const uint8_t *key, size_t len_key)
 {
 	if (it == NULL)
 		return (mtbl_res_failure);
+	it->key = NULL;
+	it->exhausted = false;
 	return (it->iter_seek(it->clos, key, len_key));
 }
 
+/*
+ * Seek past the keys which share their first prefix_len bytes with the key
+ * last returned, to the first key after them: the prefix with any trailing
+ * 0xff bytes removed and its last byte incremented. A key shorter than the
+ * prefix is only followed by itself with a zero byte appended. If the prefix
+ * is all 0xff bytes, no key follows the keys which start with it, and the
+ * iterator is marked exhausted until it is next seeked or reset.
+ */
+mtbl_res
+mtbl_iter_seek_next_prefix(struct mtbl_iter *it, size_t prefix_len)
+{
+	size_t len;
+	uint8_t *p;
+
+	if (it == NULL || it->key == NULL)
+		return (mtbl_res_failure);
+	if (it->seek_key == NULL)
+		it->seek_key = ubuf_init(prefix_len + 1);
+	ubuf_clip(it->seek_key, 0);
+
+	if (it->len_key < prefix_len) {
+		if (it->len_key > 0)
+			ubuf_append(it->seek_key, it->key, it->len_key);
+		ubuf_add(it->seek_key, 0);
+		return (mtbl_iter_seek(it, ubuf_data(it->seek_key), ubuf_size(it->seek_key)));
+	}
+
+	len = prefix_len;
+	while (len > 0 && it->key[len - 1] == 0xff)
+		len--;
+	if (len == 0) {
+		it->key = NULL;
+		it->exhausted = true;
+		return (mtbl_res_success);
+	}
+
+	ubuf_append(it->seek_key, it->key, len);
+	p = ubuf_data(it->seek_key);
+	p[len - 1]++;
+	return (mtbl_iter_seek(it, p, len));
+}
+
 mtbl_res
 mtbl_iter_next(struct mtbl_iter *it,
 	       const uint8_t **key, size_t *len_key,
 	       const uint8_t **val, size_t *len_val)
 {
-	if (it == NULL)
+	mtbl_res res;
+
+	if (it == NULL || it->exhausted)
 		return (mtbl_res_failure);
-	return (it->iter_next(it->clos, key, len_key, val, len_val));
+	res = it->iter_next(it->clos, key, len_key, val, len_val);
+	if (res == mtbl_res_success) {
+		it->key = *key;
+		it->len_key = *len_key;
+	} else {
+		it->key = NULL;
+	}
+	return (res);
+}
+
+/*
+ * Iterators without a batch function return the entries of a batch one at a
+ * time, so each is copied before the next is read. The copies are made into a
+ * single buffer, whose final address is only known once the batch is done.
+ */
+size_t
+mtbl_iter_next_batch(struct mtbl_iter *it, struct mtbl_entry *entries, size_t n)
+{
+	const uint8_t *key, *val;
+	size_t len_key, len_val, i = 0;
+
+	if (it == NULL || it->exhausted)
+		return (0);
+	if (it->iter_next_batch != NULL) {
+		i = it->iter_next_batch(it->clos, entries, n);
+		goto out;
+	}
+
+	if (it->batch == NULL)
+		it->batch = ubuf_init(256);
+	ubuf_clip(it->batch, 0);
+	while (i < n && it->iter_next(it->clos, &key, &len_key, &val, &len_val) == mtbl_res_success) {
+		entries[i].key = (const uint8_t *) (uintptr_t) ubuf_size(it->batch);
+		entries[i].len_key = len_key;
+		ubuf_append(it->batch, key, len_key);
+		entries[i].val = (const uint8_t *) (uintptr_t) ubuf_size(it->batch);
+		entries[i].len_val = len_val;
+		if (len_val > 0)
+			ubuf_append(it->batch, val, len_val);
+		i++;
+
+		/* Only the last entry of a batch may be a tombstone. */
+		if (iter_entry_type(it) != ENTRY_TYPE_VALUE)
+			break;
+	}
+	for (size_t j = 0; j < i; j++) {
+		entries[j].key = ubuf_data(it->batch) + (uintptr_t) entries[j].key;
+		entries[j].val = ubuf_data(it->batch) + (uintptr_t) entries[j].val;
+	}
+out:
+	if (i > 0) {
+		it->key = entries[i - 1].key;
+		it->len_key = entries[i - 1].len_key;
+	} else {
+		it->key = NULL;
+	}
+	return (i);
 }
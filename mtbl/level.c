@@ -0,0 +1,410 @@
+/*
+ * Copyright (c) 2024 DomainTools LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mtbl-private.h"
+
+#include "libmy/ubuf.h"
+
+/*
+ * A level is a source made of other sources whose key ranges are known and do
+ * not overlap, in order of their keys. It provides the entries of its sources
+ * one after the other, and finds the sources which may have a given key by
+ * binary search over their key ranges, instead of merging them.
+ */
+
+VECTOR_GENERATE(level_source_vec, const struct mtbl_source *);
+VECTOR_GENERATE(key_range_vec, struct key_range);
+
+typedef enum {
+	LEVEL_ITER_TYPE_ITER,
+	LEVEL_ITER_TYPE_GET_PREFIX,
+	LEVEL_ITER_TYPE_GET_RANGE,
+} level_iter_type;
+
+struct level {
+	level_source_vec		*sources;
+	key_range_vec			*ranges;
+	struct mtbl_source		*source;
+};
+
+struct level_iter {
+	struct level			*l;
+	level_iter_type			it_type;
+	ubuf				*key0;
+	ubuf				*key1;
+	size_t				start, end, i;
+	struct mtbl_iter		*it;
+};
+
+static struct mtbl_iter *
+level_iter(void *);
+
+static struct mtbl_iter *
+level_get(void *, const uint8_t *, size_t);
+
+static struct mtbl_iter *
+level_get_prefix(void *, const uint8_t *, size_t);
+
+static struct mtbl_iter *
+level_get_range(void *, const uint8_t *, size_t, const uint8_t *, size_t);
+
+static void
+level_key_range(void *, struct key_range *);
+
+static mtbl_res
+level_lookup(void *, const uint8_t *, size_t, mtbl_lookup_func, void *);
+
+struct level *
+level_init(void)
+{
+	struct level *l = my_calloc(1, sizeof(*l));
+
+	l->sources = level_source_vec_init(16);
+	l->ranges = key_range_vec_init(16);
+	l->source = mtbl_source_init(level_iter,
+				     level_get,
+				     level_get_prefix,
+				     level_get_range,
+				     NULL, l);
+	source_set_key_range_func(l->source, level_key_range);
+	source_set_lookup_func(l->source, level_lookup, true);
+	return (l);
+}
+
+void
+level_destroy(struct level **l)
+{
+	if (*l) {
+		level_source_vec_destroy(&(*l)->sources);
+		key_range_vec_destroy(&(*l)->ranges);
+		mtbl_source_destroy(&(*l)->source);
+		free(*l);
+		*l = NULL;
+	}
+}
+
+/*
+ * Add a source, whose keys must all be greater than those of the sources
+ * already added. The source must remain valid while the level is in use.
+ */
+void
+level_add_source(struct level *l, const struct mtbl_source *s)
+{
+	struct key_range kr;
+	size_t n = key_range_vec_size(l->ranges);
+
+	source_key_range(s, &kr);
+	assert(kr.has_first && kr.has_last);
+	if (n > 0) {
+		const struct key_range *prev = key_range_vec_data(l->ranges) + n - 1;
+		assert(bytes_compare(prev->last, prev->len_last,
+				     kr.first, kr.len_first) < 0);
+		(void) prev;
+	}
+
+	level_source_vec_add(l->sources, s);
+	key_range_vec_add(l->ranges, kr);
+	if (!source_lookup_unique(s))
+		source_set_lookup_func(l->source, level_lookup, false);
+	if (source_tombstones(s))
+		source_set_tombstones(l->source, true);
+}
+
+size_t
+level_size(const struct level *l)
+{
+	return (level_source_vec_size(l->sources));
+}
+
+const struct mtbl_source *
+level_source(struct level *l)
+{
+	return (l->source);
+}
+
+static const struct key_range *
+level_range(const struct level *l, size_t i)
+{
+	return (key_range_vec_data(l->ranges) + i);
+}
+
+/* Index of the first source whose last key is not less than the key. */
+static size_t
+level_lower_bound(const struct level *l, const uint8_t *key, size_t len_key)
+{
+	size_t lo = 0, hi = key_range_vec_size(l->ranges);
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const struct key_range *kr = level_range(l, mid);
+
+		if (bytes_compare(kr->last, kr->len_last, key, len_key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo);
+}
+
+/* Index of the first source whose first key is greater than the key. */
+static size_t
+level_upper_bound(const struct level *l, const uint8_t *key, size_t len_key)
+{
+	size_t lo = 0, hi = key_range_vec_size(l->ranges);
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const struct key_range *kr = level_range(l, mid);
+
+		if (bytes_compare(kr->first, kr->len_first, key, len_key) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo);
+}
+
+/* Index of the first source whose first key is after all keys with the prefix. */
+static size_t
+level_prefix_end(const struct level *l, const uint8_t *key, size_t len_key)
+{
+	size_t lo = 0, hi = key_range_vec_size(l->ranges);
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const struct key_range *kr = level_range(l, mid);
+
+		if (bytes_compare(kr->first, kr->len_first, key, len_key) <= 0 ||
+		    (kr->len_first >= len_key && memcmp(kr->first, key, len_key) == 0))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo);
+}
+
+static struct mtbl_iter *
+level_iter_source_iter(struct level_iter *it, size_t i)
+{
+	const struct mtbl_source *s = level_source_vec_value(it->l->sources, i);
+
+	switch (it->it_type) {
+	case LEVEL_ITER_TYPE_ITER:
+		return (mtbl_source_iter(s));
+	case LEVEL_ITER_TYPE_GET_PREFIX:
+		return (mtbl_source_get_prefix(s, ubuf_data(it->key0), ubuf_size(it->key0)));
+	case LEVEL_ITER_TYPE_GET_RANGE:
+		return (mtbl_source_get_range(s,
+					      ubuf_data(it->key0), ubuf_size(it->key0),
+					      ubuf_data(it->key1), ubuf_size(it->key1)));
+	}
+	return (NULL);
+}
+
+static mtbl_res
+level_iter_seek(void *v, const uint8_t *key, size_t len_key)
+{
+	struct level_iter *it = (struct level_iter *) v;
+	size_t i = level_lower_bound(it->l, key, len_key);
+
+	if (i < it->start)
+		i = it->start;
+
+	/* Seeking within the current source does not need a new iterator. */
+	if (i == it->i && it->it != NULL)
+		return (mtbl_iter_seek(it->it, key, len_key));
+
+	mtbl_iter_destroy(&it->it);
+	it->i = i;
+	if (i < it->end) {
+		it->it = level_iter_source_iter(it, i);
+		if (it->it != NULL)
+			return (mtbl_iter_seek(it->it, key, len_key));
+	}
+	return (mtbl_res_success);
+}
+
+static mtbl_res
+level_iter_next(void *v,
+		const uint8_t **key, size_t *len_key,
+		const uint8_t **val, size_t *len_val)
+{
+	struct level_iter *it = (struct level_iter *) v;
+
+	while (it->i < it->end) {
+		if (it->it == NULL)
+			it->it = level_iter_source_iter(it, it->i);
+		if (mtbl_iter_next(it->it, key, len_key, val, len_val) == mtbl_res_success)
+			return (mtbl_res_success);
+		mtbl_iter_destroy(&it->it);
+		it->i++;
+	}
+	return (mtbl_res_failure);
+}
+
+/*
+ * Re-aim the iterator at the sources which may have the new keys. The
+ * iterator of the current source is reset in place if it is the first of
+ * them.
+ */
+static bool
+level_iter_reset(void *v, iter_reset_type type,
+		 const uint8_t *key0, size_t len_key0,
+		 const uint8_t *key1, size_t len_key1)
+{
+	struct level_iter *it = (struct level_iter *) v;
+	size_t start, end;
+
+	start = level_lower_bound(it->l, key0, len_key0);
+	ubuf_clip(it->key0, 0);
+	ubuf_clip(it->key1, 0);
+	ubuf_append(it->key0, key0, len_key0);
+	if (type == ITER_RESET_PREFIX) {
+		it->it_type = LEVEL_ITER_TYPE_GET_PREFIX;
+		end = level_prefix_end(it->l, key0, len_key0);
+	} else {
+		it->it_type = LEVEL_ITER_TYPE_GET_RANGE;
+		ubuf_append(it->key1, key1, len_key1);
+		end = level_upper_bound(it->l, key1, len_key1);
+	}
+
+	if (it->i != start || start >= end ||
+	    !iter_reset(it->it, type, key0, len_key0, key1, len_key1))
+		mtbl_iter_destroy(&it->it);
+	it->start = start;
+	it->end = end;
+	it->i = start;
+	return (true);
+}
+
+static entry_type
+level_iter_entry_type(void *v)
+{
+	struct level_iter *it = (struct level_iter *) v;
+	return (iter_entry_type(it->it));
+}
+
+static void
+level_iter_free(void *v)
+{
+	struct level_iter *it = (struct level_iter *) v;
+
+	if (it) {
+		mtbl_iter_destroy(&it->it);
+		ubuf_destroy(&it->key0);
+		ubuf_destroy(&it->key1);
+		free(it);
+	}
+}
+
+static struct mtbl_iter *
+level_iter_init(struct level *l, level_iter_type it_type, size_t start, size_t end,
+		const uint8_t *key0, size_t len_key0,
+		const uint8_t *key1, size_t len_key1)
+{
+	struct level_iter *it = my_calloc(1, sizeof(*it));
+	struct mtbl_iter *iter;
+
+	it->l = l;
+	it->it_type = it_type;
+	it->key0 = ubuf_init(len_key0);
+	it->key1 = ubuf_init(len_key1);
+	if (len_key0 > 0)
+		ubuf_append(it->key0, key0, len_key0);
+	if (len_key1 > 0)
+		ubuf_append(it->key1, key1, len_key1);
+	it->start = start;
+	it->end = end;
+	it->i = start;
+	iter = mtbl_iter_init(level_iter_seek, level_iter_next, level_iter_free, it);
+	iter_set_entry_type_func(iter, level_iter_entry_type);
+	iter_set_reset_func(iter, level_iter_reset);
+	return (iter);
+}
+
+static struct mtbl_iter *
+level_iter(void *clos)
+{
+	struct level *l = (struct level *) clos;
+
+	return (level_iter_init(l, LEVEL_ITER_TYPE_ITER, 0, level_size(l),
+				NULL, 0, NULL, 0));
+}
+
+static struct mtbl_iter *
+level_get_range(void *clos,
+		const uint8_t *key0, size_t len_key0,
+		const uint8_t *key1, size_t len_key1)
+{
+	struct level *l = (struct level *) clos;
+
+	return (level_iter_init(l, LEVEL_ITER_TYPE_GET_RANGE,
+				level_lower_bound(l, key0, len_key0),
+				level_upper_bound(l, key1, len_key1),
+				key0, len_key0, key1, len_key1));
+}
+
+static struct mtbl_iter *
+level_get(void *clos, const uint8_t *key, size_t len_key)
+{
+	return (level_get_range(clos, key, len_key, key, len_key));
+}
+
+static struct mtbl_iter *
+level_get_prefix(void *clos, const uint8_t *key, size_t len_key)
+{
+	struct level *l = (struct level *) clos;
+
+	return (level_iter_init(l, LEVEL_ITER_TYPE_GET_PREFIX,
+				level_lower_bound(l, key, len_key),
+				level_prefix_end(l, key, len_key),
+				key, len_key, NULL, 0));
+}
+
+static void
+level_key_range(void *clos, struct key_range *kr)
+{
+	struct level *l = (struct level *) clos;
+	size_t n = level_size(l);
+
+	memset(kr, 0, sizeof(*kr));
+	if (n == 0)
+		return;
+	kr->has_first = true;
+	kr->first = level_range(l, 0)->first;
+	kr->len_first = level_range(l, 0)->len_first;
+	kr->has_last = true;
+	kr->last = level_range(l, n - 1)->last;
+	kr->len_last = level_range(l, n - 1)->len_last;
+}
+
+/* At most one source of a level can have the key. */
+static mtbl_res
+level_lookup(void *clos, const uint8_t *key, size_t len_key,
+	     mtbl_lookup_func lookup, void *lookup_clos)
+{
+	struct level *l = (struct level *) clos;
+	size_t i = level_lower_bound(l, key, len_key);
+	const struct key_range *kr;
+
+	if (i == level_size(l))
+		return (mtbl_res_failure);
+	kr = level_range(l, i);
+	if (bytes_compare(kr->first, kr->len_first, key, len_key) > 0)
+		return (mtbl_res_failure);
+	return (mtbl_source_lookup(level_source_vec_value(l->sources, i),
+				   key, len_key, lookup, lookup_clos));
+}
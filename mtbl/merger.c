@@ -16,8 +16,8 @@
  */
 
 #include "mtbl-private.h"
+#include "threadpool.h"
 
-#include "libmy/heap.h"
 #include "libmy/ubuf.h"
 
 struct entry {
@@ -25,6 +25,7 @@ struct entry {
 	struct mtbl_iter		*it;
 	const uint8_t			*key, *val;
 	size_t				len_key, len_val;
+	uint64_t			prefix;	/* first 8 bytes of key, big-endian */
 };
 
 VECTOR_GENERATE(entry_vec, struct entry *);
@@ -33,29 +34,78 @@ VECTOR_GENERATE(iter_vec, struct mtbl_iter *);
 
 VECTOR_GENERATE(source_vec, const struct mtbl_source *);
 
+VECTOR_GENERATE(val_vec, const uint8_t *);
+
+VECTOR_GENERATE(len_vec, size_t);
+
+/* A value for the current key, when some of the sources have tombstones. */
+struct merger_val {
+	size_t				source;	/* index of the entry it came from */
+	size_t				offset;	/* in cur_val */
+	size_t				len;
+	entry_type			type;
+	bool				hidden;
+};
+
+VECTOR_GENERATE(merger_val_vec, struct merger_val);
+
+/*
+ * The entries are merged with a tournament tree of losers. tree[0] holds the
+ * index of the entry with the smallest key/val, and tree[1..n-1] hold the
+ * index of the loser of the match played at each internal node, where the
+ * entries are the leaves n..2n-1. When the winner advances, only the matches
+ * on the path from its leaf to the root are replayed.
+ */
 struct merger_iter {
 	struct mtbl_merger		*m;
-	struct heap			*h;	/* entries sorted by key/val */
 	entry_vec			*entries;
-	/* iters is maintained solely for resource management purposes */
+	entry_vec			*spare;	/* entries kept for reuse by a reset */
+	size_t				*tree;
+	size_t				size_tree;
+	bool				built;	/* the tree is built on first use */
+	/* iters is indexed by source, with NULL for sources not iterated */
 	iter_vec                        *iters;
 	ubuf				*cur_key;
 	ubuf				*cur_val;
 	bool				finished;
-	bool				pending;
+	bool				deferred;	/* winner returned in place, not yet advanced */
+
+	/* Values for the current key, and the merge_values output buffer. */
+	len_vec				*len_vals;
+	val_vec				*vals;
+	uint8_t				*merge_buf;
+	size_t				size_merge_buf;
+
+	/*
+	 * If some of the sources have tombstones, the values for the current
+	 * key, and the next of them to return without a merge function.
+	 */
+	bool				tombstones;
+	merger_val_vec			*mvals;
+	size_t				next_mval;
+	entry_type			type;	/* of the entry last returned */
+
+	/* Copies of the entries of the last batch. */
+	ubuf				*batch;
 };
 
 struct mtbl_merger_options {
 	mtbl_merge_func			merge;
+	mtbl_merge_values_func		merge_values;
 	void				*merge_clos;
 	mtbl_dupsort_func		dupsort;
 	void				*dupsort_clos;
+	struct mtbl_threadpool		*pool;
 };
 
 struct mtbl_merger {
 	source_vec			*sources;
 	struct mtbl_source		*source;
 	struct mtbl_merger_options	opt;
+	merger_tombstones		tombstones;
+	struct readahead		*ra;	/* shared by the iterators, once used */
+	void				(*free_func)(void *);
+	void				*free_clos;
 };
 
 static struct mtbl_iter *
@@ -73,9 +123,21 @@ merger_get_range(void *, const uint8_t *, size_t, const uint8_t *, size_t);
 static mtbl_res
 merger_iter_next(void *, const uint8_t **, size_t *, const uint8_t **, size_t *);
 
+static void
+merger_iter_free(void *);
+
 static void
 merger_iter_add_entry(struct merger_iter *it, struct mtbl_iter *ent_it);
 
+static bool
+merger_iter_reset(void *, iter_reset_type, const uint8_t *, size_t, const uint8_t *, size_t);
+
+static void
+merger_key_range(void *, struct key_range *);
+
+static mtbl_res
+merger_lookup(void *, const uint8_t *, size_t, mtbl_lookup_func, void *);
+
 struct mtbl_merger_options *
 mtbl_merger_options_init(void)
 {
@@ -96,6 +158,17 @@ mtbl_merger_options_set_merge_func(struct mtbl_merger_options *opt,
 				   mtbl_merge_func merge, void *clos)
 {
 	opt->merge = merge;
+	opt->merge_values = NULL;
+	opt->merge_clos = clos;
+}
+
+void
+mtbl_merger_options_set_merge_values_func(struct mtbl_merger_options *opt,
+					  mtbl_merge_values_func merge_values,
+					  void *clos)
+{
+	opt->merge = NULL;
+	opt->merge_values = merge_values;
 	opt->merge_clos = clos;
 }
 
@@ -107,6 +180,13 @@ mtbl_merger_options_set_dupsort_func(struct mtbl_merger_options *opt,
 	opt->dupsort_clos = clos;
 }
 
+void
+mtbl_merger_options_set_threadpool(struct mtbl_merger_options *opt,
+				   struct mtbl_threadpool *pool)
+{
+	opt->pool = pool;
+}
+
 struct mtbl_merger *
 mtbl_merger_init(const struct mtbl_merger_options *opt)
 {
@@ -121,6 +201,9 @@ mtbl_merger_init(const struct mtbl_merger_options *opt)
 				     merger_get_prefix,
 				     merger_get_range,
 				     NULL, m);
+	source_set_key_range_func(m->source, merger_key_range);
+	source_set_lookup_func(m->source, merger_lookup,
+			       m->opt.merge != NULL || m->opt.merge_values != NULL);
 	return (m);
 }
 
@@ -130,6 +213,9 @@ mtbl_merger_destroy(struct mtbl_merger **m)
 	if (*m) {
 		source_vec_destroy(&(*m)->sources);
 		mtbl_source_destroy(&(*m)->source);
+		readahead_destroy(&(*m)->ra);
+		if ((*m)->free_func != NULL)
+			(*m)->free_func((*m)->free_clos);
 		free(*m);
 		*m = NULL;
 	}
@@ -145,22 +231,54 @@ void
 mtbl_merger_add_source(struct mtbl_merger *m, const struct mtbl_source *s)
 {
 	source_vec_add(m->sources, s);
+	if (source_tombstones(s) && m->tombstones != MERGER_TOMBSTONES_DROP)
+		source_set_tombstones(m->source, true);
+}
+
+void
+merger_set_free_func(struct mtbl_merger *m, void (*free_func)(void *), void *clos)
+{
+	m->free_func = free_func;
+	m->free_clos = clos;
+}
+
+void
+merger_set_tombstones(struct mtbl_merger *m, merger_tombstones tombstones)
+{
+	m->tombstones = tombstones;
+	source_set_tombstones(m->source, false);
+	for (size_t i = 0; i < source_vec_size(m->sources); i++)
+		if (source_tombstones(source_vec_value(m->sources, i)) &&
+		    tombstones != MERGER_TOMBSTONES_DROP)
+			source_set_tombstones(m->source, true);
+}
+
+static inline uint64_t
+key_prefix(const uint8_t *key, size_t len_key)
+{
+	uint64_t prefix = 0;
+
+	memcpy(&prefix, key, len_key < sizeof(prefix) ? len_key : sizeof(prefix));
+	return (be64toh(prefix));
 }
 
 static int
-_mtbl_merger_compare(const void *va, const void *vb, void *clos)
+_mtbl_merger_compare(const struct mtbl_merger *m,
+		     const struct entry *a, const struct entry *b)
 {
-	const struct entry *a = (const struct entry *) va;
-	const struct entry *b = (const struct entry *) vb;
-	const struct mtbl_merger *m = (const struct mtbl_merger *)clos;
 	int res;
 
-	if (a->key == NULL && b->key == NULL)
-		return (0);
-	if (a->key == NULL)
-		return (1);
-	if (b->key == NULL)
-		return (-1);
+	/* Finished entries sort after all others. */
+	if (a->finished || b->finished)
+		return ((int) a->finished - (int) b->finished);
+
+	/*
+	 * Zero-padded big-endian key prefixes order the same way as the keys
+	 * themselves, so the full keys only need to be compared if the
+	 * prefixes are equal.
+	 */
+	if (a->prefix != b->prefix)
+		return (a->prefix < b->prefix ? -1 : 1);
 
 	res = bytes_compare(a->key, a->len_key,
 			    b->key, b->len_key);
@@ -182,9 +300,147 @@ entry_fill(struct entry *ent)
 	res = mtbl_iter_next(ent->it, &ent->key, &ent->len_key,
 				      &ent->val, &ent->len_val);
 	ent->finished = (res != mtbl_res_success);
+	if (!ent->finished)
+		ent->prefix = key_prefix(ent->key, ent->len_key);
 	return (res);
 }
 
+/* Whether the entry at index i wins a match against the entry at index j. */
+static inline bool
+lt_wins(const struct merger_iter *it, size_t i, size_t j)
+{
+	int res = _mtbl_merger_compare(it->m,
+				       entry_vec_value(it->entries, i),
+				       entry_vec_value(it->entries, j));
+	return (res < 0 || (res == 0 && i < j));
+}
+
+static size_t
+lt_build_node(struct merger_iter *it, size_t node)
+{
+	size_t n = entry_vec_size(it->entries);
+	size_t l, r;
+
+	if (node >= n)
+		return (node - n);
+	l = lt_build_node(it, 2 * node);
+	r = lt_build_node(it, 2 * node + 1);
+	if (lt_wins(it, r, l)) {
+		it->tree[node] = l;
+		return (r);
+	}
+	it->tree[node] = r;
+	return (l);
+}
+
+/* Play all matches of the tournament tree. */
+static void
+lt_build(struct merger_iter *it)
+{
+	size_t n = entry_vec_size(it->entries);
+
+	if (it->size_tree < n || it->tree == NULL) {
+		it->size_tree = n > 0 ? n : 1;
+		it->tree = my_realloc(it->tree, it->size_tree * sizeof(size_t));
+	}
+	if (n > 0)
+		it->tree[0] = lt_build_node(it, 1);
+	it->built = true;
+}
+
+/* Replay the matches on the path from the winner's leaf to the root. */
+static void
+lt_replay(struct merger_iter *it)
+{
+	size_t n = entry_vec_size(it->entries);
+	size_t winner = it->tree[0];
+
+	for (size_t node = (winner + n) / 2; node > 0; node /= 2) {
+		if (lt_wins(it, it->tree[node], winner)) {
+			size_t tmp = it->tree[node];
+			it->tree[node] = winner;
+			winner = tmp;
+		}
+	}
+	it->tree[0] = winner;
+}
+
+/* The entry with the smallest key/val, or NULL if all entries are finished. */
+static struct entry *
+lt_top(struct merger_iter *it)
+{
+	struct entry *e;
+
+	if (!it->built)
+		lt_build(it);
+	if (entry_vec_size(it->entries) == 0)
+		return (NULL);
+	e = entry_vec_value(it->entries, it->tree[0]);
+	return (e->finished ? NULL : e);
+}
+
+/*
+ * Whether any other entry has the same key as the winner. Such an entry
+ * would sort directly after the winner, so it must be one of the losers of
+ * the matches on the winner's path to the root.
+ */
+static bool
+lt_top_has_dup(struct merger_iter *it)
+{
+	size_t n = entry_vec_size(it->entries);
+	size_t winner = it->tree[0];
+	const struct entry *w = entry_vec_value(it->entries, winner);
+
+	for (size_t node = (winner + n) / 2; node > 0; node /= 2) {
+		const struct entry *e = entry_vec_value(it->entries, it->tree[node]);
+
+		if (!e->finished && e->prefix == w->prefix &&
+		    bytes_compare(e->key, e->len_key, w->key, w->len_key) == 0)
+			return (true);
+	}
+	return (false);
+}
+
+/*
+ * Advance past the winner returned in place by the last call to
+ * merger_iter_next(). If 'save_key' is true, its key is first copied to
+ * cur_key, since it is about to be overwritten.
+ */
+static void
+merger_iter_advance(struct merger_iter *it, bool save_key)
+{
+	struct entry *e;
+
+	if (!it->deferred)
+		return;
+	it->deferred = false;
+	e = lt_top(it);
+	if (save_key) {
+		ubuf_clip(it->cur_key, 0);
+		ubuf_append(it->cur_key, e->key, e->len_key);
+	}
+	entry_fill(e);
+	lt_replay(it);
+}
+
+/*
+ * Return the winner's key and value without copying them. The source
+ * iterator is only advanced on the next call, so the pointers remain valid
+ * until then.
+ */
+static mtbl_res
+merger_iter_return_top(struct merger_iter *it, struct entry *e,
+		       const uint8_t **out_key, size_t *out_len_key,
+		       const uint8_t **out_val, size_t *out_len_val)
+{
+	it->deferred = true;
+	*out_key = e->key;
+	*out_len_key = e->len_key;
+	*out_val = e->val;
+	*out_len_val = e->len_val;
+	return (mtbl_res_success);
+}
+
 static mtbl_res
 merger_iter_seek(void *v, const uint8_t *key, size_t len_key)
 {
@@ -193,30 +449,32 @@ merger_iter_seek(void *v, const uint8_t *key, size_t len_key)
 	bool changed = false;
 	mtbl_res res;
 
+	merger_iter_advance(it, true);
 	it->finished = false;
-	it->pending = false;
+	if (it->mvals != NULL) {
+		merger_val_vec_clip(it->mvals, 0);
+		it->next_mval = 0;
+	}
 
-	e = heap_peek(it->h);
+	e = lt_top(it);
 
 	/*
 	 * If we are seeking backwards from our current key or the end of
 	 * the iterator (e == NULL), seek all entries to the desired key
-	 * and rebuild the heap.
+	 * and rebuild the tournament tree.
 	 */
 	if (e == NULL || ubuf_size(it->cur_key) == 0 ||
 	    bytes_compare(key, len_key, ubuf_data(it->cur_key), ubuf_size(it->cur_key)) < 0) {
-		heap_clip(it->h, 0);
 		for (size_t i = 0; i < entry_vec_size(it->entries); i++) {
 			struct entry *ent = entry_vec_value(it->entries, i);
 			res = mtbl_iter_seek(ent->it, key, len_key);
-			if (res != mtbl_res_success)
+			if (res != mtbl_res_success) {
+				ent->finished = true;
 				continue;
-			res = entry_fill(ent);
-			if (res != mtbl_res_success)
-				continue;
-			heap_add(it->h, ent);
+			}
+			entry_fill(ent);
 		}
-		heap_heapify(it->h);
+		lt_build(it);
 		return (mtbl_res_success);
 	}
 
@@ -227,16 +485,15 @@ merger_iter_seek(void *v, const uint8_t *key, size_t len_key)
 	while (bytes_compare(key, len_key, e->key, e->len_key) > 0) {
 		changed = true;
 		res = mtbl_iter_seek(e->it, key, len_key);
-		if (res == mtbl_res_success && entry_fill(e) == mtbl_res_success) {
-			heap_replace(it->h, e);
-			e = heap_peek(it->h);
-		} else {
-			heap_pop(it->h);
-			e = heap_peek(it->h);
-			if (e == NULL) {
-				it->finished = true;
-				break;
-			}
+		if (res == mtbl_res_success)
+			entry_fill(e);
+		else
+			e->finished = true;
+		lt_replay(it);
+		e = lt_top(it);
+		if (e == NULL) {
+			it->finished = true;
+			break;
 		}
 	}
 
@@ -253,83 +510,436 @@ merger_iter_seek(void *v, const uint8_t *key, size_t len_key)
 	return (mtbl_res_success);
 }
 
+/*
+ * Gather all of the values for the winner's key, which occurs in more than
+ * one source, and merge them with a single call to the merge_values function,
+ * which writes into a buffer owned by the iterator.
+ */
 static mtbl_res
-merger_iter_next(void *v,
-		 const uint8_t **out_key, size_t *out_len_key,
-		 const uint8_t **out_val, size_t *out_len_val)
+merger_iter_next_values(struct merger_iter *it, struct entry *e,
+			const uint8_t **out_key, size_t *out_len_key,
+			const uint8_t **out_val, size_t *out_len_val)
 {
-	struct merger_iter *it = (struct merger_iter *) v;
-	struct entry *e;
+	const uint8_t *p;
+	size_t n_vals, len_val;
 	mtbl_res res;
 
-	if (it->finished)
+	ubuf_clip(it->cur_key, 0);
+	ubuf_clip(it->cur_val, 0);
+	len_vec_clip(it->len_vals, 0);
+	ubuf_append(it->cur_key, e->key, e->len_key);
+	do {
+		ubuf_append(it->cur_val, e->val, e->len_val);
+		len_vec_add(it->len_vals, e->len_val);
+		entry_fill(e);
+		lt_replay(it);
+		e = lt_top(it);
+	} while (e != NULL &&
+		 bytes_compare(ubuf_data(it->cur_key), ubuf_size(it->cur_key),
+			       e->key, e->len_key) == 0);
+
+	p = ubuf_data(it->cur_val);
+
+	/* The values are packed back to back in cur_val. */
+	n_vals = len_vec_size(it->len_vals);
+	val_vec_clip(it->vals, 0);
+	for (size_t i = 0; i < n_vals; i++) {
+		val_vec_add(it->vals, p);
+		p += len_vec_value(it->len_vals, i);
+	}
+	res = it->m->opt.merge_values(it->m->opt.merge_clos,
+				      ubuf_data(it->cur_key), ubuf_size(it->cur_key),
+				      n_vals, val_vec_data(it->vals),
+				      len_vec_data(it->len_vals),
+				      &it->merge_buf, &it->size_merge_buf,
+				      &len_val);
+	if (res != mtbl_res_success)
 		return (mtbl_res_failure);
 
+	*out_key = ubuf_data(it->cur_key);
+	*out_len_key = ubuf_size(it->cur_key);
+	*out_val = it->merge_buf;
+	*out_len_val = len_val;
+	return (mtbl_res_success);
+}
+
+/*
+ * Whether the value at index i of mvals is hidden by a tombstone or replacing
+ * value from a later source, or from later in the same source.
+ */
+static bool
+merger_val_hidden(const struct merger_iter *it, size_t i)
+{
+	const struct merger_val *mvals = merger_val_vec_data(it->mvals);
+
+	for (size_t j = 0; j < merger_val_vec_size(it->mvals); j++) {
+		if (j == i || mvals[j].type == ENTRY_TYPE_VALUE)
+			continue;
+		if (mvals[j].type == ENTRY_TYPE_TOMBSTONE &&
+		    it->m->tombstones == MERGER_TOMBSTONES_DOMINATE)
+			return (true);
+		if (mvals[j].source > mvals[i].source ||
+		    (mvals[j].source == mvals[i].source && j > i))
+			return (true);
+	}
+	return (false);
+}
+
+/*
+ * Gather the entries for the winner's key into mvals, and keep only the
+ * values which are not hidden. Returns the type of entry the key is
+ * returned as: a tombstone if no values remain, and otherwise a replacing
+ * value if any were hidden, unless tombstones are dropped.
+ */
+static entry_type
+merger_iter_gather(struct merger_iter *it, struct entry *e)
+{
+	struct merger_val *mvals;
+	bool hides = false;
+	size_t n = 0;
+
 	ubuf_clip(it->cur_key, 0);
 	ubuf_clip(it->cur_val, 0);
+	merger_val_vec_clip(it->mvals, 0);
+	it->next_mval = 0;
+	ubuf_append(it->cur_key, e->key, e->len_key);
+	do {
+		struct merger_val mv = {
+			.source = it->tree[0],
+			.offset = ubuf_size(it->cur_val),
+			.len = e->len_val,
+			.type = iter_entry_type(e->it),
+			.hidden = false,
+		};
+
+		if (e->len_val > 0)
+			ubuf_append(it->cur_val, e->val, e->len_val);
+		merger_val_vec_add(it->mvals, mv);
+		hides |= mv.type != ENTRY_TYPE_VALUE;
+		entry_fill(e);
+		lt_replay(it);
+		e = lt_top(it);
+	} while (e != NULL &&
+		 bytes_compare(ubuf_data(it->cur_key), ubuf_size(it->cur_key),
+			       e->key, e->len_key) == 0);
+
+	/* Mark the hidden values, then compact the remaining ones in place. */
+	mvals = merger_val_vec_data(it->mvals);
+	for (size_t i = 0; i < merger_val_vec_size(it->mvals); i++)
+		mvals[i].hidden = merger_val_hidden(it, i);
+	for (size_t i = 0; i < merger_val_vec_size(it->mvals); i++) {
+		if (mvals[i].hidden || mvals[i].type == ENTRY_TYPE_TOMBSTONE)
+			continue;
+		mvals[i].type = ENTRY_TYPE_VALUE;
+		mvals[n++] = mvals[i];
+	}
+	merger_val_vec_clip(it->mvals, n);
+
+	if (!hides || it->m->tombstones == MERGER_TOMBSTONES_DROP)
+		return (ENTRY_TYPE_VALUE);
+	return (n > 0 ? ENTRY_TYPE_REPLACE : ENTRY_TYPE_TOMBSTONE);
+}
+
+/* Merge the values remaining in mvals into merge_buf. */
+static mtbl_res
+merger_iter_merge_mvals(struct merger_iter *it, size_t *len_merged)
+{
+	const uint8_t *key = ubuf_data(it->cur_key);
+	size_t len_key = ubuf_size(it->cur_key);
+	size_t n_vals = merger_val_vec_size(it->mvals);
+
+	val_vec_clip(it->vals, 0);
+	len_vec_clip(it->len_vals, 0);
+	for (size_t i = 0; i < n_vals; i++) {
+		const struct merger_val *mv = merger_val_vec_data(it->mvals) + i;
+
+		val_vec_add(it->vals, ubuf_data(it->cur_val) + mv->offset);
+		len_vec_add(it->len_vals, mv->len);
+	}
+
+	if (it->m->opt.merge_values != NULL)
+		return (it->m->opt.merge_values(it->m->opt.merge_clos, key, len_key,
+						n_vals, val_vec_data(it->vals),
+						len_vec_data(it->len_vals),
+						&it->merge_buf, &it->size_merge_buf,
+						len_merged));
+
+	const uint8_t *val = val_vec_value(it->vals, 0);
+	size_t len_val = len_vec_value(it->len_vals, 0);
+	uint8_t *merged_val = NULL;
+
+	for (size_t i = 1; i < n_vals; i++) {
+		uint8_t *tmp = NULL;
+		size_t len_tmp = 0;
+
+		it->m->opt.merge(it->m->opt.merge_clos, key, len_key,
+				 val, len_val,
+				 val_vec_value(it->vals, i), len_vec_value(it->len_vals, i),
+				 &tmp, &len_tmp);
+		free(merged_val);
+		if (tmp == NULL)
+			return (mtbl_res_failure);
+		merged_val = tmp;
+		val = merged_val;
+		len_val = len_tmp;
+	}
+	if (it->size_merge_buf < len_val) {
+		it->merge_buf = my_realloc(it->merge_buf, len_val);
+		it->size_merge_buf = len_val;
+	}
+	memcpy(it->merge_buf, merged_val, len_val);
+	*len_merged = len_val;
+	free(merged_val);
+	return (mtbl_res_success);
+}
+
+/*
+ * Return the next entry when some of the sources have tombstones. Keys which
+ * occur in only one source are still returned in place.
+ */
+static mtbl_res
+merger_iter_next_tombstones(struct merger_iter *it,
+			    const uint8_t **out_key, size_t *out_len_key,
+			    const uint8_t **out_val, size_t *out_len_val)
+{
+	struct entry *e;
+	entry_type type;
+	size_t len_val;
 
 	for (;;) {
-		for (;;) {
-			e = heap_peek(it->h);
-			if (e == NULL) {
-				it->finished = true;
-				break;
-			}
-			if (e->finished)
-				heap_pop(it->h);
-			else
-				break;
+		/* Without a merge function, the values of a key are returned in turn. */
+		if (it->next_mval < merger_val_vec_size(it->mvals)) {
+			const struct merger_val *mv = merger_val_vec_data(it->mvals) + it->next_mval;
+
+			it->type = mv->type;
+			it->next_mval++;
+			*out_key = ubuf_data(it->cur_key);
+			*out_len_key = ubuf_size(it->cur_key);
+			*out_val = ubuf_data(it->cur_val) + mv->offset;
+			*out_len_val = mv->len;
+			return (mtbl_res_success);
 		}
 
-		if (it->finished)
-			break;
+		merger_iter_advance(it, false);
+		e = lt_top(it);
+		if (e == NULL) {
+			it->finished = true;
+			return (mtbl_res_failure);
+		}
 
-		if (ubuf_size(it->cur_key) == 0) {
-			ubuf_clip(it->cur_val, 0);
-			ubuf_append(it->cur_key, e->key, e->len_key);
-			ubuf_append(it->cur_val, e->val, e->len_val);
-			it->pending = true;
-			res = entry_fill(e);
-			if (res == mtbl_res_success)
-				heap_replace(it->h, e);
-			continue;
+		if (!lt_top_has_dup(it)) {
+			type = iter_entry_type(e->it);
+			if (it->m->tombstones == MERGER_TOMBSTONES_DROP) {
+				if (type == ENTRY_TYPE_TOMBSTONE) {
+					entry_fill(e);
+					lt_replay(it);
+					continue;
+				}
+				type = ENTRY_TYPE_VALUE;
+			}
+			it->type = type;
+			return (merger_iter_return_top(it, e, out_key, out_len_key,
+						       out_val, out_len_val));
 		}
 
-		if (it->m->opt.merge == NULL)
-			break;
+		type = merger_iter_gather(it, e);
+		if (merger_val_vec_size(it->mvals) == 0) {
+			if (type != ENTRY_TYPE_TOMBSTONE)
+				continue;
+			it->type = type;
+			*out_key = ubuf_data(it->cur_key);
+			*out_len_key = ubuf_size(it->cur_key);
+			*out_val = ubuf_data(it->cur_val);
+			*out_len_val = 0;
+			return (mtbl_res_success);
+		}
 
-		if (bytes_compare(ubuf_data(it->cur_key), ubuf_size(it->cur_key),
-				  e->key, e->len_key) == 0)
+		if (merger_val_vec_size(it->mvals) == 1 ||
+		    (it->m->opt.merge == NULL && it->m->opt.merge_values == NULL))
 		{
-			uint8_t *merged_val = NULL;
-			size_t len_merged_val = 0;
-			it->m->opt.merge(it->m->opt.merge_clos,
-					 ubuf_data(it->cur_key), ubuf_size(it->cur_key),
-					 ubuf_data(it->cur_val), ubuf_size(it->cur_val),
-					 e->val, e->len_val, &merged_val, &len_merged_val);
-			if (merged_val == NULL)
-				return (mtbl_res_failure);
-			ubuf_clip(it->cur_val, 0);
-			ubuf_append(it->cur_val, merged_val, len_merged_val);
-			free(merged_val);
-			res = entry_fill(e);
-			if (res == mtbl_res_success)
-				heap_replace(it->h, e);
-		} else {
-			break;
+			merger_val_vec_data(it->mvals)[0].type = type;
+			continue;
 		}
-	}
 
-	if (it->pending) {
-		it->pending = false;
+		if (merger_iter_merge_mvals(it, &len_val) != mtbl_res_success)
+			return (mtbl_res_failure);
+		merger_val_vec_clip(it->mvals, 0);
+		it->type = type;
 		*out_key = ubuf_data(it->cur_key);
-		*out_val = ubuf_data(it->cur_val);
 		*out_len_key = ubuf_size(it->cur_key);
-		*out_len_val = ubuf_size(it->cur_val);
+		*out_val = it->merge_buf;
+		*out_len_val = len_val;
 		return (mtbl_res_success);
-	} else {
+	}
+}
+
+static mtbl_res
+merger_iter_next(void *v,
+		 const uint8_t **out_key, size_t *out_len_key,
+		 const uint8_t **out_val, size_t *out_len_val)
+{
+	struct merger_iter *it = (struct merger_iter *) v;
+	struct entry *e;
+
+	if (it->finished)
 		return (mtbl_res_failure);
+	if (it->tombstones)
+		return (merger_iter_next_tombstones(it, out_key, out_len_key,
+						    out_val, out_len_val));
+
+	merger_iter_advance(it, false);
+	e = lt_top(it);
+	if (e == NULL) {
+		it->finished = true;
+		return (mtbl_res_failure);
+	}
+
+	/* Keys which occur in only one source need no merging or copying. */
+	if ((it->m->opt.merge == NULL && it->m->opt.merge_values == NULL) ||
+	    !lt_top_has_dup(it))
+		return (merger_iter_return_top(it, e, out_key, out_len_key,
+					       out_val, out_len_val));
+
+	if (it->m->opt.merge_values != NULL)
+		return (merger_iter_next_values(it, e, out_key, out_len_key,
+						out_val, out_len_val));
+
+	ubuf_clip(it->cur_key, 0);
+	ubuf_clip(it->cur_val, 0);
+	ubuf_append(it->cur_key, e->key, e->len_key);
+	ubuf_append(it->cur_val, e->val, e->len_val);
+	entry_fill(e);
+	lt_replay(it);
+
+	while ((e = lt_top(it)) != NULL &&
+	       bytes_compare(ubuf_data(it->cur_key), ubuf_size(it->cur_key),
+			     e->key, e->len_key) == 0)
+	{
+		uint8_t *merged_val = NULL;
+		size_t len_merged_val = 0;
+		it->m->opt.merge(it->m->opt.merge_clos,
+				 ubuf_data(it->cur_key), ubuf_size(it->cur_key),
+				 ubuf_data(it->cur_val), ubuf_size(it->cur_val),
+				 e->val, e->len_val, &merged_val, &len_merged_val);
+		if (merged_val == NULL)
+			return (mtbl_res_failure);
+		ubuf_clip(it->cur_val, 0);
+		ubuf_append(it->cur_val, merged_val, len_merged_val);
+		free(merged_val);
+		entry_fill(e);
+		lt_replay(it);
+	}
+
+	*out_key = ubuf_data(it->cur_key);
+	*out_val = ubuf_data(it->cur_val);
+	*out_len_key = ubuf_size(it->cur_key);
+	*out_len_val = ubuf_size(it->cur_val);
+	return (mtbl_res_success);
+}
+
+/*
+ * Entries returned in place are only valid until their source advances, so the
+ * entries of a batch are copied. This still saves a call through the iterator
+ * for each entry, and one for each iterator stacked on the merger.
+ */
+static size_t
+merger_iter_next_batch(void *v, struct mtbl_entry *entries, size_t n)
+{
+	struct merger_iter *it = (struct merger_iter *) v;
+	const uint8_t *key, *val;
+	size_t len_key, len_val, i = 0;
+
+	if (it->batch == NULL)
+		it->batch = ubuf_init(256);
+	ubuf_clip(it->batch, 0);
+
+	while (i < n && merger_iter_next(it, &key, &len_key, &val, &len_val) == mtbl_res_success) {
+		entries[i].key = (const uint8_t *) (uintptr_t) ubuf_size(it->batch);
+		entries[i].len_key = len_key;
+		ubuf_append(it->batch, key, len_key);
+		entries[i].val = (const uint8_t *) (uintptr_t) ubuf_size(it->batch);
+		entries[i].len_val = len_val;
+		if (len_val > 0)
+			ubuf_append(it->batch, val, len_val);
+		i++;
+
+		/* Only the last entry of a batch may be a tombstone. */
+		if (it->type != ENTRY_TYPE_VALUE)
+			break;
+	}
+	for (size_t j = 0; j < i; j++) {
+		entries[j].key = ubuf_data(it->batch) + (uintptr_t) entries[j].key;
+		entries[j].val = ubuf_data(it->batch) + (uintptr_t) entries[j].val;
+	}
+	return (i);
+}
+
+/*
+ * The winner's data block can be copied verbatim if it was returned in place
+ * and every other entry sorts after the last key of the block. The smallest
+ * of the other entries is one of the losers on the winner's path.
+ */
+static bool
+merger_iter_raw_block(void *v, struct raw_block *rb)
+{
+	struct merger_iter *it = (struct merger_iter *) v;
+	size_t n = entry_vec_size(it->entries);
+	size_t winner;
+
+	if (!it->deferred)
+		return (false);
+	winner = it->tree[0];
+	if (!iter_raw_block(entry_vec_value(it->entries, winner)->it, rb))
+		return (false);
+
+	/* Blocks with tombstones to drop must be read entry by entry. */
+	if (rb->m->has_tombstones && it->m->tombstones == MERGER_TOMBSTONES_DROP)
+		return (false);
+
+	for (size_t node = (winner + n) / 2; node > 0; node /= 2) {
+		const struct entry *e = entry_vec_value(it->entries, it->tree[node]);
+
+		if (!e->finished &&
+		    bytes_compare(e->key, e->len_key, rb->bound, rb->len_bound) <= 0)
+			return (false);
 	}
+	return (true);
+}
+
+static void
+merger_iter_skip_block(void *v)
+{
+	struct merger_iter *it = (struct merger_iter *) v;
+	struct entry *e = lt_top(it);
+
+	assert(it->deferred);
+	it->deferred = false;
+	iter_skip_block(e->it);
+	entry_fill(e);
+	lt_replay(it);
+
+	/* The keys of the block were never seen, so force the next seek to reseek. */
+	ubuf_clip(it->cur_key, 0);
+}
+
+static entry_type
+merger_iter_entry_type(void *v)
+{
+	struct merger_iter *it = (struct merger_iter *) v;
+	return (it->type);
+}
+
+static struct mtbl_iter *
+merger_iter_wrap(struct merger_iter *it)
+{
+	struct mtbl_iter *iter;
+
+	iter = mtbl_iter_init(merger_iter_seek, merger_iter_next, merger_iter_free, it);
+	iter_set_raw_block_funcs(iter, merger_iter_raw_block, merger_iter_skip_block);
+	iter_set_entry_type_func(iter, merger_iter_entry_type);
+	iter_set_next_batch_func(iter, merger_iter_next_batch);
+	iter_set_reset_func(iter, merger_iter_reset);
+	return (iter);
 }
 
 static void
@@ -337,12 +947,17 @@ merger_iter_free(void *v)
 {
 	struct merger_iter *it = (struct merger_iter *) v;
 	if (it != NULL) {
-		heap_destroy(&it->h);
+		free(it->tree);
 		for (size_t i = 0; i < entry_vec_size(it->entries); i++) {
 			struct entry *ent = entry_vec_value(it->entries, i);
 			free(ent);
 		}
 		entry_vec_destroy(&it->entries);
+		if (it->spare != NULL) {
+			for (size_t i = 0; i < entry_vec_size(it->spare); i++)
+				free(entry_vec_value(it->spare, i));
+			entry_vec_destroy(&it->spare);
+		}
 		for (size_t i = 0; i < iter_vec_size(it->iters); i++) {
 			struct mtbl_iter *iter = iter_vec_value(it->iters, i);
 			mtbl_iter_destroy(&iter);
@@ -350,6 +965,11 @@ merger_iter_free(void *v)
 		iter_vec_destroy(&it->iters);
 		ubuf_destroy(&it->cur_key);
 		ubuf_destroy(&it->cur_val);
+		ubuf_destroy(&it->batch);
+		len_vec_destroy(&it->len_vals);
+		val_vec_destroy(&it->vals);
+		merger_val_vec_destroy(&it->mvals);
+		free(it->merge_buf);
 		free(it);
 	}
 }
@@ -359,29 +979,417 @@ merger_iter_init(struct mtbl_merger *m)
 {
 	struct merger_iter *it = my_calloc(1, sizeof(*it));
 	it->m = m;
-	it->h = heap_init(_mtbl_merger_compare, m);
 	it->entries = entry_vec_init(source_vec_size(m->sources));
 	it->iters = iter_vec_init(source_vec_size(m->sources));
 	it->cur_key = ubuf_init(256);
 	it->cur_val = ubuf_init(256);
+	it->len_vals = len_vec_init(16);
+	it->vals = val_vec_init(16);
+	for (size_t i = 0; i < source_vec_size(m->sources); i++)
+		it->tombstones |= source_tombstones(source_vec_value(m->sources, i));
+	if (it->tombstones)
+		it->mvals = merger_val_vec_init(16);
 	return (it);
 }
 
+/*
+ * For longer iterations, entries are read and decompressed ahead of the
+ * merge on the threadpool, if one is set. The read-ahead state, with its
+ * result handler thread, is created on first use and shared by all the
+ * iterators of the merger, so that starting an iterator does not start a
+ * thread.
+ */
+static struct mtbl_iter *
+merger_iter_read_ahead(struct merger_iter *it, struct mtbl_iter *s_it)
+{
+	struct mtbl_merger *m = it->m;
+	struct readahead *ra, *expected = NULL;
+
+	if (s_it == NULL || m->opt.pool == NULL || m->opt.pool->pool == NULL)
+		return (s_it);
+	ra = __atomic_load_n(&m->ra, __ATOMIC_ACQUIRE);
+	if (ra == NULL) {
+		ra = readahead_init(m->opt.pool->pool);
+		if (!__atomic_compare_exchange_n(&m->ra, &expected, ra, false,
+						 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			/* Another iterator created it first. */
+			readahead_destroy(&ra);
+			ra = expected;
+		}
+	}
+	return (readahead_iter(ra, s_it));
+}
+
+/* Add an iterator over the next source, which may be NULL. */
+static void
+merger_iter_add_iter(struct merger_iter *it, struct mtbl_iter *s_it, bool read_ahead)
+{
+	if (read_ahead)
+		s_it = merger_iter_read_ahead(it, s_it);
+	iter_vec_add(it->iters, s_it);
+	if (s_it != NULL)
+		merger_iter_add_entry(it, s_it);
+}
+
 static void
 merger_iter_add_entry(struct merger_iter *it, struct mtbl_iter *ent_it)
 {
-	struct entry *ent = my_calloc(1, sizeof(*ent));
+	struct entry *ent;
+	size_t n_spare = it->spare != NULL ? entry_vec_size(it->spare) : 0;
+
+	if (n_spare > 0) {
+		ent = entry_vec_value(it->spare, n_spare - 1);
+		entry_vec_clip(it->spare, n_spare - 1);
+	} else {
+		ent = my_calloc(1, sizeof(*ent));
+	}
 	ent->it = ent_it;
 	ent->finished = false;
 	mtbl_res res = entry_fill(ent);
 	if (res != mtbl_res_success) {
-		free(ent);
+		if (it->spare == NULL)
+			it->spare = entry_vec_init(1);
+		entry_vec_add(it->spare, ent);
 	} else {
-		heap_push(it->h, ent);
+		assert(!it->built);
 		entry_vec_add(it->entries, ent);
 	}
 }
 
+/*
+ * The key range of the merger is the union of the key ranges of its sources,
+ * if they are all known.
+ */
+static void
+merger_key_range(void *clos, struct key_range *kr)
+{
+	struct mtbl_merger *m = (struct mtbl_merger *) clos;
+	size_t n_sources = source_vec_size(m->sources);
+
+	kr->has_first = n_sources > 0;
+	kr->has_last = n_sources > 0;
+	for (size_t i = 0; i < n_sources; i++) {
+		const struct mtbl_source *s = source_vec_value(m->sources, i);
+		struct key_range skr;
+
+		source_key_range(s, &skr);
+		if (kr->has_first && skr.has_first &&
+		    (i == 0 || bytes_compare(skr.first, skr.len_first,
+					     kr->first, kr->len_first) < 0))
+		{
+			kr->first = skr.first;
+			kr->len_first = skr.len_first;
+		}
+		if (kr->has_last && skr.has_last &&
+		    (i == 0 || bytes_compare(skr.last, skr.len_last,
+					     kr->last, kr->len_last) > 0))
+		{
+			kr->last = skr.last;
+			kr->len_last = skr.len_last;
+		}
+		kr->has_first &= skr.has_first;
+		kr->has_last &= skr.has_last;
+	}
+}
+
+/* Whether a source may have keys between key0 and key1, inclusive. */
+static bool
+source_overlaps_range(const struct mtbl_source *s,
+		      const uint8_t *key0, size_t len_key0,
+		      const uint8_t *key1, size_t len_key1)
+{
+	struct key_range kr;
+
+	source_key_range(s, &kr);
+	if (kr.has_last && bytes_compare(key0, len_key0, kr.last, kr.len_last) > 0)
+		return (false);
+	if (kr.has_first && bytes_compare(key1, len_key1, kr.first, kr.len_first) < 0)
+		return (false);
+	return (true);
+}
+
+/* Whether a source may have keys starting with the given prefix. */
+static bool
+source_overlaps_prefix(const struct mtbl_source *s,
+		       const uint8_t *key, size_t len_key)
+{
+	struct key_range kr;
+
+	source_key_range(s, &kr);
+	if (kr.has_last && bytes_compare(kr.last, kr.len_last, key, len_key) < 0)
+		return (false);
+	if (kr.has_first && bytes_compare(kr.first, kr.len_first, key, len_key) > 0 &&
+	    !(kr.len_first >= len_key && memcmp(kr.first, key, len_key) == 0))
+		return (false);
+	return (true);
+}
+
+/*
+ * Re-aim the iterator at new keys. The iterators of the sources are reset
+ * in place where they can be, and only replaced where they cannot, and the
+ * entries and tournament tree are reused.
+ */
+static bool
+merger_iter_reset(void *v, iter_reset_type type,
+		  const uint8_t *key0, size_t len_key0,
+		  const uint8_t *key1, size_t len_key1)
+{
+	struct merger_iter *it = (struct merger_iter *) v;
+	struct mtbl_merger *m = it->m;
+	size_t n_sources = source_vec_size(m->sources);
+	struct mtbl_iter **iters;
+
+	if (it->spare == NULL)
+		it->spare = entry_vec_init(entry_vec_size(it->entries) + 1);
+	for (size_t i = entry_vec_size(it->entries); i > 0; i--)
+		entry_vec_add(it->spare, entry_vec_value(it->entries, i - 1));
+	entry_vec_clip(it->entries, 0);
+	it->built = false;
+	it->finished = false;
+	it->deferred = false;
+	it->type = ENTRY_TYPE_VALUE;
+	ubuf_clip(it->cur_key, 0);
+	ubuf_clip(it->cur_val, 0);
+	if (it->mvals != NULL) {
+		merger_val_vec_clip(it->mvals, 0);
+		it->next_mval = 0;
+	}
+
+	while (iter_vec_size(it->iters) < n_sources)
+		iter_vec_add(it->iters, NULL);
+	iters = iter_vec_data(it->iters);
+	for (size_t i = 0; i < n_sources; i++) {
+		const struct mtbl_source *s = source_vec_value(m->sources, i);
+
+		/*
+		 * The iterators of sources which do not overlap the new keys
+		 * are kept for later resets, but have no entry.
+		 */
+		if (type == ITER_RESET_PREFIX ?
+		    !source_overlaps_prefix(s, key0, len_key0) :
+		    !source_overlaps_range(s, key0, len_key0, key1, len_key1))
+			continue;
+
+		if (!iter_reset(iters[i], type, key0, len_key0, key1, len_key1)) {
+			mtbl_iter_destroy(&iters[i]);
+			switch (type) {
+			case ITER_RESET_GET:
+				iters[i] = mtbl_source_get_range(s, key0, len_key0, key0, len_key0);
+				break;
+			case ITER_RESET_PREFIX:
+				iters[i] = merger_iter_read_ahead(it,
+					mtbl_source_get_prefix(s, key0, len_key0));
+				break;
+			case ITER_RESET_RANGE:
+				iters[i] = merger_iter_read_ahead(it,
+					mtbl_source_get_range(s, key0, len_key0, key1, len_key1));
+				break;
+			}
+		}
+		if (iters[i] != NULL)
+			merger_iter_add_entry(it, iters[i]);
+	}
+	return (true);
+}
+
+/*
+ * Space on the stack of a lookup for MERGER_LOOKUP_VALS values, and
+ * MERGER_LOOKUP_BYTES bytes of them.
+ */
+#define MERGER_LOOKUP_VALS		16
+#define MERGER_LOOKUP_BYTES		4096
+
+/*
+ * Values found by a lookup. The values are only valid within the lookup
+ * function of the source which found them, so they are copied to buf in the
+ * order of the sources, and the lookup function of the merger is only called
+ * once every source has been looked up.
+ */
+struct merger_lookup {
+	const uint8_t			**vals;
+	size_t				*len_vals;
+	size_t				n_vals;
+	size_t				size_vals;
+	uint8_t				*buf;
+	size_t				len_buf;
+	size_t				size_buf;
+
+	const uint8_t			*stack_vals[MERGER_LOOKUP_VALS];
+	size_t				stack_len_vals[MERGER_LOOKUP_VALS];
+	uint8_t				stack_buf[MERGER_LOOKUP_BYTES];
+};
+
+static void
+merger_lookup_val(void *clos,
+		  const uint8_t *key __attribute__((unused)),
+		  size_t len_key __attribute__((unused)),
+		  const uint8_t *val, size_t len_val)
+{
+	struct merger_lookup *ml = (struct merger_lookup *) clos;
+
+	if (ml->n_vals == ml->size_vals) {
+		ml->size_vals *= 2;
+		if (ml->vals == ml->stack_vals) {
+			ml->vals = my_calloc(ml->size_vals, sizeof(*ml->vals));
+			ml->len_vals = my_calloc(ml->size_vals, sizeof(*ml->len_vals));
+			memcpy(ml->len_vals, ml->stack_len_vals, sizeof(ml->stack_len_vals));
+		} else {
+			ml->vals = my_realloc(ml->vals, ml->size_vals * sizeof(*ml->vals));
+			ml->len_vals = my_realloc(ml->len_vals,
+						  ml->size_vals * sizeof(*ml->len_vals));
+		}
+	}
+	if (ml->size_buf - ml->len_buf < len_val) {
+		size_t size_buf = ml->size_buf;
+
+		while (size_buf - ml->len_buf < len_val)
+			size_buf *= 2;
+		if (ml->buf == ml->stack_buf) {
+			ml->buf = my_malloc(size_buf);
+			memcpy(ml->buf, ml->stack_buf, ml->len_buf);
+		} else {
+			ml->buf = my_realloc(ml->buf, size_buf);
+		}
+		ml->size_buf = size_buf;
+	}
+	memcpy(ml->buf + ml->len_buf, val, len_val);
+	ml->len_buf += len_val;
+	ml->len_vals[ml->n_vals++] = len_val;
+}
+
+/* Look up the key in every source, collecting the values found. */
+static void
+merger_lookup_collect(struct mtbl_merger *m, struct merger_lookup *ml,
+		      const uint8_t *key, size_t len_key)
+{
+	size_t offset = 0;
+
+	ml->vals = ml->stack_vals;
+	ml->len_vals = ml->stack_len_vals;
+	ml->n_vals = 0;
+	ml->size_vals = MERGER_LOOKUP_VALS;
+	ml->buf = ml->stack_buf;
+	ml->len_buf = 0;
+	ml->size_buf = sizeof(ml->stack_buf);
+
+	for (size_t i = 0; i < source_vec_size(m->sources); i++) {
+		const struct mtbl_source *s = source_vec_value(m->sources, i);
+
+		if (source_overlaps_range(s, key, len_key, key, len_key))
+			mtbl_source_lookup(s, key, len_key, merger_lookup_val, ml);
+	}
+	for (size_t i = 0; i < ml->n_vals; i++) {
+		ml->vals[i] = ml->buf + offset;
+		offset += ml->len_vals[i];
+	}
+}
+
+static void
+merger_lookup_clear(struct merger_lookup *ml)
+{
+	if (ml->buf != ml->stack_buf)
+		free(ml->buf);
+	if (ml->vals != ml->stack_vals) {
+		free(ml->vals);
+		free(ml->len_vals);
+	}
+}
+
+/* Without a merge function, each source's values are returned in turn. */
+static mtbl_res
+merger_lookup_all(struct mtbl_merger *m, const uint8_t *key, size_t len_key,
+		  mtbl_lookup_func lookup, void *lookup_clos)
+{
+	struct merger_lookup ml;
+
+	merger_lookup_collect(m, &ml, key, len_key);
+	for (size_t i = 0; i < ml.n_vals; i++)
+		lookup(lookup_clos, key, len_key, ml.vals[i], ml.len_vals[i]);
+	merger_lookup_clear(&ml);
+	return (ml.n_vals > 0 ? mtbl_res_success : mtbl_res_failure);
+}
+
+/* Each source is unique, so it adds at most one value to be merged. */
+static mtbl_res
+merger_lookup_merge(struct mtbl_merger *m, const uint8_t *key, size_t len_key,
+		    mtbl_lookup_func lookup, void *lookup_clos)
+{
+	struct merger_lookup ml;
+	uint8_t *merged_val = NULL;
+	size_t len_merged_val = 0;
+	mtbl_res res = mtbl_res_failure;
+
+	merger_lookup_collect(m, &ml, key, len_key);
+	if (ml.n_vals == 1) {
+		lookup(lookup_clos, key, len_key, ml.vals[0], ml.len_vals[0]);
+		res = mtbl_res_success;
+	} else if (ml.n_vals > 1 && m->opt.merge_values != NULL) {
+		size_t size_merged_val = 0;
+
+		if (m->opt.merge_values(m->opt.merge_clos, key, len_key,
+					ml.n_vals, ml.vals, ml.len_vals, &merged_val,
+					&size_merged_val, &len_merged_val) != mtbl_res_success)
+		{
+			my_free(merged_val);
+		}
+	} else if (ml.n_vals > 1) {
+		const uint8_t *val = ml.vals[0];
+		size_t len_val = ml.len_vals[0];
+
+		for (size_t i = 1; i < ml.n_vals; i++) {
+			uint8_t *tmp = NULL;
+			size_t len_tmp = 0;
+
+			m->opt.merge(m->opt.merge_clos, key, len_key,
+				     val, len_val, ml.vals[i], ml.len_vals[i],
+				     &tmp, &len_tmp);
+			free(merged_val);
+			merged_val = tmp;
+			len_merged_val = len_tmp;
+			if (merged_val == NULL)
+				break;
+			val = merged_val;
+			len_val = len_merged_val;
+		}
+	}
+
+	if (merged_val != NULL) {
+		lookup(lookup_clos, key, len_key, merged_val, len_merged_val);
+		res = mtbl_res_success;
+		free(merged_val);
+	}
+	merger_lookup_clear(&ml);
+	return (res);
+}
+
+static mtbl_res
+merger_lookup(void *clos, const uint8_t *key, size_t len_key,
+	      mtbl_lookup_func lookup, void *lookup_clos)
+{
+	struct mtbl_merger *m = (struct mtbl_merger *) clos;
+
+	/* The dupsort function orders the values, which needs an iterator. */
+	if (m->opt.dupsort != NULL)
+		return (source_lookup_iter(m->source, key, len_key, lookup, lookup_clos));
+
+	if (m->opt.merge == NULL && m->opt.merge_values == NULL)
+		return (merger_lookup_all(m, key, len_key, lookup, lookup_clos));
+
+	/*
+	 * Values can only be merged in place if each source has at most one,
+	 * and none of them is hidden by a tombstone.
+	 */
+	for (size_t i = 0; i < source_vec_size(m->sources); i++) {
+		const struct mtbl_source *s = source_vec_value(m->sources, i);
+
+		if (!source_lookup_unique(s) || source_tombstones(s))
+			return (source_lookup_iter(m->source, key, len_key, lookup, lookup_clos));
+	}
+
+	return (merger_lookup_merge(m, key, len_key, lookup, lookup_clos));
+}
+
 static struct mtbl_iter *
 merger_iter(void *clos)
 {
@@ -389,11 +1397,9 @@ merger_iter(void *clos)
 	struct merger_iter *it = merger_iter_init(m);
 	for (size_t i = 0; i < source_vec_size(m->sources); i++) {
 		const struct mtbl_source *s = source_vec_value(m->sources, i);
-		struct mtbl_iter *s_it = mtbl_source_iter(s);
-		iter_vec_add(it->iters, s_it);
-		merger_iter_add_entry(it, s_it);
+		merger_iter_add_iter(it, mtbl_source_iter(s), true);
 	}
-	return (mtbl_iter_init(merger_iter_seek, merger_iter_next, merger_iter_free, it));
+	return (merger_iter_wrap(it));
 }
 
 static struct mtbl_iter *
@@ -403,17 +1409,15 @@ merger_get(void *clos, const uint8_t *key, size_t len_key)
 	struct merger_iter *it = merger_iter_init(m);
 	for (size_t i = 0; i < source_vec_size(m->sources); i++) {
 		const struct mtbl_source *s = source_vec_value(m->sources, i);
-		struct mtbl_iter *s_it = mtbl_source_get_range(s, key, len_key, key, len_key);
-		if (s_it != NULL) {
-			iter_vec_add(it->iters, s_it);
-			merger_iter_add_entry(it, s_it);
-		}
+		merger_iter_add_iter(it,
+			source_overlaps_range(s, key, len_key, key, len_key) ?
+			mtbl_source_get_range(s, key, len_key, key, len_key) : NULL, false);
 	}
 	if (entry_vec_size(it->entries) == 0) {
 		merger_iter_free(it);
 		return (NULL);
 	}
-	return (mtbl_iter_init(merger_iter_seek, merger_iter_next, merger_iter_free, it));
+	return (merger_iter_wrap(it));
 }
 
 static struct mtbl_iter *
@@ -425,17 +1429,15 @@ merger_get_range(void *clos,
 	struct merger_iter *it = merger_iter_init(m);
 	for (size_t i = 0; i < source_vec_size(m->sources); i++) {
 		const struct mtbl_source *s = source_vec_value(m->sources, i);
-		struct mtbl_iter *s_it = mtbl_source_get_range(s, key0, len_key0, key1, len_key1);
-		if (s_it != NULL) {
-			iter_vec_add(it->iters, s_it);
-			merger_iter_add_entry(it, s_it);
-		}
+		merger_iter_add_iter(it,
+			source_overlaps_range(s, key0, len_key0, key1, len_key1) ?
+			mtbl_source_get_range(s, key0, len_key0, key1, len_key1) : NULL, true);
 	}
 	if (entry_vec_size(it->entries) == 0) {
 		merger_iter_free(it);
 		return (NULL);
 	}
-	return (mtbl_iter_init(merger_iter_seek, merger_iter_next, merger_iter_free, it));
+	return (merger_iter_wrap(it));
 }
 
 static struct mtbl_iter *
@@ -446,15 +1448,13 @@ merger_get_prefix(void *clos,
 	struct merger_iter *it = merger_iter_init(m);
 	for (size_t i = 0; i < source_vec_size(m->sources); i++) {
 		const struct mtbl_source *s = source_vec_value(m->sources, i);
-		struct mtbl_iter *s_it = mtbl_source_get_prefix(s, key, len_key);
-		if (s_it != NULL) {
-			iter_vec_add(it->iters, s_it);
-			merger_iter_add_entry(it, s_it);
-		}
+		merger_iter_add_iter(it,
+			source_overlaps_prefix(s, key, len_key) ?
+			mtbl_source_get_prefix(s, key, len_key) : NULL, true);
 	}
 	if (entry_vec_size(it->entries) == 0) {
 		merger_iter_free(it);
 		return (NULL);
 	}
-	return (mtbl_iter_init(merger_iter_seek, merger_iter_next, merger_iter_free, it));
+	return (merger_iter_wrap(it));
 }
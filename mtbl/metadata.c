@@ -32,10 +32,35 @@ metadata_write(const struct mtbl_metadata *m, uint8_t *buf)
 	p += mtbl_fixed_encode64(p, m->bytes_keys);
 	p += mtbl_fixed_encode64(p, m->bytes_values);
 
+	/*
+	 * Record the first and last keys if they fit in the remaining space.
+	 * If both do not fit, a key is only recorded if it fits in half of it.
+	 */
+	bool first = m->has_first_key && m->len_first_key <= MTBL_METADATA_KEY_SIZE;
+	bool last = m->has_last_key && m->len_last_key <= MTBL_METADATA_KEY_SIZE;
+	size_t len_first = first ? m->len_first_key : 0;
+	size_t len_last = last ? m->len_last_key : 0;
+	if (len_first + len_last > MTBL_METADATA_KEY_SIZE) {
+		first = len_first <= MTBL_METADATA_KEY_SIZE / 2;
+		last = len_last <= MTBL_METADATA_KEY_SIZE / 2;
+		len_first = first ? len_first : 0;
+		len_last = last ? len_last : 0;
+	}
+	p += mtbl_fixed_encode64(p, (first ? MTBL_METADATA_HAS_FIRST_KEY : 0) |
+				    (last ? MTBL_METADATA_HAS_LAST_KEY : 0));
+	p += mtbl_fixed_encode32(p, len_first);
+	p += mtbl_fixed_encode32(p, len_last);
+	memcpy(p, m->first_key, len_first);
+	p += len_first;
+	memcpy(p, m->last_key, len_last);
+	p += len_last;
+
 	padding = MTBL_METADATA_SIZE - (p - buf) - sizeof(uint32_t);
 	while (padding-- != 0)
 		*(p++) = '\0';
-	mtbl_fixed_encode32(buf + MTBL_METADATA_SIZE - sizeof(uint32_t), MTBL_MAGIC);
+	/* Files with tombstones have their own magic, so that older readers reject them. */
+	mtbl_fixed_encode32(buf + MTBL_METADATA_SIZE - sizeof(uint32_t),
+			    m->has_tombstones ? MTBL_MAGIC_TOMBSTONES : MTBL_MAGIC);
 }
 
 bool
@@ -45,12 +70,17 @@ metadata_read(const uint8_t *buf, struct mtbl_metadata *m)
 	const uint8_t *p = buf;
 
 	magic = mtbl_fixed_decode32(buf + MTBL_METADATA_SIZE - sizeof(uint32_t));
-	if (magic == MTBL_MAGIC_V1)
+	m->has_tombstones = false;
+	if (magic == MTBL_MAGIC_V1) {
 		m->file_version = MTBL_FORMAT_V1;
-	else if (magic == MTBL_MAGIC)
+	} else if (magic == MTBL_MAGIC) {
+		m->file_version = MTBL_FORMAT_V2;
+	} else if (magic == MTBL_MAGIC_TOMBSTONES) {
 		m->file_version = MTBL_FORMAT_V2;
-	else
+		m->has_tombstones = true;
+	} else {
 		return (false);
+	}
 
 	m->index_block_offset = mtbl_fixed_decode64(p); p += 8;
 	m->data_block_size = mtbl_fixed_decode64(p); p += 8;
@@ -60,12 +90,51 @@ metadata_read(const uint8_t *buf, struct mtbl_metadata *m)
 	m->bytes_data_blocks = mtbl_fixed_decode64(p); p += 8;
 	m->bytes_index_block = mtbl_fixed_decode64(p); p += 8;
 	m->bytes_keys = mtbl_fixed_decode64(p); p += 8;
-	m->bytes_values = mtbl_fixed_decode64(p);
+	m->bytes_values = mtbl_fixed_decode64(p); p += 8;
+
+	/*
+	 * Older files are zero-padded after the above fields, and so have no
+	 * first or last key.
+	 */
+	uint64_t flags = mtbl_fixed_decode64(p); p += 8;
+	size_t len_first = mtbl_fixed_decode32(p); p += 4;
+	size_t len_last = mtbl_fixed_decode32(p); p += 4;
+	m->has_first_key = false;
+	m->has_last_key = false;
+	if (m->file_version == MTBL_FORMAT_V2 &&
+	    len_first + len_last <= MTBL_METADATA_KEY_SIZE)
+	{
+		if ((flags & MTBL_METADATA_HAS_FIRST_KEY) != 0)
+			metadata_set_first_key(m, p, len_first);
+		p += len_first;
+		if ((flags & MTBL_METADATA_HAS_LAST_KEY) != 0)
+			metadata_set_last_key(m, p, len_last);
+	}
 
 	return (true);
 
 }
 
+void
+metadata_set_first_key(struct mtbl_metadata *m, const uint8_t *key, size_t len_key)
+{
+	m->has_first_key = len_key <= sizeof(m->first_key);
+	if (m->has_first_key) {
+		memcpy(m->first_key, key, len_key);
+		m->len_first_key = len_key;
+	}
+}
+
+void
+metadata_set_last_key(struct mtbl_metadata *m, const uint8_t *key, size_t len_key)
+{
+	m->has_last_key = len_key <= sizeof(m->last_key);
+	if (m->has_last_key) {
+		memcpy(m->last_key, key, len_key);
+		m->len_last_key = len_key;
+	}
+}
+
 mtbl_file_version
 mtbl_metadata_file_version(const struct mtbl_metadata *m)
 {
@@ -125,3 +194,31 @@ mtbl_metadata_bytes_values(const struct mtbl_metadata *m)
 {
 	return m->bytes_values;
 }
+
+bool
+mtbl_metadata_has_tombstones(const struct mtbl_metadata *m)
+{
+	return m->has_tombstones;
+}
+
+mtbl_res
+mtbl_metadata_first_key(const struct mtbl_metadata *m,
+			const uint8_t **key, size_t *len_key)
+{
+	if (!m->has_first_key)
+		return (mtbl_res_failure);
+	*key = m->first_key;
+	*len_key = m->len_first_key;
+	return (mtbl_res_success);
+}
+
+mtbl_res
+mtbl_metadata_last_key(const struct mtbl_metadata *m,
+		       const uint8_t **key, size_t *len_key)
+{
+	if (!m->has_last_key)
+		return (mtbl_res_failure);
+	*key = m->last_key;
+	*len_key = m->len_last_key;
+	return (mtbl_res_success);
+}
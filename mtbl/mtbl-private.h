@@ -42,8 +42,17 @@
 
 #define MTBL_MAGIC_V1			0x77846676
 #define MTBL_MAGIC			0x4D54424C
+#define MTBL_MAGIC_TOMBSTONES		0x4D54424D
 #define MTBL_METADATA_SIZE		512
 
+/*
+ * Space for the first and last keys in the metadata trailer, after the ten
+ * 64-bit fields, the two 32-bit key lengths, and the 32-bit magic.
+ */
+#define MTBL_METADATA_KEY_SIZE		(MTBL_METADATA_SIZE - 10 * 8 - 3 * 4)
+#define MTBL_METADATA_HAS_FIRST_KEY	(1 << 0)
+#define MTBL_METADATA_HAS_LAST_KEY	(1 << 1)
+
 #define DEFAULT_COMPRESSION_TYPE	MTBL_COMPRESSION_ZLIB
 #define DEFAULT_COMPRESSION_LEVEL	(-10000)
 #define DEFAULT_BLOCK_RESTART_INTERVAL	16
@@ -54,15 +63,37 @@
 #define DEFAULT_SORTER_MEMORY		1073741824
 #define MIN_SORTER_MEMORY		10485760
 #define INITIAL_SORTER_VEC_SIZE		131072
+#define INITIAL_SORTER_COMBINER_SIZE	65536
 
 #define DEFAULT_FILESET_RELOAD_INTERVAL	60
 
+#define DEFAULT_COMPACT_TIER_FILES	4
+#define DEFAULT_COMPACT_TIER_RATIO	4
+#define DEFAULT_COMPACT_TIER_SIZE	1048576
+#define COMPACT_THROTTLE_INTERVAL	1024
+
+#define READAHEAD_BATCH_SIZE		65536
+#define WRITER_BATCH_SIZE		65536
+#define WRITER_BATCHES			3
+
 /* types */
 
 struct block;
 struct block_builder;
 struct block_iter;
 
+/*
+ * The type of an entry. A tombstone hides the values of its key in older
+ * sources, and has no value of its own. A replacing value also hides the
+ * values of its key in older sources. In files which may hold tombstones,
+ * each stored value is preceded by one byte holding the entry type.
+ */
+typedef enum {
+	ENTRY_TYPE_VALUE = 0,
+	ENTRY_TYPE_TOMBSTONE = 1,
+	ENTRY_TYPE_REPLACE = 2,
+} entry_type;
+
 /* block */
 
 struct block *block_init(uint8_t *data, size_t size, bool needs_free);
@@ -79,6 +110,12 @@ void block_iter_prev(struct block_iter *);
 bool block_iter_get(struct block_iter *,
 	const uint8_t **key, size_t *key_len,
 	const uint8_t **val, size_t *val_len);
+bool block_lookup(const struct block *,
+	const uint8_t *key, size_t key_len, bool *exact,
+	const uint8_t **val, size_t *val_len);
+bool block_data_lookup(uint8_t *data, size_t size,
+	const uint8_t *key, size_t key_len, bool *exact,
+	const uint8_t **val, size_t *val_len);
 
 /* block builder */
 
@@ -119,10 +156,259 @@ struct mtbl_metadata {
 	uint64_t	bytes_index_block;
 	uint64_t	bytes_keys;
 	uint64_t	bytes_values;
+
+	/* Values are preceded by their entry type. */
+	bool		has_tombstones;
+
+	/* Keys too large for the metadata trailer are not recorded. */
+	bool		has_first_key;
+	bool		has_last_key;
+	size_t		len_first_key;
+	size_t		len_last_key;
+	uint8_t		first_key[MTBL_METADATA_KEY_SIZE];
+	uint8_t		last_key[MTBL_METADATA_KEY_SIZE];
 };
 
 void metadata_write(const struct mtbl_metadata *, uint8_t *buf);
 bool metadata_read(const uint8_t *buf, struct mtbl_metadata *);
+void metadata_set_first_key(struct mtbl_metadata *, const uint8_t *, size_t);
+void metadata_set_last_key(struct mtbl_metadata *, const uint8_t *, size_t);
+
+/* iter */
+
+/*
+ * A compressed data block of an MTBL file, which can be copied verbatim into
+ * another MTBL file using the same compression algorithm and block size.
+ */
+struct raw_block {
+	const struct mtbl_metadata	*m;		/* of the file holding the block */
+	const uint8_t			*data;		/* compressed block contents */
+	size_t				len_data;
+	uint32_t			crc;		/* little-endian, as stored */
+	struct block			*b;		/* decoded block contents */
+	const uint8_t			*first_key;
+	size_t				len_first_key;
+	const uint8_t			*bound;		/* >= every key in the block */
+	size_t				len_bound;
+};
+
+/*
+ * If the entry last returned by the iterator is the first entry of a data
+ * block which lies entirely within the iteration, describe the block. After
+ * the block is copied, skipping it makes the next call to mtbl_iter_next()
+ * return the entry following the block.
+ */
+typedef bool (*iter_raw_block_func)(void *clos, struct raw_block *);
+typedef void (*iter_skip_block_func)(void *clos);
+
+void iter_set_raw_block_funcs(struct mtbl_iter *,
+	iter_raw_block_func, iter_skip_block_func);
+bool iter_raw_block(struct mtbl_iter *, struct raw_block *);
+void iter_skip_block(struct mtbl_iter *);
+
+/* The type of the entry last returned by the iterator. */
+typedef entry_type (*iter_entry_type_func)(void *clos);
+
+void iter_set_entry_type_func(struct mtbl_iter *, iter_entry_type_func);
+entry_type iter_entry_type(struct mtbl_iter *);
+
+/*
+ * Return up to n entries, as mtbl_iter_next_batch() does, for iterators which
+ * can do so faster than one entry at a time.
+ */
+typedef size_t (*iter_next_batch_func)(void *clos, struct mtbl_entry *, size_t n);
+
+void iter_set_next_batch_func(struct mtbl_iter *, iter_next_batch_func);
+
+/*
+ * Re-aim the iterator at the entries a get, get_prefix or get_range of its
+ * source would return, keeping what it has allocated. Returns false if the
+ * iterator cannot be reset, in which case it can only be destroyed.
+ */
+typedef enum {
+	ITER_RESET_GET,
+	ITER_RESET_PREFIX,
+	ITER_RESET_RANGE,
+} iter_reset_type;
+
+typedef bool (*iter_reset_func)(void *clos, iter_reset_type,
+	const uint8_t *key0, size_t len_key0,
+	const uint8_t *key1, size_t len_key1);
+
+void iter_set_reset_func(struct mtbl_iter *, iter_reset_func);
+bool iter_reset(struct mtbl_iter *, iter_reset_type,
+	const uint8_t *key0, size_t len_key0,
+	const uint8_t *key1, size_t len_key1);
+
+/* readahead */
+
+struct readahead;
+struct threadpool;
+
+struct readahead *readahead_init(struct threadpool *);
+void readahead_destroy(struct readahead **);
+struct mtbl_iter *readahead_iter(struct readahead *, struct mtbl_iter *);
+
+/* level */
+
+struct level;
+
+struct level *level_init(void);
+void level_destroy(struct level **);
+void level_add_source(struct level *, const struct mtbl_source *);
+size_t level_size(const struct level *);
+const struct mtbl_source *level_source(struct level *);
+
+/* merger */
+
+/*
+ * How a merger treats tombstones and replacing values. In each mode, they
+ * hide the values of their key from the sources added before theirs. By
+ * default, they are then dropped, and the remaining values are returned as
+ * plain values. With MERGER_TOMBSTONES_KEEP, they are returned, so that the
+ * output can hide values from sources outside of the merge.
+ * MERGER_TOMBSTONES_DOMINATE is like MERGER_TOMBSTONES_KEEP, except that a
+ * tombstone hides the values of its key from every source.
+ */
+typedef enum {
+	MERGER_TOMBSTONES_DROP,
+	MERGER_TOMBSTONES_KEEP,
+	MERGER_TOMBSTONES_DOMINATE,
+} merger_tombstones;
+
+void merger_set_tombstones(struct mtbl_merger *, merger_tombstones);
+
+/* Call free_func(clos) when the merger is destroyed, after its sources are dropped. */
+void merger_set_free_func(struct mtbl_merger *, void (*free_func)(void *), void *clos);
+
+/* reader */
+
+/* Read the index block of a reader into memory. */
+void reader_prefetch_index(struct mtbl_reader *);
+
+/* source */
+
+/*
+ * Bounds on the keys provided by a source. A missing bound means that
+ * nothing is known about the keys on that side.
+ */
+struct key_range {
+	bool		has_first;
+	bool		has_last;
+	const uint8_t	*first;
+	const uint8_t	*last;
+	size_t		len_first;
+	size_t		len_last;
+};
+
+typedef void (*source_key_range_func)(void *clos, struct key_range *);
+
+void source_set_key_range_func(struct mtbl_source *, source_key_range_func);
+void source_key_range(const struct mtbl_source *, struct key_range *);
+
+/* Whether the iterators of a source may return tombstones or replacing values. */
+void source_set_tombstones(struct mtbl_source *, bool);
+bool source_tombstones(const struct mtbl_source *);
+
+/*
+ * Look up a key without creating any iterators, calling the lookup function
+ * for each entry that mtbl_source_get() would return. A source is 'unique'
+ * if it returns at most one entry for any key.
+ */
+typedef mtbl_res (*source_lookup_func)(void *clos,
+	const uint8_t *key, size_t len_key,
+	mtbl_lookup_func, void *lookup_clos);
+
+void source_set_lookup_func(struct mtbl_source *, source_lookup_func, bool unique);
+bool source_lookup_unique(const struct mtbl_source *);
+mtbl_res source_lookup_iter(const struct mtbl_source *,
+	const uint8_t *key, size_t len_key,
+	mtbl_lookup_func, void *lookup_clos);
+
+/* writer */
+
+/* Add an entry of any type. */
+mtbl_res writer_add(struct mtbl_writer *,
+	const uint8_t *key, size_t len_key,
+	const uint8_t *val, size_t len_val,
+	entry_type);
+
+/* Copy writer options, or return the default options if NULL. */
+struct mtbl_writer_options *writer_options_dup(const struct mtbl_writer_options *);
+
+/* varint */
+
+#if __GNUC__ >= 3 && defined(__x86_64__)
+/* Set at load time if the CPU has a fast BMI2 pext instruction. */
+extern bool varint_use_bmi2;
+
+size_t varint_decode32_n_bmi2(const uint8_t *, size_t, uint32_t *, size_t);
+size_t varint_decode64_n_bmi2(const uint8_t *, size_t, uint64_t *, size_t);
+#endif
+
+/*
+ * Decode a varint of at most max_len bytes from the len_data bytes at data.
+ * Returns the number of bytes read, or 0 if the varint is longer.
+ */
+static inline size_t
+varint_decode_bounded(const uint8_t *data, size_t len_data, uint64_t *value, size_t max_len)
+{
+	uint64_t val = 0;
+
+	for (size_t len = 0; len < max_len && len < len_data; len++) {
+		val |= (uint64_t)(data[len] & 0x7f) << (7 * len);
+		if ((data[len] & 0x80) == 0) {
+			*value = val;
+			return (len + 1);
+		}
+	}
+	return (0);
+}
+
+/*
+ * Like mtbl_varint_decode32_n() and mtbl_varint_decode64_n(). The few varints
+ * of entry headers and index values are decoded inline, and only the BMI2
+ * kernel is called out of line.
+ */
+static inline size_t
+varint_decode32_n(const uint8_t *data, size_t len_data, uint32_t *values, size_t n)
+{
+	size_t pos = 0;
+
+#if __GNUC__ >= 3 && defined(__x86_64__)
+	if (varint_use_bmi2)
+		return (varint_decode32_n_bmi2(data, len_data, values, n));
+#endif
+	for (size_t i = 0; i < n; i++) {
+		uint64_t val;
+		size_t len = varint_decode_bounded(data + pos, len_data - pos, &val, 5);
+
+		if (len == 0)
+			return (0);
+		values[i] = (uint32_t) val;
+		pos += len;
+	}
+	return (pos);
+}
+
+static inline size_t
+varint_decode64_n(const uint8_t *data, size_t len_data, uint64_t *values, size_t n)
+{
+	size_t pos = 0;
+
+#if __GNUC__ >= 3 && defined(__x86_64__)
+	if (varint_use_bmi2)
+		return (varint_decode64_n_bmi2(data, len_data, values, n));
+#endif
+	for (size_t i = 0; i < n; i++) {
+		size_t len = varint_decode_bounded(data + pos, len_data - pos, &values[i], 10);
+
+		if (len == 0)
+			return (0);
+		pos += len;
+	}
+	return (pos);
+}
 
 /* misc */
 
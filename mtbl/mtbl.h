@@ -92,7 +92,9 @@ struct mtbl_merger;
 struct mtbl_merger_options;
 struct mtbl_fileset;
 struct mtbl_fileset_options;
+struct mtbl_compact_options;
 struct mtbl_sorter;
+struct mtbl_sorter_handle;
 struct mtbl_sorter_options;
 
 typedef void
@@ -102,6 +104,14 @@ typedef void
 	const uint8_t *val1, size_t len_val1,
 	uint8_t **merged_val, size_t *len_merged_val);
 
+typedef mtbl_res
+(*mtbl_merge_values_func)(void *clos,
+	const uint8_t *key, size_t len_key,
+	size_t n_vals,
+	const uint8_t * const *vals, const size_t *len_vals,
+	uint8_t **merged_val, size_t *size_merged_val,
+	size_t *len_merged_val);
+
 typedef int
 (*mtbl_dupsort_func)(void *clos,
 	const uint8_t *key, size_t len_key,
@@ -160,6 +170,12 @@ mtbl_iter_seek(
 	const uint8_t *key, size_t len_key)
 __attribute__((warn_unused_result));
 
+mtbl_res
+mtbl_iter_seek_next_prefix(
+	struct mtbl_iter *,
+	size_t prefix_len)
+__attribute__((warn_unused_result));
+
 mtbl_res
 mtbl_iter_next(
 	struct mtbl_iter *,
@@ -167,6 +183,41 @@ mtbl_iter_next(
 	const uint8_t **val, size_t *len_val)
 __attribute__((warn_unused_result));
 
+bool
+mtbl_iter_is_tombstone(struct mtbl_iter *);
+
+struct mtbl_entry {
+	const uint8_t	*key;
+	size_t		len_key;
+	const uint8_t	*val;
+	size_t		len_val;
+};
+
+size_t
+mtbl_iter_next_batch(
+	struct mtbl_iter *,
+	struct mtbl_entry *entries, size_t n)
+__attribute__((warn_unused_result));
+
+mtbl_res
+mtbl_iter_reset_get(
+	struct mtbl_iter *,
+	const uint8_t *key, size_t len_key)
+__attribute__((warn_unused_result));
+
+mtbl_res
+mtbl_iter_reset_prefix(
+	struct mtbl_iter *,
+	const uint8_t *key, size_t len_key)
+__attribute__((warn_unused_result));
+
+mtbl_res
+mtbl_iter_reset_range(
+	struct mtbl_iter *,
+	const uint8_t *key0, size_t len_key0,
+	const uint8_t *key1, size_t len_key1)
+__attribute__((warn_unused_result));
+
 /* source */
 
 typedef struct mtbl_iter *
@@ -186,6 +237,12 @@ typedef struct mtbl_iter *
 
 typedef void (*mtbl_source_free_func)(void *);
 
+typedef void
+(*mtbl_lookup_func)(
+	void *clos,
+	const uint8_t *key, size_t len_key,
+	const uint8_t *val, size_t len_val);
+
 struct mtbl_source *
 mtbl_source_init(
 	mtbl_source_iter_func,
@@ -213,6 +270,12 @@ mtbl_source_get_range(
 	const uint8_t *key0, size_t len_key0,
 	const uint8_t *key1, size_t len_key1);
 
+mtbl_res
+mtbl_source_lookup(
+	const struct mtbl_source *,
+	const uint8_t *key, size_t len_key,
+	mtbl_lookup_func, void *clos);
+
 mtbl_res
 mtbl_source_write(const struct mtbl_source *, struct mtbl_writer *)
 __attribute__((warn_unused_result));
@@ -235,6 +298,19 @@ mtbl_writer_add(
 	const uint8_t *val, size_t len_val)
 __attribute__((warn_unused_result));
 
+mtbl_res
+mtbl_writer_add_tombstone(
+	struct mtbl_writer *,
+	const uint8_t *key, size_t len_key)
+__attribute__((warn_unused_result));
+
+mtbl_res
+mtbl_writer_add_iter_block(
+	struct mtbl_writer *,
+	struct mtbl_iter *,
+	uint64_t *count_entries)
+__attribute__((warn_unused_result));
+
 /* writer options */
 
 struct mtbl_writer_options *
@@ -268,6 +344,16 @@ mtbl_writer_options_set_threadpool(
 	struct mtbl_writer_options *,
 	struct mtbl_threadpool *);
 
+void
+mtbl_writer_options_set_pipeline(
+	struct mtbl_writer_options *,
+	bool);
+
+void
+mtbl_writer_options_set_tombstones(
+	struct mtbl_writer_options *,
+	bool);
+
 /* reader */
 
 struct mtbl_reader *
@@ -285,6 +371,9 @@ mtbl_reader_source(struct mtbl_reader *);
 const struct mtbl_metadata *
 mtbl_reader_metadata(struct mtbl_reader *);
 
+struct mtbl_iter *
+mtbl_reader_index_iter(struct mtbl_reader *);
+
 /* reader options */
 
 struct mtbl_reader_options *
@@ -336,6 +425,17 @@ mtbl_metadata_bytes_keys(const struct mtbl_metadata *);
 uint64_t
 mtbl_metadata_bytes_values(const struct mtbl_metadata *);
 
+mtbl_res
+mtbl_metadata_first_key(const struct mtbl_metadata *,
+	const uint8_t **key, size_t *len_key);
+
+mtbl_res
+mtbl_metadata_last_key(const struct mtbl_metadata *,
+	const uint8_t **key, size_t *len_key);
+
+bool
+mtbl_metadata_has_tombstones(const struct mtbl_metadata *);
+
 /* merger */
 
 struct mtbl_merger *
@@ -364,12 +464,23 @@ mtbl_merger_options_set_merge_func(
 	mtbl_merge_func,
 	void *clos);
 
+void
+mtbl_merger_options_set_merge_values_func(
+	struct mtbl_merger_options *,
+	mtbl_merge_values_func,
+	void *clos);
+
 void
 mtbl_merger_options_set_dupsort_func(
 	struct mtbl_merger_options *,
 	mtbl_dupsort_func,
 	void *clos);
 
+void
+mtbl_merger_options_set_threadpool(
+	struct mtbl_merger_options *,
+	struct mtbl_threadpool *);
+
 /* fileset */
 
 struct mtbl_fileset *
@@ -412,6 +523,12 @@ mtbl_fileset_options_set_merge_func(
 	mtbl_merge_func,
 	void *clos);
 
+void
+mtbl_fileset_options_set_merge_values_func(
+	struct mtbl_fileset_options *,
+	mtbl_merge_values_func,
+	void *clos);
+
 void
 mtbl_fileset_options_set_dupsort_func(
 	struct mtbl_fileset_options *,
@@ -436,8 +553,94 @@ mtbl_fileset_options_set_reload_interval(
 	struct mtbl_fileset_options *,
 	uint32_t reload_interval);
 
+void
+mtbl_fileset_options_set_threadpool(
+	struct mtbl_fileset_options *,
+	struct mtbl_threadpool *);
+
+void
+mtbl_fileset_options_set_prefetch_index(
+	struct mtbl_fileset_options *,
+	bool prefetch_index);
+
+void
+mtbl_fileset_options_set_watch(
+	struct mtbl_fileset_options *,
+	bool watch);
+
+void
+mtbl_fileset_options_set_max_open_readers(
+	struct mtbl_fileset_options *,
+	size_t max_open_readers);
+
+/* compact */
+
+mtbl_res
+mtbl_compact(const char *setfile, const struct mtbl_compact_options *,
+	size_t *n_merged);
+
+/* compact options */
+
+struct mtbl_compact_options *
+mtbl_compact_options_init(void);
+
+void
+mtbl_compact_options_destroy(struct mtbl_compact_options **);
+
+void
+mtbl_compact_options_set_merge_func(
+	struct mtbl_compact_options *,
+	mtbl_merge_func,
+	void *clos);
+
+void
+mtbl_compact_options_set_merge_values_func(
+	struct mtbl_compact_options *,
+	mtbl_merge_values_func,
+	void *clos);
+
+void
+mtbl_compact_options_set_writer_options(
+	struct mtbl_compact_options *,
+	const struct mtbl_writer_options *);
+
+void
+mtbl_compact_options_set_tier_files(
+	struct mtbl_compact_options *,
+	size_t tier_files);
+
+void
+mtbl_compact_options_set_tier_ratio(
+	struct mtbl_compact_options *,
+	size_t tier_ratio);
+
+void
+mtbl_compact_options_set_tier_size(
+	struct mtbl_compact_options *,
+	uint64_t tier_size);
+
+void
+mtbl_compact_options_set_rate_limit(
+	struct mtbl_compact_options *,
+	uint64_t bytes_per_second);
+
+void
+mtbl_compact_options_set_keep_inputs(
+	struct mtbl_compact_options *,
+	bool);
+
 /* sorter */
 
+typedef enum {
+	MTBL_SORTER_TEMP_DIR_ROUND_ROBIN = 0,
+	MTBL_SORTER_TEMP_DIR_FREE_SPACE = 1,
+} mtbl_sorter_temp_dir_policy;
+
+typedef enum {
+	MTBL_SORTER_RUN_QUICKSORT = 0,
+	MTBL_SORTER_RUN_REPLACEMENT_SELECTION = 1,
+} mtbl_sorter_run_mode;
+
 struct mtbl_sorter *
 mtbl_sorter_init(const struct mtbl_sorter_options *);
 
@@ -450,6 +653,11 @@ mtbl_sorter_add(struct mtbl_sorter *,
 	const uint8_t *val, size_t len_val)
 __attribute__((warn_unused_result));
 
+mtbl_res
+mtbl_sorter_add_tombstone(struct mtbl_sorter *,
+	const uint8_t *key, size_t len_key)
+__attribute__((warn_unused_result));
+
 mtbl_res
 mtbl_sorter_write(struct mtbl_sorter *, struct mtbl_writer *)
 __attribute__((warn_unused_result));
@@ -457,6 +665,36 @@ __attribute__((warn_unused_result));
 struct mtbl_iter *
 mtbl_sorter_iter(struct mtbl_sorter *s);
 
+size_t
+mtbl_sorter_count_temp_dirs(const struct mtbl_sorter *);
+
+mtbl_res
+mtbl_sorter_temp_dir_usage(
+	const struct mtbl_sorter *,
+	size_t idx,
+	const char **temp_dir,
+	uint64_t *count_files,
+	uint64_t *bytes_files);
+
+/* sorter handle */
+
+struct mtbl_sorter_handle *
+mtbl_sorter_handle_init(struct mtbl_sorter *);
+
+void
+mtbl_sorter_handle_destroy(struct mtbl_sorter_handle **);
+
+mtbl_res
+mtbl_sorter_handle_add(struct mtbl_sorter_handle *,
+	const uint8_t *key, size_t len_key,
+	const uint8_t *val, size_t len_val)
+__attribute__((warn_unused_result));
+
+mtbl_res
+mtbl_sorter_handle_add_tombstone(struct mtbl_sorter_handle *,
+	const uint8_t *key, size_t len_key)
+__attribute__((warn_unused_result));
+
 /* sorter options */
 
 struct mtbl_sorter_options *
@@ -471,11 +709,32 @@ mtbl_sorter_options_set_merge_func(
 	mtbl_merge_func merge_fp,
 	void *clos);
 
+void
+mtbl_sorter_options_set_merge_values_func(
+	struct mtbl_sorter_options *,
+	mtbl_merge_values_func merge_values_fp,
+	void *clos);
+
 void
 mtbl_sorter_options_set_temp_dir(
 	struct mtbl_sorter_options *,
 	const char *);
 
+void
+mtbl_sorter_options_add_temp_dir(
+	struct mtbl_sorter_options *,
+	const char *);
+
+void
+mtbl_sorter_options_set_temp_dir_policy(
+	struct mtbl_sorter_options *,
+	mtbl_sorter_temp_dir_policy);
+
+void
+mtbl_sorter_options_set_run_mode(
+	struct mtbl_sorter_options *,
+	mtbl_sorter_run_mode);
+
 void
 mtbl_sorter_options_set_max_memory(
 	struct mtbl_sorter_options *,
@@ -486,6 +745,11 @@ mtbl_sorter_options_set_threadpool(
 	struct mtbl_sorter_options *,
 	struct mtbl_threadpool *);
 
+void
+mtbl_sorter_options_set_combine(
+	struct mtbl_sorter_options *,
+	bool);
+
 /* crc32c */
 
 uint32_t
@@ -525,6 +789,12 @@ mtbl_varint_decode32(const uint8_t *ptr, uint32_t *value);
 size_t
 mtbl_varint_decode64(const uint8_t *ptr, uint64_t *value);
 
+size_t
+mtbl_varint_decode32_n(const uint8_t *ptr, size_t len_ptr, uint32_t *values, size_t n);
+
+size_t
+mtbl_varint_decode64_n(const uint8_t *ptr, size_t len_ptr, uint64_t *values, size_t n);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2024 DomainTools LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+
+#include "mtbl-private.h"
+#include "threadpool.h"
+
+#include "libmy/my_queue.h"
+#include "libmy/ubuf.h"
+
+/*
+ * A read-ahead iterator reads batches of entries from another iterator on a
+ * threadpool worker, so that block decompression for the next batch overlaps
+ * with the consumption of the current one. The underlying iterator is only
+ * used by one job at a time: the job for the next batch is dispatched when
+ * the consumer takes the previous batch. Finished batches are handed from
+ * the result handler thread to the consumer through a single-producer,
+ * single-consumer queue. One struct readahead, and so one result handler
+ * thread, is shared by all the read-ahead iterators of a merger, each with
+ * its own queue; waiting consumers are woken together and check their own.
+ */
+
+struct readahead {
+	struct threadpool		*pool;
+	struct result_handler		*rhandler;
+	pthread_mutex_t			m;
+	pthread_cond_t			c;
+};
+
+struct readahead_batch {
+	struct readahead_iter		*ra_it;
+	ubuf				*buf;	/* varint key length, value length and type, key, value */
+	size_t				pos;
+	bool				eof;
+};
+
+struct readahead_iter {
+	struct readahead		*ra;
+	struct mtbl_iter		*it;
+	struct my_queue			*q;
+	struct readahead_batch		*batches[2];
+	struct readahead_batch		*cur;
+	bool				pending;
+	entry_type			type;	/* of the entry last returned */
+};
+
+static void
+readahead_done(void *res, void *cbdata)
+{
+	struct readahead_batch *b = (struct readahead_batch *) res;
+	struct readahead *ra = (struct readahead *) cbdata;
+	bool ok;
+
+	ok = my_queue_insert(b->ra_it->q, &b, NULL);
+	assert(ok);
+	pthread_mutex_lock(&ra->m);
+	pthread_cond_broadcast(&ra->c);
+	pthread_mutex_unlock(&ra->m);
+}
+
+struct readahead *
+readahead_init(struct threadpool *pool)
+{
+	struct readahead *ra = my_calloc(1, sizeof(*ra));
+
+	ra->pool = pool;
+	ra->rhandler = result_handler_init(readahead_done, ra);
+	pthread_mutex_init(&ra->m, NULL);
+	pthread_cond_init(&ra->c, NULL);
+	return (ra);
+}
+
+void
+readahead_destroy(struct readahead **ra)
+{
+	if (*ra) {
+		result_handler_destroy(&(*ra)->rhandler);
+		pthread_mutex_destroy(&(*ra)->m);
+		pthread_cond_destroy(&(*ra)->c);
+		my_free(*ra);
+	}
+}
+
+/* Runs on a threadpool worker. */
+static void *
+readahead_fill(void *arg)
+{
+	struct readahead_batch *b = (struct readahead_batch *) arg;
+	const uint8_t *key, *val;
+	size_t len_key, len_val;
+
+	ubuf_clip(b->buf, 0);
+	b->pos = 0;
+	b->eof = false;
+	while (ubuf_size(b->buf) < READAHEAD_BATCH_SIZE) {
+		if (mtbl_iter_next(b->ra_it->it, &key, &len_key, &val, &len_val) != mtbl_res_success) {
+			b->eof = true;
+			break;
+		}
+		ubuf_reserve(b->buf, 2 * 10 + len_key + len_val);
+		ubuf_advance(b->buf, mtbl_varint_encode64(ubuf_ptr(b->buf), len_key));
+		ubuf_advance(b->buf, mtbl_varint_encode64(ubuf_ptr(b->buf),
+			(len_val << 2) | iter_entry_type(b->ra_it->it)));
+		ubuf_append(b->buf, key, len_key);
+		if (len_val > 0)
+			ubuf_append(b->buf, val, len_val);
+	}
+	return (b);
+}
+
+static void
+readahead_dispatch(struct readahead_iter *ra_it)
+{
+	struct readahead_batch *b;
+
+	assert(!ra_it->pending);
+	b = ra_it->batches[0] != ra_it->cur ? ra_it->batches[0] : ra_it->batches[1];
+	ra_it->pending = true;
+	threadpool_dispatch(ra_it->ra->pool, ra_it->ra->rhandler, false,
+			    readahead_fill, b);
+}
+
+/* Wait for the batch being read by the pending job. */
+static struct readahead_batch *
+readahead_wait(struct readahead_iter *ra_it)
+{
+	struct readahead_batch *b;
+
+	assert(ra_it->pending);
+	pthread_mutex_lock(&ra_it->ra->m);
+	while (!my_queue_remove(ra_it->q, &b, NULL))
+		pthread_cond_wait(&ra_it->ra->c, &ra_it->ra->m);
+	pthread_mutex_unlock(&ra_it->ra->m);
+	ra_it->pending = false;
+	return (b);
+}
+
+static mtbl_res
+readahead_iter_seek(void *v, const uint8_t *key, size_t len_key)
+{
+	struct readahead_iter *ra_it = (struct readahead_iter *) v;
+	mtbl_res res;
+
+	if (ra_it->pending)
+		(void) readahead_wait(ra_it);
+	ra_it->cur = NULL;
+	res = mtbl_iter_seek(ra_it->it, key, len_key);
+	readahead_dispatch(ra_it);
+	return (res);
+}
+
+static bool
+readahead_iter_reset(void *v, iter_reset_type type,
+		     const uint8_t *key0, size_t len_key0,
+		     const uint8_t *key1, size_t len_key1)
+{
+	struct readahead_iter *ra_it = (struct readahead_iter *) v;
+	bool ok;
+
+	if (ra_it->pending)
+		(void) readahead_wait(ra_it);
+	ra_it->cur = NULL;
+	ok = iter_reset(ra_it->it, type, key0, len_key0, key1, len_key1);
+	if (ok)
+		readahead_dispatch(ra_it);
+	return (ok);
+}
+
+static mtbl_res
+readahead_iter_next(void *v,
+		    const uint8_t **key, size_t *len_key,
+		    const uint8_t **val, size_t *len_val)
+{
+	struct readahead_iter *ra_it = (struct readahead_iter *) v;
+	struct readahead_batch *b;
+
+	for (;;) {
+		b = ra_it->cur;
+		if (b != NULL && b->pos < ubuf_size(b->buf)) {
+			const uint8_t *p = ubuf_data(b->buf) + b->pos;
+			uint64_t len_k, len_v;
+
+			p += mtbl_varint_decode64(p, &len_k);
+			p += mtbl_varint_decode64(p, &len_v);
+			ra_it->type = (entry_type) (len_v & 3);
+			len_v >>= 2;
+			*key = p;
+			*len_key = len_k;
+			*val = p + len_k;
+			*len_val = len_v;
+			b->pos = (p + len_k + len_v) - ubuf_data(b->buf);
+			return (mtbl_res_success);
+		}
+		if (!ra_it->pending)
+			return (mtbl_res_failure);
+
+		/* Take the next batch, and start reading the one after it. */
+		ra_it->cur = readahead_wait(ra_it);
+		if (!ra_it->cur->eof)
+			readahead_dispatch(ra_it);
+	}
+}
+
+static entry_type
+readahead_iter_entry_type(void *v)
+{
+	struct readahead_iter *ra_it = (struct readahead_iter *) v;
+	return (ra_it->type);
+}
+
+static void
+readahead_iter_free(void *v)
+{
+	struct readahead_iter *ra_it = (struct readahead_iter *) v;
+
+	if (ra_it != NULL) {
+		if (ra_it->pending)
+			(void) readahead_wait(ra_it);
+		mtbl_iter_destroy(&ra_it->it);
+		my_queue_destroy(&ra_it->q);
+		for (size_t i = 0; i < 2; i++) {
+			ubuf_destroy(&ra_it->batches[i]->buf);
+			free(ra_it->batches[i]);
+		}
+		free(ra_it);
+	}
+}
+
+struct mtbl_iter *
+readahead_iter(struct readahead *ra, struct mtbl_iter *it)
+{
+	struct readahead_iter *ra_it;
+	struct mtbl_iter *iter;
+
+	if (it == NULL)
+		return (NULL);
+	ra_it = my_calloc(1, sizeof(*ra_it));
+	ra_it->ra = ra;
+	ra_it->it = it;
+	ra_it->q = my_queue_init(2, sizeof(struct readahead_batch *));
+	assert(ra_it->q != NULL);
+	for (size_t i = 0; i < 2; i++) {
+		ra_it->batches[i] = my_calloc(1, sizeof(struct readahead_batch));
+		ra_it->batches[i]->ra_it = ra_it;
+		ra_it->batches[i]->buf = ubuf_init(READAHEAD_BATCH_SIZE);
+	}
+	readahead_dispatch(ra_it);
+	iter = mtbl_iter_init(readahead_iter_seek, readahead_iter_next,
+			      readahead_iter_free, ra_it);
+	iter_set_entry_type_func(iter, readahead_iter_entry_type);
+	iter_set_reset_func(iter, readahead_iter_reset);
+	return (iter);
+}
@@ -33,9 +33,17 @@ struct reader_iter {
 	struct block_iter		*bi;
 	struct block_iter		*index_iter;
 	ubuf				*k;
+	ubuf				*batch;		/* keys of the last batch */
 	bool				first;
 	bool				valid;
+	bool				block_start;	/* bi is at the first entry of b */
 	reader_iter_type		it_type;
+	entry_type			type;		/* of the entry last returned */
+};
+
+struct reader_index_iter {
+	struct block_iter		*bi;
+	bool				first;
 };
 
 struct mtbl_reader_options {
@@ -55,9 +63,18 @@ struct mtbl_reader {
 static void
 reader_init_madvise(struct mtbl_reader *);
 
+static void
+reader_key_range(void *, struct key_range *);
+
+static mtbl_res
+reader_lookup(void *, const uint8_t *, size_t, mtbl_lookup_func, void *);
+
 static mtbl_res
 reader_iter_seek(void *, const uint8_t *, size_t);
 
+static mtbl_res
+reader_index_iter_seek(void *, const uint8_t *, size_t);
+
 static mtbl_res
 reader_iter_next(void *, const uint8_t **, size_t *, const uint8_t **, size_t *);
 
@@ -67,6 +84,9 @@ reader_iter_free(void *);
 static struct mtbl_iter *
 reader_iter(void *);
 
+static struct mtbl_iter *
+reader_iter_wrap(struct reader_iter *);
+
 static struct mtbl_iter *
 reader_get(void *, const uint8_t *, size_t);
 
@@ -194,9 +214,10 @@ mtbl_reader_init_fd(int fd, const struct mtbl_reader_options *opt)
 		index_len = mtbl_fixed_decode32(r->data + r->m.index_block_offset + 0);
 	} else {
 		uint64_t tmp;
-		index_len_len = mtbl_varint_decode64(r->data + r->m.index_block_offset + 0, &tmp);
+		index_len_len = varint_decode64_n(r->data + r->m.index_block_offset + 0,
+						  r->len_data - r->m.index_block_offset, &tmp, 1);
 		index_len = tmp;
-		if ((uint64_t)index_len != tmp) {
+		if (index_len_len == 0 || (uint64_t)index_len != tmp) {
 			mtbl_reader_destroy(&r);
 			return NULL;
 		}
@@ -214,6 +235,9 @@ mtbl_reader_init_fd(int fd, const struct mtbl_reader_options *opt)
 				     reader_get_prefix,
 				     reader_get_range,
 				     NULL, r);
+	source_set_key_range_func(r->source, reader_key_range);
+	source_set_lookup_func(r->source, reader_lookup, true);
+	source_set_tombstones(r->source, r->m.has_tombstones);
 	return (r);
 }
 
@@ -232,6 +256,26 @@ mtbl_reader_init(const char *fname, const struct mtbl_reader_options *opt)
 	return (r);
 }
 
+void
+reader_prefetch_index(struct mtbl_reader *r)
+{
+	size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+	size_t offset = r->m.index_block_offset - r->m.index_block_offset % page_size;
+	size_t len = r->len_data - MTBL_METADATA_SIZE - offset;
+	volatile uint8_t sum = 0;
+
+#if defined(HAVE_POSIX_MADVISE)
+	(void) posix_madvise(r->data + offset, len, POSIX_MADV_WILLNEED);
+#elif defined(HAVE_MADVISE)
+	(void) madvise(r->data + offset, len, MADV_WILLNEED);
+#endif
+
+	/* Touch each page of the index block, so that later seeks do not fault. */
+	for (size_t i = 0; i < len; i += page_size)
+		sum += r->data[offset + i];
+	(void) sum;
+}
+
 void
 mtbl_reader_destroy(struct mtbl_reader **r)
 {
@@ -251,12 +295,66 @@ mtbl_reader_source(struct mtbl_reader *r)
 	return (r->source);
 }
 
-static struct block *
-get_block(struct mtbl_reader *r, uint64_t offset)
+static mtbl_res
+reader_index_iter_seek(void *v, const uint8_t *key, size_t len_key)
+{
+	struct reader_index_iter *it = (struct reader_index_iter *) v;
+
+	block_iter_seek(it->bi, key, len_key);
+	it->first = true;
+	return (mtbl_res_success);
+}
+
+static mtbl_res
+reader_index_iter_next(void *v,
+		       const uint8_t **key, size_t *len_key,
+		       const uint8_t **val, size_t *len_val)
+{
+	struct reader_index_iter *it = (struct reader_index_iter *) v;
+
+	if (!it->first)
+		block_iter_next(it->bi);
+	it->first = false;
+
+	if (block_iter_get(it->bi, key, len_key, val, len_val))
+		return (mtbl_res_success);
+	return (mtbl_res_failure);
+}
+
+static void
+reader_index_iter_free(void *v)
 {
-	bool needs_free = false;
-	uint8_t *block_contents = NULL, *raw_contents = NULL;
-	size_t block_contents_size = 0, raw_contents_size = 0;
+	struct reader_index_iter *it = (struct reader_index_iter *) v;
+	if (it) {
+		block_iter_destroy(&it->bi);
+		free(it);
+	}
+}
+
+struct mtbl_iter *
+mtbl_reader_index_iter(struct mtbl_reader *r)
+{
+	struct reader_index_iter *it = my_calloc(1, sizeof(*it));
+
+	assert(r != NULL);
+	it->bi = block_iter_init(r->index);
+	block_iter_seek_to_first(it->bi);
+	it->first = true;
+	return (mtbl_iter_init(reader_index_iter_seek,
+			       reader_index_iter_next,
+			       reader_index_iter_free, it));
+}
+
+/*
+ * Locate the contents of the data block at 'offset', decompressing them if
+ * necessary. Returns whether the contents must be freed by the caller.
+ */
+static bool
+get_block_contents(struct mtbl_reader *r, uint64_t offset,
+		   uint8_t **block_contents, size_t *block_contents_size)
+{
+	uint8_t *raw_contents = NULL;
+	size_t raw_contents_size = 0;
 	size_t raw_contents_size_len;
 	mtbl_res res;
 
@@ -267,7 +365,9 @@ get_block(struct mtbl_reader *r, uint64_t offset)
 		raw_contents_size = mtbl_fixed_decode32(&r->data[offset + 0]);
 	} else {
 		uint64_t tmp;
-		raw_contents_size_len = mtbl_varint_decode64(&r->data[offset + 0], &tmp);
+		raw_contents_size_len = varint_decode64_n(&r->data[offset + 0],
+							  r->len_data - offset, &tmp, 1);
+		assert(raw_contents_size_len > 0);
 		raw_contents_size = tmp;
 		assert((uint64_t)raw_contents_size == tmp);
 	}
@@ -281,37 +381,102 @@ get_block(struct mtbl_reader *r, uint64_t offset)
 	}
 
 	if (r->m.compression_algorithm == MTBL_COMPRESSION_NONE) {
-		block_contents = raw_contents;
-		block_contents_size = raw_contents_size;
-	} else {
-		needs_free = true;
-		res = mtbl_decompress(
-			r->m.compression_algorithm,
-			raw_contents,
-			raw_contents_size,
-			&block_contents,
-			&block_contents_size
-		);
-		assert(res == mtbl_res_success);
+		*block_contents = raw_contents;
+		*block_contents_size = raw_contents_size;
+		return (false);
 	}
 
+	res = mtbl_decompress(
+		r->m.compression_algorithm,
+		raw_contents,
+		raw_contents_size,
+		block_contents,
+		block_contents_size
+	);
+	assert(res == mtbl_res_success);
+	return (true);
+}
+
+/*
+ * Decode the offset of the data block an index entry points to. A malformed
+ * index value fails, rather than leaving the offset unset or past the data.
+ */
+static bool
+index_block_offset(const struct mtbl_reader *r, const uint8_t *ival, size_t len_ival,
+		   uint64_t *offset)
+{
+	return (varint_decode64_n(ival, len_ival, offset, 1) > 0 && *offset < r->len_data);
+}
+
+static struct block *
+get_block(struct mtbl_reader *r, uint64_t offset)
+{
+	uint8_t *block_contents = NULL;
+	size_t block_contents_size = 0;
+	bool needs_free;
+
+	needs_free = get_block_contents(r, offset, &block_contents, &block_contents_size);
 	return (block_init(block_contents, block_contents_size, needs_free));
 }
 
+/* Strip the entry type which precedes each value in files with tombstones. */
+static entry_type
+reader_entry_type(const struct mtbl_reader *r, const uint8_t **val, size_t *len_val)
+{
+	uint8_t type;
+
+	if (!r->m.has_tombstones || *len_val == 0)
+		return (ENTRY_TYPE_VALUE);
+	type = (*val)[0];
+	*val += 1;
+	*len_val -= 1;
+	if (type == ENTRY_TYPE_TOMBSTONE || type == ENTRY_TYPE_REPLACE)
+		return ((entry_type) type);
+	return (ENTRY_TYPE_VALUE);
+}
+
+/*
+ * Search the index block for the data block which may hold the key, then
+ * search that data block, without creating any iterators or block objects.
+ * Only the decompression of the data block allocates memory.
+ */
+static mtbl_res
+reader_lookup(void *clos, const uint8_t *key, size_t len_key,
+	      mtbl_lookup_func lookup, void *lookup_clos)
+{
+	struct mtbl_reader *r = (struct mtbl_reader *) clos;
+	uint8_t *block_contents = NULL;
+	size_t block_contents_size = 0;
+	const uint8_t *ival, *val;
+	size_t len_ival, len_val;
+	uint64_t offset;
+	bool exact, needs_free, found;
+
+	if (!block_lookup(r->index, key, len_key, &exact, &ival, &len_ival))
+		return (mtbl_res_failure);
+	if (!index_block_offset(r, ival, len_ival, &offset))
+		return (mtbl_res_failure);
+
+	needs_free = get_block_contents(r, offset, &block_contents, &block_contents_size);
+	found = block_data_lookup(block_contents, block_contents_size,
+				  key, len_key, &exact, &val, &len_val) && exact &&
+		reader_entry_type(r, &val, &len_val) != ENTRY_TYPE_TOMBSTONE;
+	if (found)
+		lookup(lookup_clos, key, len_key, val, len_val);
+	if (needs_free)
+		free(block_contents);
+	return (found ? mtbl_res_success : mtbl_res_failure);
+}
+
 static struct block *
-get_block_at_index(struct mtbl_reader *r, struct block_iter *index_iter)
+get_block_at_index(struct mtbl_reader *r, struct block_iter *index_iter, uint64_t *offset)
 {
 	const uint8_t *ikey, *ival;
 	size_t len_ikey, len_ival;
 
-	if (block_iter_get(index_iter, &ikey, &len_ikey, &ival, &len_ival)) {
-		struct block *b;
-		uint64_t offset;
-
-		mtbl_varint_decode64(ival, &offset);
-		b = get_block(r, offset);
-		return (b);
-	}
+	if (block_iter_get(index_iter, &ikey, &len_ikey, &ival, &len_ival) &&
+	    index_block_offset(r, ival, len_ival, offset))
+		return (get_block(r, *offset));
 
 	return (NULL);
 }
@@ -326,7 +491,7 @@ reader_iter(void *clos)
 	it->index_iter = block_iter_init(r->index);
 
 	block_iter_seek_to_first(it->index_iter);
-	it->b = get_block_at_index(r, it->index_iter);
+	it->b = get_block_at_index(r, it->index_iter, &it->block_offset);
 	if (it->b == NULL) {
 		block_iter_destroy(&it->index_iter);
 		block_destroy(&it->b);
@@ -339,8 +504,9 @@ reader_iter(void *clos)
 
 	it->first = true;
 	it->valid = true;
+	it->block_start = true;
 	it->it_type = READER_ITER_TYPE_ITER;
-	return (mtbl_iter_init(reader_iter_seek, reader_iter_next, reader_iter_free, it));
+	return (reader_iter_wrap(it));
 }
 
 static struct reader_iter *
@@ -352,7 +518,7 @@ reader_iter_init(struct mtbl_reader *r, const uint8_t *key, size_t len_key)
 	it->index_iter = block_iter_init(r->index);
 
 	block_iter_seek(it->index_iter, key, len_key);
-	it->b = get_block_at_index(r, it->index_iter);
+	it->b = get_block_at_index(r, it->index_iter, &it->block_offset);
 	if (it->b == NULL) {
 		block_iter_destroy(&it->index_iter);
 		block_destroy(&it->b);
@@ -378,7 +544,7 @@ reader_get(void *clos, const uint8_t *key, size_t len_key)
 	it->k = ubuf_init(len_key);
 	ubuf_append(it->k, key, len_key);
 	it->it_type = READER_ITER_TYPE_GET;
-	return (mtbl_iter_init(reader_iter_seek, reader_iter_next, reader_iter_free, it));
+	return (reader_iter_wrap(it));
 }
 
 static struct mtbl_iter *
@@ -391,7 +557,7 @@ reader_get_prefix(void *clos, const uint8_t *key, size_t len_key)
 	it->k = ubuf_init(len_key);
 	ubuf_append(it->k, key, len_key);
 	it->it_type = READER_ITER_TYPE_GET_PREFIX;
-	return (mtbl_iter_init(reader_iter_seek, reader_iter_next, reader_iter_free, it));
+	return (reader_iter_wrap(it));
 }
 
 static struct mtbl_iter *
@@ -406,7 +572,7 @@ reader_get_range(void *clos,
 	it->k = ubuf_init(len_key1);
 	ubuf_append(it->k, key1, len_key1);
 	it->it_type = READER_ITER_TYPE_GET_RANGE;
-	return (mtbl_iter_init(reader_iter_seek, reader_iter_next, reader_iter_free, it));
+	return (reader_iter_wrap(it));
 }
 
 static void
@@ -415,6 +581,7 @@ reader_iter_free(void *v)
 	struct reader_iter *it = (struct reader_iter *) v;
 	if (it) {
 		ubuf_destroy(&it->k);
+		ubuf_destroy(&it->batch);
 		block_destroy(&it->b);
 		block_iter_destroy(&it->bi);
 		block_iter_destroy(&it->index_iter);
@@ -472,7 +639,8 @@ reader_iter_seek(void *v,
 		return (mtbl_res_success);
 	}
 
-	mtbl_varint_decode64(ival, &new_offset);
+	if (!index_block_offset(it->r, ival, len_ival, &new_offset))
+		return (mtbl_res_failure);
 
 	/* We can skip decoding a new block if our new key is within the
 	 * currently-decoded block. */ 
@@ -492,10 +660,31 @@ reader_iter_seek(void *v,
 
 	it->first = true;
 	it->valid = true;
+	it->block_start = false;
 
 	return (mtbl_res_success);
 }
 
+/* Whether a key is within the keys the iterator was created for. */
+static bool
+reader_iter_in_range(const struct reader_iter *it, const uint8_t *key, size_t len_key)
+{
+	switch (it->it_type) {
+	case READER_ITER_TYPE_ITER:
+		return (true);
+	case READER_ITER_TYPE_GET:
+		return (bytes_compare(key, len_key, ubuf_data(it->k), ubuf_size(it->k)) == 0);
+	case READER_ITER_TYPE_GET_PREFIX:
+		return (ubuf_size(it->k) <= len_key &&
+			memcmp(ubuf_data(it->k), key, ubuf_size(it->k)) == 0);
+	case READER_ITER_TYPE_GET_RANGE:
+		return (bytes_compare(key, len_key, ubuf_data(it->k), ubuf_size(it->k)) <= 0);
+	default:
+		assert(0);
+	}
+	return (false);
+}
+
 static mtbl_res
 reader_iter_next(void *v,
 	       const uint8_t **key, size_t *len_key,
@@ -505,8 +694,10 @@ reader_iter_next(void *v,
 	if (!it->valid)
 		return (mtbl_res_failure);
 
-	if (!it->first)
+	if (!it->first) {
 		block_iter_next(it->bi);
+		it->block_start = false;
+	}
 	it->first = false;
 
 	it->valid = block_iter_get(it->bi, key, len_key, val, len_val);
@@ -515,37 +706,187 @@ reader_iter_next(void *v,
 		block_iter_destroy(&it->bi);
 		if (!block_iter_next(it->index_iter))
 			return (mtbl_res_failure);
-		it->b = get_block_at_index(it->r, it->index_iter);
+		it->b = get_block_at_index(it->r, it->index_iter, &it->block_offset);
+		if (it->b == NULL) {
+			it->valid = false;
+			return (mtbl_res_failure);
+		}
 		it->bi = block_iter_init(it->b);
 		block_iter_seek_to_first(it->bi);
+		it->block_start = true;
 		it->valid = block_iter_get(it->bi, key, len_key, val, len_val);
 		if (!it->valid)
 			return (mtbl_res_failure);
 	}
 
-	switch (it->it_type) {
-	case READER_ITER_TYPE_ITER:
+	it->valid = reader_iter_in_range(it, *key, *len_key);
+	if (!it->valid)
+		return (mtbl_res_failure);
+	it->type = reader_entry_type(it->r, val, len_val);
+	return (mtbl_res_success);
+}
+
+/*
+ * Return the entries of the current data block in a batch. The values point
+ * into the block, so a batch ends with the block, but the keys are copied,
+ * since the block iterator builds each key in the same buffer.
+ */
+static size_t
+reader_iter_next_batch(void *v, struct mtbl_entry *entries, size_t n)
+{
+	struct reader_iter *it = (struct reader_iter *) v;
+	const uint8_t *key, *val;
+	size_t len_key, len_val, i = 0;
+
+	if (it->batch == NULL)
+		it->batch = ubuf_init(256);
+	ubuf_clip(it->batch, 0);
+
+	while (i < n) {
+		if (i == 0) {
+			if (reader_iter_next(it, &key, &len_key, &val, &len_val) != mtbl_res_success)
+				break;
+		} else {
+			/* At the end of the block, the next batch moves on to the next. */
+			if (!block_iter_next(it->bi))
+				break;
+			it->block_start = false;
+			block_iter_get(it->bi, &key, &len_key, &val, &len_val);
+			it->valid = reader_iter_in_range(it, key, len_key);
+			if (!it->valid)
+				break;
+			it->type = reader_entry_type(it->r, &val, &len_val);
+		}
+
+		entries[i].key = (const uint8_t *) (uintptr_t) ubuf_size(it->batch);
+		entries[i].len_key = len_key;
+		entries[i].val = val;
+		entries[i].len_val = len_val;
+		ubuf_append(it->batch, key, len_key);
+		i++;
+
+		/* Only the last entry of a batch may be a tombstone. */
+		if (it->type != ENTRY_TYPE_VALUE)
+			break;
+	}
+	for (size_t j = 0; j < i; j++)
+		entries[j].key = ubuf_data(it->batch) + (uintptr_t) entries[j].key;
+	return (i);
+}
+
+/*
+ * Re-aim the iterator as if it had been returned by reader_get(),
+ * reader_get_prefix() or reader_get_range(). The seek keeps the decoded
+ * block if the new keys start in it.
+ */
+static bool
+reader_iter_reset(void *v, iter_reset_type type,
+		  const uint8_t *key0, size_t len_key0,
+		  const uint8_t *key1, size_t len_key1)
+{
+	struct reader_iter *it = (struct reader_iter *) v;
+
+	if (it->k == NULL)
+		it->k = ubuf_init(len_key1 > len_key0 ? len_key1 : len_key0);
+	ubuf_clip(it->k, 0);
+	switch (type) {
+	case ITER_RESET_GET:
+		it->it_type = READER_ITER_TYPE_GET;
+		ubuf_append(it->k, key0, len_key0);
 		break;
-	case READER_ITER_TYPE_GET:
-		if (bytes_compare(*key, *len_key, ubuf_data(it->k), ubuf_size(it->k)) != 0)
-			it->valid = false;
+	case ITER_RESET_PREFIX:
+		it->it_type = READER_ITER_TYPE_GET_PREFIX;
+		ubuf_append(it->k, key0, len_key0);
 		break;
-	case READER_ITER_TYPE_GET_PREFIX:
-		if (!(ubuf_size(it->k) <= *len_key &&
-		      memcmp(ubuf_data(it->k), *key, ubuf_size(it->k)) == 0))
-		{
-			it->valid = false;
-		}
+	case ITER_RESET_RANGE:
+		it->it_type = READER_ITER_TYPE_GET_RANGE;
+		ubuf_append(it->k, key1, len_key1);
+		break;
+	}
+	return (reader_iter_seek(it, key0, len_key0) == mtbl_res_success);
+}
+
+static entry_type
+reader_iter_entry_type(void *v)
+{
+	struct reader_iter *it = (struct reader_iter *) v;
+	return (it->type);
+}
+
+static bool
+reader_iter_raw_block(void *v, struct raw_block *rb)
+{
+	struct reader_iter *it = (struct reader_iter *) v;
+	struct mtbl_reader *r = it->r;
+	const uint8_t *ival, *val;
+	size_t len_ival, len_val, len_length;
+	uint64_t offset, len_data;
+
+	if (!it->valid || it->first || !it->block_start ||
+	    r->m.file_version != MTBL_FORMAT_V2)
+		return (false);
+	if (!block_iter_get(it->index_iter, &rb->bound, &rb->len_bound, &ival, &len_ival))
+		return (false);
+
+	/* The whole block must lie within the iteration. */
+	switch (it->it_type) {
+	case READER_ITER_TYPE_ITER:
 		break;
 	case READER_ITER_TYPE_GET_RANGE:
-		if (bytes_compare(*key, *len_key, ubuf_data(it->k), ubuf_size(it->k)) > 0)
-			it->valid = false;
+		if (bytes_compare(rb->bound, rb->len_bound,
+				  ubuf_data(it->k), ubuf_size(it->k)) > 0)
+			return (false);
 		break;
 	default:
-		assert(0);
+		return (false);
 	}
 
-	if (it->valid)
-		return (mtbl_res_success);
-	return (mtbl_res_failure);
+	if (!index_block_offset(r, ival, len_ival, &offset))
+		return (false);
+	len_length = varint_decode64_n(&r->data[offset], r->len_data - offset, &len_data, 1);
+	assert(len_length > 0);
+	memcpy(&rb->crc, &r->data[offset + len_length], sizeof(rb->crc));
+	rb->data = &r->data[offset + len_length + sizeof(rb->crc)];
+	rb->len_data = len_data;
+	rb->m = &r->m;
+	rb->b = it->b;
+	if (!block_iter_get(it->bi, &rb->first_key, &rb->len_first_key, &val, &len_val))
+		return (false);
+	return (true);
+}
+
+static void
+reader_iter_skip_block(void *v)
+{
+	struct reader_iter *it = (struct reader_iter *) v;
+
+	/* The next call to reader_iter_next() moves on to the next block. */
+	block_iter_seek_to_last(it->bi);
+	it->block_start = false;
+}
+
+static struct mtbl_iter *
+reader_iter_wrap(struct reader_iter *it)
+{
+	struct mtbl_iter *iter;
+
+	iter = mtbl_iter_init(reader_iter_seek, reader_iter_next, reader_iter_free, it);
+	iter_set_raw_block_funcs(iter, reader_iter_raw_block, reader_iter_skip_block);
+	iter_set_entry_type_func(iter, reader_iter_entry_type);
+	iter_set_next_batch_func(iter, reader_iter_next_batch);
+	iter_set_reset_func(iter, reader_iter_reset);
+	return (iter);
+}
+
+static void
+reader_key_range(void *clos, struct key_range *kr)
+{
+	struct mtbl_reader *r = (struct mtbl_reader *) clos;
+
+	kr->has_first = r->m.has_first_key;
+	kr->first = r->m.first_key;
+	kr->len_first = r->m.len_first_key;
+	kr->has_last = r->m.has_last_key;
+	kr->last = r->m.last_key;
+	kr->len_last = r->m.len_last_key;
 }
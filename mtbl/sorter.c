@@ -14,10 +14,15 @@
  * limitations under the License.
  */
 
+#include <sys/statvfs.h>
+#include <pthread.h>
+
 #include "mtbl-private.h"
 #include "threadpool.h"
 
+#include "libmy/heap.h"
 #include "libmy/ubuf.h"
+#include "libmy/xxhash.h"
 
 
 VECTOR_GENERATE(reader_vec, struct mtbl_reader *);
@@ -25,11 +30,13 @@ VECTOR_GENERATE(reader_vec, struct mtbl_reader *);
 struct sorter_iter {
 	struct mtbl_merger		*m;
 	struct mtbl_iter		*m_iter;
+	struct mtbl_source		*mem_source;
 };
 
 struct entry {
 	uint32_t			len_key;
 	uint32_t			len_val;
+	bool				tombstone;
 	uint8_t				data[];
 };
 
@@ -38,35 +45,132 @@ struct entry {
 
 VECTOR_GENERATE(entry_vec, struct entry *);
 
+VECTOR_GENERATE(val_vec, const uint8_t *);
+
+VECTOR_GENERATE(len_vec, size_t);
+
+typedef enum {
+	MEM_ITER_TYPE_ITER,
+	MEM_ITER_TYPE_GET,
+	MEM_ITER_TYPE_GET_PREFIX,
+	MEM_ITER_TYPE_GET_RANGE,
+} mem_iter_type;
+
+/*
+ * Iterator over the sorted, de-duplicated entries still held in memory by
+ * the sorter. These entries are served directly to the merger instead of
+ * being spilled to a temporary file.
+ */
+struct mem_iter {
+	entry_vec			*entries;
+	size_t				idx;
+	ubuf				*k;
+	mem_iter_type			it_type;
+};
+
+/*
+ * Open addressing hash table slot mapping a key hash to the index of the
+ * entry with that key in the sorter's in-memory entry vector.
+ */
+struct combiner_slot {
+	uint64_t			hash;
+	size_t				idx;	/* index + 1, or 0 if empty */
+};
+
+/* Temporary files written to one of the sorter's temporary directories. */
+struct temp_dir_usage {
+	uint64_t			count_files;
+	uint64_t			bytes_files;
+};
+
 struct mtbl_sorter_options {
 	size_t				max_memory;
-	char				*tmp_dname;
+	char				**tmp_dnames;
+	size_t				n_tmp_dnames;
+	bool				tmp_dnames_default;
+	mtbl_sorter_temp_dir_policy	tmp_dir_policy;
+	mtbl_sorter_run_mode		run_mode;
 	mtbl_merge_func			merge;
+	mtbl_merge_values_func		merge_values;
 	void				*merge_clos;
 	struct mtbl_threadpool		*pool;
+	bool				combine;
 };
 
-struct mtbl_sorter {
-	reader_vec			*readers;
+/*
+ * Unsorted entries accumulated by a single producer, along with the
+ * combiner hash table indexing them.
+ *
+ * In replacement selection mode, once the memory limit has been reached,
+ * 'rs_heap' holds the entries which can still be written to the run being
+ * written by 'rs_writer', while 'vec' collects entries which sort before the
+ * last key written and must wait for the next run.
+ */
+struct sorter_buffer {
 	entry_vec			*vec;
 	size_t				entry_bytes;
+
+	struct combiner_slot		*slots;
+	size_t				n_slots;
+	size_t				n_slots_used;
+
+	struct heap			*rs_heap;
+	struct entry			*rs_last;	/* taken from rs_heap, not yet written */
+	struct mtbl_writer		*rs_writer;
+	int				rs_fd;
+	size_t				rs_tmp_dir;
+	bool				rs_tombstones;	/* rs_writer can write tombstones */
+
+	/* Output buffer reused by merge_values functions. */
+	uint8_t				*merge_buf;
+	size_t				size_merge_buf;
+};
+
+struct mtbl_sorter {
+	reader_vec			*readers;
+	struct sorter_buffer		buf;
 	bool				iterating;
 
+	/* Set once any tombstone has been added, by any producer. */
+	bool				tombstones;
+
+	/*
+	 * Protects 'readers' and 'handle_vec', which are shared with
+	 * producer threads using mtbl_sorter_handle objects.
+	 */
+	pthread_mutex_t			lock;
+	entry_vec			*handle_vec;
+	size_t				n_handles;
+
+	struct temp_dir_usage		*tmp_usage;
+	size_t				next_tmp_dir;
+
 	struct mtbl_sorter_options	opt;
 
 	struct threadpool		*pool;
 	struct result_handler		*rhandler;
 };
 
+struct mtbl_sorter_handle {
+	struct mtbl_sorter		*s;
+	struct sorter_buffer		buf;
+};
+
 struct entry_batch {
 	const struct mtbl_sorter	*s;
 	entry_vec			*entries;
+	size_t				tmp_dir;
 };
 
 
-static struct entry_batch *_mtbl_sorter_get_entry_batch(struct mtbl_sorter *);
+static struct entry_batch *_mtbl_sorter_get_entry_batch(struct mtbl_sorter *,
+							 struct sorter_buffer *);
+static mtbl_res _mtbl_sorter_sort_entries(const struct mtbl_sorter *, entry_vec *);
 static struct mtbl_reader *_mtbl_sorter_write_chunk(struct entry_batch *);
-static mtbl_res _mtbl_sorter_flush(struct mtbl_sorter *);
+static mtbl_res _mtbl_sorter_flush(struct mtbl_sorter *, struct sorter_buffer *);
+static size_t _mtbl_sorter_next_temp_dir(struct mtbl_sorter *);
+static mtbl_res _mtbl_sorter_rs_spill(struct mtbl_sorter *, struct sorter_buffer *);
+static mtbl_res _mtbl_sorter_rs_finish(struct mtbl_sorter *, struct sorter_buffer *);
 static void* _write_temp_file_wrapper(void *batch);
 static void _collect_readers_cb(void *result, void *sorter);
 
@@ -78,15 +182,26 @@ mtbl_sorter_options_init(void)
 	opt = my_calloc(1, sizeof(*opt));
 	opt->max_memory = DEFAULT_SORTER_MEMORY;
 	opt->pool = NULL;
+	opt->tmp_dir_policy = MTBL_SORTER_TEMP_DIR_ROUND_ROBIN;
 	mtbl_sorter_options_set_temp_dir(opt, DEFAULT_SORTER_TEMP_DIR);
+	opt->tmp_dnames_default = true;
 	return (opt);
 }
 
+static void
+_mtbl_sorter_options_clear_temp_dirs(struct mtbl_sorter_options *opt)
+{
+	for (size_t i = 0; i < opt->n_tmp_dnames; i++)
+		free(opt->tmp_dnames[i]);
+	my_free(opt->tmp_dnames);
+	opt->n_tmp_dnames = 0;
+}
+
 void
 mtbl_sorter_options_destroy(struct mtbl_sorter_options **opt)
 {
 	if (*opt) {
-		free((*opt)->tmp_dname);
+		_mtbl_sorter_options_clear_temp_dirs(*opt);
 		my_free(*opt);
 	}
 }
@@ -96,6 +211,17 @@ mtbl_sorter_options_set_merge_func(struct mtbl_sorter_options *opt,
 				   mtbl_merge_func merge, void *clos)
 {
 	opt->merge = merge;
+	opt->merge_values = NULL;
+	opt->merge_clos = clos;
+}
+
+void
+mtbl_sorter_options_set_merge_values_func(struct mtbl_sorter_options *opt,
+					  mtbl_merge_values_func merge_values,
+					  void *clos)
+{
+	opt->merge = NULL;
+	opt->merge_values = merge_values;
 	opt->merge_clos = clos;
 }
 
@@ -103,8 +229,50 @@ void
 mtbl_sorter_options_set_temp_dir(struct mtbl_sorter_options *opt,
 				 const char *temp_dir)
 {
-	free(opt->tmp_dname);
-	opt->tmp_dname = strdup(temp_dir);
+	_mtbl_sorter_options_clear_temp_dirs(opt);
+	mtbl_sorter_options_add_temp_dir(opt, temp_dir);
+}
+
+void
+mtbl_sorter_options_add_temp_dir(struct mtbl_sorter_options *opt,
+				 const char *temp_dir)
+{
+	/* The first directory added replaces the default one. */
+	if (opt->tmp_dnames_default) {
+		_mtbl_sorter_options_clear_temp_dirs(opt);
+		opt->tmp_dnames_default = false;
+	}
+	opt->tmp_dnames = my_realloc(opt->tmp_dnames,
+				     (opt->n_tmp_dnames + 1) * sizeof(char *));
+	opt->tmp_dnames[opt->n_tmp_dnames++] = my_strdup(temp_dir);
+}
+
+void
+mtbl_sorter_options_set_temp_dir_policy(struct mtbl_sorter_options *opt,
+					mtbl_sorter_temp_dir_policy policy)
+{
+	switch (policy) {
+	case MTBL_SORTER_TEMP_DIR_ROUND_ROBIN:
+	case MTBL_SORTER_TEMP_DIR_FREE_SPACE:
+		break;
+	default:
+		assert(0);
+	}
+	opt->tmp_dir_policy = policy;
+}
+
+void
+mtbl_sorter_options_set_run_mode(struct mtbl_sorter_options *opt,
+				 mtbl_sorter_run_mode run_mode)
+{
+	switch (run_mode) {
+	case MTBL_SORTER_RUN_QUICKSORT:
+	case MTBL_SORTER_RUN_REPLACEMENT_SELECTION:
+		break;
+	default:
+		assert(0);
+	}
+	opt->run_mode = run_mode;
 }
 
 void
@@ -123,6 +291,13 @@ mtbl_sorter_options_set_threadpool(struct mtbl_sorter_options *opt,
 	opt->pool = pool;
 }
 
+void
+mtbl_sorter_options_set_combine(struct mtbl_sorter_options *opt,
+				bool combine)
+{
+	opt->combine = combine;
+}
+
 struct mtbl_sorter *
 mtbl_sorter_init(const struct mtbl_sorter_options *opt)
 {
@@ -131,10 +306,19 @@ mtbl_sorter_init(const struct mtbl_sorter_options *opt)
 	s = my_calloc(1, sizeof(*s));
 	if (opt != NULL) {
 		memcpy(&s->opt, opt, sizeof(*opt));
-		s->opt.tmp_dname = strdup(opt->tmp_dname);
+		s->opt.tmp_dnames = NULL;
+		s->opt.n_tmp_dnames = 0;
+		s->opt.tmp_dnames_default = false;
+		for (size_t i = 0; i < opt->n_tmp_dnames; i++)
+			mtbl_sorter_options_add_temp_dir(&s->opt, opt->tmp_dnames[i]);
 	}
-	s->vec = entry_vec_init(INITIAL_SORTER_VEC_SIZE);
+	if (s->opt.n_tmp_dnames == 0)
+		mtbl_sorter_options_add_temp_dir(&s->opt, DEFAULT_SORTER_TEMP_DIR);
+	s->tmp_usage = my_calloc(s->opt.n_tmp_dnames, sizeof(*s->tmp_usage));
+	s->buf.vec = entry_vec_init(INITIAL_SORTER_VEC_SIZE);
 	s->readers = reader_vec_init(1);
+	s->handle_vec = entry_vec_init(1);
+	pthread_mutex_init(&s->lock, NULL);
 
 	if (s->opt.pool != NULL) {
 		s->pool = s->opt.pool->pool;
@@ -144,15 +328,39 @@ mtbl_sorter_init(const struct mtbl_sorter_options *opt)
 	return (s);
 }
 
+static void
+_sorter_buffer_clear(struct sorter_buffer *buf)
+{
+	for (size_t i = 0; i < entry_vec_size(buf->vec); i++)
+		free(entry_vec_value(buf->vec, i));
+	entry_vec_destroy(&buf->vec);
+	if (buf->rs_heap != NULL) {
+		while (heap_size(buf->rs_heap) > 0)
+			free(heap_pop(buf->rs_heap));
+		heap_destroy(&buf->rs_heap);
+	}
+	my_free(buf->rs_last);
+	if (buf->rs_writer != NULL) {
+		mtbl_writer_destroy(&buf->rs_writer);
+		close(buf->rs_fd);
+	}
+	my_free(buf->merge_buf);
+	buf->size_merge_buf = 0;
+	my_free(buf->slots);
+	buf->n_slots = 0;
+	buf->n_slots_used = 0;
+	buf->entry_bytes = 0;
+}
+
 void
 mtbl_sorter_destroy(struct mtbl_sorter **s)
 {
 	if (*s) {
-		for (unsigned i = 0; i < entry_vec_size((*s)->vec); i++) {
-			struct entry *ent = entry_vec_value((*s)->vec, i);
-			free(ent);
-		}
-		entry_vec_destroy(&((*s)->vec));
+		assert((*s)->n_handles == 0);
+		_sorter_buffer_clear(&(*s)->buf);
+		for (size_t i = 0; i < entry_vec_size((*s)->handle_vec); i++)
+			free(entry_vec_value((*s)->handle_vec, i));
+		entry_vec_destroy(&(*s)->handle_vec);
 
 		for (unsigned i = 0; i < reader_vec_size((*s)->readers); i++) {
 			struct mtbl_reader *r = reader_vec_value((*s)->readers, i);
@@ -161,11 +369,35 @@ mtbl_sorter_destroy(struct mtbl_sorter **s)
 		reader_vec_destroy(&((*s)->readers));
 
 		result_handler_destroy(&(*s)->rhandler);
-		free((*s)->opt.tmp_dname);
+		pthread_mutex_destroy(&(*s)->lock);
+		free((*s)->tmp_usage);
+		_mtbl_sorter_options_clear_temp_dirs(&(*s)->opt);
 		my_free(*s);
 	}
 }
 
+size_t
+mtbl_sorter_count_temp_dirs(const struct mtbl_sorter *s)
+{
+	return (s->opt.n_tmp_dnames);
+}
+
+mtbl_res
+mtbl_sorter_temp_dir_usage(const struct mtbl_sorter *s, size_t idx,
+			   const char **temp_dir,
+			   uint64_t *count_files, uint64_t *bytes_files)
+{
+	if (idx >= s->opt.n_tmp_dnames)
+		return (mtbl_res_failure);
+	if (temp_dir != NULL)
+		*temp_dir = s->opt.tmp_dnames[idx];
+	if (count_files != NULL)
+		*count_files = __sync_add_and_fetch(&s->tmp_usage[idx].count_files, 0);
+	if (bytes_files != NULL)
+		*bytes_files = __sync_add_and_fetch(&s->tmp_usage[idx].bytes_files, 0);
+	return (mtbl_res_success);
+}
+
 static int
 _mtbl_sorter_compare(const void *va, const void *vb)
 {
@@ -176,86 +408,309 @@ _mtbl_sorter_compare(const void *va, const void *vb)
 			      entry_key(b), b->len_key));
 }
 
-static struct mtbl_reader *
-_mtbl_sorter_write_chunk(struct entry_batch *b)
+static int
+_mtbl_sorter_heap_compare(const void *a, const void *b,
+			  void *clos __attribute__((unused)))
 {
-	mtbl_res res;
-	const struct mtbl_sorter *s = b->s;
+	return (_mtbl_sorter_compare(&a, &b));
+}
+
+static struct entry *
+_mtbl_sorter_entry_init(const uint8_t *key, size_t len_key,
+			const uint8_t *val, size_t len_val, bool tombstone)
+{
+	struct entry *ent = my_malloc(sizeof(*ent) + len_key + len_val);
+
+	ent->len_key = len_key;
+	ent->len_val = len_val;
+	ent->tombstone = tombstone;
+	memcpy(entry_key(ent), key, len_key);
+	if (len_val > 0)
+		memcpy(entry_val(ent), val, len_val);
+	return (ent);
+}
+
+static size_t
+_mtbl_sorter_entry_bytes(const struct entry *ent)
+{
+	return (sizeof(*ent) + ent->len_key + ent->len_val);
+}
+
+static entry_type
+_mtbl_sorter_entry_type(const struct entry *ent)
+{
+	return (ent->tombstone ? ENTRY_TYPE_TOMBSTONE : ENTRY_TYPE_VALUE);
+}
+
+/*
+ * Return a new entry with the given key and the value resulting from merging
+ * all of the values 'vals', or NULL if the merge function fails. A
+ * merge_values function writes the merged value into '*merge_buf', which is
+ * reused from call to call. A pairwise merge function is folded over the
+ * values from left to right.
+ */
+static struct entry *
+_mtbl_sorter_merge_values(const struct mtbl_sorter *s,
+			  const uint8_t *key, size_t len_key,
+			  size_t n_vals, const uint8_t **vals, const size_t *len_vals,
+			  uint8_t **merge_buf, size_t *size_merge_buf)
+{
+	struct entry *merge_ent;
+	const uint8_t *merge_val;
+	uint8_t *pair_val = NULL;
+	size_t len_merge_val;
+
+	assert(n_vals >= 2);
+	if (s->opt.merge_values != NULL) {
+		mtbl_res res = s->opt.merge_values(s->opt.merge_clos,
+						   key, len_key,
+						   n_vals, vals, len_vals,
+						   merge_buf, size_merge_buf,
+						   &len_merge_val);
+		if (res != mtbl_res_success)
+			return (NULL);
+		merge_val = *merge_buf;
+	} else {
+		assert(s->opt.merge != NULL);
+		merge_val = vals[0];
+		len_merge_val = len_vals[0];
+		for (size_t i = 1; i < n_vals; i++) {
+			uint8_t *val = NULL;
+			size_t len_val = 0;
+
+			s->opt.merge(s->opt.merge_clos,
+				     key, len_key,
+				     merge_val, len_merge_val,
+				     vals[i], len_vals[i],
+				     &val, &len_val);
+			free(pair_val);
+			if (val == NULL)
+				return (NULL);
+			pair_val = val;
+			merge_val = val;
+			len_merge_val = len_val;
+		}
+	}
+	assert(len_merge_val <= UINT_MAX);
+
+	merge_ent = _mtbl_sorter_entry_init(key, len_key, merge_val, len_merge_val, false);
+	free(pair_val);
+
+	return (merge_ent);
+}
+
+/*
+ * Return a new entry with the key of 'ent' and the value resulting from
+ * merging the value of 'ent' with 'val', or NULL if the merge function
+ * fails.
+ */
+static struct entry *
+_mtbl_sorter_merge_entry(const struct mtbl_sorter *s, struct sorter_buffer *buf,
+			 const struct entry *ent,
+			 const uint8_t *val, size_t len_val)
+{
+	const uint8_t *vals[2] = { entry_val(ent), val };
+	size_t len_vals[2] = { ent->len_val, len_val };
+
+	return (_mtbl_sorter_merge_values(s, entry_key(ent), ent->len_key,
+					  2, vals, len_vals,
+					  &buf->merge_buf, &buf->size_merge_buf));
+}
+
+/*
+ * Sort a batch of entries and merge each run of entries with duplicate keys
+ * into a single entry, compacting the vector in place. On failure, all
+ * entries are freed and the vector is left empty.
+ */
+static mtbl_res
+_mtbl_sorter_sort_entries(const struct mtbl_sorter *s, entry_vec *vec)
+{
+	struct entry **entries = entry_vec_data(vec);
+	size_t n_entries = entry_vec_size(vec);
+	val_vec *vals = NULL;
+	len_vec *len_vals = NULL;
+	uint8_t *merge_buf = NULL;
+	size_t size_merge_buf = 0;
+	mtbl_res res = mtbl_res_success;
+	size_t n = 0, i, j;
+
+	qsort(entries, n_entries, sizeof(void *), _mtbl_sorter_compare);
+	for (i = 0; i < n_entries; i = j) {
+		struct entry *ent = entries[i];
+		struct entry *merge_ent;
+
+		for (j = i + 1; j < n_entries; j++)
+			if (_mtbl_sorter_compare(&ent, &entries[j]) != 0)
+				break;
+		if (j - i == 1) {
+			entries[n++] = ent;
+			continue;
+		}
+
+		/*
+		 * The sorter does not keep the order in which entries were
+		 * added, so a tombstone hides every value added for its key.
+		 */
+		for (size_t k = i; k < j; k++) {
+			if (entries[k]->tombstone) {
+				ent = entries[k];
+				break;
+			}
+		}
+		if (ent->tombstone) {
+			for (size_t k = i; k < j; k++)
+				if (entries[k] != ent)
+					free(entries[k]);
+			entries[n++] = ent;
+			continue;
+		}
+
+		if (vals == NULL) {
+			vals = val_vec_init(16);
+			len_vals = len_vec_init(16);
+		}
+		val_vec_clip(vals, 0);
+		len_vec_clip(len_vals, 0);
+		for (size_t k = i; k < j; k++) {
+			val_vec_add(vals, entry_val(entries[k]));
+			len_vec_add(len_vals, entries[k]->len_val);
+		}
+
+		merge_ent = _mtbl_sorter_merge_values(s, entry_key(ent), ent->len_key,
+						      j - i, val_vec_data(vals),
+						      len_vec_data(len_vals),
+						      &merge_buf, &size_merge_buf);
+		if (merge_ent == NULL) {
+			res = mtbl_res_failure;
+			break;
+		}
+		for (size_t k = i; k < j; k++)
+			free(entries[k]);
+		entries[n++] = merge_ent;
+	}
+
+	if (res != mtbl_res_success) {
+		for (size_t k = 0; k < n; k++)
+			free(entries[k]);
+		for (size_t k = i; k < n_entries; k++)
+			free(entries[k]);
+		n = 0;
+	}
+	entry_vec_clip(vec, n);
+
+	if (vals != NULL) {
+		val_vec_destroy(&vals);
+		len_vec_destroy(&len_vals);
+	}
+	free(merge_buf);
+	return (res);
+}
+
+/* Create an unlinked temporary file and a writer for it. */
+static struct mtbl_writer *
+_mtbl_sorter_temp_writer(const struct mtbl_sorter *s, size_t tmp_dir, int *fd)
+{
+	const char *tmp_dname = s->opt.tmp_dnames[tmp_dir];
+	struct mtbl_writer *w;
 	char template[64];
 
 	/* Temporary file creation: */
 	sprintf(template, "/.mtbl.%ld.XXXXXX", (long)getpid());
-	ubuf *tmp_fname = ubuf_init(strlen(s->opt.tmp_dname) + strlen(template) + 1);
-	ubuf_append(tmp_fname, (uint8_t *) s->opt.tmp_dname, strlen(s->opt.tmp_dname));
+	ubuf *tmp_fname = ubuf_init(strlen(tmp_dname) + strlen(template) + 1);
+	ubuf_append(tmp_fname, (uint8_t *) tmp_dname, strlen(tmp_dname));
 	ubuf_append(tmp_fname, (uint8_t *) template, strlen(template));
 	ubuf_append(tmp_fname, (const uint8_t *) "\x00", 1);
 
-	int fd = mkstemp((char *) ubuf_data(tmp_fname));
-	assert(fd >= 0);
+	*fd = mkstemp((char *) ubuf_data(tmp_fname));
+	assert(*fd >= 0);
 	int unlink_ret = unlink((char *) ubuf_data(tmp_fname));
 	assert(unlink_ret == 0);
 	ubuf_destroy(&tmp_fname);
 
 	struct mtbl_writer_options *wopt = mtbl_writer_options_init();
 	mtbl_writer_options_set_compression(wopt, MTBL_COMPRESSION_SNAPPY);
-	struct mtbl_writer *w = mtbl_writer_init_fd(fd, wopt);
+	mtbl_writer_options_set_tombstones(wopt,
+		__atomic_load_n(&s->tombstones, __ATOMIC_RELAXED));
+	w = mtbl_writer_init_fd(*fd, wopt);
 	mtbl_writer_options_destroy(&wopt);
 
+	return (w);
+}
+
+/*
+ * Open a reader for a completed temporary file and account for it in the
+ * usage of its temporary directory. The file descriptor is closed.
+ */
+static struct mtbl_reader *
+_mtbl_sorter_temp_reader(const struct mtbl_sorter *s, size_t tmp_dir, int fd)
+{
+	struct temp_dir_usage *usage = &s->tmp_usage[tmp_dir];
+	struct mtbl_reader *r;
+
+	r = mtbl_reader_init_fd(fd, NULL);
+	close(fd);
+	if (r != NULL) {
+		const struct mtbl_metadata *m = mtbl_reader_metadata(r);
+		uint64_t bytes = mtbl_metadata_index_block_offset(m) +
+				 mtbl_metadata_bytes_index_block(m) +
+				 MTBL_METADATA_SIZE;
+
+		/* Chunks may be written concurrently by threadpool workers. */
+		__sync_add_and_fetch(&usage->count_files, 1);
+		__sync_add_and_fetch(&usage->bytes_files, bytes);
+	}
+	return (r);
+}
+
+static void
+_mtbl_sorter_add_reader(struct mtbl_sorter *s, struct mtbl_reader *r)
+{
+	pthread_mutex_lock(&s->lock);
+	reader_vec_add(s->readers, r);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static struct mtbl_reader *
+_mtbl_sorter_write_chunk(struct entry_batch *b)
+{
+	mtbl_res res;
+	const struct mtbl_sorter *s = b->s;
+	size_t tmp_dir = b->tmp_dir;
+	int fd;
+
+	struct mtbl_writer *w = _mtbl_sorter_temp_writer(s, tmp_dir, &fd);
+
 	/* Sort and add sorter entries to the temporary file writer. */
-	struct entry **entries = entry_vec_data(b->entries);
-	qsort(entries, entry_vec_size(b->entries), sizeof(void *), _mtbl_sorter_compare);
+	res = _mtbl_sorter_sort_entries(s, b->entries);
+	if (res != mtbl_res_success) {
+		mtbl_writer_destroy(&w);
+		close(fd);
+		entry_vec_destroy(&b->entries);
+		free(b);
+		return (NULL);
+	}
 	for (unsigned i = 0; i < entry_vec_size(b->entries); i++) {
 		struct entry *ent = entry_vec_value(b->entries, i);
 
-		if (i + 1 < entry_vec_size(b->entries)) {
-			struct entry *next_ent = entry_vec_value(b->entries, i + 1);
-			struct entry *merge_ent = NULL;
-
-			if (_mtbl_sorter_compare(&ent, &next_ent) == 0) {
-				assert(s->opt.merge != NULL);
-				uint8_t *merge_val = NULL;
-				size_t len_merge_val = 0;
-				s->opt.merge(s->opt.merge_clos,
-					     entry_key(ent), ent->len_key,
-					     entry_val(ent), ent->len_val,
-					     entry_val(next_ent), next_ent->len_val,
-					     &merge_val, &len_merge_val);
-				if (merge_val == NULL) {
-					free(b);
-					mtbl_writer_destroy(&w);
-					return (NULL);
-				}
-				size_t len = sizeof(struct entry) + ent->len_key + len_merge_val;
-				merge_ent = my_malloc(len);
-				merge_ent->len_key = ent->len_key;
-				merge_ent->len_val = len_merge_val;
-				memcpy(entry_key(merge_ent), entry_key(ent), ent->len_key);
-				memcpy(entry_val(merge_ent), merge_val, len_merge_val);
-				free(merge_val);
-				free(ent);
-				free(next_ent);
-
-				entry_vec_data(b->entries)[i + 1] = merge_ent;
-
-				continue;
-			}
-		}
-
-		res = mtbl_writer_add(w,
-				      entry_key(ent), ent->len_key,
-				      entry_val(ent), ent->len_val);
-		free(ent);
+		res = writer_add(w,
+				 entry_key(ent), ent->len_key,
+				 entry_val(ent), ent->len_val,
+				 _mtbl_sorter_entry_type(ent));
 		if (res != mtbl_res_success)
 			break;
 	}
+	for (unsigned i = 0; i < entry_vec_size(b->entries); i++)
+		free(entry_vec_value(b->entries, i));
 	mtbl_writer_destroy(&w);
 	entry_vec_destroy(&b->entries);
 	free(b);
 
-	if (res != mtbl_res_success)
+	if (res != mtbl_res_success) {
+		close(fd);
 		return (NULL);
+	}
 
-	return (mtbl_reader_init_fd(fd, NULL));
+	return (_mtbl_sorter_temp_reader(s, tmp_dir, fd));
 }
 
 mtbl_res
@@ -272,7 +727,7 @@ mtbl_sorter_write(struct mtbl_sorter *s, struct mtbl_writer *w)
 	if (it == NULL)
 		return (mtbl_res_failure);
 	while (mtbl_iter_next(it, &key, &len_key, &val, &len_val) == mtbl_res_success) {
-		res = mtbl_writer_add(w, key, len_key, val, len_val);
+		res = writer_add(w, key, len_key, val, len_val, iter_entry_type(it));
 		if (res != mtbl_res_success)
 			break;
 	}
@@ -280,43 +735,405 @@ mtbl_sorter_write(struct mtbl_sorter *s, struct mtbl_writer *w)
 	return (res);
 }
 
+static void
+_mtbl_sorter_combiner_grow(struct sorter_buffer *buf)
+{
+	struct combiner_slot *old_slots = buf->slots;
+	size_t old_n_slots = buf->n_slots;
+
+	buf->n_slots = old_n_slots ? 2 * old_n_slots : INITIAL_SORTER_COMBINER_SIZE;
+	buf->slots = my_calloc(buf->n_slots, sizeof(*buf->slots));
+	for (size_t i = 0; i < old_n_slots; i++) {
+		if (old_slots[i].idx == 0)
+			continue;
+		size_t j = old_slots[i].hash & (buf->n_slots - 1);
+		while (buf->slots[j].idx != 0)
+			j = (j + 1) & (buf->n_slots - 1);
+		buf->slots[j] = old_slots[i];
+	}
+	free(old_slots);
+}
+
+/*
+ * Find the combiner slot holding the entry for 'key', or the empty slot
+ * where an entry for 'key' should be inserted.
+ */
+static struct combiner_slot *
+_mtbl_sorter_combiner_lookup(struct sorter_buffer *buf, uint64_t hash,
+			     const uint8_t *key, size_t len_key)
+{
+	size_t i;
+
+	if (2 * (buf->n_slots_used + 1) > buf->n_slots)
+		_mtbl_sorter_combiner_grow(buf);
+
+	i = hash & (buf->n_slots - 1);
+	while (buf->slots[i].idx != 0) {
+		if (buf->slots[i].hash == hash) {
+			struct entry *ent = entry_vec_value(buf->vec, buf->slots[i].idx - 1);
+			if (bytes_compare(entry_key(ent), ent->len_key, key, len_key) == 0)
+				break;
+		}
+		i = (i + 1) & (buf->n_slots - 1);
+	}
+	return (&buf->slots[i]);
+}
+
+static mtbl_res
+_mtbl_sorter_combine(const struct mtbl_sorter *s, struct sorter_buffer *buf,
+		     struct combiner_slot *slot,
+		     const uint8_t *val, size_t len_val, bool tombstone)
+{
+	struct entry *ent = entry_vec_value(buf->vec, slot->idx - 1);
+	struct entry *merge_ent;
+
+	if (ent->tombstone)
+		return (mtbl_res_success);
+	if (tombstone)
+		merge_ent = _mtbl_sorter_entry_init(entry_key(ent), ent->len_key,
+						    NULL, 0, true);
+	else
+		merge_ent = _mtbl_sorter_merge_entry(s, buf, ent, val, len_val);
+	if (merge_ent == NULL)
+		return (mtbl_res_failure);
+
+	buf->entry_bytes -= ent->len_val;
+	buf->entry_bytes += merge_ent->len_val;
+	entry_vec_data(buf->vec)[slot->idx - 1] = merge_ent;
+	free(ent);
+
+	return (mtbl_res_success);
+}
+
+/* Memory used by the entries held in a sorter buffer. */
+static size_t
+_sorter_buffer_bytes(const struct sorter_buffer *buf)
+{
+	size_t bytes = buf->entry_bytes + entry_vec_bytes(buf->vec) +
+		       buf->n_slots * sizeof(*buf->slots);
+
+	if (buf->rs_heap != NULL)
+		bytes += heap_size(buf->rs_heap) * sizeof(struct entry *);
+	return (bytes);
+}
+
+/* Write out the entry last taken from the replacement selection heap. */
+static mtbl_res
+_mtbl_sorter_rs_write_last(struct sorter_buffer *buf)
+{
+	struct entry *ent = buf->rs_last;
+	mtbl_res res;
+
+	if (ent == NULL)
+		return (mtbl_res_success);
+	res = writer_add(buf->rs_writer,
+			 entry_key(ent), ent->len_key,
+			 entry_val(ent), ent->len_val,
+			 _mtbl_sorter_entry_type(ent));
+	buf->entry_bytes -= _mtbl_sorter_entry_bytes(ent);
+	my_free(buf->rs_last);
+	return (res);
+}
+
+/*
+ * Take the smallest entry from the replacement selection heap, merging it
+ * with the previously taken entry if their keys are equal, or writing the
+ * previously taken entry to the current run otherwise.
+ */
+static mtbl_res
+_mtbl_sorter_rs_next(struct mtbl_sorter *s, struct sorter_buffer *buf)
+{
+	struct entry *ent = heap_pop(buf->rs_heap);
+	struct entry *last = buf->rs_last;
+
+	if (last != NULL && _mtbl_sorter_compare(&last, &ent) == 0) {
+		struct entry *merge_ent;
+
+		/* A tombstone hides the values for its key. */
+		if (last->tombstone || ent->tombstone) {
+			struct entry *hidden = last->tombstone ? ent : last;
+
+			buf->entry_bytes -= _mtbl_sorter_entry_bytes(hidden);
+			buf->rs_last = last->tombstone ? last : ent;
+			free(hidden);
+			return (mtbl_res_success);
+		}
+
+		merge_ent = _mtbl_sorter_merge_entry(s, buf, last,
+						     entry_val(ent), ent->len_val);
+		buf->entry_bytes -= _mtbl_sorter_entry_bytes(last);
+		buf->entry_bytes -= _mtbl_sorter_entry_bytes(ent);
+		free(last);
+		free(ent);
+		buf->rs_last = merge_ent;
+		if (merge_ent == NULL)
+			return (mtbl_res_failure);
+		buf->entry_bytes += _mtbl_sorter_entry_bytes(merge_ent);
+		return (mtbl_res_success);
+	}
+
+	mtbl_res res = _mtbl_sorter_rs_write_last(buf);
+	buf->rs_last = ent;
+	return (res);
+}
+
+/*
+ * Start a new replacement selection run from the entries held in the
+ * buffer's entry vector.
+ */
+static void
+_mtbl_sorter_rs_start_run(struct mtbl_sorter *s, struct sorter_buffer *buf)
+{
+	if (buf->rs_heap == NULL)
+		buf->rs_heap = heap_init(_mtbl_sorter_heap_compare, NULL);
+	for (size_t i = 0; i < entry_vec_size(buf->vec); i++)
+		heap_add(buf->rs_heap, entry_vec_value(buf->vec, i));
+	heap_heapify(buf->rs_heap);
+	entry_vec_clip(buf->vec, 0);
+
+	if (buf->n_slots_used > 0) {
+		memset(buf->slots, 0, buf->n_slots * sizeof(*buf->slots));
+		buf->n_slots_used = 0;
+	}
+
+	buf->rs_tmp_dir = _mtbl_sorter_next_temp_dir(s);
+	buf->rs_tombstones = __atomic_load_n(&s->tombstones, __ATOMIC_RELAXED);
+	buf->rs_writer = _mtbl_sorter_temp_writer(s, buf->rs_tmp_dir, &buf->rs_fd);
+}
+
+/*
+ * Write out the remainder of the current replacement selection run and add
+ * the completed run to the sorter. A failed run is recorded as a NULL reader.
+ */
+static mtbl_res
+_mtbl_sorter_rs_end_run(struct mtbl_sorter *s, struct sorter_buffer *buf)
+{
+	mtbl_res res = mtbl_res_success;
+	struct mtbl_reader *r = NULL;
+
+	while (res == mtbl_res_success && heap_size(buf->rs_heap) > 0)
+		res = _mtbl_sorter_rs_next(s, buf);
+	if (res == mtbl_res_success)
+		res = _mtbl_sorter_rs_write_last(buf);
+	mtbl_writer_destroy(&buf->rs_writer);
+
+	if (res == mtbl_res_success) {
+		r = _mtbl_sorter_temp_reader(s, buf->rs_tmp_dir, buf->rs_fd);
+		if (r == NULL)
+			res = mtbl_res_failure;
+	} else {
+		close(buf->rs_fd);
+	}
+	_mtbl_sorter_add_reader(s, r);
+
+	return (res);
+}
+
+/*
+ * Write entries to replacement selection runs until the buffer is back
+ * under the sorter's memory limit.
+ */
+static mtbl_res
+_mtbl_sorter_rs_spill(struct mtbl_sorter *s, struct sorter_buffer *buf)
+{
+	mtbl_res res = mtbl_res_success;
+
+	assert(!s->iterating);
+	if (buf->rs_writer == NULL)
+		_mtbl_sorter_rs_start_run(s, buf);
+
+	while (_sorter_buffer_bytes(buf) >= s->opt.max_memory) {
+		if (heap_size(buf->rs_heap) == 0) {
+			/* No entry can extend the current run. */
+			if (entry_vec_size(buf->vec) == 0)
+				break;
+			res = _mtbl_sorter_rs_end_run(s, buf);
+			if (res != mtbl_res_success)
+				return (res);
+			_mtbl_sorter_rs_start_run(s, buf);
+		}
+		res = _mtbl_sorter_rs_next(s, buf);
+		if (res != mtbl_res_success) {
+			/* Entries have been lost; fail the sort. */
+			_mtbl_sorter_add_reader(s, NULL);
+			return (res);
+		}
+	}
+
+	return (res);
+}
+
+/*
+ * Complete any replacement selection run in progress. Entries waiting for
+ * the next run are left in the buffer's entry vector.
+ */
+static mtbl_res
+_mtbl_sorter_rs_finish(struct mtbl_sorter *s, struct sorter_buffer *buf)
+{
+	if (buf->rs_writer == NULL)
+		return (mtbl_res_success);
+	return (_mtbl_sorter_rs_end_run(s, buf));
+}
+
+static mtbl_res
+_mtbl_sorter_buffer_add(struct mtbl_sorter *s, struct sorter_buffer *buf,
+			const uint8_t *key, size_t len_key,
+			const uint8_t *val, size_t len_val, bool tombstone)
+{
+	mtbl_res res = mtbl_res_success;
+	assert(len_key <= UINT_MAX);
+	assert(len_val <= UINT_MAX);
+
+	struct combiner_slot *slot = NULL;
+	struct entry *ent;
+	uint64_t hash = 0;
+
+	if (tombstone) {
+		__atomic_store_n(&s->tombstones, true, __ATOMIC_RELAXED);
+
+		/* A run started before the first tombstone cannot hold one. */
+		if (buf->rs_writer != NULL && !buf->rs_tombstones) {
+			res = _mtbl_sorter_rs_end_run(s, buf);
+			if (res != mtbl_res_success)
+				return (res);
+		}
+	}
+
+	/*
+	 * Entries which do not sort before the last entry taken for the
+	 * current replacement selection run can still be written to it.
+	 */
+	if (buf->rs_writer != NULL &&
+	    (buf->rs_last == NULL ||
+	     bytes_compare(key, len_key,
+			   entry_key(buf->rs_last), buf->rs_last->len_key) >= 0))
+	{
+		ent = _mtbl_sorter_entry_init(key, len_key, val, len_val, tombstone);
+		heap_push(buf->rs_heap, ent);
+		buf->entry_bytes += _mtbl_sorter_entry_bytes(ent);
+		goto out;
+	}
+
+	/* Merge with an existing in-memory entry for this key, if any. */
+	if (s->opt.combine &&
+	    (s->opt.merge != NULL || s->opt.merge_values != NULL))
+	{
+		hash = XXH64(key, len_key, 0);
+		slot = _mtbl_sorter_combiner_lookup(buf, hash, key, len_key);
+		if (slot->idx != 0) {
+			res = _mtbl_sorter_combine(s, buf, slot, val, len_val, tombstone);
+			if (res != mtbl_res_success)
+				return (res);
+			goto out;
+		}
+	}
+
+	ent = _mtbl_sorter_entry_init(key, len_key, val, len_val, tombstone);
+	entry_vec_append(buf->vec, &ent, 1);
+	buf->entry_bytes += _mtbl_sorter_entry_bytes(ent);
+
+	if (slot != NULL) {
+		slot->hash = hash;
+		slot->idx = entry_vec_size(buf->vec);
+		buf->n_slots_used++;
+	}
+
+out:
+	if (_sorter_buffer_bytes(buf) >= s->opt.max_memory) {
+		if (s->opt.run_mode == MTBL_SORTER_RUN_REPLACEMENT_SELECTION)
+			res = _mtbl_sorter_rs_spill(s, buf);
+		else
+			res = _mtbl_sorter_flush(s, buf);
+	}
+
+	return (res);
+}
+
 mtbl_res
 mtbl_sorter_add(struct mtbl_sorter *s,
 		const uint8_t *key, size_t len_key,
 		const uint8_t *val, size_t len_val)
 {
-	mtbl_res res = mtbl_res_success;
 	if (s->iterating)
 		return (mtbl_res_failure);
-	assert(len_key <= UINT_MAX);
-	assert(len_val <= UINT_MAX);
+	return (_mtbl_sorter_buffer_add(s, &s->buf, key, len_key, val, len_val, false));
+}
 
-	struct entry *ent;
-	size_t entry_bytes;
+mtbl_res
+mtbl_sorter_add_tombstone(struct mtbl_sorter *s,
+			  const uint8_t *key, size_t len_key)
+{
+	if (s->iterating)
+		return (mtbl_res_failure);
+	return (_mtbl_sorter_buffer_add(s, &s->buf, key, len_key, NULL, 0, true));
+}
 
-	entry_bytes = sizeof(*ent) + len_key + len_val;
-	ent = my_malloc(entry_bytes);
-	ent->len_key = len_key;
-	ent->len_val = len_val;
-	memcpy(entry_key(ent), key, len_key);
-	memcpy(entry_val(ent), val, len_val);
-	entry_vec_append(s->vec, &ent, 1);
-	s->entry_bytes += entry_bytes;
+struct mtbl_sorter_handle *
+mtbl_sorter_handle_init(struct mtbl_sorter *s)
+{
+	struct mtbl_sorter_handle *h;
 
-	if (s->entry_bytes + entry_vec_bytes(s->vec) >= s->opt.max_memory)
-		res = _mtbl_sorter_flush(s);
+	assert(!s->iterating);
+	h = my_calloc(1, sizeof(*h));
+	h->s = s;
+	h->buf.vec = entry_vec_init(INITIAL_SORTER_VEC_SIZE);
+	__sync_add_and_fetch(&s->n_handles, 1);
+	return (h);
+}
 
-	return (res);
+void
+mtbl_sorter_handle_destroy(struct mtbl_sorter_handle **h)
+{
+	if (*h) {
+		struct mtbl_sorter *s = (*h)->s;
+		entry_vec *vec = (*h)->buf.vec;
+
+		/* A failed run is recorded in the sorter and fails the sort. */
+		(void) _mtbl_sorter_rs_finish(s, &(*h)->buf);
+
+		/*
+		 * Hand over the entries remaining in this handle's buffer to
+		 * the sorter, to be sorted together with the sorter's own
+		 * in-memory entries by mtbl_sorter_iter().
+		 */
+		pthread_mutex_lock(&s->lock);
+		entry_vec_append(s->handle_vec, entry_vec_data(vec), entry_vec_size(vec));
+		pthread_mutex_unlock(&s->lock);
+		entry_vec_clip(vec, 0);
+
+		_sorter_buffer_clear(&(*h)->buf);
+		__sync_sub_and_fetch(&s->n_handles, 1);
+		my_free(*h);
+	}
+}
+
+mtbl_res
+mtbl_sorter_handle_add(struct mtbl_sorter_handle *h,
+		       const uint8_t *key, size_t len_key,
+		       const uint8_t *val, size_t len_val)
+{
+	if (h->s->iterating)
+		return (mtbl_res_failure);
+	return (_mtbl_sorter_buffer_add(h->s, &h->buf, key, len_key, val, len_val, false));
+}
+
+mtbl_res
+mtbl_sorter_handle_add_tombstone(struct mtbl_sorter_handle *h,
+				 const uint8_t *key, size_t len_key)
+{
+	if (h->s->iterating)
+		return (mtbl_res_failure);
+	return (_mtbl_sorter_buffer_add(h->s, &h->buf, key, len_key, NULL, 0, true));
 }
 
 static mtbl_res
-_mtbl_sorter_flush(struct mtbl_sorter *s)
+_mtbl_sorter_flush(struct mtbl_sorter *s, struct sorter_buffer *buf)
 {
 	mtbl_res res = mtbl_res_success;
 	struct entry_batch *b;
 
 	assert(!s->iterating);
-	b = _mtbl_sorter_get_entry_batch(s);
+	b = _mtbl_sorter_get_entry_batch(s, buf);
 
 	if (s->pool != NULL) {
 		threadpool_dispatch(
@@ -329,15 +1146,57 @@ _mtbl_sorter_flush(struct mtbl_sorter *s)
 
 	} else {
 		struct mtbl_reader *r = _mtbl_sorter_write_chunk(b);
-		reader_vec_add(s->readers, r);
+		_mtbl_sorter_add_reader(s, r);
 		if (r == NULL) res = mtbl_res_failure;
 	}
 
 	return (res);
 }
 
+static uint64_t
+_temp_dir_free_bytes(const char *dname)
+{
+	struct statvfs st;
+
+	if (statvfs(dname, &st) != 0)
+		return (0);
+	return ((uint64_t) st.f_bavail * st.f_frsize);
+}
+
+/*
+ * Select the temporary directory to write the next chunk to. This may be
+ * called concurrently by producer threads using mtbl_sorter_handle objects.
+ */
+static size_t
+_mtbl_sorter_next_temp_dir(struct mtbl_sorter *s)
+{
+	size_t start, idx;
+
+	if (s->opt.n_tmp_dnames == 1)
+		return (0);
+
+	start = __sync_fetch_and_add(&s->next_tmp_dir, 1) % s->opt.n_tmp_dnames;
+	idx = start;
+
+	if (s->opt.tmp_dir_policy == MTBL_SORTER_TEMP_DIR_FREE_SPACE) {
+		uint64_t best = 0;
+
+		for (size_t i = 0; i < s->opt.n_tmp_dnames; i++) {
+			/* Start at the round-robin position to break ties. */
+			size_t j = (start + i) % s->opt.n_tmp_dnames;
+			uint64_t avail = _temp_dir_free_bytes(s->opt.tmp_dnames[j]);
+			if (avail > best) {
+				best = avail;
+				idx = j;
+			}
+		}
+	}
+
+	return (idx);
+}
+
 static struct entry_batch *
-_mtbl_sorter_get_entry_batch(struct mtbl_sorter *s)
+_mtbl_sorter_get_entry_batch(struct mtbl_sorter *s, struct sorter_buffer *buf)
 {
 	struct entry_batch *b;
 
@@ -345,10 +1204,16 @@ _mtbl_sorter_get_entry_batch(struct mtbl_sorter *s)
 
 	b = calloc(1, sizeof(*b));
 	b->s = s;
-	b->entries = s->vec;
+	b->entries = buf->vec;
+	b->tmp_dir = _mtbl_sorter_next_temp_dir(s);
 
-	s->vec = entry_vec_init(INITIAL_SORTER_VEC_SIZE);
-	s->entry_bytes = 0;
+	buf->vec = entry_vec_init(INITIAL_SORTER_VEC_SIZE);
+	buf->entry_bytes = 0;
+
+	if (buf->n_slots_used > 0) {
+		memset(buf->slots, 0, buf->n_slots * sizeof(*buf->slots));
+		buf->n_slots_used = 0;
+	}
 
 	return b;
 }
@@ -362,7 +1227,143 @@ _write_temp_file_wrapper(void *batch) {
 static void _collect_readers_cb(void *reader, void *sorter) {
 
 	struct mtbl_sorter *s = sorter;
-	reader_vec_add(s->readers, reader);
+	_mtbl_sorter_add_reader(s, reader);
+}
+
+/* Index of the first entry with a key >= 'key'. */
+static size_t
+mem_lower_bound(entry_vec *entries, const uint8_t *key, size_t len_key)
+{
+	size_t lo = 0, hi = entry_vec_size(entries);
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		struct entry *ent = entry_vec_value(entries, mid);
+		if (bytes_compare(entry_key(ent), ent->len_key, key, len_key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo);
+}
+
+static mtbl_res
+mem_iter_seek(void *v, const uint8_t *key, size_t len_key)
+{
+	struct mem_iter *it = (struct mem_iter *) v;
+	it->idx = mem_lower_bound(it->entries, key, len_key);
+	return (mtbl_res_success);
+}
+
+static mtbl_res
+mem_iter_next(void *v,
+	      const uint8_t **key, size_t *len_key,
+	      const uint8_t **val, size_t *len_val)
+{
+	struct mem_iter *it = (struct mem_iter *) v;
+	struct entry *ent;
+
+	if (it->idx >= entry_vec_size(it->entries))
+		return (mtbl_res_failure);
+	ent = entry_vec_value(it->entries, it->idx);
+
+	switch (it->it_type) {
+	case MEM_ITER_TYPE_ITER:
+		break;
+	case MEM_ITER_TYPE_GET:
+		if (bytes_compare(entry_key(ent), ent->len_key,
+				  ubuf_data(it->k), ubuf_size(it->k)) != 0)
+			return (mtbl_res_failure);
+		break;
+	case MEM_ITER_TYPE_GET_PREFIX:
+		if (!(ubuf_size(it->k) <= ent->len_key &&
+		      memcmp(ubuf_data(it->k), entry_key(ent), ubuf_size(it->k)) == 0))
+			return (mtbl_res_failure);
+		break;
+	case MEM_ITER_TYPE_GET_RANGE:
+		if (bytes_compare(entry_key(ent), ent->len_key,
+				  ubuf_data(it->k), ubuf_size(it->k)) > 0)
+			return (mtbl_res_failure);
+		break;
+	default:
+		assert(0);
+	}
+
+	it->idx++;
+	*key = entry_key(ent);
+	*len_key = ent->len_key;
+	*val = entry_val(ent);
+	*len_val = ent->len_val;
+	return (mtbl_res_success);
+}
+
+static entry_type
+mem_iter_entry_type(void *v)
+{
+	struct mem_iter *it = (struct mem_iter *) v;
+
+	if (it->idx == 0)
+		return (ENTRY_TYPE_VALUE);
+	return (_mtbl_sorter_entry_type(entry_vec_value(it->entries, it->idx - 1)));
+}
+
+static void
+mem_iter_free(void *v)
+{
+	struct mem_iter *it = (struct mem_iter *) v;
+	if (it) {
+		ubuf_destroy(&it->k);
+		free(it);
+	}
+}
+
+static struct mtbl_iter *
+mem_iter_init(entry_vec *entries, mem_iter_type it_type,
+	      const uint8_t *key0, size_t len_key0,
+	      const uint8_t *key1, size_t len_key1)
+{
+	struct mem_iter *it = my_calloc(1, sizeof(*it));
+	struct mtbl_iter *iter;
+
+	it->entries = entries;
+	it->it_type = it_type;
+	if (it_type != MEM_ITER_TYPE_ITER) {
+		it->idx = mem_lower_bound(entries, key0, len_key0);
+		it->k = ubuf_init(len_key1);
+		ubuf_append(it->k, key1, len_key1);
+	}
+	iter = mtbl_iter_init(mem_iter_seek, mem_iter_next, mem_iter_free, it);
+	iter_set_entry_type_func(iter, mem_iter_entry_type);
+	return (iter);
+}
+
+static struct mtbl_iter *
+mem_source_iter(void *clos)
+{
+	return (mem_iter_init(clos, MEM_ITER_TYPE_ITER, NULL, 0, NULL, 0));
+}
+
+static struct mtbl_iter *
+mem_source_get(void *clos, const uint8_t *key, size_t len_key)
+{
+	return (mem_iter_init(clos, MEM_ITER_TYPE_GET,
+			      key, len_key, key, len_key));
+}
+
+static struct mtbl_iter *
+mem_source_get_prefix(void *clos, const uint8_t *key, size_t len_key)
+{
+	return (mem_iter_init(clos, MEM_ITER_TYPE_GET_PREFIX,
+			      key, len_key, key, len_key));
+}
+
+static struct mtbl_iter *
+mem_source_get_range(void *clos,
+		     const uint8_t *key0, size_t len_key0,
+		     const uint8_t *key1, size_t len_key1)
+{
+	return (mem_iter_init(clos, MEM_ITER_TYPE_GET_RANGE,
+			      key0, len_key0, key1, len_key1));
 }
 
 static mtbl_res
@@ -382,6 +1383,13 @@ sorter_iter_next(void *v,
 	return (mtbl_iter_next(it->m_iter, key, len_key, val, len_val));
 }
 
+static entry_type
+sorter_iter_entry_type(void *v)
+{
+	struct sorter_iter *it = (struct sorter_iter *) v;
+	return (iter_entry_type(it->m_iter));
+}
+
 static void
 sorter_iter_free(void *v)
 {
@@ -389,36 +1397,89 @@ sorter_iter_free(void *v)
 	if (it) {
 		mtbl_iter_destroy(&it->m_iter);
 		mtbl_merger_destroy(&it->m);
+		mtbl_source_destroy(&it->mem_source);
 		free(it);
 	}
 }
 
+static struct mtbl_iter *
+sorter_iter_wrap(struct sorter_iter *it)
+{
+	struct mtbl_iter *iter;
+
+	iter = mtbl_iter_init(sorter_iter_seek, sorter_iter_next, sorter_iter_free, it);
+	iter_set_entry_type_func(iter, sorter_iter_entry_type);
+	return (iter);
+}
+
 struct mtbl_iter *
 mtbl_sorter_iter(struct mtbl_sorter *s)
 {
 	struct sorter_iter *it = my_calloc(1, sizeof(*it));
 	struct mtbl_merger_options *mopt = mtbl_merger_options_init();
 
-	if (entry_vec_size(s->vec) > 0) {
-		mtbl_res res = _mtbl_sorter_flush(s);
+	/*
+	 * Wait for any outstanding temporary files to be written before
+	 * adding them to the merger.
+	 */
+	assert(s->n_handles == 0);
+	result_handler_destroy(&s->rhandler);
+	(void) _mtbl_sorter_rs_finish(s, &s->buf);
+	s->iterating = true;
+
+	/* Join the entries left over in any destroyed producer handles. */
+	entry_vec_append(s->buf.vec, entry_vec_data(s->handle_vec),
+			 entry_vec_size(s->handle_vec));
+	entry_vec_clip(s->handle_vec, 0);
+
+	/*
+	 * Entries which have not been spilled to disk are sorted in place and
+	 * merged directly from memory. If the sorter never exceeded its memory
+	 * limit, no temporary files are written at all.
+	 */
+	if (entry_vec_size(s->buf.vec) > 0) {
+		mtbl_res res = _mtbl_sorter_sort_entries(s, s->buf.vec);
 
 		if (res != mtbl_res_success) {
+			mtbl_merger_options_destroy(&mopt);
 			free(it);
 			return (NULL);
 		}
+		it->mem_source = mtbl_source_init(mem_source_iter,
+						  mem_source_get,
+						  mem_source_get_prefix,
+						  mem_source_get_range,
+						  NULL, s->buf.vec);
+		source_set_tombstones(it->mem_source, s->tombstones);
+
+		/* Nothing was spilled, so there is nothing to merge. */
+		if (reader_vec_size(s->readers) == 0) {
+			mtbl_merger_options_destroy(&mopt);
+			it->m_iter = mtbl_source_iter(it->mem_source);
+			return (sorter_iter_wrap(it));
+		}
 	}
 
-	mtbl_merger_options_set_merge_func(mopt, s->opt.merge, s->opt.merge_clos);
+	if (s->opt.merge_values != NULL)
+		mtbl_merger_options_set_merge_values_func(mopt, s->opt.merge_values,
+							  s->opt.merge_clos);
+	else
+		mtbl_merger_options_set_merge_func(mopt, s->opt.merge, s->opt.merge_clos);
 	it->m = mtbl_merger_init(mopt);
 	mtbl_merger_options_destroy(&mopt);
-	result_handler_destroy(&s->rhandler);
+	merger_set_tombstones(it->m, MERGER_TOMBSTONES_DOMINATE);
 
 	for (size_t i = 0; i < reader_vec_size(s->readers); i++) {
 		struct mtbl_reader *r = reader_vec_value(s->readers,i);
+		if (r == NULL) {
+			sorter_iter_free(it);
+			return (NULL);
+		}
 		mtbl_merger_add_source(it->m, mtbl_reader_source(r));
 	}
+	if (it->mem_source != NULL)
+		mtbl_merger_add_source(it->m, it->mem_source);
 
 	it->m_iter = mtbl_source_iter(mtbl_merger_source(it->m));
-	s->iterating = true;
-	return (mtbl_iter_init(sorter_iter_seek, sorter_iter_next, sorter_iter_free, it));
+	return (sorter_iter_wrap(it));
 }
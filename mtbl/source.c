@@ -22,6 +22,10 @@ struct mtbl_source {
 	mtbl_source_get_prefix_func	source_get_prefix;
 	mtbl_source_get_range_func	source_get_range;
 	mtbl_source_free_func		source_free;
+	source_key_range_func		source_key_range;
+	source_lookup_func		source_lookup;
+	bool				lookup_unique;
+	bool				tombstones;
 	void				*clos;
 };
 
@@ -58,6 +62,45 @@ mtbl_source_destroy(struct mtbl_source **s)
 	}
 }
 
+void
+source_set_key_range_func(struct mtbl_source *s, source_key_range_func key_range)
+{
+	s->source_key_range = key_range;
+}
+
+void
+source_key_range(const struct mtbl_source *s, struct key_range *kr)
+{
+	memset(kr, 0, sizeof(*kr));
+	if (s->source_key_range != NULL)
+		s->source_key_range(s->clos, kr);
+}
+
+void
+source_set_lookup_func(struct mtbl_source *s, source_lookup_func lookup, bool unique)
+{
+	s->source_lookup = lookup;
+	s->lookup_unique = unique;
+}
+
+bool
+source_lookup_unique(const struct mtbl_source *s)
+{
+	return (s->source_lookup != NULL && s->lookup_unique);
+}
+
+void
+source_set_tombstones(struct mtbl_source *s, bool tombstones)
+{
+	s->tombstones = tombstones;
+}
+
+bool
+source_tombstones(const struct mtbl_source *s)
+{
+	return (s->tombstones);
+}
+
 struct mtbl_iter *
 mtbl_source_iter(const struct mtbl_source *s)
 {
@@ -86,6 +129,37 @@ mtbl_source_get_range(const struct mtbl_source *s,
 	return (s->source_get_range(s->clos, key0, len_key0, key1, len_key1));
 }
 
+mtbl_res
+source_lookup_iter(const struct mtbl_source *s,
+		   const uint8_t *key, size_t len_key,
+		   mtbl_lookup_func lookup, void *clos)
+{
+	const uint8_t *k, *val;
+	size_t len_k, len_val;
+	struct mtbl_iter *it;
+	mtbl_res res = mtbl_res_failure;
+
+	it = mtbl_source_get(s, key, len_key);
+	while (mtbl_iter_next(it, &k, &len_k, &val, &len_val) == mtbl_res_success) {
+		if (iter_entry_type(it) == ENTRY_TYPE_TOMBSTONE)
+			continue;
+		lookup(clos, k, len_k, val, len_val);
+		res = mtbl_res_success;
+	}
+	mtbl_iter_destroy(&it);
+	return (res);
+}
+
+mtbl_res
+mtbl_source_lookup(const struct mtbl_source *s,
+		   const uint8_t *key, size_t len_key,
+		   mtbl_lookup_func lookup, void *clos)
+{
+	if (s->source_lookup != NULL)
+		return (s->source_lookup(s->clos, key, len_key, lookup, clos));
+	return (source_lookup_iter(s, key, len_key, lookup, clos));
+}
+
 mtbl_res
 mtbl_source_write(const struct mtbl_source *s, struct mtbl_writer *w)
 {
@@ -97,7 +171,10 @@ mtbl_source_write(const struct mtbl_source *s, struct mtbl_writer *w)
 	if (it == NULL)
 		return (mtbl_res_failure);
 	while (mtbl_iter_next(it, &key, &len_key, &val, &len_val) == mtbl_res_success) {
-		res = mtbl_writer_add(w, key, len_key, val, len_val);
+		/* Copy whole data blocks verbatim where possible. */
+		if (mtbl_writer_add_iter_block(w, it, NULL) == mtbl_res_success)
+			continue;
+		res = writer_add(w, key, len_key, val, len_val, iter_entry_type(it));
 		if (res != mtbl_res_success)
 			break;
 	}
@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2024 DomainTools LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Decoding of consecutive varints 16 bytes at a time. One SSE2 load and
+ * byte mask give the ends of all the varints in the 16 bytes, and the
+ * BMI2 pext instruction gathers the 7 bit groups of each of them at once.
+ * The scalar decoder in mtbl-private.h handles the last bytes of a buffer,
+ * and 64 bit varints longer than 8 bytes.
+ */
+
+#if __GNUC__ >= 3 && defined(__x86_64__)
+
+#include <emmintrin.h>
+
+#include "mtbl-private.h"
+
+#define CPUID_VENDOR		(0)
+#define CPUID_FEATURES		(1)
+#define CPUID_EXTENDED_FEATURES	(7)
+#define BMI2_FEATURE_BIT	(1 << 8)
+
+/*
+ * AMD CPUs before Zen 3 (family 19h) implement pext in microcode, taking
+ * tens to hundreds of cycles depending on the mask, which makes this
+ * decoder much slower than the scalar one.
+ */
+#define AMD_FAST_PEXT_FAMILY	(0x19)
+
+bool varint_bmi2_supported(void);
+
+bool
+varint_bmi2_supported(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+	uint32_t max_level, family;
+	bool amd;
+
+	asm("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+	    : "a" (CPUID_VENDOR));
+	max_level = eax;
+	if (max_level < CPUID_EXTENDED_FEATURES)
+		return (false);
+
+	/* "AuthenticAMD" or "HygonGenuine" in ebx, edx, ecx. */
+	amd = (ebx == 0x68747541 && edx == 0x69746e65 && ecx == 0x444d4163) ||
+	      (ebx == 0x6f677948 && edx == 0x6e65476e && ecx == 0x656e6975);
+	if (amd) {
+		asm("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+		    : "a" (CPUID_FEATURES));
+		family = (eax >> 8) & 0xf;
+		if (family == 0xf)
+			family += (eax >> 20) & 0xff;
+		if (family < AMD_FAST_PEXT_FAMILY)
+			return (false);
+	}
+
+	asm("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+	    : "a" (CPUID_EXTENDED_FEATURES), "c" (0));
+	return (ebx & BMI2_FEATURE_BIT);
+}
+
+static inline uint64_t
+my_asm_pext_u64(uint64_t src, uint64_t mask)
+{
+	uint64_t dst;
+	asm("pextq %[mask], %[src], %[dst]\n"
+	    : [dst] "=r" (dst) : [src] "r" (src), [mask] "rm" (mask));
+	return dst;
+}
+
+/* The 8 bytes of the 16 byte chunk lo:hi starting at byte off, zero filled. */
+static inline uint64_t
+chunk_bytes(uint64_t lo, uint64_t hi, unsigned off)
+{
+	if (off == 0)
+		return (lo);
+	if (off < 8)
+		return ((lo >> (8 * off)) | (hi << (64 - 8 * off)));
+	return (hi >> (8 * (off - 8)));
+}
+
+/*
+ * Decode up to n varints of at most max_len bytes, stopping at the first
+ * one which does not end within 16 bytes of the buffer's remaining data.
+ * Returns the number of bytes consumed, and sets *n_done to the number of
+ * varints decoded, or returns SIZE_MAX if a varint is too long.
+ */
+static inline size_t
+decode_chunks(const uint8_t *data, size_t len_data, uint64_t *values, size_t n,
+	      unsigned max_len, size_t *n_done)
+{
+	size_t pos = 0, i = 0;
+
+	while (i < n && len_data - pos >= 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *) (data + pos));
+		uint64_t lo = (uint64_t) _mm_cvtsi128_si64(chunk);
+		uint64_t hi = (uint64_t) _mm_cvtsi128_si64(_mm_unpackhi_epi64(chunk, chunk));
+		uint32_t ends = ~(uint32_t) _mm_movemask_epi8(chunk) & 0xffff;
+		unsigned off = 0;
+
+		if (ends == 0)
+			return (SIZE_MAX);
+		while (i < n && ends != 0) {
+			unsigned end = __builtin_ctz(ends);
+			unsigned len = end + 1 - off;
+
+			if (len > max_len)
+				return (SIZE_MAX);
+			if (len > 8)
+				break;
+			values[i++] = my_asm_pext_u64(
+				chunk_bytes(lo, hi, off) & (~UINT64_C(0) >> (64 - 8 * len)),
+				UINT64_C(0x7f7f7f7f7f7f7f7f));
+			ends &= ends - 1;
+			off = end + 1;
+		}
+		pos += off;
+		if (off == 0)
+			break;
+	}
+	*n_done = i;
+	return (pos);
+}
+
+size_t
+varint_decode32_n_bmi2(const uint8_t *data, size_t len_data, uint32_t *values, size_t n)
+{
+	uint64_t v[16];
+	size_t pos = 0;
+
+	while (n > 0) {
+		size_t n_chunk = n < 16 ? n : 16, n_done = 0, len;
+
+		len = decode_chunks(data + pos, len_data - pos, v, n_chunk, 5, &n_done);
+		if (len == SIZE_MAX)
+			return (0);
+		pos += len;
+		for (size_t i = 0; i < n_done; i++)
+			values[i] = (uint32_t) v[i];
+		if (n_done == 0) {
+			len = varint_decode_bounded(data + pos, len_data - pos, v, 5);
+			if (len == 0)
+				return (0);
+			pos += len;
+			values[0] = (uint32_t) v[0];
+			n_done = 1;
+		}
+		values += n_done;
+		n -= n_done;
+	}
+	return (pos);
+}
+
+size_t
+varint_decode64_n_bmi2(const uint8_t *data, size_t len_data, uint64_t *values, size_t n)
+{
+	size_t pos = 0;
+
+	while (n > 0) {
+		size_t n_done = 0, len;
+
+		len = decode_chunks(data + pos, len_data - pos, values, n, 10, &n_done);
+		if (len == SIZE_MAX)
+			return (0);
+		pos += len;
+		if (n_done == 0) {
+			len = varint_decode_bounded(data + pos, len_data - pos, values, 10);
+			if (len == 0)
+				return (0);
+			pos += len;
+			n_done = 1;
+		}
+		values += n_done;
+		n -= n_done;
+	}
+	return (pos);
+}
+
+#endif
@@ -63,6 +63,13 @@
 
 #include "mtbl-private.h"
 
+#if __GNUC__ >= 3 && defined(__x86_64__)
+bool varint_use_bmi2;
+
+/* varint-bmi2.c */
+bool varint_bmi2_supported(void);
+#endif
+
 unsigned
 mtbl_varint_length(uint64_t v)
 {
@@ -169,3 +176,28 @@ mtbl_varint_decode64(const uint8_t *data, uint64_t *value)
 {
 	return _varint_decode(data, value, 64);
 }
+
+/*
+ * The BMI2 kernel is chosen at load time. Without it, the scalar decoding in
+ * mtbl-private.h is used.
+ */
+#if __GNUC__ >= 3 && defined(__x86_64__)
+__attribute__((constructor))
+static void
+varint_runtime_detection(void)
+{
+	varint_use_bmi2 = varint_bmi2_supported();
+}
+#endif
+
+size_t
+mtbl_varint_decode32_n(const uint8_t *data, size_t len_data, uint32_t *values, size_t n)
+{
+	return (varint_decode32_n(data, len_data, values, n));
+}
+
+size_t
+mtbl_varint_decode64_n(const uint8_t *data, size_t len_data, uint64_t *values, size_t n)
+{
+	return (varint_decode64_n(data, len_data, values, n));
+}
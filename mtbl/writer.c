@@ -14,9 +14,12 @@
  * limitations under the License.
  */
 
+#include <pthread.h>
+
 #include "mtbl-private.h"
 #include "bytes.h"
 #include "threadpool.h"
+#include "libmy/my_queue.h"
 #include "libmy/ubuf.h"
 #include "libmy/my_alloc.h"
 
@@ -27,6 +30,8 @@ struct mtbl_writer_options {
 	size_t				block_size;
 	size_t				block_restart_interval;
 	struct mtbl_threadpool		*pool;
+	bool				pipeline;
+	bool				tombstones;
 };
 
 struct mtbl_writer {
@@ -43,8 +48,28 @@ struct mtbl_writer {
 	ubuf				*last_key;
 	uint64_t			last_offset;
 
+	/* With the tombstones option, each value is preceded by its entry type. */
+	ubuf				*typed_val;
+
 	bool				closed;
 	uint64_t			pending_offset;
+
+	/*
+	 * With the pipeline option, added entries are packed into batches
+	 * which are passed to the builder thread. The builder thread owns
+	 * the data block builder and 'last_key', while 'add_key' holds the
+	 * last key added by the caller.
+	 */
+	bool				pipelined;
+	pthread_t			builder;
+	pthread_mutex_t			lock;
+	pthread_cond_t			cond;
+	struct my_queue			*full;
+	struct my_queue			*empty;
+	ubuf				*batch;
+	ubuf				*add_key;
+	uint64_t			n_sent;
+	uint64_t			n_built;
 };
 
 struct data_block {
@@ -57,11 +82,19 @@ struct data_block {
 	size_t				len_last_key;
 
 	uint32_t			crc;
+	bool				raw;	/* already compressed */
 };
 
 
 static void _mtbl_writer_finish(struct mtbl_writer *);
+static void _mtbl_writer_add_entry(struct mtbl_writer *,
+	const uint8_t *, size_t, const uint8_t *, size_t);
+static void _mtbl_writer_pipeline_init(struct mtbl_writer *);
+static void _mtbl_writer_pipeline_destroy(struct mtbl_writer *);
+static void _mtbl_writer_send_batch(struct mtbl_writer *);
+static void _mtbl_writer_sync(struct mtbl_writer *);
 static void _mtbl_writer_flush(struct mtbl_writer *);
+static void _mtbl_writer_submit_block(struct mtbl_writer *, struct data_block *);
 static void _mtbl_writer_compress_block(struct data_block *);
 static size_t _mtbl_writer_write_block(int, struct data_block *);
 static void _mtbl_writer_write_data_block(struct mtbl_writer *, struct data_block *);
@@ -84,6 +117,16 @@ mtbl_writer_options_init(void)
 	return (opt);
 }
 
+struct mtbl_writer_options *
+writer_options_dup(const struct mtbl_writer_options *opt)
+{
+	struct mtbl_writer_options *dup = mtbl_writer_options_init();
+
+	if (opt != NULL)
+		memcpy(dup, opt, sizeof(*dup));
+	return (dup);
+}
+
 void
 mtbl_writer_options_destroy(struct mtbl_writer_options **opt)
 {
@@ -139,6 +182,20 @@ mtbl_writer_options_set_threadpool(struct mtbl_writer_options *opt,
 	opt->pool = pool;
 }
 
+void
+mtbl_writer_options_set_pipeline(struct mtbl_writer_options *opt,
+				 bool pipeline)
+{
+	opt->pipeline = pipeline;
+}
+
+void
+mtbl_writer_options_set_tombstones(struct mtbl_writer_options *opt,
+				   bool tombstones)
+{
+	opt->tombstones = tombstones;
+}
+
 struct mtbl_writer *
 mtbl_writer_init_fd(int orig_fd, const struct mtbl_writer_options *opt)
 {
@@ -154,6 +211,8 @@ mtbl_writer_init_fd(int orig_fd, const struct mtbl_writer_options *opt)
 		w->opt.block_size = DEFAULT_BLOCK_SIZE;
 		w->opt.block_restart_interval = DEFAULT_BLOCK_RESTART_INTERVAL;
 		w->opt.pool = NULL;
+		w->opt.pipeline = false;
+		w->opt.tombstones = false;
 	} else {
 		memcpy(&w->opt, opt, sizeof(*opt));
 	}
@@ -168,6 +227,9 @@ mtbl_writer_init_fd(int orig_fd, const struct mtbl_writer_options *opt)
 	w->m.file_version = MTBL_FORMAT_V2;
 	w->m.compression_algorithm = w->opt.compression_type;
 	w->m.data_block_size = w->opt.block_size;
+	w->m.has_tombstones = w->opt.tombstones;
+	if (w->m.has_tombstones)
+		w->typed_val = ubuf_init(256);
 	w->data = block_builder_init(w->opt.block_restart_interval);
 	w->index = block_builder_init(w->opt.block_restart_interval);
 
@@ -177,6 +239,9 @@ mtbl_writer_init_fd(int orig_fd, const struct mtbl_writer_options *opt)
 		w->rhandler = result_handler_init(_write_data_block_wrapper, w);
 	}
 
+	if (w->opt.pipeline)
+		_mtbl_writer_pipeline_init(w);
+
 	return (w);
 }
 
@@ -206,6 +271,8 @@ mtbl_writer_destroy(struct mtbl_writer **w)
 		block_builder_destroy(&((*w)->data));
 		block_builder_destroy(&((*w)->index));
 		ubuf_destroy(&(*w)->last_key);
+		ubuf_destroy(&(*w)->add_key);
+		ubuf_destroy(&(*w)->typed_val);
 
 		my_free(*w);
 	}
@@ -216,15 +283,84 @@ mtbl_writer_add(struct mtbl_writer *w,
 		const uint8_t *key, size_t len_key,
 		const uint8_t *val, size_t len_val)
 {
+	return (writer_add(w, key, len_key, val, len_val, ENTRY_TYPE_VALUE));
+}
+
+mtbl_res
+mtbl_writer_add_tombstone(struct mtbl_writer *w,
+			  const uint8_t *key, size_t len_key)
+{
+	return (writer_add(w, key, len_key, NULL, 0, ENTRY_TYPE_TOMBSTONE));
+}
+
+mtbl_res
+writer_add(struct mtbl_writer *w,
+	   const uint8_t *key, size_t len_key,
+	   const uint8_t *val, size_t len_val,
+	   entry_type type)
+{
+	ubuf *last_key = w->pipelined ? w->add_key : w->last_key;
+
 	assert(!w->closed);
+	if (type != ENTRY_TYPE_VALUE && !w->m.has_tombstones)
+		return (mtbl_res_failure);
 	if (w->m.count_entries > 0) {
 		if (!(bytes_compare(key, len_key,
-				    ubuf_data(w->last_key), ubuf_size(w->last_key)) > 0))
+				    ubuf_data(last_key), ubuf_size(last_key)) > 0))
 		{
 			return (mtbl_res_failure);
 		}
+	} else {
+		metadata_set_first_key(&w->m, key, len_key);
 	}
 
+	w->m.count_entries += 1;
+	w->m.bytes_keys += len_key;
+	w->m.bytes_values += len_val;
+
+	if (!w->pipelined) {
+		if (w->m.has_tombstones) {
+			ubuf_clip(w->typed_val, 0);
+			ubuf_add(w->typed_val, (uint8_t) type);
+			if (len_val > 0)
+				ubuf_append(w->typed_val, val, len_val);
+			val = ubuf_data(w->typed_val);
+			len_val = ubuf_size(w->typed_val);
+		}
+		_mtbl_writer_add_entry(w, key, len_key, val, len_val);
+		return (mtbl_res_success);
+	}
+
+	ubuf_reset(w->add_key);
+	ubuf_append(w->add_key, key, len_key);
+
+	if (w->batch == NULL) {
+		pthread_mutex_lock(&w->lock);
+		while (!my_queue_remove(w->empty, &w->batch, NULL))
+			pthread_cond_wait(&w->cond, &w->lock);
+		pthread_mutex_unlock(&w->lock);
+		ubuf_clip(w->batch, 0);
+	}
+	ubuf_reserve(w->batch, 2 * 10 + 1 + len_key + len_val);
+	ubuf_advance(w->batch, mtbl_varint_encode64(ubuf_ptr(w->batch), len_key));
+	ubuf_advance(w->batch, mtbl_varint_encode64(ubuf_ptr(w->batch),
+						    len_val + (w->m.has_tombstones ? 1 : 0)));
+	ubuf_append(w->batch, key, len_key);
+	if (w->m.has_tombstones)
+		ubuf_add(w->batch, (uint8_t) type);
+	if (len_val > 0)
+		ubuf_append(w->batch, val, len_val);
+	if (ubuf_size(w->batch) >= WRITER_BATCH_SIZE)
+		_mtbl_writer_send_batch(w);
+
+	return (mtbl_res_success);
+}
+
+static void
+_mtbl_writer_add_entry(struct mtbl_writer *w,
+		       const uint8_t *key, size_t len_key,
+		       const uint8_t *val, size_t len_val)
+{
 	size_t estimated_block_size = block_builder_current_size_estimate(w->data);
 	estimated_block_size += 3*5 + len_key + len_val;
 
@@ -235,12 +371,91 @@ mtbl_writer_add(struct mtbl_writer *w,
 
 	ubuf_reset(w->last_key);
 	ubuf_append(w->last_key, key, len_key);
-
-	w->m.count_entries += 1;
-	w->m.bytes_keys += len_key;
-	w->m.bytes_values += len_val;
 	block_builder_add(w->data, key, len_key, val, len_val);
+}
+
+mtbl_res
+mtbl_writer_add_iter_block(struct mtbl_writer *w, struct mtbl_iter *it,
+			   uint64_t *count_entries)
+{
+	struct raw_block rb;
+	struct block_iter *bi;
+	struct data_block b;
+	const uint8_t *key, *val;
+	size_t len_key, len_val;
+	uint64_t count = 0, bytes_keys = 0, bytes_values = 0;
 
+	assert(!w->closed);
+	if (!iter_raw_block(it, &rb))
+		return (mtbl_res_failure);
+	if (rb.m->file_version != MTBL_FORMAT_V2 ||
+	    rb.m->has_tombstones != w->m.has_tombstones ||
+	    rb.m->compression_algorithm != (uint64_t) w->opt.compression_type ||
+	    rb.m->data_block_size != w->opt.block_size)
+		return (mtbl_res_failure);
+	if (w->m.count_entries > 0 &&
+	    !(bytes_compare(rb.first_key, rb.len_first_key,
+			    ubuf_data(w->pipelined ? w->add_key : w->last_key),
+			    ubuf_size(w->pipelined ? w->add_key : w->last_key)) > 0))
+		return (mtbl_res_failure);
+
+	/* Take over the data block builder from the builder thread. */
+	if (w->pipelined)
+		_mtbl_writer_sync(w);
+
+	/*
+	 * The entries are still walked to keep the metadata exact, and to
+	 * find the last key of the block, which becomes its index key.
+	 */
+	bi = block_iter_init(rb.b);
+	for (block_iter_seek_to_first(bi);
+	     block_iter_get(bi, &key, &len_key, &val, &len_val);
+	     block_iter_next(bi))
+	{
+		count++;
+		bytes_keys += len_key;
+		bytes_values += len_val;
+		if (w->m.has_tombstones && len_val > 0)
+			bytes_values--;
+	}
+	block_iter_seek_to_last(bi);
+	block_iter_get(bi, &key, &len_key, &val, &len_val);
+
+	if (w->m.count_entries == 0)
+		metadata_set_first_key(&w->m, rb.first_key, rb.len_first_key);
+	if (!block_builder_empty(w->data)) {
+		bytes_shortest_separator(w->last_key, rb.first_key, rb.len_first_key);
+		_mtbl_writer_flush(w);
+	}
+
+	ubuf_reset(w->last_key);
+	ubuf_append(w->last_key, key, len_key);
+	if (w->pipelined) {
+		ubuf_reset(w->add_key);
+		ubuf_append(w->add_key, key, len_key);
+	}
+	block_iter_destroy(&bi);
+
+	/* Copy the compressed block, which the iterator may unmap. */
+	memset(&b, 0, sizeof(b));
+	b.raw = true;
+	b.comp_type = w->opt.compression_type;
+	b.len_data = rb.len_data;
+	b.data = my_malloc(b.len_data);
+	memcpy(b.data, rb.data, b.len_data);
+	b.crc = rb.crc;
+	b.len_last_key = ubuf_size(w->last_key);
+	b.last_key = my_malloc(b.len_last_key);
+	memcpy(b.last_key, ubuf_data(w->last_key), b.len_last_key);
+	_mtbl_writer_submit_block(w, &b);
+
+	w->m.count_entries += count;
+	w->m.bytes_keys += bytes_keys;
+	w->m.bytes_values += bytes_values;
+
+	iter_skip_block(it);
+	if (count_entries != NULL)
+		*count_entries = count;
 	return (mtbl_res_success);
 }
 
@@ -251,7 +466,11 @@ _mtbl_writer_finish(struct mtbl_writer *w)
 	uint8_t tbuf[MTBL_METADATA_SIZE];
 	size_t bytes_written;
 
+	if (w->pipelined)
+		_mtbl_writer_pipeline_destroy(w);
 	_mtbl_writer_flush(w);
+	if (w->m.count_entries > 0)
+		metadata_set_last_key(&w->m, ubuf_data(w->last_key), ubuf_size(w->last_key));
 
 	result_handler_destroy(&w->rhandler);
 	assert(!w->closed);
@@ -273,6 +492,114 @@ _mtbl_writer_finish(struct mtbl_writer *w)
 	free(index.data);
 }
 
+/* Runs on the builder thread. */
+static void *
+_mtbl_writer_builder(void *arg)
+{
+	struct mtbl_writer *w = (struct mtbl_writer *) arg;
+	ubuf *batch;
+
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		while (!my_queue_remove(w->full, &batch, NULL))
+			pthread_cond_wait(&w->cond, &w->lock);
+		pthread_mutex_unlock(&w->lock);
+		if (batch == NULL)
+			break;
+
+		const uint8_t *p = ubuf_data(batch);
+		const uint8_t *end = p + ubuf_size(batch);
+		while (p < end) {
+			uint64_t len_key, len_val;
+
+			p += mtbl_varint_decode64(p, &len_key);
+			p += mtbl_varint_decode64(p, &len_val);
+			_mtbl_writer_add_entry(w, p, len_key, p + len_key, len_val);
+			p += len_key + len_val;
+		}
+
+		(void) my_queue_insert(w->empty, &batch, NULL);
+		pthread_mutex_lock(&w->lock);
+		w->n_built++;
+		pthread_cond_broadcast(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+	}
+	return (NULL);
+}
+
+static void
+_mtbl_writer_pipeline_init(struct mtbl_writer *w)
+{
+	w->pipelined = true;
+	w->add_key = ubuf_init(256);
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+
+	/* The queues hold one less than their size, which is a power of 2. */
+	w->full = my_queue_init(WRITER_BATCHES + 1, sizeof(ubuf *));
+	w->empty = my_queue_init(WRITER_BATCHES + 1, sizeof(ubuf *));
+	assert(w->full != NULL && w->empty != NULL);
+	for (size_t i = 0; i < WRITER_BATCHES; i++) {
+		ubuf *batch = ubuf_init(WRITER_BATCH_SIZE);
+		bool ok = my_queue_insert(w->empty, &batch, NULL);
+		assert(ok);
+	}
+
+	int rc = pthread_create(&w->builder, NULL, _mtbl_writer_builder, w);
+	assert(rc == 0);
+}
+
+/* Stop the builder thread, after it has added every entry. */
+static void
+_mtbl_writer_pipeline_destroy(struct mtbl_writer *w)
+{
+	ubuf *batch = NULL;
+	bool ok;
+
+	_mtbl_writer_sync(w);
+	ok = my_queue_insert(w->full, &batch, NULL);
+	assert(ok);
+	pthread_mutex_lock(&w->lock);
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->builder, NULL);
+	w->pipelined = false;
+
+	while (my_queue_remove(w->empty, &batch, NULL))
+		ubuf_destroy(&batch);
+	my_queue_destroy(&w->full);
+	my_queue_destroy(&w->empty);
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->cond);
+}
+
+static void
+_mtbl_writer_send_batch(struct mtbl_writer *w)
+{
+	bool ok;
+
+	if (w->batch == NULL)
+		return;
+	ok = my_queue_insert(w->full, &w->batch, NULL);
+	assert(ok);
+	w->batch = NULL;
+	w->n_sent++;
+	pthread_mutex_lock(&w->lock);
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Wait for the builder thread to add every entry sent to it. */
+static void
+_mtbl_writer_sync(struct mtbl_writer *w)
+{
+	_mtbl_writer_send_batch(w);
+	pthread_mutex_lock(&w->lock);
+	while (w->n_built != w->n_sent)
+		pthread_cond_wait(&w->cond, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+}
+
 static void
 _mtbl_writer_flush(struct mtbl_writer *w)
 {
@@ -290,18 +617,25 @@ _mtbl_writer_flush(struct mtbl_writer *w)
 	b.len_last_key = ubuf_size(w->last_key);
 	b.last_key = my_malloc(b.len_last_key);
 	memcpy(b.last_key, ubuf_data(w->last_key), b.len_last_key);
+	b.raw = false;
 	block_builder_finish(w->data, &b.data, &b.len_data);
 	block_builder_reset(w->data);
 
+	_mtbl_writer_submit_block(w, &b);
+}
+
+static void
+_mtbl_writer_submit_block(struct mtbl_writer *w, struct data_block *b)
+{
 	if (w->pool != NULL) {
 		struct data_block *bthread = my_calloc(1, sizeof(*bthread));
 
-		memcpy(bthread, &b, sizeof(b));
+		memcpy(bthread, b, sizeof(*b));
 		threadpool_dispatch(w->pool, w->rhandler, true,	/* ordered */
 				    _compress_block_wrapper, (void *)bthread);
 	} else {
-		_mtbl_writer_compress_block(&b);
-		_mtbl_writer_write_data_block(w, &b);
+		_mtbl_writer_compress_block(b);
+		_mtbl_writer_write_data_block(w, b);
 	}
 }
 
@@ -311,6 +645,9 @@ _mtbl_writer_compress_block(struct data_block *b)
 	mtbl_res res;
 	struct data_block tmp;
 
+	if (b->raw)
+		return;
+
 	if (b->comp_type == MTBL_COMPRESSION_NONE) {
 		res = mtbl_res_success;
 	} else if (b->comp_level == DEFAULT_COMPRESSION_LEVEL) {
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2024 DomainTools LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "merge_dso.h"
+
+#include "libmy/ubuf.h"
+
+static void *
+get_user_func(void *handle, const char *prefix, const char *suffix)
+{
+	ubuf *func_name = ubuf_init(0);
+	void *func;
+
+	/* Append the terminating NUL of the suffix, for ubuf_data(). */
+	ubuf_append(func_name, (const uint8_t *) prefix, strlen(prefix));
+	ubuf_append(func_name, (const uint8_t *) suffix, strlen(suffix) + 1);
+	func = dlsym(handle, (const char *) ubuf_data(func_name));
+	ubuf_destroy(&func_name);
+	return (func);
+}
+
+void
+merge_dso_load(struct merge_dso *dso, void (*usage)(void))
+{
+	const char *merge_dso_path = getenv("MTBL_MERGE_DSO");
+	const char *merge_dso_prefix = getenv("MTBL_MERGE_FUNC_PREFIX");
+	void *handle;
+
+	if (merge_dso_path == NULL) {
+		fprintf(stderr, "Error: MTBL_MERGE_DSO environment variable not set.\n\n");
+		usage();
+	}
+	if (merge_dso_prefix == NULL) {
+		fprintf(stderr, "Error: MTBL_MERGE_FUNC_PREFIX environment variable not set.\n\n");
+		usage();
+	}
+
+	dlerror();
+	handle = dlopen(merge_dso_path, RTLD_NOW);
+	if (handle == NULL) {
+		fprintf(stderr, "Error: dlopen() failed: %s\n", dlerror());
+		exit(EXIT_FAILURE);
+	}
+
+	/* The merge values func is preferred over the pairwise merge func. */
+	dso->merge_values = get_user_func(handle, merge_dso_prefix, "_values_func");
+	dso->merge = get_user_func(handle, merge_dso_prefix, "_func");
+	if (dso->merge == NULL && dso->merge_values == NULL) {
+		fprintf(stderr, "Error: user merge function required but not found in DSO.\n\n");
+		usage();
+	}
+	dso->init = get_user_func(handle, merge_dso_prefix, "_init_func");
+	dso->free = get_user_func(handle, merge_dso_prefix, "_free_func");
+}
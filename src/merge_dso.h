@@ -0,0 +1,21 @@
+#ifndef MERGE_DSO_H
+#define MERGE_DSO_H
+
+#include <mtbl.h>
+
+/* The merge functions a user DSO provides to mtbl_merge and mtbl_compact. */
+struct merge_dso {
+	mtbl_merge_init_func	init;
+	mtbl_merge_free_func	free;
+	mtbl_merge_func		merge;
+	mtbl_merge_values_func	merge_values;
+};
+
+/*
+ * Load the DSO named by MTBL_MERGE_DSO and look up the functions whose
+ * names start with MTBL_MERGE_FUNC_PREFIX. On errors, print a message and
+ * call usage, or exit if the DSO cannot be opened.
+ */
+void merge_dso_load(struct merge_dso *dso, void (*usage)(void));
+
+#endif /* MERGE_DSO_H */
@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2024 DomainTools LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <locale.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <mtbl.h>
+
+#include "merge_dso.h"
+
+#define DEFAULT_INTERVAL	60
+
+static const char		*program_name;
+
+static struct mtbl_threadpool	*opt_threadpool		= NULL;
+static size_t			opt_thread_count	= 0;
+static mtbl_compression_type	opt_compression_type	= MTBL_COMPRESSION_ZLIB;
+static long			opt_compression_level	= LONG_MIN;
+static long			opt_block_size		= 0;
+static long			opt_tier_files		= 0;
+static long			opt_tier_ratio		= 0;
+static long			opt_tier_size		= 0;
+static long			opt_rate_limit		= 0;
+static long			opt_interval		= DEFAULT_INTERVAL;
+static bool			opt_keep_inputs		= false;
+static bool			opt_once		= false;
+
+static struct merge_dso		user_funcs;
+
+static volatile sig_atomic_t	stop;
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-1] [-b <SIZE>] [-c <COMPRESSION>] [-i <INTERVAL>] [-k] [-l <LEVEL>]\n"
+		"       [-m <TIER SIZE>] [-n <TIER FILES>] [-r <RATE>] [-t <THREADS>] [-x <TIER RATIO>]\n"
+		"       <SETFILE>\n"
+		"\n"
+		"Watches an MTBL fileset file and merges the files it lists in size tiers,\n"
+		"replacing them in the fileset file with the merged files.\n"
+		"Requires a merge function provided by the user at runtime via a DSO.\n"
+		"See mtbl_compact(1) for details.\n"
+		"\n"
+		"-1 runs until no tier needs to be merged, then exits.\n"
+		"-k keeps merged files on disk after removing them from <SETFILE>.\n"
+		"\n"
+		"<SIZE> is the uncompressed data block size hint, in bytes.\n"
+		"<COMPRESSION> is one of none, snappy, zlib, lz4, lz4hc, or zstd.\n"
+		"<LEVEL> is the numeric compression level passed to the compression algorithm.\n"
+		"<INTERVAL> is how often to check <SETFILE> for changes, in seconds (default 60).\n"
+		"<TIER SIZE> is the size of the smallest files in the second tier, in bytes.\n"
+		"<TIER FILES> is the number of files in a tier which are merged together.\n"
+		"<TIER RATIO> is the ratio between the file sizes of consecutive tiers.\n"
+		"<RATE> limits the output written while merging, in bytes per second.\n"
+		"<THREADS> is the number of threads to use for building and compressing blocks.\n"
+		,
+		program_name
+	);
+	exit(EXIT_FAILURE);
+}
+
+static void
+handle_signal(int sig __attribute__((unused)))
+{
+	stop = 1;
+}
+
+static bool
+parse_long(const char *str, long *val)
+{
+	char *endptr;
+
+	errno = 0;
+	*val = strtol(str, &endptr, 0);
+	if (errno != 0 || endptr == str || *endptr != '\0')
+		return (false);
+	return (true);
+}
+
+static bool
+parse_positive(const char *str, long *val)
+{
+	return (parse_long(str, val) && *val > 0);
+}
+
+/* Wait until the fileset file is replaced or modified. */
+static void
+wait_for_setfile(const char *setfile, struct stat *last)
+{
+	struct stat ss;
+
+	while (!stop) {
+		sleep(opt_interval);
+		if (stat(setfile, &ss) != 0)
+			continue;
+		if (ss.st_ino != last->st_ino || ss.st_mtime != last->st_mtime) {
+			*last = ss;
+			return;
+		}
+	}
+}
+
+static bool
+compact(const char *setfile, const struct mtbl_compact_options *copt)
+{
+	size_t n_merged;
+
+	do {
+		if (mtbl_compact(setfile, copt, &n_merged) != mtbl_res_success) {
+			fprintf(stderr, "%s: Error: mtbl_compact() failed on %s\n",
+				program_name, setfile);
+			return (false);
+		}
+		if (n_merged > 0)
+			fprintf(stderr, "%s: merged %zu files in %s\n",
+				program_name, n_merged, setfile);
+	} while (n_merged > 0 && !stop);
+	return (true);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct mtbl_compact_options *copt;
+	struct mtbl_writer_options *wopt;
+	const char *setfile;
+	struct stat last;
+	void *user_clos = NULL;
+	bool ok = true;
+	int c;
+
+	setlocale(LC_ALL, "");
+	program_name = argv[0];
+
+	while ((c = getopt(argc, argv, "1b:c:i:kl:m:n:r:t:x:")) != -1) {
+		switch (c) {
+		case '1':
+			opt_once = true;
+			break;
+		case 'b':
+			if (!parse_positive(optarg, &opt_block_size))
+				usage();
+			break;
+		case 'c':
+			if (mtbl_compression_type_from_str(optarg, &opt_compression_type) !=
+			    mtbl_res_success)
+				usage();
+			break;
+		case 'i':
+			if (!parse_positive(optarg, &opt_interval))
+				usage();
+			break;
+		case 'k':
+			opt_keep_inputs = true;
+			break;
+		case 'l':
+			if (!parse_long(optarg, &opt_compression_level))
+				usage();
+			break;
+		case 'm':
+			if (!parse_positive(optarg, &opt_tier_size))
+				usage();
+			break;
+		case 'n':
+			if (!parse_positive(optarg, &opt_tier_files))
+				usage();
+			break;
+		case 'r':
+			if (!parse_positive(optarg, &opt_rate_limit))
+				usage();
+			break;
+		case 't': {
+			long thread_count;
+			if (!parse_long(optarg, &thread_count) || thread_count < 0)
+				usage();
+			opt_thread_count = thread_count;
+			break;
+		}
+		case 'x':
+			if (!parse_positive(optarg, &opt_tier_ratio))
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 1)
+		usage();
+	setfile = argv[optind];
+	if (stat(setfile, &last) != 0) {
+		fprintf(stderr, "Error: unable to stat %s: %s\n", setfile, strerror(errno));
+		return (EXIT_FAILURE);
+	}
+
+	merge_dso_load(&user_funcs, usage);
+	if (user_funcs.init != NULL)
+		user_clos = user_funcs.init();
+
+	opt_threadpool = mtbl_threadpool_init(opt_thread_count);
+	wopt = mtbl_writer_options_init();
+	mtbl_writer_options_set_compression(wopt, opt_compression_type);
+	if (opt_compression_level != LONG_MIN)
+		mtbl_writer_options_set_compression_level(wopt, opt_compression_level);
+	if (opt_block_size > 0)
+		mtbl_writer_options_set_block_size(wopt, opt_block_size);
+	mtbl_writer_options_set_threadpool(wopt, opt_threadpool);
+	mtbl_writer_options_set_pipeline(wopt, opt_thread_count > 0);
+
+	copt = mtbl_compact_options_init();
+	if (user_funcs.merge_values != NULL)
+		mtbl_compact_options_set_merge_values_func(copt, user_funcs.merge_values, user_clos);
+	else
+		mtbl_compact_options_set_merge_func(copt, user_funcs.merge, user_clos);
+	mtbl_compact_options_set_writer_options(copt, wopt);
+	if (opt_tier_files > 0)
+		mtbl_compact_options_set_tier_files(copt, opt_tier_files);
+	if (opt_tier_ratio > 0)
+		mtbl_compact_options_set_tier_ratio(copt, opt_tier_ratio);
+	if (opt_tier_size > 0)
+		mtbl_compact_options_set_tier_size(copt, opt_tier_size);
+	mtbl_compact_options_set_rate_limit(copt, opt_rate_limit);
+	mtbl_compact_options_set_keep_inputs(copt, opt_keep_inputs);
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	for (;;) {
+		ok = compact(setfile, copt);
+		if (opt_once || stop)
+			break;
+		wait_for_setfile(setfile, &last);
+		if (stop)
+			break;
+	}
+
+	mtbl_compact_options_destroy(&copt);
+	mtbl_writer_options_destroy(&wopt);
+	mtbl_threadpool_destroy(&opt_threadpool);
+	if (user_funcs.free != NULL)
+		user_funcs.free(user_clos);
+
+	return (ok || !opt_once ? EXIT_SUCCESS : EXIT_FAILURE);
+}
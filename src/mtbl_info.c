@@ -90,6 +90,8 @@ print_info(const char *fname)
 		printf("%u\n", compression_algorithm);
 
 	printf("compactness:           %'.2f%%\n", compactness);
+	if (mtbl_metadata_has_tombstones(m))
+		printf("tombstones:            yes\n");
 
 	putchar('\n');
 
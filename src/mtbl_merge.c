@@ -16,11 +16,12 @@
 
 #include <sys/time.h>
 #include <assert.h>
-#include <dlfcn.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <libgen.h>
 #include <limits.h>
 #include <locale.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -30,6 +31,9 @@
 #include <unistd.h>
 
 #include <mtbl.h>
+#include "mtbl-private.h"
+
+#include "merge_dso.h"
 
 #include "libmy/getenv_int.h"
 #include "libmy/ubuf.h"
@@ -38,25 +42,49 @@
 #define DEFAULT_COMPRESS_LEVEL	-1000
 #define STATS_INTERVAL		1000000
 
+/*
+ * Number of index block samples taken per output partition when choosing
+ * the partition boundaries.
+ */
+#define SAMPLES_PER_PARTITION	1000
+
+VECTOR_GENERATE(ubuf_vec, ubuf *);
+
+/*
+ * A partition covers the closed key range [start, end] of the merged output.
+ * A NULL start or end leaves that side of the range unbounded.
+ */
+struct partition {
+	ubuf			*start;
+	ubuf			*end;
+	char			*fname;
+	struct mtbl_merger	*merger;
+	struct mtbl_writer	*writer;
+	void			*user_clos;
+	pthread_t		thr;
+	uint64_t		count;
+	uint64_t		count_merged;
+};
+
 static const char		*program_name;
 
 static const char		*mtbl_output_fname;
 
 static struct mtbl_threadpool	*opt_threadpool		= NULL;
+static size_t			opt_thread_count	= 0;
 static mtbl_compression_type	opt_compression_type	= MTBL_COMPRESSION_ZLIB;
 static int			opt_compression_level	= DEFAULT_COMPRESS_LEVEL;
 static size_t			opt_block_size		= DEFAULT_BLOCK_SIZE;
+static size_t			opt_partitions		= 1;
+static bool			opt_read_ahead		= false;
 
-static const char		*merge_dso_path;
-static const char		*merge_dso_prefix;
+static struct merge_dso		user_funcs;
 
-static mtbl_merge_init_func	user_func_init;
-static mtbl_merge_free_func	user_func_free;
-static mtbl_merge_func		user_func_merge;
-static void			*user_clos;
+static struct mtbl_reader	**readers;
+static size_t			n_readers;
 
-static struct mtbl_merger	*merger;
-static struct mtbl_writer	*writer;
+static struct partition		*partitions;
+static size_t			n_partitions;
 
 static struct timespec		start_time;
 static uint64_t			count;
@@ -66,7 +94,7 @@ static void
 usage(void)
 {
 	fprintf(stderr,
-		"Usage: %s [-b <SIZE>] [-c <COMPRESSION>] [-l <LEVEL>] [-t <THREADS>] <INPUT> [<INPUT>...] <OUTPUT>\n"
+		"Usage: %s [-b <SIZE>] [-c <COMPRESSION>] [-l <LEVEL>] [-p <PARTITIONS>] [-r] [-t <THREADS>] <INPUT> [<INPUT>...] <OUTPUT>\n"
 		"\n"
 		"Merges one or more MTBL input files into a single output file.\n"
 		"Requires a merge function provided by the user at runtime via a DSO.\n"
@@ -81,8 +109,16 @@ usage(void)
 		"<LEVEL> is the numeric compression level passed to the compression algorithm.\n"
 		"The default and valid range depend on the <COMPRESSION> parameter.\n"
 		"\n"
+		"<PARTITIONS> is the number of key ranges to merge in parallel, each into its\n"
+		"own output file. If greater than 1, <OUTPUT> is written as a fileset file\n"
+		"listing the output files. The default value is 1.\n"
+		"\n"
+		"-r reads and decompresses the input files ahead of the merge, using the\n"
+		"<THREADS> threads. Data blocks are then always re-encoded.\n"
+		"\n"
 		"<THREADS> is the number of threads that should be used for file compression.\n"
-		"The default value is 0.\n"
+		"If greater than 0, data blocks are also built on a separate thread for each\n"
+		"output file. The default value is 0.\n"
 		,
 		program_name
 	);
@@ -141,102 +177,190 @@ merge_func(void *clos,
 	   const uint8_t *val1, size_t len_val1,
 	   uint8_t **merged_val, size_t *len_merged_val)
 {
-	user_func_merge(clos,
-			key, len_key,
-			val0, len_val0,
-			val1, len_val1,
-			merged_val, len_merged_val);
-	count_merged += 1;
+	struct partition *p = (struct partition *) clos;
+
+	user_funcs.merge(p->user_clos,
+			 key, len_key,
+			 val0, len_val0,
+			 val1, len_val1,
+			 merged_val, len_merged_val);
+	p->count_merged += 1;
+}
+
+static mtbl_res
+merge_values_func(void *clos,
+		  const uint8_t *key, size_t len_key,
+		  size_t n_vals,
+		  const uint8_t * const *vals, const size_t *len_vals,
+		  uint8_t **merged_val, size_t *size_merged_val,
+		  size_t *len_merged_val)
+{
+	struct partition *p = (struct partition *) clos;
+
+	p->count_merged += n_vals - 1;
+	return (user_funcs.merge_values(p->user_clos,
+					key, len_key,
+					n_vals, vals, len_vals,
+					merged_val, size_merged_val,
+					len_merged_val));
+}
+
+static int
+ubuf_ptr_compare(const void *va, const void *vb)
+{
+	const ubuf *a = *((const ubuf **) va);
+	const ubuf *b = *((const ubuf **) vb);
+
+	return (bytes_compare(ubuf_data((ubuf *) a), ubuf_size((ubuf *) a),
+			      ubuf_data((ubuf *) b), ubuf_size((ubuf *) b)));
 }
 
+/*
+ * Fold the partition's counters into the global totals. Partitions are
+ * merged concurrently, so they count locally and only occasionally touch
+ * the shared counters.
+ */
 static void
-merge(void)
+flush_stats(struct partition *p)
+{
+	__sync_add_and_fetch(&count, p->count);
+	__sync_add_and_fetch(&count_merged, p->count_merged);
+	p->count = 0;
+	p->count_merged = 0;
+}
+
+static void *
+merge_partition(void *arg)
 {
+	struct partition *p = (struct partition *) arg;
+	const struct mtbl_source *s = mtbl_merger_source(p->merger);
 	const uint8_t *key, *val;
 	size_t len_key, len_val;
 	struct mtbl_iter *it;
 
-	it = mtbl_source_iter(mtbl_merger_source(merger));
-	assert(it != NULL);
-	while (mtbl_iter_next(it, &key, &len_key, &val, &len_val) == mtbl_res_success) {
-		mtbl_res res = mtbl_writer_add(writer, key, len_key, val, len_val);
-		assert(res == mtbl_res_success);
-		if ((++count % STATS_INTERVAL) == 0)
+	/*
+	 * A bounded range lets input data blocks which fall entirely within
+	 * the partition, between the keys of the other inputs, be copied to
+	 * the output without being recompressed.
+	 */
+	if (p->end != NULL) {
+		it = mtbl_source_get_range(s,
+			p->start != NULL ? ubuf_data(p->start) : (const uint8_t *) "",
+			p->start != NULL ? ubuf_size(p->start) : 0,
+			ubuf_data(p->end), ubuf_size(p->end));
+	} else {
+		it = mtbl_source_iter(s);
+		assert(it != NULL);
+		if (p->start != NULL) {
+			mtbl_res res = mtbl_iter_seek(it, ubuf_data(p->start), ubuf_size(p->start));
+			assert(res == mtbl_res_success);
+		}
+	}
+	while (it != NULL &&
+	       mtbl_iter_next(it, &key, &len_key, &val, &len_val) == mtbl_res_success)
+	{
+		uint64_t n = 1;
+
+		if (mtbl_writer_add_iter_block(p->writer, it, &n) != mtbl_res_success) {
+			mtbl_res res = mtbl_writer_add(p->writer, key, len_key, val, len_val);
+			assert(res == mtbl_res_success);
+		}
+		p->count += n;
+		if (p->count >= STATS_INTERVAL) {
+			flush_stats(p);
 			print_stats();
+		}
 	}
+	flush_stats(p);
 	mtbl_iter_destroy(&it);
-	mtbl_merger_destroy(&merger);
-	mtbl_writer_destroy(&writer);
+	mtbl_merger_destroy(&p->merger);
+	mtbl_writer_destroy(&p->writer);
+	return (NULL);
 }
 
 static void
-init_dso(void)
+merge(void)
 {
-	merge_dso_path = getenv("MTBL_MERGE_DSO");
-	merge_dso_prefix = getenv("MTBL_MERGE_FUNC_PREFIX");
-
-	if (merge_dso_path == NULL) {
-		fprintf(stderr, "Error: MTBL_MERGE_DSO environment variable not set.\n\n");
-		usage();
-	}
-	if (merge_dso_prefix == NULL) {
-		fprintf(stderr, "Error: MTBL_MERGE_FUNC_PREFIX environment variable not set.\n\n");
-		usage();
+	if (n_partitions == 1) {
+		merge_partition(&partitions[0]);
+		return;
 	}
 
-	dlerror();
-	void *handle = dlopen(merge_dso_path, RTLD_NOW);
-	if (handle == NULL) {
-		fprintf(stderr, "Error: dlopen() failed: %s\n", dlerror());
-		exit(EXIT_FAILURE);
+	for (size_t i = 0; i < n_partitions; i++) {
+		int rc = pthread_create(&partitions[i].thr, NULL,
+					merge_partition, &partitions[i]);
+		if (rc != 0) {
+			fprintf(stderr, "Error: pthread_create() failed: %s\n",
+				strerror(rc));
+			exit(EXIT_FAILURE);
+		}
 	}
+	for (size_t i = 0; i < n_partitions; i++)
+		pthread_join(partitions[i].thr, NULL);
+}
 
-	/*
-	 * Note: the code below uses ubufs in a subtle way, three times.
-	 * The first ubuf_append() with strlen() does not append a NUL.
-	 * The second ubuf_append() with sizeof() does append a NUL.
-	 * The ubuf_data() call accesses the underlying data as a
-	 * NUL-terminated C string.
-	 */
+/*
+ * Choose up to opt_partitions - 1 boundary keys which split the merged key
+ * space into ranges holding roughly equal numbers of data blocks. Each
+ * input's index block has one key per data block, so an evenly strided
+ * sample of the index keys of all inputs approximates the distribution of
+ * the merged output without reading any data blocks.
+ */
+static ubuf_vec *
+choose_boundaries(void)
+{
+	ubuf_vec *samples = ubuf_vec_init(SAMPLES_PER_PARTITION * opt_partitions);
+	ubuf_vec *bounds = ubuf_vec_init(opt_partitions);
+	uint64_t n_blocks = 0, stride;
 
-	/* merge func */
-	ubuf *func_name = ubuf_init(0);
-	ubuf_append(func_name,
-		    (const uint8_t *) merge_dso_prefix,
-		    strlen(merge_dso_prefix));
-	ubuf_append(func_name,
-		    (const uint8_t *) "_func",
-		    sizeof("_func"));
-	user_func_merge = dlsym(handle, (const char *) ubuf_data(func_name));
-	if (user_func_merge == NULL) {
-		fprintf(stderr, "Error: user merge function required but not found in DSO.\n\n");
-		usage();
+	for (size_t i = 0; i < n_readers; i++)
+		n_blocks += mtbl_metadata_count_data_blocks(mtbl_reader_metadata(readers[i]));
+	stride = n_blocks / (SAMPLES_PER_PARTITION * opt_partitions);
+	if (stride == 0)
+		stride = 1;
+
+	for (size_t i = 0; i < n_readers; i++) {
+		struct mtbl_iter *it = mtbl_reader_index_iter(readers[i]);
+		const uint8_t *key, *val;
+		size_t len_key, len_val;
+
+		for (uint64_t j = 0;
+		     mtbl_iter_next(it, &key, &len_key, &val, &len_val) == mtbl_res_success;
+		     j++)
+		{
+			if ((j % stride) == stride - 1) {
+				ubuf *u = ubuf_init(len_key);
+				ubuf_append(u, key, len_key);
+				ubuf_vec_add(samples, u);
+			}
+		}
+		mtbl_iter_destroy(&it);
 	}
 
-	/* init func */
-	ubuf_clip(func_name, 0);
-	ubuf_append(func_name,
-		    (const uint8_t *) merge_dso_prefix,
-		    strlen(merge_dso_prefix));
-	ubuf_append(func_name,
-		    (const uint8_t *) "_init_func",
-		    sizeof("_init_func"));
-	user_func_init = dlsym(handle, (const char *) ubuf_data(func_name));
-	if (user_func_init != NULL)
-		user_clos = user_func_init();
-
-	/* free func */
-	ubuf_clip(func_name, 0);
-	ubuf_append(func_name,
-		    (const uint8_t *) merge_dso_prefix,
-		    strlen(merge_dso_prefix));
-	ubuf_append(func_name,
-		    (const uint8_t *) "_free_func",
-		    sizeof("_free_func"));
-	user_func_free = dlsym(handle, (const char *) ubuf_data(func_name));
+	qsort(ubuf_vec_data(samples), ubuf_vec_size(samples), sizeof(ubuf *),
+	      ubuf_ptr_compare);
+
+	for (size_t i = 1; i < opt_partitions && ubuf_vec_size(samples) > 0; i++) {
+		size_t idx = i * ubuf_vec_size(samples) / opt_partitions;
+		ubuf *u;
+
+		u = ubuf_vec_value(samples, idx);
+		if (u == NULL)
+			continue;
+		if (ubuf_vec_size(bounds) > 0 &&
+		    ubuf_ptr_compare(&u, ubuf_vec_ptr(bounds) - 1) == 0)
+			continue;
+		ubuf_vec_add(bounds, u);
+		ubuf_vec_data(samples)[idx] = NULL;
+	}
 
-	/* cleanup */
-	ubuf_destroy(&func_name);
+	for (size_t i = 0; i < ubuf_vec_size(samples); i++) {
+		ubuf *u = ubuf_vec_value(samples, i);
+		if (u != NULL)
+			ubuf_destroy(&u);
+	}
+	ubuf_vec_destroy(&samples);
+	return (bounds);
 }
 
 static size_t
@@ -249,26 +373,52 @@ get_block_size(void)
 }
 
 static void
-init_mtbl(void)
+init_readers(char **fnames)
+{
+	readers = my_calloc(n_readers, sizeof(*readers));
+	for (size_t i = 0; i < n_readers; i++) {
+		fprintf(stderr, "%s: opening input file %s\n", program_name, fnames[i]);
+		readers[i] = mtbl_reader_init(fnames[i], NULL);
+		if (readers[i] == NULL) {
+			fprintf(stderr, "Error: mtbl_reader_init() failed.\n\n");
+			usage();
+		}
+	}
+}
+
+static void
+init_partition(struct partition *p)
 {
 	struct mtbl_merger_options *mopt;
 	struct mtbl_writer_options *wopt;
 
+	/* Each partition has its own merge function state. */
+	if (user_funcs.init != NULL)
+		p->user_clos = user_funcs.init();
+
 	mopt = mtbl_merger_options_init();
 	wopt = mtbl_writer_options_init();
 
-	mtbl_merger_options_set_merge_func(mopt, merge_func, user_clos);
+	if (user_funcs.merge_values != NULL)
+		mtbl_merger_options_set_merge_values_func(mopt, merge_values_func, p);
+	else
+		mtbl_merger_options_set_merge_func(mopt, merge_func, p);
+	if (opt_read_ahead)
+		mtbl_merger_options_set_threadpool(mopt, opt_threadpool);
 	mtbl_writer_options_set_compression(wopt, opt_compression_type);
 	if (opt_compression_level != DEFAULT_COMPRESS_LEVEL)
 		mtbl_writer_options_set_compression_level(wopt, opt_compression_level);
 	mtbl_writer_options_set_threadpool(wopt, opt_threadpool);
+	mtbl_writer_options_set_pipeline(wopt, opt_thread_count > 0);
 	mtbl_writer_options_set_block_size(wopt, opt_block_size);
-	merger = mtbl_merger_init(mopt);
-	assert(merger != NULL);
+	p->merger = mtbl_merger_init(mopt);
+	assert(p->merger != NULL);
+	for (size_t i = 0; i < n_readers; i++)
+		mtbl_merger_add_source(p->merger, mtbl_reader_source(readers[i]));
 
-	fprintf(stderr, "%s: opening output file %s\n", program_name, mtbl_output_fname);
-	writer = mtbl_writer_init(mtbl_output_fname, wopt);
-	if (writer == NULL) {
+	fprintf(stderr, "%s: opening output file %s\n", program_name, p->fname);
+	p->writer = mtbl_writer_init(p->fname, wopt);
+	if (p->writer == NULL) {
 		fprintf(stderr, "Error: mtbl_writer_init() failed.\n\n");
 		usage();
 	}
@@ -277,6 +427,102 @@ init_mtbl(void)
 	mtbl_writer_options_destroy(&wopt);
 }
 
+static void
+init_mtbl(void)
+{
+	ubuf_vec *bounds = NULL;
+
+	if (opt_partitions == 1) {
+		n_partitions = 1;
+		partitions = my_calloc(1, sizeof(*partitions));
+		partitions[0].fname = my_strdup(mtbl_output_fname);
+		init_partition(&partitions[0]);
+		return;
+	}
+
+	bounds = choose_boundaries();
+	n_partitions = ubuf_vec_size(bounds) + 1;
+	partitions = my_calloc(n_partitions, sizeof(*partitions));
+	for (size_t i = 0; i < n_partitions; i++) {
+		struct partition *p = &partitions[i];
+		ubuf *fname = ubuf_init(0);
+
+		/* The next partition starts at the successor of this one's end. */
+		if (i > 0) {
+			ubuf *end = ubuf_vec_value(bounds, i - 1);
+			p->start = ubuf_init(ubuf_size(end) + 1);
+			ubuf_append(p->start, ubuf_data(end), ubuf_size(end));
+			ubuf_add(p->start, '\0');
+		}
+		if (i < n_partitions - 1)
+			p->end = ubuf_vec_value(bounds, i);
+
+		ubuf_add_fmt(fname, "%s.%05zu", mtbl_output_fname, i);
+		ubuf_cterm(fname);
+		p->fname = my_strdup((const char *) ubuf_data(fname));
+		ubuf_destroy(&fname);
+
+		init_partition(p);
+	}
+	ubuf_vec_destroy(&bounds);
+}
+
+/*
+ * Write the fileset file listing the partition outputs in key order. The
+ * outputs are named relative to the fileset file's directory, and the file
+ * is renamed into place so that a concurrent fileset reader never sees a
+ * partial list.
+ */
+static void
+write_setfile(void)
+{
+	ubuf *tmp_fname = ubuf_init(0);
+	FILE *fp;
+
+	ubuf_add_fmt(tmp_fname, "%s.tmp", mtbl_output_fname);
+	ubuf_cterm(tmp_fname);
+
+	fp = fopen((const char *) ubuf_data(tmp_fname), "w");
+	if (fp == NULL) {
+		fprintf(stderr, "Error: unable to open %s: %s\n",
+			(const char *) ubuf_data(tmp_fname), strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < n_partitions; i++) {
+		char *fname = my_strdup(partitions[i].fname);
+		fprintf(fp, "%s\n", basename(fname));
+		free(fname);
+	}
+	if (fclose(fp) != 0 ||
+	    rename((const char *) ubuf_data(tmp_fname), mtbl_output_fname) != 0)
+	{
+		fprintf(stderr, "Error: unable to write %s: %s\n",
+			mtbl_output_fname, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	fprintf(stderr, "%s: wrote fileset %s with %zu files\n",
+		program_name, mtbl_output_fname, n_partitions);
+	ubuf_destroy(&tmp_fname);
+}
+
+static void
+destroy_partitions(void)
+{
+	for (size_t i = 0; i < n_partitions; i++) {
+		struct partition *p = &partitions[i];
+
+		/* call user cleanup */
+		if (user_funcs.free != NULL)
+			user_funcs.free(p->user_clos);
+		if (p->start != NULL)
+			ubuf_destroy(&p->start);
+		if (p->end != NULL)
+			ubuf_destroy(&p->end);
+		free(p->fname);
+	}
+	my_free(partitions);
+}
+
 static bool
 parse_long(const char *str, long int *val)
 {
@@ -333,6 +579,18 @@ parse_arg_compression_level(const char *arg)
 	return *endp == '\0';
 }
 
+static bool
+parse_arg_partitions(const char *arg)
+{
+	long int arg_partitions = 0;
+
+	if (!parse_long(arg, &arg_partitions) || arg_partitions < 1)
+		return false;
+
+	opt_partitions = arg_partitions;
+	return true;
+}
+
 static bool
 parse_arg_thread_count(const char *arg)
 {
@@ -340,6 +598,7 @@ parse_arg_thread_count(const char *arg)
 	int thread_count = strtol(arg, &endp, 10);
 	if (thread_count < 0)
 		return false;
+	opt_thread_count = thread_count;
 	opt_threadpool = mtbl_threadpool_init(thread_count);
 	return true;
 }
@@ -353,7 +612,7 @@ main(int argc, char **argv)
 	opt_block_size = get_block_size();
 
 	int c;
-	while ((c = getopt(argc, argv, "b:c:l:t:")) != -1) {
+	while ((c = getopt(argc, argv, "b:c:l:p:rt:")) != -1) {
 		switch (c) {
 		case 'b':
 			if (!parse_arg_block_size(optarg))
@@ -367,6 +626,13 @@ main(int argc, char **argv)
 			if (!parse_arg_compression_level(optarg))
 				usage();
 			break;
+		case 'p':
+			if (!parse_arg_partitions(optarg))
+				usage();
+			break;
+		case 'r':
+			opt_read_ahead = true;
+			break;
 		case 't':
 			if (!parse_arg_thread_count(optarg))
 				usage();
@@ -381,36 +647,26 @@ main(int argc, char **argv)
 	mtbl_output_fname = argv[argc - 1];
 
 	/* open user dso */
-	init_dso();
-
-	/* open merger, writer */
-	init_mtbl();
+	merge_dso_load(&user_funcs, usage);
 
 	/* open readers */
-	const size_t n_readers = argc - 1 - optind;
-	struct mtbl_reader *readers[n_readers];
-	for (size_t i = 0; i < n_readers; i++) {
-		const char *fname = argv[i + optind];
-		fprintf(stderr, "%s: opening input file %s\n", program_name, fname);
-		readers[i] = mtbl_reader_init(fname, NULL);
-		if (readers[i] == NULL) {
-			fprintf(stderr, "Error: mtbl_reader_init() failed.\n\n");
-			usage();
-		}
-		mtbl_merger_add_source(merger, mtbl_reader_source(readers[i]));
-	}
+	n_readers = argc - 1 - optind;
+	init_readers(&argv[optind]);
+
+	/* open mergers, writers */
+	init_mtbl();
 
 	/* do merge */
 	my_timespec_get(&start_time);
 	merge();
+	if (opt_partitions > 1)
+		write_setfile();
 
-	/* cleanup readers */
+	/* cleanup */
+	destroy_partitions();
 	for (size_t i = 0; i < n_readers; i++)
 		mtbl_reader_destroy(&readers[i]);
-
-	/* call user cleanup */
-	if (user_func_free != NULL)
-		user_func_free(user_clos);
+	my_free(readers);
 
 	mtbl_threadpool_destroy(&opt_threadpool);
 
@@ -0,0 +1,191 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mtbl-private.h"
+
+#include "libmy/ubuf.h"
+
+#include "test-common.h"
+
+static char dir[PATH_MAX];
+
+void
+test_dir_init(const char *name)
+{
+	snprintf(dir, sizeof(dir), "/tmp/%s.XXXXXX", name);
+	assert(mkdtemp(dir) != NULL);
+}
+
+void
+test_dir_remove(void)
+{
+	char cmd[PATH_MAX + 16];
+
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	assert(system(cmd) == 0);
+}
+
+const char *
+test_dir(void)
+{
+	return (dir);
+}
+
+void
+test_path(char *buf, size_t size, const char *fname)
+{
+	snprintf(buf, size, "%s/%s", dir, fname);
+}
+
+size_t
+test_make_key(char *key, size_t size, uint64_t k)
+{
+	return (snprintf(key, size, "%08" PRIx64, k));
+}
+
+void
+test_write_file(const char *name, const struct mtbl_writer_options *wopt,
+		uint64_t k0, uint64_t k1, uint64_t step,
+		const uint8_t *val, size_t len_val)
+{
+	struct mtbl_writer *w;
+	char fname[PATH_MAX], key[32];
+
+	if (val == NULL) {
+		val = (const uint8_t *) name;
+		len_val = strlen(name);
+	}
+	test_path(fname, sizeof(fname), name);
+	w = mtbl_writer_init(fname, wopt);
+	assert(w != NULL);
+	for (uint64_t k = k0; k < k1; k += step) {
+		size_t len = test_make_key(key, sizeof(key), k);
+		mtbl_res res = mtbl_writer_add(w, (const uint8_t *) key, len, val, len_val);
+		assert(res == mtbl_res_success);
+	}
+	mtbl_writer_destroy(&w);
+}
+
+void
+test_write_setfile(const char *fname, const char *contents)
+{
+	char tmp[PATH_MAX];
+	FILE *fp;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+	fp = fopen(tmp, "w");
+	assert(fp != NULL);
+	fputs(contents, fp);
+	fclose(fp);
+	assert(rename(tmp, fname) == 0);
+}
+
+void
+test_merge_join(void *clos __attribute__((unused)),
+		const uint8_t *key __attribute__((unused)),
+		size_t len_key __attribute__((unused)),
+		const uint8_t *val0, size_t len_val0,
+		const uint8_t *val1, size_t len_val1,
+		uint8_t **merged_val, size_t *len_merged_val)
+{
+	*len_merged_val = len_val0 + 1 + len_val1;
+	*merged_val = my_malloc(*len_merged_val);
+	memcpy(*merged_val, val0, len_val0);
+	(*merged_val)[len_val0] = '+';
+	memcpy(*merged_val + len_val0 + 1, val1, len_val1);
+}
+
+mtbl_res
+test_merge_sum(void *clos __attribute__((unused)),
+	       const uint8_t *key __attribute__((unused)),
+	       size_t len_key __attribute__((unused)),
+	       size_t n_vals,
+	       const uint8_t * const *vals, const size_t *len_vals,
+	       uint8_t **merged_val, size_t *size_merged_val,
+	       size_t *len_merged_val)
+{
+	uint64_t sum = 0;
+
+	for (size_t i = 0; i < n_vals; i++) {
+		uint64_t v;
+
+		assert(len_vals[i] == sizeof(v));
+		memcpy(&v, vals[i], sizeof(v));
+		sum += v;
+	}
+	if (*size_merged_val < sizeof(sum)) {
+		*merged_val = my_realloc(*merged_val, sizeof(sum));
+		*size_merged_val = sizeof(sum);
+	}
+	memcpy(*merged_val, &sum, sizeof(sum));
+	*len_merged_val = sizeof(sum);
+	return (mtbl_res_success);
+}
+
+bool
+test_same_entries(struct mtbl_iter *a, struct mtbl_iter *b, size_t limit)
+{
+	const uint8_t *key_a, *val_a, *key_b, *val_b;
+	size_t len_key_a, len_val_a, len_key_b, len_val_b;
+	bool same = true;
+	size_t n = 0;
+
+	while (n++ < limit &&
+	       mtbl_iter_next(a, &key_a, &len_key_a, &val_a, &len_val_a) == mtbl_res_success)
+	{
+		if (mtbl_iter_next(b, &key_b, &len_key_b, &val_b, &len_val_b) != mtbl_res_success ||
+		    bytes_compare(key_a, len_key_a, key_b, len_key_b) != 0 ||
+		    bytes_compare(val_a, len_val_a, val_b, len_val_b) != 0)
+		{
+			same = false;
+			break;
+		}
+	}
+	if (same && n <= limit &&
+	    mtbl_iter_next(b, &key_b, &len_key_b, &val_b, &len_val_b) == mtbl_res_success)
+		same = false;
+	return (same);
+}
+
+bool
+test_same_iters(struct mtbl_iter *a, struct mtbl_iter *b)
+{
+	bool same = test_same_entries(a, b, SIZE_MAX);
+
+	mtbl_iter_destroy(&a);
+	mtbl_iter_destroy(&b);
+	return (same);
+}
+
+void
+test_lookup_append(void *clos,
+		   const uint8_t *key __attribute__((unused)),
+		   size_t len_key __attribute__((unused)),
+		   const uint8_t *val, size_t len_val)
+{
+	ubuf *u = (ubuf *) clos;
+
+	ubuf_append(u, val, len_val);
+	ubuf_add(u, '\n');
+}
+
+bool
+test_same_lookup(const struct mtbl_source *a, const struct mtbl_source *b,
+		 const uint8_t *key, size_t len_key)
+{
+	ubuf *ua = ubuf_init(64), *ub = ubuf_init(64);
+	mtbl_res res_a, res_b;
+	bool same;
+
+	res_a = mtbl_source_lookup(a, key, len_key, test_lookup_append, ua);
+	res_b = mtbl_source_lookup(b, key, len_key, test_lookup_append, ub);
+	same = res_a == res_b && ubuf_size(ua) == ubuf_size(ub) &&
+		memcmp(ubuf_data(ua), ubuf_data(ub), ubuf_size(ua)) == 0;
+	ubuf_destroy(&ua);
+	ubuf_destroy(&ub);
+	return (same);
+}
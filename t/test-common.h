@@ -0,0 +1,67 @@
+#ifndef TEST_COMMON_H
+#define TEST_COMMON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mtbl.h>
+
+/*
+ * Helpers for the tests which write their own files, in a temporary directory
+ * named after the test.
+ */
+
+void test_dir_init(const char *name);
+void test_dir_remove(void);
+const char *test_dir(void);
+
+/* The path of a file in the test's directory. */
+void test_path(char *buf, size_t size, const char *fname);
+
+/* Key k as 8 hex digits, so that the keys sort like the numbers. */
+size_t test_make_key(char *key, size_t size, uint64_t k);
+
+/*
+ * Write the keys from k0 up to k1, excluding k1, in steps of step, to a file
+ * in the test's directory. Each value is val, or the file's name if val is
+ * NULL.
+ */
+void test_write_file(const char *name, const struct mtbl_writer_options *wopt,
+		     uint64_t k0, uint64_t k1, uint64_t step,
+		     const uint8_t *val, size_t len_val);
+
+/* Atomically replace a setfile, so that a reload sees the change. */
+void test_write_setfile(const char *fname, const char *contents);
+
+/* Values are joined with '+' in merge order, so that the order can be checked. */
+void test_merge_join(void *clos,
+		     const uint8_t *key, size_t len_key,
+		     const uint8_t *val0, size_t len_val0,
+		     const uint8_t *val1, size_t len_val1,
+		     uint8_t **merged_val, size_t *len_merged_val);
+
+/* Values are 64-bit counts in host byte order, which are added up. */
+mtbl_res test_merge_sum(void *clos,
+			const uint8_t *key, size_t len_key,
+			size_t n_vals,
+			const uint8_t * const *vals, const size_t *len_vals,
+			uint8_t **merged_val, size_t *size_merged_val,
+			size_t *len_merged_val);
+
+/*
+ * Whether two iterators return the same entries, comparing up to limit
+ * entries. test_same_iters() compares all of them, and destroys both.
+ */
+bool test_same_entries(struct mtbl_iter *a, struct mtbl_iter *b, size_t limit);
+bool test_same_iters(struct mtbl_iter *a, struct mtbl_iter *b);
+
+/* A lookup function which appends each value and a newline to a ubuf. */
+void test_lookup_append(void *clos, const uint8_t *key, size_t len_key,
+			const uint8_t *val, size_t len_val);
+
+/* Whether lookups of a key in two sources find the same values. */
+bool test_same_lookup(const struct mtbl_source *a, const struct mtbl_source *b,
+		      const uint8_t *key, size_t len_key);
+
+#endif /* TEST_COMMON_H */
@@ -0,0 +1,335 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mtbl.h>
+
+#include "mtbl-private.h"
+
+#include "test-common.h"
+
+#define NAME		"test-compact"
+
+#define NUM_FILES	6
+#define NUM_KEYS	3000
+#define NUM_SMALL_KEYS	50
+
+typedef uint64_t (*count_func)(uint64_t);
+
+/* Key k is in file i if k is a multiple of i + 1. */
+static uint64_t
+expected_count(uint64_t k)
+{
+	uint64_t count = 0;
+
+	for (uint64_t i = 0; i < NUM_FILES; i++)
+		if (k % (i + 1) == 0)
+			count++;
+	return (count);
+}
+
+static void
+write_file(uint64_t i)
+{
+	uint64_t v = 1;
+	char name[32];
+
+	snprintf(name, sizeof(name), "f%" PRIu64 ".mtbl", i);
+	test_write_file(name, NULL, 0, NUM_KEYS, i + 1, (const uint8_t *) &v, sizeof(v));
+}
+
+/*
+ * A file with a value of 1 for each of the first n_keys keys. It is not
+ * compressed, so that its size follows the number of keys.
+ */
+static void
+write_tier_file(const char *name, uint64_t n_keys)
+{
+	struct mtbl_writer_options *wopt;
+	uint64_t v = 1;
+
+	wopt = mtbl_writer_options_init();
+	mtbl_writer_options_set_compression(wopt, MTBL_COMPRESSION_NONE);
+	test_write_file(name, wopt, 0, n_keys, 1, (const uint8_t *) &v, sizeof(v));
+	mtbl_writer_options_destroy(&wopt);
+}
+
+static uint64_t
+file_size(const char *name)
+{
+	char fname[256];
+	struct stat sb;
+
+	test_path(fname, sizeof(fname), name);
+	assert(stat(fname, &sb) == 0);
+	return (sb.st_size);
+}
+
+static bool
+file_exists(const char *name)
+{
+	char fname[256];
+
+	test_path(fname, sizeof(fname), name);
+	return (access(fname, F_OK) == 0);
+}
+
+static void
+append_setfile(const char *setfile, const char *line)
+{
+	char fname[256];
+	FILE *fp;
+
+	test_path(fname, sizeof(fname), setfile);
+	fp = fopen(fname, "a");
+	assert(fp != NULL);
+	fprintf(fp, "%s\n", line);
+	fclose(fp);
+}
+
+static size_t
+count_setfile_lines(const char *setfile)
+{
+	char fname[256], *line = NULL;
+	size_t len = 0, n = 0;
+	FILE *fp;
+
+	test_path(fname, sizeof(fname), setfile);
+	fp = fopen(fname, "r");
+	assert(fp != NULL);
+	while (getline(&line, &len, fp) != -1)
+		n++;
+	free(line);
+	fclose(fp);
+	return (n);
+}
+
+static int
+check_fileset(const char *setfile, count_func count)
+{
+	struct mtbl_fileset_options *fopt = mtbl_fileset_options_init();
+	struct mtbl_fileset *fs;
+	struct mtbl_iter *it;
+	const uint8_t *key, *val;
+	size_t len_key, len_val;
+	char fname[256];
+	uint64_t k = 0;
+	int ret = 0;
+
+	test_path(fname, sizeof(fname), setfile);
+	mtbl_fileset_options_set_merge_values_func(fopt, test_merge_sum, NULL);
+	fs = mtbl_fileset_init(fname, fopt);
+	mtbl_fileset_options_destroy(&fopt);
+
+	it = mtbl_source_iter(mtbl_fileset_source(fs));
+	while (mtbl_iter_next(it, &key, &len_key, &val, &len_val) == mtbl_res_success) {
+		char expected[32];
+		uint64_t v;
+
+		test_make_key(expected, sizeof(expected), k);
+		memcpy(&v, val, sizeof(v));
+		if (len_key != strlen(expected) || memcmp(key, expected, len_key) != 0 ||
+		    v != count(k))
+		{
+			fprintf(stderr, NAME ": FAIL: bad entry for key %" PRIu64 "\n", k);
+			ret = 1;
+			break;
+		}
+		k++;
+	}
+	mtbl_iter_destroy(&it);
+	mtbl_fileset_destroy(&fs);
+
+	if (ret == 0 && k != NUM_KEYS) {
+		fprintf(stderr, NAME ": FAIL: got %" PRIu64 " keys\n", k);
+		ret = 1;
+	}
+	return (ret);
+}
+
+/* The small files "a0.mtbl" to "a2.mtbl", and the large files "b0.mtbl" to "b5.mtbl". */
+static uint64_t
+tier_count(uint64_t k)
+{
+	return (k < NUM_SMALL_KEYS ? 9 : 6);
+}
+
+static double
+elapsed_since(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+/*
+ * Small files are in the first tier, and large files in a higher one. Only
+ * a full tier is merged, the smallest one first if several are full, and
+ * the merge of the last one is rate limited.
+ */
+static int
+test_tiers(void)
+{
+	static const char *setfile = "tiers.fileset";
+	struct mtbl_compact_options *copt;
+	struct mtbl_writer_options *wopt;
+	struct timespec start;
+	char fname[256], name[32];
+	size_t n_merged;
+	double elapsed;
+	int ret = 0;
+
+	for (uint64_t i = 0; i < 3; i++) {
+		snprintf(name, sizeof(name), "a%" PRIu64 ".mtbl", i);
+		write_tier_file(name, NUM_SMALL_KEYS);
+	}
+	for (uint64_t i = 0; i < 6; i++) {
+		snprintf(name, sizeof(name), "b%" PRIu64 ".mtbl", i);
+		write_tier_file(name, NUM_KEYS);
+	}
+	assert(file_size("b0.mtbl") > 16 * file_size("a0.mtbl"));
+
+	wopt = mtbl_writer_options_init();
+	mtbl_writer_options_set_compression(wopt, MTBL_COMPRESSION_NONE);
+	mtbl_writer_options_set_block_size(wopt, 1024);
+	copt = mtbl_compact_options_init();
+	mtbl_compact_options_set_merge_values_func(copt, test_merge_sum, NULL);
+	mtbl_compact_options_set_writer_options(copt, wopt);
+	mtbl_compact_options_set_tier_files(copt, 3);
+	mtbl_compact_options_set_tier_ratio(copt, 4);
+	mtbl_compact_options_set_tier_size(copt, file_size("a0.mtbl") + 1);
+	test_path(fname, sizeof(fname), setfile);
+
+	/* Only the full tier of large files is merged. */
+	append_setfile(setfile, "a0.mtbl");
+	append_setfile(setfile, "a1.mtbl");
+	append_setfile(setfile, "b0.mtbl");
+	append_setfile(setfile, "b1.mtbl");
+	append_setfile(setfile, "b2.mtbl");
+	if (mtbl_compact(fname, copt, &n_merged) != mtbl_res_success || n_merged != 3 ||
+	    count_setfile_lines(setfile) != 3 || !file_exists("a0.mtbl") ||
+	    file_exists("b0.mtbl"))
+	{
+		fprintf(stderr, NAME ": FAIL: only the full tier\n");
+		ret = 1;
+	} else {
+		fprintf(stderr, NAME ": PASS: only the full tier\n");
+	}
+
+	/* With both tiers full, the tier of small files is merged first. */
+	append_setfile(setfile, "a2.mtbl");
+	append_setfile(setfile, "b3.mtbl");
+	append_setfile(setfile, "b4.mtbl");
+	if (mtbl_compact(fname, copt, &n_merged) != mtbl_res_success || n_merged != 3 ||
+	    count_setfile_lines(setfile) != 4 || file_exists("a0.mtbl") ||
+	    !file_exists("b3.mtbl"))
+	{
+		fprintf(stderr, NAME ": FAIL: smallest full tier\n");
+		ret = 1;
+	} else {
+		fprintf(stderr, NAME ": PASS: smallest full tier\n");
+	}
+
+	/* Writing the merged file takes at least the time the limit allows. */
+	append_setfile(setfile, "b5.mtbl");
+	mtbl_compact_options_set_rate_limit(copt, file_size("b5.mtbl"));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (mtbl_compact(fname, copt, &n_merged) != mtbl_res_success || n_merged < 3 ||
+	    file_exists("b5.mtbl"))
+	{
+		fprintf(stderr, NAME ": FAIL: rate limited merge\n");
+		ret = 1;
+	} else if ((elapsed = elapsed_since(&start)) < 0.3) {
+		fprintf(stderr, NAME ": FAIL: rate limited merge took %.3f seconds\n", elapsed);
+		ret = 1;
+	} else {
+		fprintf(stderr, NAME ": PASS: rate limited merge\n");
+	}
+	mtbl_compact_options_destroy(&copt);
+	mtbl_writer_options_destroy(&wopt);
+
+	if (check_fileset(setfile, tier_count) == 0)
+		fprintf(stderr, NAME ": PASS: merged tiers\n");
+	else
+		ret = 1;
+	return (ret);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct mtbl_compact_options *copt;
+	char fname[256], input[256], line[32];
+	size_t n_merged;
+	int ret = 0;
+
+	test_dir_init(NAME);
+	for (uint64_t i = 0; i < NUM_FILES; i++)
+		write_file(i);
+
+	copt = mtbl_compact_options_init();
+	mtbl_compact_options_set_merge_values_func(copt, test_merge_sum, NULL);
+	mtbl_compact_options_set_tier_files(copt, 4);
+	mtbl_compact_options_set_tier_size(copt, 1ULL << 40);
+	test_path(fname, sizeof(fname), "test.fileset");
+
+	/* A tier with too few files is left alone. */
+	for (uint64_t i = 0; i < 3; i++) {
+		snprintf(line, sizeof(line), "f%" PRIu64 ".mtbl", i);
+		append_setfile("test.fileset", line);
+	}
+	if (mtbl_compact(fname, copt, &n_merged) != mtbl_res_success || n_merged != 0 ||
+	    count_setfile_lines("test.fileset") != 3)
+	{
+		fprintf(stderr, NAME ": FAIL: partial tier\n");
+		ret = 1;
+	} else {
+		fprintf(stderr, NAME ": PASS: partial tier\n");
+	}
+
+	/* A full tier is merged, keeping the lines for missing files. */
+	append_setfile("test.fileset", "missing.mtbl");
+	for (uint64_t i = 3; i < NUM_FILES; i++) {
+		snprintf(line, sizeof(line), "f%" PRIu64 ".mtbl", i);
+		append_setfile("test.fileset", line);
+	}
+	if (mtbl_compact(fname, copt, &n_merged) != mtbl_res_success ||
+	    n_merged != NUM_FILES || count_setfile_lines("test.fileset") != 2)
+	{
+		fprintf(stderr, NAME ": FAIL: full tier\n");
+		ret = 1;
+	} else {
+		fprintf(stderr, NAME ": PASS: full tier\n");
+	}
+	test_path(input, sizeof(input), "f0.mtbl");
+	if (access(input, F_OK) == 0) {
+		fprintf(stderr, NAME ": FAIL: input not removed\n");
+		ret = 1;
+	}
+	if (check_fileset("test.fileset", expected_count) == 0)
+		fprintf(stderr, NAME ": PASS: merged entries\n");
+	else
+		ret = 1;
+
+	/* The merged file is alone in its tier. */
+	if (mtbl_compact(fname, copt, &n_merged) != mtbl_res_success || n_merged != 0) {
+		fprintf(stderr, NAME ": FAIL: compacted tier\n");
+		ret = 1;
+	}
+	mtbl_compact_options_destroy(&copt);
+
+	if (test_tiers() != 0)
+		ret = 1;
+
+	/* Clean up the merged file, the setfile and its lock file. */
+	test_dir_remove();
+
+	return (ret);
+}
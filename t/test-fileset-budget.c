@@ -0,0 +1,381 @@
+#include <assert.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <mtbl.h>
+
+#include "mtbl-private.h"
+
+#include "libmy/ubuf.h"
+
+#include "test-common.h"
+
+#define NAME		"test-fileset-budget"
+
+#define NUM_DISJOINT	30
+#define NUM_FILES	(NUM_DISJOINT + 2)
+#define KEYS_PER_FILE	500
+#define NUM_KEYS	(NUM_DISJOINT * KEYS_PER_FILE)
+#define MAX_OPEN	4
+#define NUM_THREADS	4
+
+static void
+file_name(char *buf, size_t size, size_t i)
+{
+	if (i < NUM_DISJOINT)
+		snprintf(buf, size, "d%02zu.mtbl", i);
+	else
+		snprintf(buf, size, "o%zu.mtbl", i - NUM_DISJOINT);
+}
+
+static void
+replaced_path(char *buf, size_t size, const char *name)
+{
+	char rname[64];
+
+	snprintf(rname, sizeof(rname), "r%s", name);
+	test_path(buf, size, rname);
+}
+
+/*
+ * Replace each file with a copy under another name in the setfile, and then
+ * remove it, as mtbl_compact() does with the files it merges.
+ */
+static void
+replace_files(const char *setfile)
+{
+	char fpath[256], rpath[256], tmp[256], name[32];
+	FILE *fp;
+
+	test_path(tmp, sizeof(tmp), "test.fileset.tmp");
+	fp = fopen(tmp, "w");
+	assert(fp != NULL);
+	for (size_t i = 0; i < NUM_FILES; i++) {
+		file_name(name, sizeof(name), i);
+		test_path(fpath, sizeof(fpath), name);
+		replaced_path(rpath, sizeof(rpath), name);
+		assert(link(fpath, rpath) == 0);
+		fprintf(fp, "r%s\n", name);
+	}
+	fclose(fp);
+	assert(rename(tmp, setfile) == 0);
+	for (size_t i = 0; i < NUM_FILES; i++) {
+		file_name(name, sizeof(name), i);
+		test_path(fpath, sizeof(fpath), name);
+		assert(unlink(fpath) == 0);
+	}
+}
+
+static struct mtbl_fileset *
+open_fileset(const char *fname, size_t max_open, mtbl_reader_filter_func filter)
+{
+	struct mtbl_fileset_options *fopt;
+	struct mtbl_fileset *fs;
+
+	fopt = mtbl_fileset_options_init();
+	mtbl_fileset_options_set_merge_func(fopt, test_merge_join, NULL);
+	mtbl_fileset_options_set_max_open_readers(fopt, max_open);
+	if (filter != NULL)
+		mtbl_fileset_options_set_reader_filter_func(fopt, filter, NULL);
+	fs = mtbl_fileset_init(fname, fopt);
+	mtbl_fileset_options_destroy(&fopt);
+	return (fs);
+}
+
+/* The number of the test's files mapped into memory, or -1 if unknown. */
+static int
+count_mapped(void)
+{
+	char line[1024], name[32];
+	ubuf *maps = ubuf_init(4096);
+	int n = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/self/maps", "r");
+	if (fp == NULL) {
+		ubuf_destroy(&maps);
+		return (-1);
+	}
+	while (fgets(line, sizeof(line), fp) != NULL)
+		ubuf_append(maps, (uint8_t *) line, strlen(line));
+	fclose(fp);
+	ubuf_cterm(maps);
+
+	for (size_t i = 0; i < NUM_FILES; i++) {
+		char needle[64];
+
+		file_name(name, sizeof(name), i);
+		snprintf(needle, sizeof(needle), "/%s\n", name);
+		if (strstr((char *) ubuf_data(maps), needle) != NULL)
+			n++;
+	}
+	ubuf_destroy(&maps);
+	return (n);
+}
+
+/* The number of file descriptors open on the test's files, or -1 if unknown. */
+static int
+count_fds(void)
+{
+	struct dirent *de;
+	DIR *d;
+	int n = 0;
+
+	d = opendir("/proc/self/fd");
+	if (d == NULL)
+		return (-1);
+	while ((de = readdir(d)) != NULL) {
+		char link[300], target[512];
+		ssize_t len;
+
+		snprintf(link, sizeof(link), "/proc/self/fd/%s", de->d_name);
+		len = readlink(link, target, sizeof(target) - 1);
+		if (len < 0)
+			continue;
+		target[len] = '\0';
+		if (strncmp(target, test_dir(), strlen(test_dir())) == 0)
+			n++;
+	}
+	closedir(d);
+	return (n);
+}
+
+/* Keep only the disjoint files, which have more entries than the others. */
+static bool
+reader_filter(struct mtbl_reader *r, void *clos)
+{
+	return (mtbl_metadata_count_entries(mtbl_reader_metadata(r)) == KEYS_PER_FILE);
+}
+
+static void *
+lookup_thread(void *arg)
+{
+	const struct mtbl_source *source = mtbl_fileset_source(arg);
+	uintptr_t n_found = 0;
+
+	for (uint64_t k = 0; k < NUM_KEYS; k += 13) {
+		struct mtbl_iter *it;
+		const uint8_t *ikey, *ival;
+		size_t len, len_ikey, len_ival;
+		char key[32];
+
+		len = test_make_key(key, sizeof(key), k);
+		it = mtbl_source_get(source, (const uint8_t *) key, len);
+		while (mtbl_iter_next(it, &ikey, &len_ikey, &ival, &len_ival) == mtbl_res_success)
+			n_found++;
+		mtbl_iter_destroy(&it);
+	}
+	return ((void *) n_found);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct mtbl_fileset *fs_all, *fs_lim;
+	const struct mtbl_source *s_all, *s_lim;
+	char fname[256], name[32], key0[32], key1[32];
+	size_t len0, len1;
+	FILE *fp;
+	int ret = 0;
+
+	/* Disjoint files, and two files overlapping all of them. */
+	test_dir_init(NAME);
+	test_path(fname, sizeof(fname), "test.fileset");
+	fp = fopen(fname, "w");
+	assert(fp != NULL);
+	for (size_t i = 0; i < NUM_FILES; i++) {
+		file_name(name, sizeof(name), i);
+		if (i < NUM_DISJOINT)
+			test_write_file(name, NULL, i * KEYS_PER_FILE, (i + 1) * KEYS_PER_FILE, 1, NULL, 0);
+		else
+			test_write_file(name, NULL, 0, NUM_KEYS, i == NUM_DISJOINT ? 7 : 11, NULL, 0);
+		fprintf(fp, "%s\n", name);
+	}
+	fclose(fp);
+
+	fs_lim = open_fileset(fname, MAX_OPEN, NULL);
+	s_lim = mtbl_fileset_source(fs_lim);
+	fs_all = open_fileset(fname, 0, NULL);
+	s_all = mtbl_fileset_source(fs_all);
+
+	if (test_same_iters(mtbl_source_iter(s_all), mtbl_source_iter(s_lim))) {
+		fprintf(stderr, NAME ": PASS: iter\n");
+	} else {
+		fprintf(stderr, NAME ": FAIL: iter\n");
+		ret = 1;
+	}
+
+	{
+		bool ok = true;
+
+		for (uint64_t k = 0; k <= NUM_KEYS + 1 && ok; k += 3) {
+			len0 = test_make_key(key0, sizeof(key0), k);
+			ok = test_same_iters(mtbl_source_get(s_all, (uint8_t *) key0, len0),
+					mtbl_source_get(s_lim, (uint8_t *) key0, len0)) &&
+			     test_same_lookup(s_all, s_lim, (uint8_t *) key0, len0);
+		}
+		len0 = test_make_key(key0, sizeof(key0), 1234);
+		len1 = test_make_key(key1, sizeof(key1), 5678);
+		ok = ok &&
+		     test_same_iters(mtbl_source_get_range(s_all, (uint8_t *) key0, len0,
+						      (uint8_t *) key1, len1),
+				mtbl_source_get_range(s_lim, (uint8_t *) key0, len0,
+						      (uint8_t *) key1, len1)) &&
+		     test_same_iters(mtbl_source_get_prefix(s_all, (uint8_t *) "00001", 5),
+				mtbl_source_get_prefix(s_lim, (uint8_t *) "00001", 5));
+		if (ok) {
+			fprintf(stderr, NAME ": PASS: get\n");
+		} else {
+			fprintf(stderr, NAME ": FAIL: get\n");
+			ret = 1;
+		}
+	}
+	mtbl_fileset_destroy(&fs_all);
+
+	/* Lookups from several threads at once. */
+	{
+		pthread_t threads[NUM_THREADS];
+		uintptr_t expected = (uintptr_t) lookup_thread(fs_lim);
+		bool ok = true;
+
+		for (size_t i = 0; i < NUM_THREADS; i++)
+			assert(pthread_create(&threads[i], NULL, lookup_thread, fs_lim) == 0);
+		for (size_t i = 0; i < NUM_THREADS; i++) {
+			void *n_found;
+
+			pthread_join(threads[i], &n_found);
+			if ((uintptr_t) n_found != expected)
+				ok = false;
+		}
+		if (ok) {
+			fprintf(stderr, NAME ": PASS: concurrent lookups\n");
+		} else {
+			fprintf(stderr, NAME ": FAIL: concurrent lookups\n");
+			ret = 1;
+		}
+	}
+
+	/*
+	 * With no iterators left, at most MAX_OPEN files remain mapped, and no
+	 * file descriptors are kept open.
+	 */
+	{
+		int n_mapped = count_mapped(), n_fds = count_fds();
+
+		if (n_mapped >= 0 && n_mapped > MAX_OPEN) {
+			fprintf(stderr, NAME ": FAIL: %d files mapped\n", n_mapped);
+			ret = 1;
+		} else if (n_fds > 0) {
+			fprintf(stderr, NAME ": FAIL: %d files open\n", n_fds);
+			ret = 1;
+		} else {
+			fprintf(stderr, NAME ": PASS: open files limited\n");
+		}
+	}
+	mtbl_fileset_destroy(&fs_lim);
+
+	/* A reader filter sees the files, which are opened again for it. */
+	{
+		struct mtbl_iter *it;
+		const uint8_t *key, *val;
+		size_t len_key, len_val, n = 0;
+
+		fs_lim = open_fileset(fname, 1, reader_filter);
+		it = mtbl_source_iter(mtbl_fileset_source(fs_lim));
+		while (mtbl_iter_next(it, &key, &len_key, &val, &len_val) == mtbl_res_success)
+			n++;
+		mtbl_iter_destroy(&it);
+		mtbl_fileset_destroy(&fs_lim);
+		if (n == NUM_KEYS) {
+			fprintf(stderr, NAME ": PASS: reader filter\n");
+		} else {
+			fprintf(stderr, NAME ": FAIL: reader filter found %zu entries\n", n);
+			ret = 1;
+		}
+	}
+
+	/*
+	 * Files replaced in the setfile and removed from disk, as by
+	 * mtbl_compact(), before the setfile is reloaded are found removed when
+	 * opened again, and the fileset is reloaded to read their replacements,
+	 * also by an iterator started before they were removed.
+	 */
+	{
+		struct mtbl_iter *a, *b;
+		const uint8_t *key_a, *val_a, *key_b, *val_b;
+		size_t len_key_a, len_val_a, len_key_b, len_val_b, n = 0;
+		ubuf *u = ubuf_init(64);
+		bool ok = true;
+
+		fs_all = open_fileset(fname, 0, NULL);
+		s_all = mtbl_fileset_source(fs_all);
+		fs_lim = open_fileset(fname, 1, NULL);
+		s_lim = mtbl_fileset_source(fs_lim);
+		a = mtbl_source_iter(s_all);
+		b = mtbl_source_iter(s_lim);
+		while (mtbl_iter_next(a, &key_a, &len_key_a, &val_a, &len_val_a) == mtbl_res_success) {
+			if (n++ == NUM_KEYS / 2)
+				replace_files(fname);
+			if (mtbl_iter_next(b, &key_b, &len_key_b, &val_b, &len_val_b) != mtbl_res_success ||
+			    bytes_compare(key_a, len_key_a, key_b, len_key_b) != 0 ||
+			    bytes_compare(val_a, len_val_a, val_b, len_val_b) != 0)
+			{
+				ok = false;
+				break;
+			}
+		}
+		ok = ok && mtbl_iter_next(b, &key_b, &len_key_b, &val_b, &len_val_b) != mtbl_res_success;
+		mtbl_iter_destroy(&a);
+		mtbl_iter_destroy(&b);
+		for (uint64_t k = 0; k < NUM_KEYS && ok; k += 97) {
+			len0 = test_make_key(key0, sizeof(key0), k);
+			ok = test_same_lookup(s_all, s_lim, (uint8_t *) key0, len0) &&
+			     mtbl_source_lookup(s_lim, (uint8_t *) key0, len0,
+						test_lookup_append, u) == mtbl_res_success;
+		}
+		ok = ok && test_same_iters(mtbl_source_iter(s_all), mtbl_source_iter(s_lim));
+		if (ok) {
+			fprintf(stderr, NAME ": PASS: removed files\n");
+		} else {
+			fprintf(stderr, NAME ": FAIL: removed files\n");
+			ret = 1;
+		}
+
+		/* Files removed while still in the setfile can no longer be read. */
+		for (size_t i = 0; i < NUM_FILES; i++) {
+			char fpath[256];
+
+			file_name(name, sizeof(name), i);
+			replaced_path(fpath, sizeof(fpath), name);
+			assert(unlink(fpath) == 0);
+		}
+		n = 0;
+		a = mtbl_source_iter(s_lim);
+		while (mtbl_iter_next(a, &key_a, &len_key_a, &val_a, &len_val_a) == mtbl_res_success)
+			n++;
+		mtbl_iter_destroy(&a);
+		len0 = test_make_key(key0, sizeof(key0), 0);
+		if (n < NUM_KEYS &&
+		    mtbl_source_lookup(s_lim, (uint8_t *) key0, len0,
+				       test_lookup_append, u) == mtbl_res_failure)
+		{
+			fprintf(stderr, NAME ": PASS: missing files\n");
+		} else {
+			fprintf(stderr, NAME ": FAIL: missing files, %zu entries\n", n);
+			ret = 1;
+		}
+		mtbl_fileset_destroy(&fs_all);
+		mtbl_fileset_destroy(&fs_lim);
+		ubuf_destroy(&u);
+	}
+
+	test_dir_remove();
+
+	return (ret);
+}
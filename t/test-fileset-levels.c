@@ -0,0 +1,172 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <mtbl.h>
+
+#include "mtbl-private.h"
+
+#include "test-common.h"
+
+#define NAME		"test-fileset-levels"
+
+#define NUM_DISJOINT	20
+#define KEYS_PER_FILE	1000
+#define NUM_KEYS	(NUM_DISJOINT * KEYS_PER_FILE)
+
+int
+main(int argc, char **argv)
+{
+	struct mtbl_reader *readers[NUM_DISJOINT + 2];
+	struct mtbl_fileset_options *fopt;
+	struct mtbl_merger_options *mopt;
+	struct mtbl_fileset *fs;
+	struct mtbl_merger *m;
+	const struct mtbl_source *s_fs, *s_m;
+	char fname[256], name[32], key0[32], key1[32];
+	size_t len0, len1, n_readers = 0;
+	FILE *fp;
+	int ret = 0;
+
+	/* Disjoint files, and two files overlapping all of them. */
+	test_dir_init(NAME);
+	test_path(fname, sizeof(fname), "test.fileset");
+	fp = fopen(fname, "w");
+	assert(fp != NULL);
+	for (uint64_t i = 0; i < NUM_DISJOINT; i++) {
+		snprintf(name, sizeof(name), "d%02" PRIu64 ".mtbl", i);
+		test_write_file(name, NULL, i * KEYS_PER_FILE, (i + 1) * KEYS_PER_FILE, 3, NULL, 0);
+		fprintf(fp, "%s\n", name);
+	}
+	test_write_file("o0.mtbl", NULL, 0, NUM_KEYS, 7, NULL, 0);
+	test_write_file("o1.mtbl", NULL, 0, NUM_KEYS, 11, NULL, 0);
+	fprintf(fp, "o0.mtbl\no1.mtbl\n");
+	fclose(fp);
+
+	fopt = mtbl_fileset_options_init();
+	mtbl_fileset_options_set_merge_func(fopt, test_merge_join, NULL);
+	fs = mtbl_fileset_init(fname, fopt);
+	mtbl_fileset_options_destroy(&fopt);
+	s_fs = mtbl_fileset_source(fs);
+
+	/* The same files merged without levels, in setfile order. */
+	mopt = mtbl_merger_options_init();
+	mtbl_merger_options_set_merge_func(mopt, test_merge_join, NULL);
+	m = mtbl_merger_init(mopt);
+	mtbl_merger_options_destroy(&mopt);
+	for (uint64_t i = 0; i < NUM_DISJOINT + 2; i++) {
+		if (i < NUM_DISJOINT)
+			snprintf(name, sizeof(name), "d%02" PRIu64 ".mtbl", i);
+		else
+			snprintf(name, sizeof(name), "o%" PRIu64 ".mtbl", i - NUM_DISJOINT);
+		test_path(fname, sizeof(fname), name);
+		readers[n_readers] = mtbl_reader_init(fname, NULL);
+		assert(readers[n_readers] != NULL);
+		mtbl_merger_add_source(m, mtbl_reader_source(readers[n_readers]));
+		n_readers++;
+	}
+	s_m = mtbl_merger_source(m);
+
+	if (test_same_iters(mtbl_source_iter(s_fs), mtbl_source_iter(s_m))) {
+		fprintf(stderr, NAME ": PASS: iter\n");
+	} else {
+		fprintf(stderr, NAME ": FAIL: iter\n");
+		ret = 1;
+	}
+
+	/* Point lookups, including keys before, between and after the files. */
+	{
+		bool ok = true;
+
+		for (uint64_t k = 0; k <= NUM_KEYS + 1 && ok; k += 5) {
+			len0 = test_make_key(key0, sizeof(key0), k);
+			ok = test_same_iters(mtbl_source_get(s_fs, (uint8_t *) key0, len0),
+					mtbl_source_get(s_m, (uint8_t *) key0, len0)) &&
+			     test_same_lookup(s_fs, s_m, (uint8_t *) key0, len0);
+		}
+		if (ok) {
+			fprintf(stderr, NAME ": PASS: get\n");
+		} else {
+			fprintf(stderr, NAME ": FAIL: get key %s\n", key0);
+			ret = 1;
+		}
+	}
+
+	/* Ranges within one file, across files, and past the last file. */
+	{
+		static const uint64_t ranges[][2] = {
+			{ 10, 20 }, { 990, 1010 }, { 2500, 7500 },
+			{ 0, NUM_KEYS }, { NUM_KEYS - 10, NUM_KEYS + 10 },
+		};
+		bool ok = true;
+
+		for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]) && ok; i++) {
+			len0 = test_make_key(key0, sizeof(key0), ranges[i][0]);
+			len1 = test_make_key(key1, sizeof(key1), ranges[i][1]);
+			ok = test_same_iters(mtbl_source_get_range(s_fs, (uint8_t *) key0, len0,
+							      (uint8_t *) key1, len1),
+					mtbl_source_get_range(s_m, (uint8_t *) key0, len0,
+							      (uint8_t *) key1, len1));
+		}
+		if (ok) {
+			fprintf(stderr, NAME ": PASS: get_range\n");
+		} else {
+			fprintf(stderr, NAME ": FAIL: get_range %s %s\n", key0, key1);
+			ret = 1;
+		}
+	}
+
+	/* Prefixes matching part of a file, several files, and no file. */
+	{
+		static const char *prefixes[] = { "0000000", "000003", "00001", "0000", "1" };
+		bool ok = true;
+
+		for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]) && ok; i++) {
+			const uint8_t *p = (const uint8_t *) prefixes[i];
+			ok = test_same_iters(mtbl_source_get_prefix(s_fs, p, strlen(prefixes[i])),
+					mtbl_source_get_prefix(s_m, p, strlen(prefixes[i])));
+		}
+		if (ok) {
+			fprintf(stderr, NAME ": PASS: get_prefix\n");
+		} else {
+			fprintf(stderr, NAME ": FAIL: get_prefix\n");
+			ret = 1;
+		}
+	}
+
+	/* Seeks forward and backward across files. */
+	{
+		static const uint64_t seeks[] = { 5, 1500, 1600, 12345, 700, 0, NUM_KEYS + 5, 3 };
+		struct mtbl_iter *a = mtbl_source_iter(s_fs);
+		struct mtbl_iter *b = mtbl_source_iter(s_m);
+		bool ok = true;
+
+		for (size_t i = 0; i < sizeof(seeks) / sizeof(seeks[0]) && ok; i++) {
+			len0 = test_make_key(key0, sizeof(key0), seeks[i]);
+			assert(mtbl_iter_seek(a, (uint8_t *) key0, len0) == mtbl_res_success);
+			assert(mtbl_iter_seek(b, (uint8_t *) key0, len0) == mtbl_res_success);
+			ok = test_same_entries(a, b, 10);
+		}
+		mtbl_iter_destroy(&a);
+		mtbl_iter_destroy(&b);
+		if (ok) {
+			fprintf(stderr, NAME ": PASS: seek\n");
+		} else {
+			fprintf(stderr, NAME ": FAIL: seek to %s\n", key0);
+			ret = 1;
+		}
+	}
+
+	mtbl_fileset_destroy(&fs);
+	mtbl_merger_destroy(&m);
+	for (size_t i = 0; i < n_readers; i++)
+		mtbl_reader_destroy(&readers[i]);
+
+	test_dir_remove();
+
+	return (ret);
+}
@@ -0,0 +1,347 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <mtbl.h>
+
+#include "mtbl-private.h"
+
+#include "test-common.h"
+
+#define NAME		"test-fileset-threads"
+
+#define NUM_KEYS	2000
+#define NUM_THREADS	4
+#define NUM_RELOADS	200
+
+static int stop;
+static uint64_t n_queries;
+static uint64_t n_failures;
+
+static void
+write_file(const char *name, uint64_t v)
+{
+	test_write_file(name, NULL, 0, NUM_KEYS, 1, (const uint8_t *) &v, sizeof(v));
+}
+
+static void
+write_setfile(const char *contents)
+{
+	char fname[256];
+
+	test_path(fname, sizeof(fname), "test.fileset");
+	test_write_setfile(fname, contents);
+}
+
+/* Every version of the setfile merges to the same value for each key. */
+static bool
+check_entry(const uint8_t *key, size_t len_key, const uint8_t *val, size_t len_val,
+	    uint64_t k)
+{
+	char expected[32];
+	uint64_t v;
+
+	test_make_key(expected, sizeof(expected), k);
+	if (len_key != strlen(expected) || memcmp(key, expected, len_key) != 0 ||
+	    len_val != sizeof(v))
+		return (false);
+	memcpy(&v, val, sizeof(v));
+	return (v == 3);
+}
+
+static bool
+check_iter(struct mtbl_iter *it)
+{
+	const uint8_t *key, *val;
+	size_t len_key, len_val;
+	uint64_t k = 0;
+
+	while (mtbl_iter_next(it, &key, &len_key, &val, &len_val) == mtbl_res_success) {
+		if (!check_entry(key, len_key, val, len_val, k))
+			return (false);
+		k++;
+	}
+	return (k == NUM_KEYS);
+}
+
+/* Return the merged value of a key, or 0 if not found. */
+static uint64_t
+get_value(struct mtbl_fileset *fs, uint64_t k)
+{
+	struct mtbl_iter *it;
+	const uint8_t *ikey, *val;
+	size_t len, len_ikey, len_val;
+	char key[32];
+	uint64_t v = 0;
+
+	len = test_make_key(key, sizeof(key), k);
+	it = mtbl_source_get(mtbl_fileset_source(fs), (const uint8_t *) key, len);
+	if (mtbl_iter_next(it, &ikey, &len_ikey, &val, &len_val) == mtbl_res_success &&
+	    len_val == sizeof(v))
+		memcpy(&v, val, sizeof(v));
+	mtbl_iter_destroy(&it);
+	return (v);
+}
+
+/* Files are opened on a threadpool, skipping those which are not MTBL files. */
+static int
+test_threadpool(const char *fname)
+{
+	struct mtbl_fileset_options *fopt;
+	struct mtbl_threadpool *pool;
+	struct mtbl_fileset *fs;
+	struct mtbl_iter *it;
+	char bad[256];
+	FILE *fp;
+	int ret = 0;
+
+	test_path(bad, sizeof(bad), "bad.mtbl");
+	fp = fopen(bad, "w");
+	assert(fp != NULL);
+	fputs("not an MTBL file\n", fp);
+	fclose(fp);
+	write_setfile("a0.mtbl\nbad.mtbl\na1.mtbl\n");
+
+	pool = mtbl_threadpool_init(4);
+	fopt = mtbl_fileset_options_init();
+	mtbl_fileset_options_set_merge_values_func(fopt, test_merge_sum, NULL);
+	mtbl_fileset_options_set_threadpool(fopt, pool);
+	mtbl_fileset_options_set_prefetch_index(fopt, true);
+	fs = mtbl_fileset_init(fname, fopt);
+	mtbl_fileset_options_destroy(&fopt);
+
+	it = mtbl_source_iter(mtbl_fileset_source(fs));
+	if (!check_iter(it))
+		ret = 1;
+	mtbl_iter_destroy(&it);
+
+	/* Files added later are opened on the threadpool as well. */
+	write_setfile("b0.mtbl\nbad.mtbl\n");
+	mtbl_fileset_reload_now(fs);
+	it = mtbl_source_iter(mtbl_fileset_source(fs));
+	if (!check_iter(it))
+		ret = 1;
+	mtbl_iter_destroy(&it);
+
+	mtbl_fileset_destroy(&fs);
+	mtbl_threadpool_destroy(&pool);
+	return (ret);
+}
+
+/* A watched fileset picks up a new file without an explicit reload. */
+static int
+test_watch(const char *fname)
+{
+	struct mtbl_fileset_options *fopt;
+	struct mtbl_fileset *fs;
+	uint64_t v = 0;
+	int ret = 0;
+
+	write_setfile("b0.mtbl\n");
+	fopt = mtbl_fileset_options_init();
+	mtbl_fileset_options_set_merge_values_func(fopt, test_merge_sum, NULL);
+	mtbl_fileset_options_set_reload_interval(fopt, MTBL_FILESET_RELOAD_INTERVAL_NEVER);
+	mtbl_fileset_options_set_watch(fopt, true);
+	fs = mtbl_fileset_init(fname, fopt);
+	mtbl_fileset_options_destroy(&fopt);
+
+	if (get_value(fs, 1) != 3) {
+		fprintf(stderr, NAME ": FAIL: watched fileset initial load\n");
+		ret = 1;
+	}
+
+	write_setfile("b0.mtbl\nc0.mtbl\n");
+	for (size_t i = 0; i < 5000; i++) {
+		v = get_value(fs, 1);
+		if (v != 3)
+			break;
+		usleep(1000);
+	}
+	mtbl_fileset_destroy(&fs);
+
+	if (v != 7) {
+		fprintf(stderr, NAME ": FAIL: watched fileset got value %" PRIu64 "\n", v);
+		ret = 1;
+	}
+	return (ret);
+}
+
+static bool
+partition_a0(const char *fname, void *clos __attribute__((unused)))
+{
+	size_t len = strlen(fname);
+
+	return (len >= strlen("a0.mtbl") && strcmp(fname + len - strlen("a0.mtbl"), "a0.mtbl") == 0);
+}
+
+/* Whether every key of a merger has the value v. */
+static bool
+check_merger(struct mtbl_merger *m, uint64_t v)
+{
+	struct mtbl_iter *it = mtbl_source_iter(mtbl_merger_source(m));
+	const uint8_t *key, *val;
+	size_t len_key, len_val;
+	uint64_t k = 0, w;
+	bool ok = true;
+
+	while (ok && mtbl_iter_next(it, &key, &len_key, &val, &len_val) == mtbl_res_success) {
+		memcpy(&w, val, sizeof(w));
+		ok = len_val == sizeof(w) && w == v;
+		k++;
+	}
+	mtbl_iter_destroy(&it);
+	return (ok && k == NUM_KEYS);
+}
+
+/* Partitioned mergers keep reading their files after they leave the setfile. */
+static int
+test_partition(const char *fname)
+{
+	struct mtbl_fileset_options *fopt;
+	struct mtbl_fileset *fs;
+	struct mtbl_merger *m1, *m2;
+	int ret = 0;
+
+	write_setfile("a0.mtbl\na1.mtbl\n");
+	fopt = mtbl_fileset_options_init();
+	mtbl_fileset_options_set_merge_values_func(fopt, test_merge_sum, NULL);
+	fs = mtbl_fileset_init(fname, fopt);
+	mtbl_fileset_options_destroy(&fopt);
+
+	mtbl_fileset_partition(fs, partition_a0, NULL, &m1, &m2);
+	write_setfile("b0.mtbl\n");
+	mtbl_fileset_reload_now(fs);
+	if (!check_merger(m1, 1) || !check_merger(m2, 2))
+		ret = 1;
+	mtbl_merger_destroy(&m1);
+	mtbl_merger_destroy(&m2);
+	mtbl_fileset_destroy(&fs);
+	return (ret);
+}
+
+static void *
+query_thread(void *arg)
+{
+	const struct mtbl_source *source = mtbl_fileset_source(arg);
+	uint64_t k = 0;
+
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		struct mtbl_iter *it;
+		char key[32];
+		size_t len;
+		bool ok;
+
+		k = (k * 7 + 1) % NUM_KEYS;
+		len = test_make_key(key, sizeof(key), k);
+		it = mtbl_source_get(source, (const uint8_t *) key, len);
+		{
+			const uint8_t *ikey, *ival;
+			size_t len_ikey, len_ival;
+			ok = mtbl_iter_next(it, &ikey, &len_ikey, &ival, &len_ival) ==
+				mtbl_res_success &&
+			     check_entry(ikey, len_ikey, ival, len_ival, k) &&
+			     mtbl_iter_next(it, &ikey, &len_ikey, &ival, &len_ival) !=
+				mtbl_res_success;
+		}
+		mtbl_iter_destroy(&it);
+
+		if (ok && k % 64 == 0) {
+			it = mtbl_source_iter(source);
+			ok = check_iter(it);
+			mtbl_iter_destroy(&it);
+		}
+
+		if (!ok)
+			__sync_add_and_fetch(&n_failures, 1);
+		__sync_add_and_fetch(&n_queries, 1);
+	}
+	return (NULL);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct mtbl_fileset_options *fopt;
+	struct mtbl_fileset *fs;
+	struct mtbl_iter *it;
+	pthread_t threads[NUM_THREADS];
+	char fname[256];
+	int ret = 0;
+
+	test_dir_init(NAME);
+	write_file("a0.mtbl", 1);
+	write_file("a1.mtbl", 2);
+	write_file("b0.mtbl", 3);
+	write_file("c0.mtbl", 4);
+	write_setfile("a0.mtbl\na1.mtbl\n");
+
+	test_path(fname, sizeof(fname), "test.fileset");
+	fopt = mtbl_fileset_options_init();
+	mtbl_fileset_options_set_merge_values_func(fopt, test_merge_sum, NULL);
+	mtbl_fileset_options_set_reload_interval(fopt, 0);
+	fs = mtbl_fileset_init(fname, fopt);
+	mtbl_fileset_options_destroy(&fopt);
+
+	/* An open iterator keeps reading the files it was started on. */
+	it = mtbl_source_iter(mtbl_fileset_source(fs));
+	write_setfile("b0.mtbl\n");
+	mtbl_fileset_reload_now(fs);
+	if (check_iter(it)) {
+		fprintf(stderr, NAME ": PASS: iterator across reload\n");
+	} else {
+		fprintf(stderr, NAME ": FAIL: iterator across reload\n");
+		ret = 1;
+	}
+	mtbl_iter_destroy(&it);
+
+	if (test_threadpool(fname) == 0) {
+		fprintf(stderr, NAME ": PASS: threadpool open\n");
+	} else {
+		fprintf(stderr, NAME ": FAIL: threadpool open\n");
+		ret = 1;
+	}
+
+	/* Query from several threads while the setfile keeps changing. */
+	for (size_t i = 0; i < NUM_THREADS; i++)
+		assert(pthread_create(&threads[i], NULL, query_thread, fs) == 0);
+	for (size_t i = 0; i < NUM_RELOADS; i++) {
+		write_setfile(i % 2 == 0 ? "a0.mtbl\na1.mtbl\n" : "b0.mtbl\n");
+		mtbl_fileset_reload_now(fs);
+		usleep(1000);
+	}
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	for (size_t i = 0; i < NUM_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	mtbl_fileset_destroy(&fs);
+
+	if (n_failures > 0) {
+		fprintf(stderr, NAME ": FAIL: %" PRIu64 " of %" PRIu64 " concurrent queries\n",
+			n_failures, n_queries);
+		ret = 1;
+	} else {
+		fprintf(stderr, NAME ": PASS: %" PRIu64 " concurrent queries\n", n_queries);
+	}
+
+	if (test_partition(fname) == 0) {
+		fprintf(stderr, NAME ": PASS: partition across reload\n");
+	} else {
+		fprintf(stderr, NAME ": FAIL: partition across reload\n");
+		ret = 1;
+	}
+
+#if HAVE_SYS_INOTIFY_H
+	if (test_watch(fname) == 0)
+		fprintf(stderr, NAME ": PASS: watched fileset\n");
+	else
+		ret = 1;
+#endif
+
+	test_dir_remove();
+
+	return (ret);
+}
@@ -0,0 +1,292 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <mtbl.h>
+
+#include "mtbl-private.h"
+
+#include "libmy/ubuf.h"
+
+#include "test-common.h"
+
+#define NAME		"test-iter-batch"
+
+#define NUM_KEYS	5000
+#define NUM_FILES	3
+
+static const size_t batch_sizes[] = { 1, 2, 7, 64, 100000 };
+
+/*
+ * File i has the keys which are multiples of i + 1, so that the files share
+ * some keys. The last file also deletes the keys which are multiples of 7.
+ */
+static void
+write_file(const char *name, uint64_t i, bool tombstones)
+{
+	struct mtbl_writer_options *wopt;
+	struct mtbl_writer *w;
+	char fname[256], key[32], val[64];
+
+	test_path(fname, sizeof(fname), name);
+	wopt = mtbl_writer_options_init();
+	mtbl_writer_options_set_block_size(wopt, 256);
+	mtbl_writer_options_set_tombstones(wopt, tombstones);
+	w = mtbl_writer_init(fname, wopt);
+	mtbl_writer_options_destroy(&wopt);
+	assert(w != NULL);
+	for (uint64_t k = 0; k < NUM_KEYS; k++) {
+		size_t len = test_make_key(key, sizeof(key), k);
+		mtbl_res res;
+
+		if (tombstones && k % 7 == 0) {
+			res = mtbl_writer_add_tombstone(w, (const uint8_t *) key, len);
+		} else if (k % (i + 1) == 0) {
+			size_t len_val = snprintf(val, sizeof(val), "%s-%" PRIu64, name, k);
+			res = mtbl_writer_add(w, (const uint8_t *) key, len,
+					      (const uint8_t *) val, len_val);
+		} else {
+			continue;
+		}
+		assert(res == mtbl_res_success);
+	}
+	mtbl_writer_destroy(&w);
+}
+
+static void
+append_entry(ubuf *u, const uint8_t *key, size_t len_key,
+	     const uint8_t *val, size_t len_val, bool tombstone)
+{
+	ubuf_append(u, key, len_key);
+	ubuf_add(u, tombstone ? '!' : '=');
+	ubuf_append(u, val, len_val);
+	ubuf_add(u, '\n');
+}
+
+/* The entries of an iterator read one at a time. */
+static void
+read_next(struct mtbl_iter *it, ubuf *u)
+{
+	const uint8_t *key, *val;
+	size_t len_key, len_val;
+
+	while (mtbl_iter_next(it, &key, &len_key, &val, &len_val) == mtbl_res_success)
+		append_entry(u, key, len_key, val, len_val, mtbl_iter_is_tombstone(it));
+	mtbl_iter_destroy(&it);
+}
+
+/*
+ * The entries of an iterator read in batches. Every entry of a batch is read
+ * after the whole batch has been returned, and only the last may be a
+ * tombstone.
+ */
+static bool
+read_batches(struct mtbl_iter *it, size_t n, ubuf *u)
+{
+	struct mtbl_entry *entries = my_calloc(n, sizeof(*entries));
+	size_t n_batch;
+	bool ok = true;
+
+	while ((n_batch = mtbl_iter_next_batch(it, entries, n)) > 0) {
+		if (n_batch > n)
+			ok = false;
+		for (size_t i = 0; i < n_batch && i < n; i++)
+			append_entry(u, entries[i].key, entries[i].len_key,
+				     entries[i].val, entries[i].len_val,
+				     i == n_batch - 1 && mtbl_iter_is_tombstone(it));
+	}
+	mtbl_iter_destroy(&it);
+	free(entries);
+	return (ok);
+}
+
+/* Alternate between single entries and batches on the same iterator. */
+static void
+read_mixed(struct mtbl_iter *it, ubuf *u)
+{
+	struct mtbl_entry entries[5];
+	const uint8_t *key, *val;
+	size_t len_key, len_val, n_batch;
+
+	for (;;) {
+		if (mtbl_iter_next(it, &key, &len_key, &val, &len_val) != mtbl_res_success)
+			break;
+		append_entry(u, key, len_key, val, len_val, mtbl_iter_is_tombstone(it));
+		n_batch = mtbl_iter_next_batch(it, entries, 5);
+		if (n_batch == 0)
+			break;
+		for (size_t i = 0; i < n_batch; i++)
+			append_entry(u, entries[i].key, entries[i].len_key,
+				     entries[i].val, entries[i].len_val,
+				     i == n_batch - 1 && mtbl_iter_is_tombstone(it));
+	}
+	mtbl_iter_destroy(&it);
+}
+
+static struct mtbl_sorter *
+make_sorter(void)
+{
+	struct mtbl_sorter_options *sopt;
+	struct mtbl_sorter *sorter;
+
+	sopt = mtbl_sorter_options_init();
+	mtbl_sorter_options_set_merge_func(sopt, test_merge_join, NULL);
+	sorter = mtbl_sorter_init(sopt);
+	mtbl_sorter_options_destroy(&sopt);
+	for (uint64_t k = 0; k < NUM_KEYS; k++) {
+		char key[32];
+		size_t len = test_make_key(key, sizeof(key), (k * 7919) % NUM_KEYS);
+
+		assert(mtbl_sorter_add(sorter, (const uint8_t *) key, len,
+				       (const uint8_t *) key, len) == mtbl_res_success);
+	}
+	return (sorter);
+}
+
+typedef struct mtbl_iter *(*iter_func)(const struct mtbl_source *);
+
+static struct mtbl_iter *
+iter_all(const struct mtbl_source *s)
+{
+	return (mtbl_source_iter(s));
+}
+
+static struct mtbl_iter *
+iter_range(const struct mtbl_source *s)
+{
+	return (mtbl_source_get_range(s, (const uint8_t *) "00000100", 8,
+				      (const uint8_t *) "00000a00", 8));
+}
+
+static struct mtbl_iter *
+iter_prefix(const struct mtbl_source *s)
+{
+	return (mtbl_source_get_prefix(s, (const uint8_t *) "000003", 6));
+}
+
+static struct mtbl_iter *
+iter_seek(const struct mtbl_source *s)
+{
+	struct mtbl_iter *it = mtbl_source_iter(s);
+
+	assert(mtbl_iter_seek(it, (const uint8_t *) "00000777", 8) == mtbl_res_success);
+	return (it);
+}
+
+static bool
+check_source(const char *what, const struct mtbl_source *s)
+{
+	static const iter_func funcs[] = { iter_all, iter_range, iter_prefix, iter_seek };
+	bool ok = true;
+
+	for (size_t f = 0; f < sizeof(funcs) / sizeof(funcs[0]); f++) {
+		ubuf *expected = ubuf_init(4096);
+
+		read_next(funcs[f](s), expected);
+		for (size_t b = 0; b <= sizeof(batch_sizes) / sizeof(batch_sizes[0]); b++) {
+			ubuf *u = ubuf_init(4096);
+
+			if (b < sizeof(batch_sizes) / sizeof(batch_sizes[0]))
+				ok &= read_batches(funcs[f](s), batch_sizes[b], u);
+			else
+				read_mixed(funcs[f](s), u);
+			ok &= ubuf_size(u) == ubuf_size(expected) &&
+			      memcmp(ubuf_data(u), ubuf_data(expected), ubuf_size(u)) == 0;
+			ubuf_destroy(&u);
+		}
+		ok &= ubuf_size(expected) > 0;
+		ubuf_destroy(&expected);
+	}
+
+	if (ok)
+		fprintf(stderr, NAME ": PASS: %s\n", what);
+	else
+		fprintf(stderr, NAME ": FAIL: %s\n", what);
+	return (ok);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct mtbl_reader *readers[NUM_FILES];
+	struct mtbl_merger_options *mopt;
+	struct mtbl_fileset_options *fopt;
+	struct mtbl_merger *m;
+	struct mtbl_fileset *fs;
+	char fname[256], name[32];
+	int ret = 0;
+	FILE *fp;
+
+	test_dir_init(NAME);
+	test_path(fname, sizeof(fname), "test.fileset");
+	fp = fopen(fname, "w");
+	assert(fp != NULL);
+	for (uint64_t i = 0; i < NUM_FILES; i++) {
+		snprintf(name, sizeof(name), "f%" PRIu64 ".mtbl", i);
+		write_file(name, i, i == NUM_FILES - 1);
+		fprintf(fp, "%s\n", name);
+	}
+	fclose(fp);
+
+	for (uint64_t i = 0; i < NUM_FILES; i++) {
+		snprintf(name, sizeof(name), "f%" PRIu64 ".mtbl", i);
+		test_path(fname, sizeof(fname), name);
+		readers[i] = mtbl_reader_init(fname, NULL);
+		assert(readers[i] != NULL);
+	}
+	if (!check_source("reader", mtbl_reader_source(readers[0])))
+		ret = 1;
+	if (!check_source("reader with tombstones", mtbl_reader_source(readers[NUM_FILES - 1])))
+		ret = 1;
+
+	mopt = mtbl_merger_options_init();
+	mtbl_merger_options_set_merge_func(mopt, test_merge_join, NULL);
+	m = mtbl_merger_init(mopt);
+	mtbl_merger_options_destroy(&mopt);
+	for (size_t i = 0; i < NUM_FILES; i++)
+		mtbl_merger_add_source(m, mtbl_reader_source(readers[i]));
+	if (!check_source("merger", mtbl_merger_source(m)))
+		ret = 1;
+	mtbl_merger_destroy(&m);
+
+	test_path(fname, sizeof(fname), "test.fileset");
+	fopt = mtbl_fileset_options_init();
+	mtbl_fileset_options_set_merge_func(fopt, test_merge_join, NULL);
+	fs = mtbl_fileset_init(fname, fopt);
+	mtbl_fileset_options_destroy(&fopt);
+	if (!check_source("fileset", mtbl_fileset_source(fs)))
+		ret = 1;
+	mtbl_fileset_destroy(&fs);
+
+	/* Sorter iterators have no batch function of their own. */
+	{
+		struct mtbl_sorter *s0 = make_sorter(), *s1 = make_sorter();
+		ubuf *expected = ubuf_init(4096), *u = ubuf_init(4096);
+
+		read_next(mtbl_sorter_iter(s0), expected);
+		if (read_batches(mtbl_sorter_iter(s1), 64, u) &&
+		    ubuf_size(u) == ubuf_size(expected) &&
+		    memcmp(ubuf_data(u), ubuf_data(expected), ubuf_size(u)) == 0)
+		{
+			fprintf(stderr, NAME ": PASS: sorter\n");
+		} else {
+			fprintf(stderr, NAME ": FAIL: sorter\n");
+			ret = 1;
+		}
+		ubuf_destroy(&expected);
+		ubuf_destroy(&u);
+		mtbl_sorter_destroy(&s0);
+		mtbl_sorter_destroy(&s1);
+	}
+
+	for (size_t i = 0; i < NUM_FILES; i++)
+		mtbl_reader_destroy(&readers[i]);
+
+	test_dir_remove();
+
+	return (ret);
+}
@@ -0,0 +1,245 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <mtbl.h>
+
+#include "mtbl-private.h"
+
+#include "libmy/ubuf.h"
+
+#include "test-common.h"
+
+#define NAME		"test-iter-prefix"
+
+#define NUM_GROUPS	600
+#define NUM_FILES	2
+#define PREFIX_LEN	2
+
+static void
+merge_func(void *clos,
+	   const uint8_t *key, size_t len_key,
+	   const uint8_t *val0, size_t len_val0,
+	   const uint8_t *val1, size_t len_val1,
+	   uint8_t **merged_val, size_t *len_merged_val)
+{
+	*merged_val = my_malloc(len_val0);
+	memcpy(*merged_val, val0, len_val0);
+	*len_merged_val = len_val0;
+}
+
+/*
+ * The two byte prefix of the keys of group g. The last groups have
+ * prefixes ending in 0xff, and the very last is all 0xff bytes.
+ */
+static uint16_t
+group_prefix(size_t g)
+{
+	if (g == NUM_GROUPS - 1)
+		return (0xffff);
+	if (g >= NUM_GROUPS - 4)
+		return ((uint16_t) (((g - (NUM_GROUPS - 4) + 0x10) << 8) | 0xff));
+	return ((uint16_t) g);
+}
+
+/*
+ * File f has the keys of every group g with g % NUM_FILES == f: the group's
+ * prefix followed by a varying number of two byte suffixes. Group 1 also
+ * has a key which is shorter than the prefix.
+ */
+static void
+write_file(const char *name, size_t f)
+{
+	struct mtbl_writer_options *wopt;
+	struct mtbl_writer *w;
+	char fname[256];
+
+	test_path(fname, sizeof(fname), name);
+	wopt = mtbl_writer_options_init();
+	mtbl_writer_options_set_block_size(wopt, 256);
+	w = mtbl_writer_init(fname, wopt);
+	mtbl_writer_options_destroy(&wopt);
+	assert(w != NULL);
+	for (size_t g = 0; g < NUM_GROUPS; g++) {
+		uint16_t prefix = group_prefix(g);
+
+		if (g % NUM_FILES != f)
+			continue;
+		if (g == 1) {
+			uint8_t key[1] = { prefix >> 8 };
+			assert(mtbl_writer_add(w, key, sizeof(key), key, sizeof(key)) == mtbl_res_success);
+		}
+		for (size_t i = 0; i < (g * 7) % 150 + 1; i++) {
+			uint8_t key[4] = { prefix >> 8, prefix & 0xff, i >> 8, i & 0xff };
+			assert(mtbl_writer_add(w, key, sizeof(key), key, sizeof(key)) == mtbl_res_success);
+		}
+	}
+	mtbl_writer_destroy(&w);
+}
+
+static void
+add_prefix(ubuf *u, const uint8_t *key, size_t len_key)
+{
+	size_t len = len_key < PREFIX_LEN ? len_key : PREFIX_LEN;
+
+	ubuf_add(u, (uint8_t) len);
+	ubuf_append(u, key, len);
+}
+
+/*
+ * The distinct prefixes of an iterator's keys, found by reading them all.
+ * Returns the number of keys.
+ */
+static size_t
+scan_all(struct mtbl_iter *it, ubuf *u, size_t *n_distinct)
+{
+	const uint8_t *key, *val;
+	size_t len_key, len_val, n = 0;
+	ubuf *last = ubuf_init(PREFIX_LEN);
+
+	while (mtbl_iter_next(it, &key, &len_key, &val, &len_val) == mtbl_res_success) {
+		n++;
+		if (n > 1 && ubuf_size(last) == (len_key < PREFIX_LEN ? len_key : PREFIX_LEN) &&
+		    memcmp(ubuf_data(last), key, ubuf_size(last)) == 0)
+			continue;
+		ubuf_clip(last, 0);
+		ubuf_append(last, key, len_key < PREFIX_LEN ? len_key : PREFIX_LEN);
+		add_prefix(u, key, len_key);
+		(*n_distinct)++;
+	}
+	ubuf_destroy(&last);
+	mtbl_iter_destroy(&it);
+	return (n);
+}
+
+/*
+ * The distinct prefixes of an iterator's keys, found by skipping over them.
+ * Returns the number of keys read.
+ */
+static size_t
+scan_skip(struct mtbl_iter *it, bool batch, ubuf *u)
+{
+	const uint8_t *key, *val;
+	size_t len_key, len_val, n = 0;
+
+	for (;;) {
+		if (batch) {
+			struct mtbl_entry e;
+
+			if (mtbl_iter_next_batch(it, &e, 1) == 0)
+				break;
+			key = e.key;
+			len_key = e.len_key;
+		} else if (mtbl_iter_next(it, &key, &len_key, &val, &len_val) != mtbl_res_success) {
+			break;
+		}
+		n++;
+		add_prefix(u, key, len_key);
+		assert(mtbl_iter_seek_next_prefix(it, PREFIX_LEN) == mtbl_res_success);
+	}
+	assert(mtbl_iter_seek_next_prefix(it, PREFIX_LEN) == mtbl_res_failure);
+
+	/* Skipping past the all 0xff prefix ends the iterator until a seek. */
+	assert(mtbl_iter_seek(it, (const uint8_t *) "\x01", 1) == mtbl_res_success);
+	assert(mtbl_iter_next(it, &key, &len_key, &val, &len_val) == mtbl_res_success);
+	mtbl_iter_destroy(&it);
+	return (n);
+}
+
+static bool
+check_source(const char *what, const struct mtbl_source *s)
+{
+	bool ok = true;
+
+	for (size_t i = 0; i < 4; i++) {
+		ubuf *expected = ubuf_init(1024), *u = ubuf_init(1024);
+		struct mtbl_iter *it0, *it1;
+		size_t n_all, n_skip, n_distinct = 0;
+
+		if (i < 2) {
+			it0 = mtbl_source_iter(s);
+			it1 = mtbl_source_iter(s);
+		} else {
+			/* Only the groups whose prefix starts with 0x01. */
+			it0 = mtbl_source_get_prefix(s, (const uint8_t *) "\x01", 1);
+			it1 = mtbl_source_get_prefix(s, (const uint8_t *) "\x01", 1);
+		}
+		n_all = scan_all(it0, expected, &n_distinct);
+		n_skip = scan_skip(it1, i % 2 == 1, u);
+
+		/* Each distinct prefix is read once, instead of every key. */
+		ok &= n_skip == n_distinct && n_skip < n_all;
+		ok &= ubuf_size(u) == ubuf_size(expected) &&
+		      memcmp(ubuf_data(u), ubuf_data(expected), ubuf_size(u)) == 0;
+		ubuf_destroy(&expected);
+		ubuf_destroy(&u);
+	}
+
+	if (ok)
+		fprintf(stderr, NAME ": PASS: %s\n", what);
+	else
+		fprintf(stderr, NAME ": FAIL: %s\n", what);
+	return (ok);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct mtbl_reader *readers[NUM_FILES];
+	struct mtbl_merger_options *mopt;
+	struct mtbl_fileset_options *fopt;
+	struct mtbl_merger *m;
+	struct mtbl_fileset *fs;
+	char fname[256], name[32];
+	int ret = 0;
+	FILE *fp;
+
+	test_dir_init(NAME);
+	test_path(fname, sizeof(fname), "test.fileset");
+	fp = fopen(fname, "w");
+	assert(fp != NULL);
+	for (size_t f = 0; f < NUM_FILES; f++) {
+		snprintf(name, sizeof(name), "f%zu.mtbl", f);
+		write_file(name, f);
+		fprintf(fp, "%s\n", name);
+		test_path(fname, sizeof(fname), name);
+		readers[f] = mtbl_reader_init(fname, NULL);
+		assert(readers[f] != NULL);
+	}
+	fclose(fp);
+
+	if (!check_source("reader", mtbl_reader_source(readers[0])))
+		ret = 1;
+	if (!check_source("reader with short keys", mtbl_reader_source(readers[1])))
+		ret = 1;
+
+	mopt = mtbl_merger_options_init();
+	mtbl_merger_options_set_merge_func(mopt, merge_func, NULL);
+	m = mtbl_merger_init(mopt);
+	mtbl_merger_options_destroy(&mopt);
+	for (size_t f = 0; f < NUM_FILES; f++)
+		mtbl_merger_add_source(m, mtbl_reader_source(readers[f]));
+	if (!check_source("merger", mtbl_merger_source(m)))
+		ret = 1;
+	mtbl_merger_destroy(&m);
+
+	test_path(fname, sizeof(fname), "test.fileset");
+	fopt = mtbl_fileset_options_init();
+	mtbl_fileset_options_set_merge_func(fopt, merge_func, NULL);
+	fs = mtbl_fileset_init(fname, fopt);
+	mtbl_fileset_options_destroy(&fopt);
+	if (!check_source("fileset", mtbl_fileset_source(fs)))
+		ret = 1;
+	mtbl_fileset_destroy(&fs);
+
+	for (size_t f = 0; f < NUM_FILES; f++)
+		mtbl_reader_destroy(&readers[f]);
+
+	test_dir_remove();
+
+	return (ret);
+}
@@ -0,0 +1,362 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <mtbl.h>
+
+#include "mtbl-private.h"
+
+#include "libmy/ubuf.h"
+
+#include "test-common.h"
+
+#define NAME		"test-iter-reset"
+
+#define NUM_KEYS	5000
+#define NUM_FILES	3
+#define NUM_DISJOINT	4
+
+/*
+ * File i has the keys from k0 up to k1 which are multiples of step. If
+ * tombstones is set, it deletes the keys which are multiples of 7 instead.
+ */
+static void
+write_file(const char *name, uint64_t k0, uint64_t k1, uint64_t step, bool tombstones)
+{
+	struct mtbl_writer_options *wopt;
+	struct mtbl_writer *w;
+	char fname[256], key[32], val[64];
+
+	test_path(fname, sizeof(fname), name);
+	wopt = mtbl_writer_options_init();
+	mtbl_writer_options_set_block_size(wopt, 256);
+	mtbl_writer_options_set_tombstones(wopt, tombstones);
+	w = mtbl_writer_init(fname, wopt);
+	mtbl_writer_options_destroy(&wopt);
+	assert(w != NULL);
+	for (uint64_t k = k0; k < k1; k++) {
+		size_t len = test_make_key(key, sizeof(key), k);
+		mtbl_res res;
+
+		if (tombstones && k % 7 == 0) {
+			res = mtbl_writer_add_tombstone(w, (const uint8_t *) key, len);
+		} else if (k % step == 0) {
+			size_t len_val = snprintf(val, sizeof(val), "%s-%" PRIu64, name, k);
+			res = mtbl_writer_add(w, (const uint8_t *) key, len,
+					      (const uint8_t *) val, len_val);
+		} else {
+			continue;
+		}
+		assert(res == mtbl_res_success);
+	}
+	mtbl_writer_destroy(&w);
+}
+
+/* The entries of an iterator, up to max of them, which may be NULL. */
+static void
+read_iter(struct mtbl_iter *it, size_t max, ubuf *u)
+{
+	const uint8_t *key, *val;
+	size_t len_key, len_val;
+
+	ubuf_clip(u, 0);
+	for (size_t i = 0; i < max; i++) {
+		if (mtbl_iter_next(it, &key, &len_key, &val, &len_val) != mtbl_res_success)
+			break;
+		ubuf_append(u, key, len_key);
+		ubuf_add(u, mtbl_iter_is_tombstone(it) ? '!' : '=');
+		if (len_val > 0)
+			ubuf_append(u, val, len_val);
+		ubuf_add(u, '\n');
+	}
+}
+
+static bool
+same_ubuf(ubuf *a, ubuf *b)
+{
+	return (ubuf_size(a) == ubuf_size(b) &&
+		memcmp(ubuf_data(a), ubuf_data(b), ubuf_size(a)) == 0);
+}
+
+/* A reset, and the call to a source which it should match. */
+struct op {
+	iter_reset_type		type;
+	uint64_t		k0, k1;
+	size_t			len_prefix;
+	size_t			max;	/* entries read before the next reset */
+};
+
+static size_t
+op_keys(const struct op *op, char *key0, char *key1, size_t *len_key1)
+{
+	size_t len_key0 = test_make_key(key0, 32, op->k0);
+
+	*len_key1 = test_make_key(key1, 32, op->k1);
+	if (op->type == ITER_RESET_PREFIX)
+		len_key0 = op->len_prefix;
+	return (len_key0);
+}
+
+static struct mtbl_iter *
+op_get(const struct op *op, const struct mtbl_source *s)
+{
+	char key0[32], key1[32];
+	size_t len_key0, len_key1;
+
+	len_key0 = op_keys(op, key0, key1, &len_key1);
+	switch (op->type) {
+	case ITER_RESET_GET:
+		return (mtbl_source_get(s, (uint8_t *) key0, len_key0));
+	case ITER_RESET_PREFIX:
+		return (mtbl_source_get_prefix(s, (uint8_t *) key0, len_key0));
+	case ITER_RESET_RANGE:
+		return (mtbl_source_get_range(s, (uint8_t *) key0, len_key0,
+					      (uint8_t *) key1, len_key1));
+	}
+	return (NULL);
+}
+
+static mtbl_res
+op_reset(const struct op *op, struct mtbl_iter *it)
+{
+	char key0[32], key1[32];
+	size_t len_key0, len_key1;
+
+	len_key0 = op_keys(op, key0, key1, &len_key1);
+	switch (op->type) {
+	case ITER_RESET_GET:
+		return (mtbl_iter_reset_get(it, (uint8_t *) key0, len_key0));
+	case ITER_RESET_PREFIX:
+		return (mtbl_iter_reset_prefix(it, (uint8_t *) key0, len_key0));
+	case ITER_RESET_RANGE:
+		return (mtbl_iter_reset_range(it, (uint8_t *) key0, len_key0,
+					      (uint8_t *) key1, len_key1));
+	}
+	return (mtbl_res_failure);
+}
+
+/*
+ * Forward and backward gets, within and across blocks and past the last
+ * key, prefixes of every length and ranges, some of them only partly read.
+ */
+static size_t
+make_ops(struct op *ops, size_t size)
+{
+	size_t n = 0;
+
+	for (uint64_t k = 0; k < NUM_KEYS + 20 && n < size; k += 97) {
+		ops[n++] = (struct op) { ITER_RESET_GET, k, k, 0, SIZE_MAX };
+		ops[n++] = (struct op) { ITER_RESET_GET, k + 1, k + 1, 0, SIZE_MAX };
+		ops[n++] = (struct op) { ITER_RESET_GET, k / 2, k / 2, 0, SIZE_MAX };
+		ops[n++] = (struct op) { ITER_RESET_PREFIX, k, 0, 6 + k % 3, k % 5 == 0 ? 3 : SIZE_MAX };
+		ops[n++] = (struct op) { ITER_RESET_RANGE, k, k + k % 300, 0, k % 4 == 0 ? 10 : SIZE_MAX };
+	}
+	ops[n++] = (struct op) { ITER_RESET_PREFIX, 0, 0, 0, SIZE_MAX };
+	ops[n++] = (struct op) { ITER_RESET_RANGE, 3000, 1000, 0, SIZE_MAX };
+	ops[n++] = (struct op) { ITER_RESET_GET, 12, 12, 0, SIZE_MAX };
+	assert(n <= size);
+	return (n);
+}
+
+/*
+ * Run every op on a single iterator, first created by a get or by an
+ * iteration over the whole source, and compare its entries with those of a
+ * new iterator.
+ */
+static bool
+check_source(const char *what, const struct mtbl_source *s)
+{
+	struct op ops[512];
+	size_t n_ops = make_ops(ops, sizeof(ops) / sizeof(ops[0]));
+	ubuf *expected = ubuf_init(4096), *u = ubuf_init(4096);
+	bool ok = true;
+
+	for (size_t pass = 0; pass < 2; pass++) {
+		struct mtbl_iter *it;
+
+		if (pass == 0)
+			it = mtbl_source_get(s, (const uint8_t *) "00000001", 8);
+		else
+			it = mtbl_source_iter(s);
+		assert(it != NULL);
+		read_iter(it, 5, u);
+
+		for (size_t i = 0; i < n_ops && ok; i++) {
+			struct mtbl_iter *fresh = op_get(&ops[i], s);
+
+			read_iter(fresh, ops[i].max, expected);
+			mtbl_iter_destroy(&fresh);
+			if (op_reset(&ops[i], it) != mtbl_res_success) {
+				fprintf(stderr, NAME ": reset %zu failed\n", i);
+				ok = false;
+				break;
+			}
+			read_iter(it, ops[i].max, u);
+			if (!same_ubuf(u, expected)) {
+				fprintf(stderr, NAME ": reset %zu differs\n", i);
+				ok = false;
+			}
+		}
+		mtbl_iter_destroy(&it);
+	}
+	ubuf_destroy(&expected);
+	ubuf_destroy(&u);
+
+	if (ok)
+		fprintf(stderr, NAME ": PASS: %s\n", what);
+	else
+		fprintf(stderr, NAME ": FAIL: %s\n", what);
+	return (ok);
+}
+
+static bool
+check_merger(const char *what, struct mtbl_reader **readers, size_t n,
+	     struct mtbl_threadpool *pool)
+{
+	struct mtbl_merger_options *mopt;
+	struct mtbl_merger *m;
+	bool ok;
+
+	mopt = mtbl_merger_options_init();
+	mtbl_merger_options_set_merge_func(mopt, test_merge_join, NULL);
+	if (pool != NULL)
+		mtbl_merger_options_set_threadpool(mopt, pool);
+	m = mtbl_merger_init(mopt);
+	mtbl_merger_options_destroy(&mopt);
+	for (size_t i = 0; i < n; i++)
+		mtbl_merger_add_source(m, mtbl_reader_source(readers[i]));
+	ok = check_source(what, mtbl_merger_source(m));
+	mtbl_merger_destroy(&m);
+	return (ok);
+}
+
+/* The fileset is replaced by a rename, so that a reload sees the change. */
+static void
+write_fileset(const char *fname, size_t n_files)
+{
+	char name[32], tmp[256];
+	FILE *fp;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+	fp = fopen(tmp, "w");
+	assert(fp != NULL);
+	for (size_t i = 0; i < n_files; i++) {
+		snprintf(name, sizeof(name), "f%zu.mtbl", i);
+		fprintf(fp, "%s\n", name);
+	}
+	for (size_t i = 0; i < NUM_DISJOINT; i++) {
+		snprintf(name, sizeof(name), "d%zu.mtbl", i);
+		fprintf(fp, "%s\n", name);
+	}
+	fclose(fp);
+	assert(rename(tmp, fname) == 0);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct mtbl_reader *readers[NUM_FILES];
+	struct mtbl_fileset_options *fopt;
+	struct mtbl_threadpool *pool;
+	struct mtbl_fileset *fs;
+	char fname[256], name[32];
+	int ret = 0;
+
+	test_dir_init(NAME);
+	for (size_t i = 0; i < NUM_FILES; i++) {
+		snprintf(name, sizeof(name), "f%zu.mtbl", i);
+		write_file(name, 0, NUM_KEYS, i + 1, i == NUM_FILES - 1);
+		test_path(fname, sizeof(fname), name);
+		readers[i] = mtbl_reader_init(fname, NULL);
+		assert(readers[i] != NULL);
+	}
+	for (size_t i = 0; i < NUM_DISJOINT; i++) {
+		uint64_t size = NUM_KEYS / NUM_DISJOINT;
+
+		snprintf(name, sizeof(name), "d%zu.mtbl", i);
+		write_file(name, i * size, (i + 1) * size, 5, false);
+	}
+
+	if (!check_source("reader", mtbl_reader_source(readers[0])))
+		ret = 1;
+	if (!check_source("reader with tombstones", mtbl_reader_source(readers[NUM_FILES - 1])))
+		ret = 1;
+	if (!check_merger("merger", readers, NUM_FILES, NULL))
+		ret = 1;
+	pool = mtbl_threadpool_init(2);
+	if (!check_merger("merger with read-ahead", readers, NUM_FILES, pool))
+		ret = 1;
+
+	test_path(fname, sizeof(fname), "test.fileset");
+	write_fileset(fname, NUM_FILES - 1);
+	fopt = mtbl_fileset_options_init();
+	mtbl_fileset_options_set_merge_func(fopt, test_merge_join, NULL);
+	mtbl_fileset_options_set_threadpool(fopt, pool);
+	mtbl_fileset_options_set_max_open_readers(fopt, 3);
+	fs = mtbl_fileset_init(fname, fopt);
+	mtbl_fileset_options_destroy(&fopt);
+	if (!check_source("fileset", mtbl_fileset_source(fs)))
+		ret = 1;
+
+	/* After a reload, a reset iterator sees the files added by it. */
+	{
+		const struct mtbl_source *s = mtbl_fileset_source(fs);
+		struct mtbl_iter *it, *fresh;
+		ubuf *expected = ubuf_init(4096), *u = ubuf_init(4096);
+		char key[32];
+		size_t len = test_make_key(key, sizeof(key), 7 * 30);
+
+		it = mtbl_source_get_prefix(s, (const uint8_t *) "0000", 4);
+		write_fileset(fname, NUM_FILES);
+		mtbl_fileset_reload_now(fs);
+		assert(mtbl_iter_reset_get(it, (uint8_t *) key, len) == mtbl_res_success);
+		read_iter(it, SIZE_MAX, u);
+		fresh = mtbl_source_get(s, (uint8_t *) key, len);
+		read_iter(fresh, SIZE_MAX, expected);
+		mtbl_iter_destroy(&fresh);
+		mtbl_iter_destroy(&it);
+
+		/* The key is deleted by the new file. */
+		if (ubuf_size(u) == 0 && same_ubuf(u, expected)) {
+			fprintf(stderr, NAME ": PASS: fileset reload\n");
+		} else {
+			fprintf(stderr, NAME ": FAIL: fileset reload\n");
+			ret = 1;
+		}
+		ubuf_destroy(&expected);
+		ubuf_destroy(&u);
+	}
+	mtbl_fileset_destroy(&fs);
+	mtbl_threadpool_destroy(&pool);
+
+	/* Sorter iterators cannot be reset. */
+	{
+		struct mtbl_sorter *sorter = mtbl_sorter_init(NULL);
+		struct mtbl_iter *it;
+
+		assert(mtbl_sorter_add(sorter, (const uint8_t *) "a", 1,
+				       (const uint8_t *) "b", 1) == mtbl_res_success);
+		it = mtbl_sorter_iter(sorter);
+		if (mtbl_iter_reset_get(it, (const uint8_t *) "a", 1) == mtbl_res_failure &&
+		    mtbl_iter_reset_get(NULL, (const uint8_t *) "a", 1) == mtbl_res_failure)
+		{
+			fprintf(stderr, NAME ": PASS: sorter\n");
+		} else {
+			fprintf(stderr, NAME ": FAIL: sorter\n");
+			ret = 1;
+		}
+		mtbl_iter_destroy(&it);
+		mtbl_sorter_destroy(&sorter);
+	}
+
+	for (size_t i = 0; i < NUM_FILES; i++)
+		mtbl_reader_destroy(&readers[i]);
+
+	test_dir_remove();
+
+	return (ret);
+}
@@ -0,0 +1,616 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <mtbl.h>
+
+#include "mtbl-private.h"
+
+#define NAME		"test-merger"
+
+#define NUM_SOURCES	67
+#define NUM_KEYS	5000
+
+/*
+ * Even keys share a common prefix longer than 8 bytes, so that they can
+ * only be ordered by a full key comparison. Odd keys are short.
+ */
+#define LONG_KEY_PREFIX	"common-prefix/"
+#define LONG_KEY_FMT	LONG_KEY_PREFIX "%08" PRIx64
+#define SHORT_KEY_FMT	"%" PRIx64
+
+static void
+merge_func(void *clos,
+	   const uint8_t *key, size_t len_key,
+	   const uint8_t *val0, size_t len_val0,
+	   const uint8_t *val1, size_t len_val1,
+	   uint8_t **merged_val, size_t *len_merged_val)
+{
+	uint64_t v0, v1;
+
+	assert(len_val0 == sizeof(v0));
+	assert(len_val1 == sizeof(v1));
+	memcpy(&v0, val0, sizeof(v0));
+	memcpy(&v1, val1, sizeof(v1));
+	v0 += v1;
+	*merged_val = my_malloc(sizeof(v0));
+	memcpy(*merged_val, &v0, sizeof(v0));
+	*len_merged_val = sizeof(v0);
+}
+
+static mtbl_res
+merge_values_func(void *clos,
+		  const uint8_t *key, size_t len_key,
+		  size_t n_vals,
+		  const uint8_t * const *vals, const size_t *len_vals,
+		  uint8_t **merged_val, size_t *size_merged_val,
+		  size_t *len_merged_val)
+{
+	uint64_t sum = 0;
+
+	for (size_t i = 0; i < n_vals; i++) {
+		uint64_t v;
+
+		assert(len_vals[i] == sizeof(v));
+		memcpy(&v, vals[i], sizeof(v));
+		sum += v;
+	}
+	if (*size_merged_val < sizeof(sum)) {
+		*merged_val = my_realloc(*merged_val, sizeof(sum));
+		*size_merged_val = sizeof(sum);
+	}
+	memcpy(*merged_val, &sum, sizeof(sum));
+	*len_merged_val = sizeof(sum);
+	return (mtbl_res_success);
+}
+
+static size_t
+format_key(char *key, size_t size, uint64_t k)
+{
+	if (k % 2 == 0)
+		return (snprintf(key, size, LONG_KEY_FMT, k));
+	return (snprintf(key, size, SHORT_KEY_FMT, k));
+}
+
+static uint64_t
+parse_key(const uint8_t *key, size_t len_key)
+{
+	char buf[64];
+	uint64_t k;
+
+	assert(len_key < sizeof(buf));
+	memcpy(buf, key, len_key);
+	buf[len_key] = '\0';
+	if (strncmp(buf, LONG_KEY_PREFIX, strlen(LONG_KEY_PREFIX)) == 0)
+		assert(sscanf(buf + strlen(LONG_KEY_PREFIX), "%" SCNx64, &k) == 1);
+	else
+		assert(sscanf(buf, "%" SCNx64, &k) == 1);
+	return (k);
+}
+
+/* Key k is in source i if k is a multiple of i + 1. */
+static uint64_t
+expected_count(uint64_t k)
+{
+	uint64_t count = 0;
+
+	for (uint64_t i = 0; i < NUM_SOURCES; i++)
+		if (k % (i + 1) == 0)
+			count++;
+	return (count);
+}
+
+static struct mtbl_reader *
+init_source(uint64_t first, uint64_t last, uint64_t step)
+{
+	struct mtbl_sorter_options *sopt = mtbl_sorter_options_init();
+	struct mtbl_sorter *s = mtbl_sorter_init(sopt);
+	struct mtbl_writer *w;
+	struct mtbl_reader *r;
+	FILE *tmp = tmpfile();
+	char key[64];
+
+	assert(tmp != NULL);
+	for (uint64_t k = first; k < last; k += step) {
+		uint64_t v = 1;
+		size_t len = format_key(key, sizeof(key), k);
+		mtbl_res res = mtbl_sorter_add(s, (const uint8_t *) key, len,
+					       (const uint8_t *) &v, sizeof(v));
+		assert(res == mtbl_res_success);
+	}
+
+	w = mtbl_writer_init_fd(fileno(tmp), NULL);
+	assert(mtbl_sorter_write(s, w) == mtbl_res_success);
+	mtbl_writer_destroy(&w);
+	mtbl_sorter_destroy(&s);
+	mtbl_sorter_options_destroy(&sopt);
+
+	r = mtbl_reader_init_fd(fileno(tmp), NULL);
+	assert(r != NULL);
+	fclose(tmp);
+	return (r);
+}
+
+static int
+test_iter(const char *name, struct mtbl_merger *m)
+{
+	struct mtbl_iter *it = mtbl_source_iter(mtbl_merger_source(m));
+	const uint8_t *key, *val;
+	size_t len_key, len_val;
+	uint8_t *last_key = NULL;
+	size_t len_last_key = 0;
+	uint64_t count = 0;
+	int ret = 0;
+
+	while (mtbl_iter_next(it, &key, &len_key, &val, &len_val) == mtbl_res_success) {
+		uint64_t k = parse_key(key, len_key), v;
+
+		if (last_key != NULL &&
+		    bytes_compare(last_key, len_last_key, key, len_key) >= 0)
+		{
+			fprintf(stderr, NAME ": FAIL: key %" PRIu64 " out of order\n", k);
+			ret = 1;
+			break;
+		}
+		free(last_key);
+		last_key = my_malloc(len_key);
+		memcpy(last_key, key, len_key);
+		len_last_key = len_key;
+
+		assert(len_val == sizeof(v));
+		memcpy(&v, val, sizeof(v));
+		if (v != expected_count(k)) {
+			fprintf(stderr, NAME ": FAIL: key %" PRIu64 " merged %" PRIu64
+				" values, expected %" PRIu64 "\n", k, v, expected_count(k));
+			ret = 1;
+			break;
+		}
+		count++;
+	}
+	free(last_key);
+	mtbl_iter_destroy(&it);
+
+	if (ret == 0 && count != NUM_KEYS) {
+		fprintf(stderr, NAME ": FAIL: got %" PRIu64 " keys, expected %d\n",
+			count, NUM_KEYS);
+		ret = 1;
+	}
+	if (ret == 0)
+		fprintf(stderr, NAME ": PASS: %s\n", name);
+	return (ret);
+}
+
+static int
+test_seek(const char *name, struct mtbl_merger *m)
+{
+	/* Seek both forwards and backwards. */
+	static const uint64_t targets[] = { 10, 4000, 4002, 37, 0, 4999, 2 };
+	struct mtbl_iter *it = mtbl_source_iter(mtbl_merger_source(m));
+	const uint8_t *key, *val;
+	size_t len_key, len_val;
+	char seek_key[64];
+	int ret = 0;
+
+	for (size_t i = 0; i < sizeof(targets) / sizeof(targets[0]); i++) {
+		size_t len = format_key(seek_key, sizeof(seek_key), targets[i]);
+		uint64_t v;
+
+		assert(mtbl_iter_seek(it, (const uint8_t *) seek_key, len) == mtbl_res_success);
+		if (mtbl_iter_next(it, &key, &len_key, &val, &len_val) != mtbl_res_success ||
+		    bytes_compare(key, len_key, (const uint8_t *) seek_key, len) != 0)
+		{
+			fprintf(stderr, NAME ": FAIL: seek to %" PRIu64 "\n", targets[i]);
+			ret = 1;
+			break;
+		}
+		memcpy(&v, val, sizeof(v));
+		if (v != expected_count(targets[i])) {
+			fprintf(stderr, NAME ": FAIL: bad value after seek to %" PRIu64 "\n",
+				targets[i]);
+			ret = 1;
+			break;
+		}
+	}
+	mtbl_iter_destroy(&it);
+
+	if (ret == 0)
+		fprintf(stderr, NAME ": PASS: %s\n", name);
+	return (ret);
+}
+
+struct lookup_result {
+	uint64_t	n_calls;
+	uint64_t	sum;
+};
+
+static void
+lookup_func(void *clos,
+	    const uint8_t *key, size_t len_key,
+	    const uint8_t *val, size_t len_val)
+{
+	struct lookup_result *res = (struct lookup_result *) clos;
+	uint64_t v;
+
+	assert(len_val == sizeof(v));
+	memcpy(&v, val, sizeof(v));
+	res->n_calls++;
+	res->sum += v;
+}
+
+/*
+ * Look up every key, and keys just before and after each key. If 'merged'
+ * is false, the merger has no merge function, and returns each value as a
+ * separate entry.
+ */
+static int
+test_lookup(const char *name, struct mtbl_merger *m, bool merged)
+{
+	const struct mtbl_source *src = mtbl_merger_source(m);
+	char key[64];
+	int ret = 0;
+
+	for (uint64_t k = 0; k < NUM_KEYS + 10 && ret == 0; k++) {
+		struct lookup_result res = { 0 };
+		size_t len = format_key(key, sizeof(key), k);
+		mtbl_res r;
+
+		r = mtbl_source_lookup(src, (const uint8_t *) key, len, lookup_func, &res);
+		if (k >= NUM_KEYS) {
+			if (r != mtbl_res_failure || res.n_calls != 0) {
+				fprintf(stderr, NAME ": FAIL: %s: found absent key %" PRIu64 "\n",
+					name, k);
+				ret = 1;
+			}
+			continue;
+		}
+		if (r != mtbl_res_success ||
+		    res.n_calls != (merged ? 1 : expected_count(k)) ||
+		    res.sum != expected_count(k))
+		{
+			fprintf(stderr, NAME ": FAIL: %s: key %" PRIu64 "\n", name, k);
+			ret = 1;
+		}
+
+		/* An extension of the key, and a prefix of a long key, are absent. */
+		key[len] = 'x';
+		if (mtbl_source_lookup(src, (const uint8_t *) key, len + 1,
+				       lookup_func, &res) != mtbl_res_failure ||
+		    (k % 2 == 0 &&
+		     mtbl_source_lookup(src, (const uint8_t *) key, len - 1,
+					lookup_func, &res) != mtbl_res_failure))
+		{
+			fprintf(stderr, NAME ": FAIL: %s: near key %" PRIu64 "\n", name, k);
+			ret = 1;
+		}
+	}
+
+	if (ret == 0)
+		fprintf(stderr, NAME ": PASS: %s\n", name);
+	return (ret);
+}
+
+static uint64_t
+count_iter(struct mtbl_iter *it)
+{
+	const uint8_t *key, *val;
+	size_t len_key, len_val;
+	uint64_t count = 0;
+
+	while (it != NULL &&
+	       mtbl_iter_next(it, &key, &len_key, &val, &len_val) == mtbl_res_success)
+		count++;
+	mtbl_iter_destroy(&it);
+	return (count);
+}
+
+/*
+ * Sources holding disjoint blocks of even keys, which the merger can skip
+ * based on the key ranges recorded in their metadata.
+ */
+static int
+test_key_ranges(void)
+{
+	struct mtbl_reader *readers[NUM_SOURCES];
+	struct mtbl_merger_options *mopt;
+	struct mtbl_merger *m;
+	const struct mtbl_source *src;
+	const uint8_t *key;
+	size_t len_key;
+	char key0[64], key1[64];
+	size_t len0, len1;
+	int ret = 0;
+
+	mopt = mtbl_merger_options_init();
+	m = mtbl_merger_init(mopt);
+	mtbl_merger_options_destroy(&mopt);
+	src = mtbl_merger_source(m);
+
+	for (uint64_t i = 0; i < NUM_SOURCES; i++) {
+		readers[i] = init_source(i * 100, (i + 1) * 100, 2);
+		mtbl_merger_add_source(m, mtbl_reader_source(readers[i]));
+	}
+
+	/* The first and last keys are recorded in the metadata. */
+	len0 = format_key(key0, sizeof(key0), 100);
+	len1 = format_key(key1, sizeof(key1), 198);
+	if (mtbl_metadata_first_key(mtbl_reader_metadata(readers[1]), &key, &len_key) != mtbl_res_success ||
+	    bytes_compare(key, len_key, (const uint8_t *) key0, len0) != 0 ||
+	    mtbl_metadata_last_key(mtbl_reader_metadata(readers[1]), &key, &len_key) != mtbl_res_success ||
+	    bytes_compare(key, len_key, (const uint8_t *) key1, len1) != 0)
+	{
+		fprintf(stderr, NAME ": FAIL: metadata key range\n");
+		ret = 1;
+	}
+
+	/* Every key occurs in only one source. */
+	if (count_iter(mtbl_source_iter(src)) != NUM_SOURCES * 50) {
+		fprintf(stderr, NAME ": FAIL: iter unique keys\n");
+		ret = 1;
+	}
+
+	/* Present and absent keys. */
+	if (count_iter(mtbl_source_get(src, (const uint8_t *) key1, len1)) != 1) {
+		fprintf(stderr, NAME ": FAIL: get\n");
+		ret = 1;
+	}
+	len0 = format_key(key0, sizeof(key0), 1000);
+	if (count_iter(mtbl_source_get(src, (const uint8_t *) key0, len0 - 1)) != 0) {
+		fprintf(stderr, NAME ": FAIL: get absent key\n");
+		ret = 1;
+	}
+
+	/* A range spanning several sources. */
+	len0 = format_key(key0, sizeof(key0), 150);
+	len1 = format_key(key1, sizeof(key1), 420);
+	if (count_iter(mtbl_source_get_range(src, (const uint8_t *) key0, len0,
+					     (const uint8_t *) key1, len1)) != 136) {
+		fprintf(stderr, NAME ": FAIL: get_range\n");
+		ret = 1;
+	}
+
+	/* A prefix spanning several sources, and one before all keys. */
+	len0 = format_key(key0, sizeof(key0), 0x100);
+	if (count_iter(mtbl_source_get_prefix(src, (const uint8_t *) key0, len0 - 2)) != 128) {
+		fprintf(stderr, NAME ": FAIL: get_prefix\n");
+		ret = 1;
+	}
+	if (count_iter(mtbl_source_get_prefix(src, (const uint8_t *) "a", 1)) != 0) {
+		fprintf(stderr, NAME ": FAIL: get_prefix absent\n");
+		ret = 1;
+	}
+
+	mtbl_merger_destroy(&m);
+	for (size_t i = 0; i < NUM_SOURCES; i++)
+		mtbl_reader_destroy(&readers[i]);
+
+	if (ret == 0)
+		fprintf(stderr, NAME ": PASS: key ranges\n");
+	return (ret);
+}
+
+/* Whether two iterators return the same entries. */
+static bool
+same_entries(struct mtbl_iter *a, struct mtbl_iter *b)
+{
+	const uint8_t *key_a, *val_a, *key_b, *val_b;
+	size_t len_key_a, len_val_a, len_key_b, len_val_b;
+	bool same = true;
+
+	while (mtbl_iter_next(a, &key_a, &len_key_a, &val_a, &len_val_a) == mtbl_res_success) {
+		if (mtbl_iter_next(b, &key_b, &len_key_b, &val_b, &len_val_b) != mtbl_res_success ||
+		    bytes_compare(key_a, len_key_a, key_b, len_key_b) != 0 ||
+		    bytes_compare(val_a, len_val_a, val_b, len_val_b) != 0)
+		{
+			same = false;
+			break;
+		}
+	}
+	if (same && mtbl_iter_next(b, &key_b, &len_key_b, &val_b, &len_val_b) == mtbl_res_success)
+		same = false;
+	mtbl_iter_destroy(&a);
+	mtbl_iter_destroy(&b);
+	return (same);
+}
+
+/*
+ * Sources holding disjoint runs of several data blocks each, and one source
+ * with a few keys inside those runs. Data blocks without any of the latter
+ * keys are copied verbatim to the output.
+ */
+static int
+test_block_copy(void)
+{
+	struct mtbl_reader *readers[5], *r;
+	struct mtbl_merger_options *mopt;
+	struct mtbl_writer_options *wopt;
+	struct mtbl_threadpool *pool;
+	struct mtbl_merger *m;
+	struct mtbl_writer *w;
+	struct mtbl_iter *it;
+	const struct mtbl_source *src;
+	const uint8_t *key, *val;
+	size_t len_key, len_val;
+	uint64_t n, n_blocks = 0, n_entries = 0;
+	FILE *tmp;
+	int ret = 0;
+
+	mopt = mtbl_merger_options_init();
+	mtbl_merger_options_set_merge_func(mopt, merge_func, NULL);
+	m = mtbl_merger_init(mopt);
+	mtbl_merger_options_destroy(&mopt);
+	src = mtbl_merger_source(m);
+
+	for (uint64_t i = 0; i < 4; i++) {
+		readers[i] = init_source(i * 4000, (i + 1) * 4000, 2);
+		mtbl_merger_add_source(m, mtbl_reader_source(readers[i]));
+	}
+	readers[4] = init_source(0, 16000, 2000);
+	mtbl_merger_add_source(m, mtbl_reader_source(readers[4]));
+
+	/* Copy blocks by hand, to count them. */
+	tmp = tmpfile();
+	assert(tmp != NULL);
+	w = mtbl_writer_init_fd(fileno(tmp), NULL);
+	it = mtbl_source_iter(src);
+	while (mtbl_iter_next(it, &key, &len_key, &val, &len_val) == mtbl_res_success) {
+		if (mtbl_writer_add_iter_block(w, it, &n) == mtbl_res_success) {
+			n_blocks++;
+			n_entries += n;
+			continue;
+		}
+		assert(mtbl_writer_add(w, key, len_key, val, len_val) == mtbl_res_success);
+		n_entries++;
+	}
+	mtbl_iter_destroy(&it);
+	mtbl_writer_destroy(&w);
+	r = mtbl_reader_init_fd(fileno(tmp), NULL);
+	assert(r != NULL);
+	fclose(tmp);
+
+	if (n_blocks == 0) {
+		fprintf(stderr, NAME ": FAIL: no blocks copied\n");
+		ret = 1;
+	}
+	if (n_entries != 8000 ||
+	    mtbl_metadata_count_entries(mtbl_reader_metadata(r)) != n_entries) {
+		fprintf(stderr, NAME ": FAIL: block copy count_entries\n");
+		ret = 1;
+	}
+	if (!same_entries(mtbl_source_iter(src), mtbl_source_iter(mtbl_reader_source(r)))) {
+		fprintf(stderr, NAME ": FAIL: block copy entries\n");
+		ret = 1;
+	}
+	mtbl_reader_destroy(&r);
+
+	/* mtbl_source_write() takes the same path. */
+	tmp = tmpfile();
+	assert(tmp != NULL);
+	w = mtbl_writer_init_fd(fileno(tmp), NULL);
+	assert(mtbl_source_write(src, w) == mtbl_res_success);
+	mtbl_writer_destroy(&w);
+	r = mtbl_reader_init_fd(fileno(tmp), NULL);
+	assert(r != NULL);
+	fclose(tmp);
+
+	if (!same_entries(mtbl_source_iter(src), mtbl_source_iter(mtbl_reader_source(r)))) {
+		fprintf(stderr, NAME ": FAIL: source write entries\n");
+		ret = 1;
+	}
+	mtbl_reader_destroy(&r);
+
+	/* Likewise with blocks built on the writer's pipeline thread. */
+	pool = mtbl_threadpool_init(2);
+	wopt = mtbl_writer_options_init();
+	mtbl_writer_options_set_threadpool(wopt, pool);
+	mtbl_writer_options_set_pipeline(wopt, true);
+	tmp = tmpfile();
+	assert(tmp != NULL);
+	w = mtbl_writer_init_fd(fileno(tmp), wopt);
+	mtbl_writer_options_destroy(&wopt);
+	assert(mtbl_source_write(src, w) == mtbl_res_success);
+	mtbl_writer_destroy(&w);
+	mtbl_threadpool_destroy(&pool);
+	r = mtbl_reader_init_fd(fileno(tmp), NULL);
+	assert(r != NULL);
+	fclose(tmp);
+
+	if (mtbl_metadata_count_entries(mtbl_reader_metadata(r)) != 8000 ||
+	    !same_entries(mtbl_source_iter(src), mtbl_source_iter(mtbl_reader_source(r))))
+	{
+		fprintf(stderr, NAME ": FAIL: pipelined source write entries\n");
+		ret = 1;
+	}
+	mtbl_reader_destroy(&r);
+
+	mtbl_merger_destroy(&m);
+	for (size_t i = 0; i < 5; i++)
+		mtbl_reader_destroy(&readers[i]);
+
+	if (ret == 0)
+		fprintf(stderr, NAME ": PASS: block copy (%" PRIu64 " blocks)\n", n_blocks);
+	return (ret);
+}
+
+/* Range and prefix iterators which read ahead return the same entries. */
+static int
+test_read_ahead_range(struct mtbl_merger *m, struct mtbl_merger *mr)
+{
+	const struct mtbl_source *src = mtbl_merger_source(m);
+	const struct mtbl_source *src_ra = mtbl_merger_source(mr);
+	char key0[64], key1[64];
+	size_t len0 = format_key(key0, sizeof(key0), 100);
+	size_t len1 = format_key(key1, sizeof(key1), 3000);
+
+	if (!same_entries(mtbl_source_get_range(src, (const uint8_t *) key0, len0,
+						(const uint8_t *) key1, len1),
+			  mtbl_source_get_range(src_ra, (const uint8_t *) key0, len0,
+						(const uint8_t *) key1, len1)) ||
+	    !same_entries(mtbl_source_get_prefix(src, (const uint8_t *) key1, 2),
+			  mtbl_source_get_prefix(src_ra, (const uint8_t *) key1, 2)))
+	{
+		fprintf(stderr, NAME ": FAIL: read ahead range\n");
+		return (1);
+	}
+	fprintf(stderr, NAME ": PASS: read ahead range\n");
+	return (0);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct mtbl_reader *readers[NUM_SOURCES];
+	struct mtbl_merger_options *mopt;
+	struct mtbl_threadpool *pool = mtbl_threadpool_init(4);
+	struct mtbl_merger *m, *mv, *mn, *mr;
+	int ret = 0;
+
+	mopt = mtbl_merger_options_init();
+	mtbl_merger_options_set_merge_func(mopt, merge_func, NULL);
+	m = mtbl_merger_init(mopt);
+	mtbl_merger_options_set_merge_values_func(mopt, merge_values_func, NULL);
+	mv = mtbl_merger_init(mopt);
+	mtbl_merger_options_destroy(&mopt);
+	mopt = mtbl_merger_options_init();
+	mn = mtbl_merger_init(mopt);
+	mtbl_merger_options_destroy(&mopt);
+	mopt = mtbl_merger_options_init();
+	mtbl_merger_options_set_merge_func(mopt, merge_func, NULL);
+	mtbl_merger_options_set_threadpool(mopt, pool);
+	mr = mtbl_merger_init(mopt);
+	mtbl_merger_options_destroy(&mopt);
+
+	for (uint64_t i = 0; i < NUM_SOURCES; i++) {
+		readers[i] = init_source(0, NUM_KEYS, i + 1);
+		mtbl_merger_add_source(m, mtbl_reader_source(readers[i]));
+		mtbl_merger_add_source(mv, mtbl_reader_source(readers[i]));
+		mtbl_merger_add_source(mn, mtbl_reader_source(readers[i]));
+		mtbl_merger_add_source(mr, mtbl_reader_source(readers[i]));
+	}
+
+	ret |= test_iter("iter", m);
+	ret |= test_seek("seek", m);
+	ret |= test_iter("merge values iter", mv);
+	ret |= test_seek("merge values seek", mv);
+	ret |= test_iter("read ahead iter", mr);
+	ret |= test_seek("read ahead seek", mr);
+	ret |= test_read_ahead_range(m, mr);
+	ret |= test_lookup("lookup", m, true);
+	ret |= test_lookup("merge values lookup", mv, true);
+	ret |= test_lookup("unmerged lookup", mn, false);
+	ret |= test_key_ranges();
+	ret |= test_block_copy();
+
+	mtbl_merger_destroy(&m);
+	mtbl_merger_destroy(&mv);
+	mtbl_merger_destroy(&mn);
+	mtbl_merger_destroy(&mr);
+	for (size_t i = 0; i < NUM_SOURCES; i++)
+		mtbl_reader_destroy(&readers[i]);
+	mtbl_threadpool_destroy(&pool);
+
+	return (ret);
+}
@@ -46,6 +46,7 @@ test1(void)
 	uint8_t tbuf[MTBL_METADATA_SIZE];
 
 	memset(tbuf, 0, sizeof(tbuf));
+	memset(&m1, 0, sizeof(m1));
 
 	m1.file_version = MTBL_FORMAT_V2;
 	m1.index_block_offset = 123;
@@ -78,6 +79,88 @@ test1(void)
 	return (ret);
 }
 
+static int
+test_key_range(size_t len_first, size_t len_last,
+	       bool expect_first, bool expect_last)
+{
+	int ret = 0;
+	struct mtbl_metadata m1, m2;
+	uint8_t tbuf[MTBL_METADATA_SIZE];
+	uint8_t first[MTBL_METADATA_KEY_SIZE], last[MTBL_METADATA_KEY_SIZE];
+	const uint8_t *key;
+	size_t len_key;
+
+	memset(&m1, 0, sizeof(m1));
+	memset(first, 'a', sizeof(first));
+	memset(last, 'z', sizeof(last));
+	m1.file_version = MTBL_FORMAT_V2;
+	metadata_set_first_key(&m1, first, len_first);
+	metadata_set_last_key(&m1, last, len_last);
+
+	metadata_write(&m1, tbuf);
+	if (mtbl_fixed_decode32(tbuf + MTBL_METADATA_SIZE - sizeof(uint32_t)) != MTBL_MAGIC) {
+		fprintf(stderr, NAME ": key range overwrote magic\n");
+		return (1);
+	}
+	if (!metadata_read(tbuf, &m2)) {
+		fprintf(stderr, NAME ": metadata_read() failed\n");
+		return (1);
+	}
+
+	if ((mtbl_metadata_first_key(&m2, &key, &len_key) == mtbl_res_success) != expect_first) {
+		fprintf(stderr, NAME ": first key %zu/%zu presence mismatch\n", len_first, len_last);
+		ret |= 1;
+	} else if (expect_first &&
+		   (len_key != len_first || memcmp(key, first, len_key) != 0)) {
+		fprintf(stderr, NAME ": first key %zu/%zu mismatch\n", len_first, len_last);
+		ret |= 1;
+	}
+	if ((mtbl_metadata_last_key(&m2, &key, &len_key) == mtbl_res_success) != expect_last) {
+		fprintf(stderr, NAME ": last key %zu/%zu presence mismatch\n", len_first, len_last);
+		ret |= 1;
+	} else if (expect_last &&
+		   (len_key != len_last || memcmp(key, last, len_key) != 0)) {
+		fprintf(stderr, NAME ": last key %zu/%zu mismatch\n", len_first, len_last);
+		ret |= 1;
+	}
+
+	return (ret);
+}
+
+static int
+test3(void)
+{
+	int ret = 0;
+	const size_t max = MTBL_METADATA_KEY_SIZE;
+
+	ret |= test_key_range(0, 0, true, true);
+	ret |= test_key_range(10, 20, true, true);
+	ret |= test_key_range(max - 20, 20, true, true);
+	ret |= test_key_range(max, 0, true, true);
+	ret |= test_key_range(max - 20, 21, false, true);
+	ret |= test_key_range(21, max - 20, true, false);
+	ret |= test_key_range(max / 2 + 1, max / 2 + 1, false, false);
+
+	/* Files written without a key range. */
+	struct mtbl_metadata m1, m2;
+	uint8_t tbuf[MTBL_METADATA_SIZE];
+	const uint8_t *key;
+	size_t len_key;
+
+	memset(&m1, 0, sizeof(m1));
+	m1.file_version = MTBL_FORMAT_V2;
+	metadata_write(&m1, tbuf);
+	if (!metadata_read(tbuf, &m2) ||
+	    mtbl_metadata_first_key(&m2, &key, &len_key) == mtbl_res_success ||
+	    mtbl_metadata_last_key(&m2, &key, &len_key) == mtbl_res_success)
+	{
+		fprintf(stderr, NAME ": unexpected key range\n");
+		ret |= 1;
+	}
+
+	return (ret);
+}
+
 static int
 check(int ret, const char *s)
 {
@@ -95,6 +178,7 @@ main(int argc, char **argv)
 
 	ret |= check(test1(), "test1");
 	ret |= check(test2(), "test2");
+	ret |= check(test3(), "test3");
 
 	if (ret)
 		return (EXIT_FAILURE);
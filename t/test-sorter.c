@@ -0,0 +1,397 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <mtbl.h>
+
+#include "mtbl-private.h"
+
+#define NAME		"test-sorter"
+
+#define NUM_KEYS	250000
+#define NUM_THREADS	4
+#define KEY_FMT		"%016" PRIx64
+
+static void
+merge_func(void *clos,
+	   const uint8_t *key, size_t len_key,
+	   const uint8_t *val0, size_t len_val0,
+	   const uint8_t *val1, size_t len_val1,
+	   uint8_t **merged_val, size_t *len_merged_val)
+{
+	uint64_t v0, v1;
+
+	assert(len_val0 == sizeof(v0));
+	assert(len_val1 == sizeof(v1));
+	memcpy(&v0, val0, sizeof(v0));
+	memcpy(&v1, val1, sizeof(v1));
+	v0 += v1;
+	*merged_val = my_malloc(sizeof(v0));
+	memcpy(*merged_val, &v0, sizeof(v0));
+	*len_merged_val = sizeof(v0);
+}
+
+static mtbl_res
+merge_values_func(void *clos,
+		  const uint8_t *key, size_t len_key,
+		  size_t n_vals,
+		  const uint8_t * const *vals, const size_t *len_vals,
+		  uint8_t **merged_val, size_t *size_merged_val,
+		  size_t *len_merged_val)
+{
+	uint64_t sum = 0;
+
+	for (size_t i = 0; i < n_vals; i++) {
+		uint64_t v;
+
+		assert(len_vals[i] == sizeof(v));
+		memcpy(&v, vals[i], sizeof(v));
+		sum += v;
+	}
+	if (*size_merged_val < sizeof(sum)) {
+		*merged_val = my_realloc(*merged_val, sizeof(sum));
+		*size_merged_val = sizeof(sum);
+	}
+	memcpy(*merged_val, &sum, sizeof(sum));
+	*len_merged_val = sizeof(sum);
+	return (mtbl_res_success);
+}
+
+static void
+add_entries(struct mtbl_sorter *s, uint64_t num_keys, uint64_t num_dups)
+{
+	char key[32];
+
+	for (uint64_t d = 0; d < num_dups; d++) {
+		for (uint64_t i = 0; i < num_keys; i++) {
+			/* Scatter the keys so that each batch is unsorted. */
+			uint64_t k = (i * 7919) % num_keys;
+			uint64_t v = 1;
+			int len = snprintf(key, sizeof(key), KEY_FMT, k);
+			mtbl_res res = mtbl_sorter_add(s,
+				(const uint8_t *) key, len,
+				(const uint8_t *) &v, sizeof(v));
+			assert(res == mtbl_res_success);
+		}
+	}
+}
+
+static int
+check_iter(struct mtbl_iter *it, uint64_t num_keys, uint64_t num_dups)
+{
+	const uint8_t *key, *val;
+	size_t len_key, len_val;
+	char expected[32];
+	uint64_t count = 0;
+
+	while (mtbl_iter_next(it, &key, &len_key, &val, &len_val) == mtbl_res_success) {
+		uint64_t v;
+		int len = snprintf(expected, sizeof(expected), KEY_FMT, count);
+
+		if (bytes_compare(key, len_key, (const uint8_t *) expected, len) != 0) {
+			fprintf(stderr, NAME ": FAIL: unexpected key at entry %" PRIu64 "\n", count);
+			return (1);
+		}
+		assert(len_val == sizeof(v));
+		memcpy(&v, val, sizeof(v));
+		if (v != num_dups) {
+			fprintf(stderr, NAME ": FAIL: bad merged value %" PRIu64 " at entry %" PRIu64 "\n",
+				v, count);
+			return (1);
+		}
+		count++;
+	}
+
+	if (count != num_keys) {
+		fprintf(stderr, NAME ": FAIL: got %" PRIu64 " entries, expected %" PRIu64 "\n",
+			count, num_keys);
+		return (1);
+	}
+	return (0);
+}
+
+static int
+test_sorter(const char *name, const char *temp_dir,
+	    uint64_t num_keys, uint64_t num_dups, bool combine, bool merge_values)
+{
+	struct mtbl_sorter_options *sopt;
+	struct mtbl_sorter *s;
+	struct mtbl_iter *it;
+	int ret;
+
+	sopt = mtbl_sorter_options_init();
+	if (merge_values)
+		mtbl_sorter_options_set_merge_values_func(sopt, merge_values_func, NULL);
+	else
+		mtbl_sorter_options_set_merge_func(sopt, merge_func, NULL);
+	mtbl_sorter_options_set_temp_dir(sopt, temp_dir);
+	mtbl_sorter_options_set_max_memory(sopt, MIN_SORTER_MEMORY);
+	mtbl_sorter_options_set_combine(sopt, combine);
+	s = mtbl_sorter_init(sopt);
+	mtbl_sorter_options_destroy(&sopt);
+
+	add_entries(s, num_keys, num_dups);
+
+	it = mtbl_sorter_iter(s);
+	assert(it != NULL);
+	ret = check_iter(it, num_keys, num_dups);
+	mtbl_iter_destroy(&it);
+	mtbl_sorter_destroy(&s);
+
+	if (ret == 0)
+		fprintf(stderr, NAME ": PASS: %s\n", name);
+	return (ret);
+}
+
+static uint64_t
+count_temp_files(const struct mtbl_sorter *s)
+{
+	uint64_t total = 0;
+
+	for (size_t i = 0; i < mtbl_sorter_count_temp_dirs(s); i++) {
+		uint64_t count_files;
+		mtbl_res res = mtbl_sorter_temp_dir_usage(s, i, NULL, &count_files, NULL);
+		assert(res == mtbl_res_success);
+		total += count_files;
+	}
+	return (total);
+}
+
+static int
+test_replacement_selection(const char *name, bool presorted, bool combine)
+{
+	struct mtbl_sorter_options *sopt;
+	struct mtbl_sorter *s;
+	struct mtbl_iter *it;
+	uint64_t num_files;
+	char key[32];
+	int ret;
+
+	sopt = mtbl_sorter_options_init();
+	mtbl_sorter_options_set_merge_func(sopt, merge_func, NULL);
+	mtbl_sorter_options_set_temp_dir(sopt, ".");
+	mtbl_sorter_options_set_max_memory(sopt, MIN_SORTER_MEMORY);
+	mtbl_sorter_options_set_combine(sopt, combine);
+	mtbl_sorter_options_set_run_mode(sopt, MTBL_SORTER_RUN_REPLACEMENT_SELECTION);
+	s = mtbl_sorter_init(sopt);
+	mtbl_sorter_options_destroy(&sopt);
+
+	if (presorted) {
+		for (uint64_t i = 0; i < NUM_KEYS; i++) {
+			for (uint64_t d = 0; d < 4; d++) {
+				uint64_t v = 1;
+				int len = snprintf(key, sizeof(key), KEY_FMT, i);
+				mtbl_res res = mtbl_sorter_add(s,
+					(const uint8_t *) key, len,
+					(const uint8_t *) &v, sizeof(v));
+				assert(res == mtbl_res_success);
+			}
+		}
+	} else {
+		add_entries(s, NUM_KEYS, 4);
+	}
+
+	it = mtbl_sorter_iter(s);
+	assert(it != NULL);
+	ret = check_iter(it, NUM_KEYS, 4);
+	mtbl_iter_destroy(&it);
+
+	num_files = count_temp_files(s);
+	mtbl_sorter_destroy(&s);
+
+	/* Presorted input is written as a single run. */
+	if (presorted && num_files != 1) {
+		fprintf(stderr, NAME ": FAIL: %" PRIu64 " runs for presorted input\n",
+			num_files);
+		ret = 1;
+	} else if (num_files == 0) {
+		fprintf(stderr, NAME ": FAIL: expected the sort to spill\n");
+		ret = 1;
+	}
+
+	if (ret == 0)
+		fprintf(stderr, NAME ": PASS: %s\n", name);
+	return (ret);
+}
+
+struct producer {
+	pthread_t		thr;
+	struct mtbl_sorter	*s;
+	uint64_t		num_keys;
+	uint64_t		num_dups;
+	uint64_t		id;
+};
+
+static void *
+producer_thread(void *arg)
+{
+	struct producer *p = arg;
+	struct mtbl_sorter_handle *h = mtbl_sorter_handle_init(p->s);
+	char key[32];
+
+	/* Each producer adds an interleaved share of every key's duplicates. */
+	for (uint64_t d = p->id; d < p->num_dups; d += NUM_THREADS) {
+		for (uint64_t i = 0; i < p->num_keys; i++) {
+			uint64_t k = (i * 7919) % p->num_keys;
+			uint64_t v = 1;
+			int len = snprintf(key, sizeof(key), KEY_FMT, k);
+			mtbl_res res = mtbl_sorter_handle_add(h,
+				(const uint8_t *) key, len,
+				(const uint8_t *) &v, sizeof(v));
+			assert(res == mtbl_res_success);
+		}
+	}
+	mtbl_sorter_handle_destroy(&h);
+	return (NULL);
+}
+
+static int
+test_handles(const char *name, uint64_t num_keys, uint64_t num_dups,
+	     bool combine)
+{
+	struct producer producers[NUM_THREADS];
+	struct mtbl_sorter_options *sopt;
+	struct mtbl_sorter *s;
+	struct mtbl_iter *it;
+	int ret;
+
+	sopt = mtbl_sorter_options_init();
+	mtbl_sorter_options_set_merge_func(sopt, merge_func, NULL);
+	mtbl_sorter_options_set_temp_dir(sopt, ".");
+	mtbl_sorter_options_set_max_memory(sopt, MIN_SORTER_MEMORY);
+	mtbl_sorter_options_set_combine(sopt, combine);
+	s = mtbl_sorter_init(sopt);
+	mtbl_sorter_options_destroy(&sopt);
+
+	for (uint64_t i = 0; i < NUM_THREADS; i++) {
+		producers[i].s = s;
+		producers[i].num_keys = num_keys;
+		producers[i].num_dups = num_dups;
+		producers[i].id = i;
+		assert(pthread_create(&producers[i].thr, NULL,
+				      producer_thread, &producers[i]) == 0);
+	}
+	for (size_t i = 0; i < NUM_THREADS; i++)
+		assert(pthread_join(producers[i].thr, NULL) == 0);
+
+	/* Entries added directly to the sorter are merged with the handles'. */
+	add_entries(s, num_keys, 1);
+
+	it = mtbl_sorter_iter(s);
+	assert(it != NULL);
+	ret = check_iter(it, num_keys, num_dups + 1);
+	mtbl_iter_destroy(&it);
+	mtbl_sorter_destroy(&s);
+
+	if (ret == 0)
+		fprintf(stderr, NAME ": PASS: %s\n", name);
+	return (ret);
+}
+
+static int
+test_temp_dirs(const char *name, mtbl_sorter_temp_dir_policy policy)
+{
+	static const char *temp_dirs[] = { ".", NAME ".tmp" };
+	const size_t n_temp_dirs = sizeof(temp_dirs) / sizeof(temp_dirs[0]);
+	struct mtbl_sorter_options *sopt;
+	struct mtbl_sorter *s;
+	struct mtbl_iter *it;
+	uint64_t total_files = 0;
+	int ret;
+
+	if (mkdir(temp_dirs[1], 0700) != 0)
+		assert(access(temp_dirs[1], W_OK) == 0);
+
+	sopt = mtbl_sorter_options_init();
+	mtbl_sorter_options_set_merge_func(sopt, merge_func, NULL);
+	/* The first directory added replaces the default. */
+	if (policy == MTBL_SORTER_TEMP_DIR_ROUND_ROBIN)
+		mtbl_sorter_options_add_temp_dir(sopt, temp_dirs[0]);
+	else
+		mtbl_sorter_options_set_temp_dir(sopt, temp_dirs[0]);
+	mtbl_sorter_options_add_temp_dir(sopt, temp_dirs[1]);
+	mtbl_sorter_options_set_temp_dir_policy(sopt, policy);
+	mtbl_sorter_options_set_max_memory(sopt, MIN_SORTER_MEMORY);
+	s = mtbl_sorter_init(sopt);
+	mtbl_sorter_options_destroy(&sopt);
+
+	add_entries(s, NUM_KEYS, 4);
+
+	it = mtbl_sorter_iter(s);
+	assert(it != NULL);
+	ret = check_iter(it, NUM_KEYS, 4);
+	mtbl_iter_destroy(&it);
+
+	assert(mtbl_sorter_count_temp_dirs(s) == n_temp_dirs);
+	for (size_t i = 0; i < n_temp_dirs; i++) {
+		const char *temp_dir;
+		uint64_t count_files, bytes_files;
+
+		mtbl_res res = mtbl_sorter_temp_dir_usage(s, i,
+			&temp_dir, &count_files, &bytes_files);
+		assert(res == mtbl_res_success);
+		assert(strcmp(temp_dir, temp_dirs[i]) == 0);
+		if ((count_files == 0) != (bytes_files == 0)) {
+			fprintf(stderr, NAME ": FAIL: inconsistent usage for %s\n", temp_dir);
+			ret = 1;
+		}
+		if (policy == MTBL_SORTER_TEMP_DIR_ROUND_ROBIN && count_files == 0) {
+			fprintf(stderr, NAME ": FAIL: no temporary files in %s\n", temp_dir);
+			ret = 1;
+		}
+		total_files += count_files;
+	}
+	assert(mtbl_sorter_temp_dir_usage(s, n_temp_dirs, NULL, NULL, NULL) == mtbl_res_failure);
+	mtbl_sorter_destroy(&s);
+	rmdir(temp_dirs[1]);
+
+	if (total_files < 2) {
+		fprintf(stderr, NAME ": FAIL: expected the sort to spill\n");
+		ret = 1;
+	}
+
+	if (ret == 0)
+		fprintf(stderr, NAME ": PASS: %s\n", name);
+	return (ret);
+}
+
+int
+main(int argc, char **argv)
+{
+	int ret = 0;
+
+	/* No temporary files may be created if all entries fit in memory. */
+	ret |= test_sorter("in-memory", "/nonexistent", 1000, 2, false, false);
+	ret |= test_sorter("spilled", ".", NUM_KEYS, 2, false, false);
+
+	/* Combining duplicates as they are added keeps this run in memory. */
+	ret |= test_sorter("combined in-memory", "/nonexistent", 50000, 20, true, false);
+	ret |= test_sorter("combined spilled", ".", NUM_KEYS, 2, true, false);
+
+	/* Merging all of the values for a key at once. */
+	ret |= test_sorter("merge values in-memory", "/nonexistent", 1000, 5, false, true);
+	ret |= test_sorter("merge values spilled", ".", NUM_KEYS, 3, false, true);
+	ret |= test_sorter("merge values combined", ".", NUM_KEYS, 2, true, true);
+
+	/* Replacement selection run generation. */
+	ret |= test_replacement_selection("replacement selection", false, false);
+	ret |= test_replacement_selection("replacement selection combined", false, true);
+	ret |= test_replacement_selection("replacement selection presorted", true, false);
+
+	/* Concurrent producers, each with its own sorter handle. */
+	ret |= test_handles("handles in-memory", 1000, 8, false);
+	ret |= test_handles("handles spilled", NUM_KEYS, 8, false);
+	ret |= test_handles("handles combined", NUM_KEYS, 8, true);
+
+	/* Temporary files striped across several directories. */
+	ret |= test_temp_dirs("round-robin temp dirs", MTBL_SORTER_TEMP_DIR_ROUND_ROBIN);
+	ret |= test_temp_dirs("free-space temp dirs", MTBL_SORTER_TEMP_DIR_FREE_SPACE);
+
+	return (ret);
+}
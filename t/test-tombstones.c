@@ -0,0 +1,528 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <mtbl.h>
+
+#include "mtbl-private.h"
+
+#include "libmy/ubuf.h"
+
+#include "test-common.h"
+
+#define NAME		"test-tombstones"
+
+#define NUM_KEYS	3000
+#define NUM_SORTER_KEYS	200000
+
+/*
+ * "a.mtbl" has every key. "b.mtbl" deletes the multiples of 3, and adds to
+ * the keys which are 1 modulo 5. "c.mtbl" adds back the multiples of 6.
+ */
+static void
+write_files(void)
+{
+	struct mtbl_writer_options *wopt;
+	struct mtbl_writer *wa, *wb, *wc;
+	char fname[PATH_MAX], key[32];
+
+	wopt = mtbl_writer_options_init();
+	mtbl_writer_options_set_block_size(wopt, 256);
+	test_path(fname, sizeof(fname), "a.mtbl");
+	wa = mtbl_writer_init(fname, wopt);
+	test_path(fname, sizeof(fname), "c.mtbl");
+	wc = mtbl_writer_init(fname, wopt);
+	mtbl_writer_options_set_tombstones(wopt, true);
+	test_path(fname, sizeof(fname), "b.mtbl");
+	wb = mtbl_writer_init(fname, wopt);
+	mtbl_writer_options_destroy(&wopt);
+	assert(wa != NULL && wb != NULL && wc != NULL);
+
+	for (uint64_t k = 0; k < NUM_KEYS; k++) {
+		size_t len = test_make_key(key, sizeof(key), k);
+		const uint8_t *ukey = (const uint8_t *) key;
+
+		assert(mtbl_writer_add(wa, ukey, len, (const uint8_t *) "a", 1) == mtbl_res_success);
+		if (k % 3 == 0)
+			assert(mtbl_writer_add_tombstone(wb, ukey, len) == mtbl_res_success);
+		else if (k % 5 == 1)
+			assert(mtbl_writer_add(wb, ukey, len, (const uint8_t *) "b", 1) == mtbl_res_success);
+		if (k % 6 == 0)
+			assert(mtbl_writer_add(wc, ukey, len, (const uint8_t *) "c", 1) == mtbl_res_success);
+	}
+
+	/* Files without the tombstones option can not hold them. */
+	assert(mtbl_writer_add_tombstone(wc, (const uint8_t *) "z", 1) == mtbl_res_failure);
+
+	mtbl_writer_destroy(&wa);
+	mtbl_writer_destroy(&wb);
+	mtbl_writer_destroy(&wc);
+}
+
+/* The merged value of key k, or NULL if it is deleted. */
+static const char *
+expected_value(uint64_t k)
+{
+	if (k % 6 == 0)
+		return ("c");
+	if (k % 3 == 0)
+		return (NULL);
+	if (k % 5 == 1)
+		return ("a+b");
+	return ("a");
+}
+
+static bool
+check_entry(const uint8_t *key, size_t len_key, const uint8_t *val, size_t len_val,
+	    uint64_t k)
+{
+	const char *expected = expected_value(k);
+	char ekey[32];
+	size_t len_ekey = test_make_key(ekey, sizeof(ekey), k);
+
+	return (expected != NULL &&
+		bytes_compare(key, len_key, (const uint8_t *) ekey, len_ekey) == 0 &&
+		bytes_compare(val, len_val, (const uint8_t *) expected, strlen(expected)) == 0);
+}
+
+/* The next key which is not deleted, from k on. */
+static uint64_t
+next_key(uint64_t k)
+{
+	while (k < NUM_KEYS && expected_value(k) == NULL)
+		k++;
+	return (k);
+}
+
+static void
+lookup_func(void *clos, const uint8_t *key, size_t len_key,
+	    const uint8_t *val, size_t len_val)
+{
+	ubuf_append((ubuf *) clos, val, len_val);
+}
+
+static bool
+check_source(const struct mtbl_source *s)
+{
+	const uint8_t *key, *val;
+	size_t len_key, len_val;
+	struct mtbl_iter *it;
+	char ekey[32];
+	size_t len_ekey;
+	uint64_t k;
+	bool ok = true;
+
+	/* Iteration skips the deleted keys. */
+	it = mtbl_source_iter(s);
+	k = next_key(0);
+	while (ok && mtbl_iter_next(it, &key, &len_key, &val, &len_val) == mtbl_res_success) {
+		ok = k < NUM_KEYS && check_entry(key, len_key, val, len_val, k) &&
+		     !mtbl_iter_is_tombstone(it);
+		k = next_key(k + 1);
+	}
+	ok = ok && k == NUM_KEYS;
+
+	/* Seeking onto a deleted key finds the next key. */
+	len_ekey = test_make_key(ekey, sizeof(ekey), 9);
+	if (ok && mtbl_iter_seek(it, (const uint8_t *) ekey, len_ekey) == mtbl_res_success) {
+		ok = mtbl_iter_next(it, &key, &len_key, &val, &len_val) == mtbl_res_success &&
+		     check_entry(key, len_key, val, len_val, 10);
+	}
+	mtbl_iter_destroy(&it);
+
+	/* Point lookups through both interfaces. */
+	for (k = 0; ok && k < NUM_KEYS; k++) {
+		const char *expected = expected_value(k);
+		ubuf *u = ubuf_init(16);
+		mtbl_res res;
+
+		len_ekey = test_make_key(ekey, sizeof(ekey), k);
+		it = mtbl_source_get(s, (const uint8_t *) ekey, len_ekey);
+		res = mtbl_iter_next(it, &key, &len_key, &val, &len_val);
+		if (expected == NULL)
+			ok = res == mtbl_res_failure;
+		else
+			ok = res == mtbl_res_success && check_entry(key, len_key, val, len_val, k) &&
+			     mtbl_iter_next(it, &key, &len_key, &val, &len_val) == mtbl_res_failure;
+		mtbl_iter_destroy(&it);
+
+		res = mtbl_source_lookup(s, (const uint8_t *) ekey, len_ekey, lookup_func, u);
+		if (ok && expected == NULL)
+			ok = res == mtbl_res_failure;
+		else if (ok)
+			ok = res == mtbl_res_success &&
+			     bytes_compare(ubuf_data(u), ubuf_size(u),
+					   (const uint8_t *) expected, strlen(expected)) == 0;
+		ubuf_destroy(&u);
+	}
+	return (ok);
+}
+
+static bool
+check_fileset(const char *setfile)
+{
+	struct mtbl_fileset_options *fopt;
+	struct mtbl_fileset *fs;
+	bool ok;
+
+	fopt = mtbl_fileset_options_init();
+	mtbl_fileset_options_set_merge_func(fopt, test_merge_join, NULL);
+	fs = mtbl_fileset_init(setfile, fopt);
+	mtbl_fileset_options_destroy(&fopt);
+	ok = check_source(mtbl_fileset_source(fs));
+	mtbl_fileset_destroy(&fs);
+	return (ok);
+}
+
+/* Whether the only file in the setfile has tombstones. */
+static bool
+setfile_tombstones(const char *setfile)
+{
+	struct mtbl_reader *r;
+	char line[256], fname[PATH_MAX];
+	bool tombstones;
+	FILE *fp;
+
+	fp = fopen(setfile, "r");
+	assert(fp != NULL);
+	assert(fgets(line, sizeof(line), fp) != NULL);
+	assert(fgets(fname, sizeof(fname), fp) == NULL);
+	fclose(fp);
+	line[strcspn(line, "\n")] = '\0';
+	test_path(fname, sizeof(fname), line);
+	r = mtbl_reader_init(fname, NULL);
+	assert(r != NULL);
+	tombstones = mtbl_metadata_has_tombstones(mtbl_reader_metadata(r));
+	mtbl_reader_destroy(&r);
+	return (tombstones);
+}
+
+static int
+test_reader(void)
+{
+	const uint8_t *key, *val;
+	size_t len_key, len_val;
+	struct mtbl_reader *r;
+	struct mtbl_iter *it;
+	char fname[PATH_MAX];
+	uint64_t n = 0, n_tombstones = 0;
+	int ret = 0;
+
+	test_path(fname, sizeof(fname), "b.mtbl");
+	r = mtbl_reader_init(fname, NULL);
+	assert(r != NULL);
+	if (!mtbl_metadata_has_tombstones(mtbl_reader_metadata(r)))
+		ret = 1;
+
+	/* Readers return tombstones as entries with empty values. */
+	it = mtbl_source_iter(mtbl_reader_source(r));
+	while (mtbl_iter_next(it, &key, &len_key, &val, &len_val) == mtbl_res_success) {
+		if (mtbl_iter_is_tombstone(it)) {
+			n_tombstones++;
+			if (len_val != 0)
+				ret = 1;
+		} else if (len_val != 1 || val[0] != 'b') {
+			ret = 1;
+		}
+		n++;
+	}
+	mtbl_iter_destroy(&it);
+	if (n_tombstones != (NUM_KEYS + 2) / 3 || n != mtbl_metadata_count_entries(mtbl_reader_metadata(r)))
+		ret = 1;
+
+	/* A tombstone is not found by a lookup. */
+	if (mtbl_source_lookup(mtbl_reader_source(r), (const uint8_t *) "00000000", 8,
+			       lookup_func, NULL) != mtbl_res_failure)
+		ret = 1;
+	mtbl_reader_destroy(&r);
+	return (ret);
+}
+
+static int
+test_merger(void)
+{
+	static const char *names[] = { "a.mtbl", "b.mtbl", "c.mtbl" };
+	struct mtbl_reader *readers[3];
+	struct mtbl_merger_options *mopt;
+	struct mtbl_merger *m;
+	char fname[PATH_MAX];
+	int ret = 0;
+
+	mopt = mtbl_merger_options_init();
+	mtbl_merger_options_set_merge_func(mopt, test_merge_join, NULL);
+	m = mtbl_merger_init(mopt);
+	mtbl_merger_options_destroy(&mopt);
+	for (size_t i = 0; i < 3; i++) {
+		test_path(fname, sizeof(fname), names[i]);
+		readers[i] = mtbl_reader_init(fname, NULL);
+		assert(readers[i] != NULL);
+		mtbl_merger_add_source(m, mtbl_reader_source(readers[i]));
+	}
+	if (!check_source(mtbl_merger_source(m)))
+		ret = 1;
+	mtbl_merger_destroy(&m);
+	for (size_t i = 0; i < 3; i++)
+		mtbl_reader_destroy(&readers[i]);
+	return (ret);
+}
+
+/*
+ * Compact the delta files first, which keeps their tombstones, then all of
+ * the files, which drops them.
+ */
+static int
+test_compact(const char *setfile)
+{
+	struct mtbl_compact_options *copt;
+	struct stat sb;
+	char fname[PATH_MAX];
+	size_t n_merged;
+	int ret = 0;
+
+	test_path(fname, sizeof(fname), "a.mtbl");
+	assert(stat(fname, &sb) == 0);
+
+	copt = mtbl_compact_options_init();
+	mtbl_compact_options_set_merge_func(copt, test_merge_join, NULL);
+	mtbl_compact_options_set_tier_files(copt, 2);
+	mtbl_compact_options_set_tier_ratio(copt, 1000);
+	mtbl_compact_options_set_tier_size(copt, sb.st_size);
+	if (mtbl_compact(setfile, copt, &n_merged) != mtbl_res_success || n_merged != 2) {
+		fprintf(stderr, NAME ": FAIL: compact delta files\n");
+		ret = 1;
+	} else if (!check_fileset(setfile)) {
+		fprintf(stderr, NAME ": FAIL: fileset after compacting delta files\n");
+		ret = 1;
+	}
+
+	mtbl_compact_options_set_tier_size(copt, 4 * sb.st_size);
+	if (mtbl_compact(setfile, copt, &n_merged) != mtbl_res_success || n_merged != 2) {
+		fprintf(stderr, NAME ": FAIL: compact all files\n");
+		ret = 1;
+	} else if (!check_fileset(setfile) || setfile_tombstones(setfile)) {
+		fprintf(stderr, NAME ": FAIL: fileset after compacting all files\n");
+		ret = 1;
+	}
+	mtbl_compact_options_destroy(&copt);
+	return (ret);
+}
+
+static void
+write_later_file(const char *name, bool tombstones)
+{
+	struct mtbl_writer_options *wopt;
+	struct mtbl_writer *w;
+	char fname[PATH_MAX], key[32];
+
+	wopt = mtbl_writer_options_init();
+	mtbl_writer_options_set_tombstones(wopt, tombstones);
+	test_path(fname, sizeof(fname), name);
+	w = mtbl_writer_init(fname, wopt);
+	mtbl_writer_options_destroy(&wopt);
+	assert(w != NULL);
+	for (uint64_t k = 0; k < NUM_KEYS; k++) {
+		size_t len = test_make_key(key, sizeof(key), k);
+		const uint8_t *ukey = (const uint8_t *) key;
+
+		if (!tombstones)
+			assert(mtbl_writer_add(w, ukey, len, (const uint8_t *) "d", 1) == mtbl_res_success);
+		else if (k % 3 == 0)
+			assert(mtbl_writer_add_tombstone(w, ukey, len) == mtbl_res_success);
+	}
+	mtbl_writer_destroy(&w);
+}
+
+/*
+ * Compact files without tombstones, then add a file deleting some of their
+ * keys. The merged file sorts in place of its inputs, which the setfile's
+ * name sorts after, so the deletes hide its values too.
+ */
+static int
+test_compact_then_delete(void)
+{
+	struct mtbl_compact_options *copt;
+	struct mtbl_fileset_options *fopt;
+	struct mtbl_fileset *fs;
+	struct mtbl_iter *it;
+	const uint8_t *key, *val;
+	size_t len, len_key, len_val, n_merged;
+	char setfile[PATH_MAX], ekey[32];
+	uint64_t k = 0;
+	bool ok = true;
+	FILE *fp;
+
+	write_later_file("d1.mtbl", false);
+	write_later_file("d2.mtbl", false);
+	write_later_file("d3.mtbl", true);
+	test_path(setfile, sizeof(setfile), "later.fileset");
+	test_write_setfile(setfile, "d1.mtbl\nd2.mtbl\n");
+
+	copt = mtbl_compact_options_init();
+	mtbl_compact_options_set_merge_func(copt, test_merge_join, NULL);
+	mtbl_compact_options_set_tier_files(copt, 2);
+	if (mtbl_compact(setfile, copt, &n_merged) != mtbl_res_success || n_merged != 2)
+		ok = false;
+	mtbl_compact_options_destroy(&copt);
+
+	fp = fopen(setfile, "a");
+	assert(fp != NULL);
+	fputs("d3.mtbl\n", fp);
+	fclose(fp);
+
+	fopt = mtbl_fileset_options_init();
+	mtbl_fileset_options_set_merge_func(fopt, test_merge_join, NULL);
+	fs = mtbl_fileset_init(setfile, fopt);
+	mtbl_fileset_options_destroy(&fopt);
+	it = mtbl_source_iter(mtbl_fileset_source(fs));
+	while (ok && mtbl_iter_next(it, &key, &len_key, &val, &len_val) == mtbl_res_success) {
+		if (k % 3 == 0)
+			k++;
+		len = test_make_key(ekey, sizeof(ekey), k);
+		ok = bytes_compare(key, len_key, (const uint8_t *) ekey, len) == 0 &&
+			bytes_compare(val, len_val, (const uint8_t *) "d+d", 3) == 0;
+		k++;
+	}
+	mtbl_iter_destroy(&it);
+	mtbl_fileset_destroy(&fs);
+	if (!ok || k != NUM_KEYS) {
+		fprintf(stderr, NAME ": FAIL: tombstones added after compaction\n");
+		return (1);
+	}
+	return (0);
+}
+
+/*
+ * Each key is added twice. The multiples of 3 are deleted the second time,
+ * which hides the value added the first time, possibly in an earlier run.
+ */
+static int
+test_sorter(mtbl_sorter_run_mode run_mode, bool combine)
+{
+	const uint8_t *key, *val;
+	size_t len_key, len_val;
+	struct mtbl_sorter_options *sopt;
+	struct mtbl_writer_options *wopt;
+	struct mtbl_sorter *s;
+	struct mtbl_writer *w;
+	struct mtbl_reader *r;
+	struct mtbl_iter *it;
+	char fname[PATH_MAX], ekey[32];
+	uint64_t k = 0;
+	bool ok = true;
+
+	sopt = mtbl_sorter_options_init();
+	mtbl_sorter_options_set_merge_values_func(sopt, test_merge_sum, NULL);
+	mtbl_sorter_options_set_temp_dir(sopt, test_dir());
+	mtbl_sorter_options_set_max_memory(sopt, 0);
+	mtbl_sorter_options_set_run_mode(sopt, run_mode);
+	mtbl_sorter_options_set_combine(sopt, combine);
+	s = mtbl_sorter_init(sopt);
+	mtbl_sorter_options_destroy(&sopt);
+
+	for (uint64_t pass = 0; pass < 2; pass++) {
+		for (uint64_t i = 0; i < NUM_SORTER_KEYS; i++) {
+			uint64_t sk = (i * 7919) % NUM_SORTER_KEYS, v = 1;
+			size_t len = test_make_key(ekey, sizeof(ekey), sk);
+			mtbl_res res;
+
+			if (pass == 1 && sk % 3 == 0)
+				res = mtbl_sorter_add_tombstone(s, (const uint8_t *) ekey, len);
+			else
+				res = mtbl_sorter_add(s, (const uint8_t *) ekey, len,
+						      (const uint8_t *) &v, sizeof(v));
+			assert(res == mtbl_res_success);
+		}
+	}
+
+	test_path(fname, sizeof(fname), "sorted.mtbl");
+	unlink(fname);
+	wopt = mtbl_writer_options_init();
+	mtbl_writer_options_set_tombstones(wopt, true);
+	w = mtbl_writer_init(fname, wopt);
+	mtbl_writer_options_destroy(&wopt);
+	assert(mtbl_sorter_write(s, w) == mtbl_res_success);
+	mtbl_writer_destroy(&w);
+	mtbl_sorter_destroy(&s);
+
+	r = mtbl_reader_init(fname, NULL);
+	assert(r != NULL);
+	it = mtbl_source_iter(mtbl_reader_source(r));
+	while (ok && mtbl_iter_next(it, &key, &len_key, &val, &len_val) == mtbl_res_success) {
+		size_t len = test_make_key(ekey, sizeof(ekey), k);
+		uint64_t v = 0;
+
+		if (len_val == sizeof(v))
+			memcpy(&v, val, sizeof(v));
+		ok = bytes_compare(key, len_key, (const uint8_t *) ekey, len) == 0 &&
+		     mtbl_iter_is_tombstone(it) == (k % 3 == 0) &&
+		     (k % 3 == 0 ? len_val == 0 : v == 2);
+		k++;
+	}
+	mtbl_iter_destroy(&it);
+	mtbl_reader_destroy(&r);
+	return (ok && k == NUM_SORTER_KEYS ? 0 : 1);
+}
+
+int
+main(int argc, char **argv)
+{
+	char setfile[PATH_MAX];
+	int ret = 0;
+
+	test_dir_init(NAME);
+	write_files();
+	test_path(setfile, sizeof(setfile), "test.fileset");
+	test_write_setfile(setfile, "a.mtbl\nb.mtbl\nc.mtbl\n");
+
+	if (test_reader() == 0) {
+		fprintf(stderr, NAME ": PASS: reader\n");
+	} else {
+		fprintf(stderr, NAME ": FAIL: reader\n");
+		ret = 1;
+	}
+
+	if (test_merger() == 0) {
+		fprintf(stderr, NAME ": PASS: merger\n");
+	} else {
+		fprintf(stderr, NAME ": FAIL: merger\n");
+		ret = 1;
+	}
+
+	if (check_fileset(setfile)) {
+		fprintf(stderr, NAME ": PASS: fileset\n");
+	} else {
+		fprintf(stderr, NAME ": FAIL: fileset\n");
+		ret = 1;
+	}
+
+	if (test_compact(setfile) == 0) {
+		fprintf(stderr, NAME ": PASS: compact\n");
+	} else {
+		ret = 1;
+	}
+
+	if (test_compact_then_delete() == 0)
+		fprintf(stderr, NAME ": PASS: compact then delete\n");
+	else
+		ret = 1;
+
+	if (test_sorter(MTBL_SORTER_RUN_QUICKSORT, false) == 0 &&
+	    test_sorter(MTBL_SORTER_RUN_QUICKSORT, true) == 0 &&
+	    test_sorter(MTBL_SORTER_RUN_REPLACEMENT_SELECTION, false) == 0)
+	{
+		fprintf(stderr, NAME ": PASS: sorter\n");
+	} else {
+		fprintf(stderr, NAME ": FAIL: sorter\n");
+		ret = 1;
+	}
+
+	test_dir_remove();
+
+	return (ret);
+}
@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <mtbl.h>
@@ -205,6 +206,139 @@ test1(void)
 	return (ret);
 }
 
+#define NUM_BATCH	1000
+
+/* A value of a random encoded length. */
+static uint64_t
+random_value(unsigned bits)
+{
+	uint64_t v = ((uint64_t) random() << 42) ^ ((uint64_t) random() << 21) ^ random();
+
+	return (v >> (64 - 1 - random() % bits));
+}
+
+/* Test batch decoding against single decoding, for every buffer position. */
+static int
+test5(void)
+{
+	static uint8_t buf[NUM_BATCH * 10];
+	static uint64_t expected[NUM_BATCH], actual[NUM_BATCH];
+	static uint32_t actual_32[NUM_BATCH];
+	size_t offsets[NUM_BATCH + 1];
+	uint8_t *p;
+	int ret = 0;
+
+	srandom(5);
+
+	/* 64 bit values, some of them 9 or 10 bytes long. */
+	p = buf;
+	for (size_t i = 0; i < NUM_BATCH; i++) {
+		offsets[i] = p - buf;
+		expected[i] = random_value(64);
+		p += mtbl_varint_encode64(p, expected[i]);
+	}
+	offsets[NUM_BATCH] = p - buf;
+	for (size_t i = 0; i < NUM_BATCH; i++) {
+		for (size_t n = 1; i + n <= NUM_BATCH; n = n * 3 + 1) {
+			size_t len = mtbl_varint_decode64_n(buf + offsets[i],
+							    offsets[i + n] - offsets[i],
+							    actual, n);
+			if (len != offsets[i + n] - offsets[i]) {
+				ret |= 1;
+				fprintf(stderr, "64: i= %zu n= %zu len= %zu\n", i, n, len);
+				continue;
+			}
+			for (size_t j = 0; j < n; j++) {
+				if (actual[j] != expected[i + j]) {
+					ret |= 1;
+					fprintf(stderr, "64: expected= %" PRIu64 ", actual= %" PRIu64 "\n",
+						expected[i + j], actual[j]);
+				}
+			}
+		}
+	}
+
+	/* 32 bit values, mostly short ones. */
+	p = buf;
+	for (size_t i = 0; i < NUM_BATCH; i++) {
+		offsets[i] = p - buf;
+		expected[i] = random_value(i % 4 == 0 ? 32 : 14);
+		p += mtbl_varint_encode32(p, (uint32_t) expected[i]);
+	}
+	offsets[NUM_BATCH] = p - buf;
+	for (size_t i = 0; i < NUM_BATCH; i++) {
+		for (size_t n = 1; i + n <= NUM_BATCH; n = n * 3 + 1) {
+			size_t len = mtbl_varint_decode32_n(buf + offsets[i],
+							    offsets[i + n] - offsets[i],
+							    actual_32, n);
+			if (len != offsets[i + n] - offsets[i]) {
+				ret |= 1;
+				fprintf(stderr, "32: i= %zu n= %zu len= %zu\n", i, n, len);
+				continue;
+			}
+			for (size_t j = 0; j < n; j++) {
+				if (actual_32[j] != expected[i + j]) {
+					ret |= 1;
+					fprintf(stderr, "32: expected= %" PRIu64 ", actual= %u\n",
+						expected[i + j], actual_32[j]);
+				}
+			}
+		}
+	}
+
+	return (ret);
+}
+
+/* Test batch decoding of truncated and invalid varints. */
+static int
+test6(void)
+{
+	uint8_t buf[64];
+	uint64_t val_64[8];
+	uint32_t val_32[32];
+	size_t len;
+	uint8_t *p = buf;
+
+	for (size_t i = 0; i < 8; i++)
+		p += mtbl_varint_encode64(p, UINT64_C(1) << (i * 9));
+	len = p - buf;
+	if (mtbl_varint_decode64_n(buf, len, val_64, 8) != len)
+		return 1;
+
+	/* Fewer than n varints, or a varint cut short by the end of the buffer. */
+	if (mtbl_varint_decode64_n(buf, len - 1, val_64, 8) != 0)
+		return 1;
+	if (mtbl_varint_decode64_n(buf, len, val_64, 9) != 0)
+		return 1;
+
+	/* A 64 bit varint longer than 10 bytes. */
+	memset(buf, 0xff, sizeof(buf));
+	if (mtbl_varint_decode64_n(buf, sizeof(buf), val_64, 1) != 0)
+		return 1;
+	buf[10] = 0x01;
+	if (mtbl_varint_decode64_n(buf, sizeof(buf), val_64, 1) != 0)
+		return 1;
+	buf[9] = 0x01;
+	if (mtbl_varint_decode64_n(buf, sizeof(buf), val_64, 1) != 10 ||
+	    val_64[0] != UINT64_MAX)
+		return 1;
+
+	/* A 32 bit varint longer than 5 bytes, after some valid ones. */
+	memset(buf, 0x01, sizeof(buf));
+	memset(buf + 20, 0xff, 5);
+	buf[25] = 0x01;
+	if (mtbl_varint_decode32_n(buf, sizeof(buf), val_32, 8) != 8)
+		return 1;
+	if (mtbl_varint_decode32_n(buf, sizeof(buf), val_32, 21) != 0)
+		return 1;
+	buf[24] = 0x0f;
+	if (mtbl_varint_decode32_n(buf, sizeof(buf), val_32, 21) != 25 ||
+	    val_32[20] != UINT32_MAX)
+		return 1;
+
+	return 0;
+}
+
 static int
 check(int ret, const char *s)
 {
@@ -224,6 +358,8 @@ main(int argc, char **argv)
 	ret |= check(test2(), "test2");
 	ret |= check(test3(), "test3");
 	ret |= check(test4(), "test4");
+	ret |= check(test5(), "test5");
+	ret |= check(test6(), "test6");
 
 	if (ret)
 		return (EXIT_FAILURE);